@@ -31,17 +31,27 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
 OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+/*
+Modified for yoruba by Douglas G. Scofield, douglasgscofield@gmail.com, see
+MemTrack.h.  The block list, stamps and per-type digests are replaced by
+per-thread counters, peaks by type and phase, and sampled call stacks.
+*/
+
 /* ---------------------------------------- includes */
 
-#include <assert.h>
 #include <stdio.h>
 #include <stdlib.h>
-#include <cstring>
+#include <string.h>
+#include <stdint.h>
+#include <math.h>
+#include <pthread.h>
+#include <dlfcn.h>
+#include <execinfo.h>
+#include <cxxabi.h>
 #include <algorithm>
 #include <new>
 
 #include "MemTrack.h"
-#undef new    // IMPORTANT!
 
 /* ------------------------------------------------------------ */
 /* -------------------- namespace MemTrack -------------------- */
@@ -50,516 +60,468 @@ OF THE POSSIBILITY OF SUCH DAMAGE.
 namespace MemTrack
 {
 
-    /* ------------------------------------------------------------ */
-    /* --------------------- class BlockHeader -------------------- */
-    /* ------------------------------------------------------------ */
+    /* ---------------------------------------- limits */
 
-    class BlockHeader
+    enum
     {
-        private:    // static member variables
-            static BlockHeader *ourFirstNode;
-    
-        private:    // member variables
-            BlockHeader *myPrevNode;
-            BlockHeader *myNextNode;
-            size_t myRequestedSize;
-            char const *myFilename;
-            int myLineNum;
-            char const *myTypeName;
-
-        public:     // members
-            BlockHeader(size_t requestedSize);
-            ~BlockHeader();
-        
-            size_t GetRequestedSize() const { return myRequestedSize; }
-            char const *GetFilename() const { return myFilename; }
-            int GetLineNum() const { return myLineNum; }
-            char const *GetTypeName() const { return myTypeName; }
-        
-            void Stamp(char const *filename, int lineNum, char const *typeName);
-        
-            static void AddNode(BlockHeader *node);
-            static void RemoveNode(BlockHeader *node);
-            static size_t CountBlocks();
-            static void GetBlocks(BlockHeader **blockHeaderPP);
-            static bool TypeGreaterThan(BlockHeader *header1, BlockHeader *header2);
+        MAX_TAGS = 32,          // type 0 is everything not tagged
+        MAX_PHASES = 32,        // phase 0 is outside any phase
+        MAX_SITES = 4096,
+        MAX_FRAMES = 16,
+        MAX_PRINTED_FRAMES = 4,
+        SKIP_FRAMES = 3,        // SampleBlock, TrackMalloc, operator new
+        MAX_REPORTED_SITES = 20
     };
 
-    /* ---------------------------------------- BlockHeader static member variables */
+    static const uint16_t BLOCK_MAGIC = 0x4d54;
+    static const int64_t FLUSH_BYTES = 256 * 1024;
+    static const int64_t DEFAULT_SAMPLE_INTERVAL = 512 * 1024;
 
-    BlockHeader *BlockHeader::ourFirstNode = NULL;
+    /* ------------------------------------------------------------ */
+    /* --------------------- struct BlockHeader ------------------- */
+    /* ------------------------------------------------------------ */
 
-    /* ---------------------------------------- BlockHeader constructor */
+    // Sixteen bytes, so a block keeps the alignment malloc gave it.
 
-    BlockHeader::BlockHeader(size_t requestedSize)
+    struct BlockHeader
     {
-        myPrevNode = NULL;
-        myNextNode = NULL;
-        myRequestedSize = requestedSize;
-        myFilename = "[unknown]";
-        myLineNum = 0;
-        myTypeName = "[unknown]";
-    }
+        uint64_t size;
+        uint32_t site;          // 1 + index into sites if sampled, else 0
+        uint16_t tag;
+        uint16_t magic;
+    };
 
-    /* ---------------------------------------- BlockHeader destructor */
+    /* ------------------------------------------------------------ */
+    /* ------------------------ struct Site ----------------------- */
+    /* ------------------------------------------------------------ */
 
-    BlockHeader::~BlockHeader()
-    {
-    }
-        
-    /* ---------------------------------------- BlockHeader Stamp */
+    // A call stack seen by the sampler.  Bytes are estimates, each sample
+    // standing for all the bytes allocated since the one before it.
 
-    void BlockHeader::Stamp(char const *filename, int lineNum, char const *typeName)
+    struct Site
     {
-        myFilename = filename;
-        myLineNum = lineNum;
-        myTypeName = typeName;
-    }
+        void *frames[MAX_FRAMES];
+        int numFrames;
+        int tag;
+        int64_t samples;
+        int64_t bytes;
+        int64_t liveBytes;
+    };
 
-    /* ---------------------------------------- BlockHeader AddNode */
+    /* ------------------------------------------------------------ */
+    /* ---------------------- struct ThreadCounts ----------------- */
+    /* ------------------------------------------------------------ */
 
-    void BlockHeader::AddNode(BlockHeader *node)
+    // Changes by this thread not yet added to the totals.  They are added once
+    // FLUSH_BYTES have been allocated or freed, when the thread exits, and by
+    // TrackListMemoryUsage() for the thread calling it, so peaks may be missed
+    // by up to FLUSH_BYTES per thread.
+
+    struct ThreadCounts
     {
-        assert(node != NULL);
-        assert(node->myPrevNode == NULL);
-        assert(node->myNextNode == NULL);
+        int64_t pending[MAX_TAGS];
+        int64_t churn;
+        int64_t allocs;
+        int64_t allocBytes;
+        int64_t untilSample;
+        uint64_t rng;
+        int started;
+        int busy;               // sampling, don't sample allocations made meanwhile
+    };
 
-        // If we have at least one node in the list ...        
-        if (ourFirstNode != NULL)
-        {
-            // ... make the new node the first node's predecessor.
-            assert(ourFirstNode->myPrevNode == NULL);
-            ourFirstNode->myPrevNode = node;
-        }
+    /* ---------------------------------------- state */
 
-        // Make the first node the new node's succesor.
-        node->myNextNode = ourFirstNode;
+    static __thread ThreadCounts ourCounts;
+    static __thread int ourTag;
 
-        // Make the new node the first node.
-        ourFirstNode = node;
-    }
+    static pthread_mutex_t ourMutex = PTHREAD_MUTEX_INITIALIZER;
+    static pthread_once_t ourOnce = PTHREAD_ONCE_INIT;
+    static pthread_key_t ourThreadKey;
 
-    /* ---------------------------------------- BlockHeader RemoveNode */
+    static char const *ourTagNames[MAX_TAGS] = { "other" };
+    static int ourNumTags = 1;
+    static char const *ourPhaseNames[MAX_PHASES] = { "(none)" };
+    static int ourNumPhases = 1;
+    static int ourPhase = 0;
 
-    void BlockHeader::RemoveNode(BlockHeader *node)
-    {
-        assert(node != NULL);
-        assert(ourFirstNode != NULL);
+    static int64_t ourSampleInterval = DEFAULT_SAMPLE_INTERVAL;
 
-        // If target node is the first node in the list...
-        if (ourFirstNode == node)
-        {
-            // ... make the target node's successor the first node.
-            assert(ourFirstNode->myPrevNode == NULL);
-            ourFirstNode = node->myNextNode;
-        }
-        
-        // Link target node's predecessor, if any, to its successor.
-        if (node->myPrevNode != NULL)
-        {
-            node->myPrevNode->myNextNode = node->myNextNode;
-        }
-        
-        // Link target node's successor, if any, to its predecessor.
-        if (node->myNextNode != NULL)
-        {
-            node->myNextNode->myPrevNode = node->myPrevNode;
-        }
+    static int64_t ourLiveTotal = 0;
+    static int64_t ourPeakTotal = 0;
+    static int64_t ourLive[MAX_TAGS];
+    static int64_t ourPeak[MAX_TAGS];
+    static int64_t ourPhasePeak[MAX_PHASES];
+    static int64_t ourPhaseTagPeak[MAX_PHASES][MAX_TAGS];
+    static int64_t ourAllocs = 0;
+    static int64_t ourAllocBytes = 0;
 
-        // Clear target node's previous and next pointers.
-        node->myPrevNode = NULL;
-        node->myNextNode = NULL;
-    }
+    static Site ourSites[MAX_SITES];
+    static int ourNumSites = 0;
 
-    /* ---------------------------------------- BlockHeader CountBlocks */
+    /* ---------------------------------------- RaiseTo */
 
-    size_t BlockHeader::CountBlocks()
+    static inline void RaiseTo(int64_t *peak, int64_t value)
     {
-        size_t count = 0;
-        BlockHeader *currNode = ourFirstNode;
-        while (currNode != NULL)
-        {
-            count++;
-            currNode = currNode->myNextNode;
-        }
-        return count;
+        int64_t p = __atomic_load_n(peak, __ATOMIC_RELAXED);
+        while (value > p
+               && ! __atomic_compare_exchange_n(peak, &p, value, true, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+            ;
     }
 
-    /* ---------------------------------------- BlockHeader GetBlocks */
+    /* ---------------------------------------- Flush */
 
-    void BlockHeader::GetBlocks(BlockHeader **blockHeaderPP)
+    static void Flush()
     {
-        BlockHeader *currNode = ourFirstNode;
-        while (currNode != NULL)
+        ThreadCounts &c = ourCounts;
+        int phase = __atomic_load_n(&ourPhase, __ATOMIC_RELAXED);
+        int64_t sum = 0;
+        for (int t = 0; t < MAX_TAGS; t++)
+        {
+            int64_t d = c.pending[t];
+            if (d == 0) continue;
+            c.pending[t] = 0;
+            sum += d;
+            int64_t live = __atomic_add_fetch(&ourLive[t], d, __ATOMIC_RELAXED);
+            if (d > 0)
+            {
+                RaiseTo(&ourPeak[t], live);
+                RaiseTo(&ourPhaseTagPeak[phase][t], live);
+            }
+        }
+        int64_t live = __atomic_add_fetch(&ourLiveTotal, sum, __ATOMIC_RELAXED);
+        if (sum > 0)
         {
-            *blockHeaderPP = currNode;
-            blockHeaderPP++;
-            currNode = currNode->myNextNode;
+            RaiseTo(&ourPeakTotal, live);
+            RaiseTo(&ourPhasePeak[phase], live);
         }
+        __atomic_add_fetch(&ourAllocs, c.allocs, __ATOMIC_RELAXED);
+        __atomic_add_fetch(&ourAllocBytes, c.allocBytes, __ATOMIC_RELAXED);
+        c.allocs = c.allocBytes = c.churn = 0;
     }
 
-    /* ---------------------------------------- BlockHeader TypeGreaterThan */
+    /* ---------------------------------------- thread start and exit */
 
-    bool BlockHeader::TypeGreaterThan(BlockHeader *header1, BlockHeader *header2)
+    static void ThreadExit(void *)
     {
-        return (strcmp(header1->myTypeName, header2->myTypeName) > 0);
+        Flush();
     }
 
-    /* ------------------------------------------------------------ */
-    /* ---------------------- class Signature --------------------- */
-    /* ------------------------------------------------------------ */
-
-    class Signature
+    static void Init()
     {
-        private:    // constants
-            static const unsigned int SIGNATURE1 = 0xCAFEBABE;
-            static const unsigned int SIGNATURE2 = 0xFACEFACE;
-        
-        private:    // member variables
-            unsigned int mySignature1;
-            unsigned int mySignature2;
-            
-        public:        // construction/destruction
-            Signature() : mySignature1(SIGNATURE1), mySignature2(SIGNATURE2) {};
-            ~Signature() { mySignature1 = 0; mySignature2 = 0; }
-            
-        public:        // static member functions
-            static bool IsValidSignature(const Signature *pProspectiveSignature)
-            {
-                try
-                {
-                    if (pProspectiveSignature->mySignature1 != SIGNATURE1) return false;
-                    if (pProspectiveSignature->mySignature2 != SIGNATURE2) return false;
-                    return true;
-                }
-                catch (...)
-                {
-                    return false;
-                }
-            }
-    };
-
-    /* ------------------------------------------------------------ */
-    /* -------------------- address conversion -------------------- */
-    /* ------------------------------------------------------------ */
-
-    /* We divide the memory blocks we allocate into two "chunks", the
-     * "prolog chunk" where we store information about the allocation,
-     * and the "user chunk" which we return to the caller to use.
-     */
-
-    /* ---------------------------------------- alignment */
-
-    const size_t ALIGNMENT = 4;
-
-    /* If "value" (a memory size or offset) falls on an alignment boundary,
-     * then just return it.  Otherwise return the smallest number larger
-     * than "value" that falls on an alignment boundary.
-     */    
-
-    #define PAD_TO_ALIGNMENT_BOUNDARY(value) \
-        ((value) + ((ALIGNMENT - ((value) % ALIGNMENT)) % ALIGNMENT))
-
-    /* ---------------------------------------- chunk structs */
-    
-    /* We declare incomplete structures for each chunk, just to 
-     * provide type safety.
-     */
-
-    struct PrologChunk;
-    struct UserChunk;
-
-    /* ---------------------------------------- chunk sizes and offsets */
-
-    const size_t SIZE_BlockHeader = PAD_TO_ALIGNMENT_BOUNDARY(sizeof(BlockHeader));
-    const size_t SIZE_Signature = PAD_TO_ALIGNMENT_BOUNDARY(sizeof(Signature));
+        pthread_key_create(&ourThreadKey, ThreadExit);
+        char const *s = getenv("MEMTRACK_SAMPLE_INTERVAL");
+        if (s != NULL) ourSampleInterval = atoll(s);
+    }
 
-    const size_t OFFSET_BlockHeader = 0;
-    const size_t OFFSET_Signature = OFFSET_BlockHeader + SIZE_BlockHeader;
-    const size_t OFFSET_UserChunk = OFFSET_Signature + SIZE_Signature;
-    
-    const size_t SIZE_PrologChunk = OFFSET_UserChunk;
+    // Bytes to the next sample, exponentially distributed so that every byte
+    // is equally likely to be sampled.
 
-    /* ---------------------------------------- GetUserAddress */
+    static int64_t NextInterval(ThreadCounts &c)
+    {
+        int64_t mean = __atomic_load_n(&ourSampleInterval, __ATOMIC_RELAXED);
+        if (mean <= 0) return INT64_MAX;
+        c.rng ^= c.rng << 13;
+        c.rng ^= c.rng >> 7;
+        c.rng ^= c.rng << 17;
+        double u = (double((c.rng >> 11) + 1)) / 9007199254740993.0;  // (0, 1)
+        return int64_t(-log(u) * mean) + 1;
+    }
 
-    static UserChunk *GetUserAddress(PrologChunk *pProlog)
+    static void ThreadStart(ThreadCounts &c)
     {
-        char *pchProlog = reinterpret_cast<char *>(pProlog);
-        char *pchUser = pchProlog + OFFSET_UserChunk;
-        UserChunk *pUser = reinterpret_cast<UserChunk *>(pchUser);
-        return pUser;
+        c.started = 1;
+        pthread_once(&ourOnce, Init);
+        pthread_setspecific(ourThreadKey, &c);
+        c.rng = uint64_t(uintptr_t(&c)) * 0x9e3779b97f4a7c15ULL | 1;
+        c.untilSample = NextInterval(c);
     }
 
-    /* ---------------------------------------- GetPrologAddress */
+    // The bytes a sample of a block of size bytes stands for, the inverse of
+    // the chance that the block was sampled.
 
-    static PrologChunk *GetPrologAddress(UserChunk *pUser)
+    static int64_t SampleWeight(uint64_t size)
     {
-        char *pchUser = reinterpret_cast<char *>(pUser);
-        char *pchProlog = pchUser - OFFSET_UserChunk;
-        PrologChunk *pProlog = reinterpret_cast<PrologChunk *>(pchProlog);
-        return pProlog;
+        int64_t mean = __atomic_load_n(&ourSampleInterval, __ATOMIC_RELAXED);
+        if (mean <= 0) return int64_t(size);
+        return int64_t(double(size) / (1.0 - exp(-double(size) / mean)));
     }
 
-    /* ---------------------------------------- GetHeaderAddress */
+    /* ---------------------------------------- sampling */
 
-    static BlockHeader *GetHeaderAddress(PrologChunk *pProlog)
+    static __attribute__((noinline)) uint32_t SampleBlock(ThreadCounts &c, uint64_t size, int tag)
     {
-        char *pchProlog = reinterpret_cast<char *>(pProlog);
-        char *pchHeader = pchProlog + OFFSET_BlockHeader;
-        BlockHeader *pHeader = reinterpret_cast<BlockHeader *>(pchHeader);
-        return pHeader;
-    }
+        c.busy = 1;
+        c.untilSample = NextInterval(c);
+
+        void *frames[MAX_FRAMES + SKIP_FRAMES];
+        int n = backtrace(frames, MAX_FRAMES + SKIP_FRAMES) - SKIP_FRAMES;
+        if (n < 0) n = 0;
+        uint64_t h = uint64_t(tag);
+        for (int i = 0; i < n; i++)
+            h = (h ^ uint64_t(uintptr_t(frames[SKIP_FRAMES + i]))) * 0x100000001b3ULL;
+
+        uint32_t site = 0;
+        pthread_mutex_lock(&ourMutex);
+        for (size_t probe = 0, i = size_t(h ^ (h >> 29)) % MAX_SITES; probe < MAX_SITES;
+             probe++, i = (i + 1) % MAX_SITES)
+        {
+            Site &s = ourSites[i];
+            if (s.samples == 0 && s.numFrames == 0)
+            {
+                if (ourNumSites >= MAX_SITES / 2) break;    // keep probes short
+                memcpy(s.frames, frames + SKIP_FRAMES, n * sizeof(void *));
+                s.numFrames = n > 0 ? n : -1;
+                s.tag = tag;
+                ourNumSites++;
+            }
+            else if (s.tag != tag || s.numFrames != (n > 0 ? n : -1)
+                     || memcmp(s.frames, frames + SKIP_FRAMES, n * sizeof(void *)) != 0)
+                continue;
+            int64_t w = SampleWeight(size);
+            s.samples++;
+            s.bytes += w;
+            s.liveBytes += w;
+            site = uint32_t(i) + 1;
+            break;
+        }
+        pthread_mutex_unlock(&ourMutex);
 
-    /* ---------------------------------------- GetSignatureAddress */
+        c.busy = 0;
+        return site;
+    }
 
-    static Signature *GetSignatureAddress(PrologChunk *pProlog)
+    static void UnsampleBlock(uint32_t site, uint64_t size)
     {
-        char *pchProlog = reinterpret_cast<char *>(pProlog);
-        char *pchSignature = pchProlog + OFFSET_Signature;
-        Signature *pSignature = reinterpret_cast<Signature *>(pchSignature);
-        return pSignature;
+        __atomic_sub_fetch(&ourSites[site - 1].liveBytes, SampleWeight(size), __ATOMIC_RELAXED);
     }
 
     /* ------------------------------------------------------------ */
-    /* -------------- memory allocation and stamping -------------- */
+    /* ---------------------- allocation ------------------------- */
     /* ------------------------------------------------------------ */
 
     /* ---------------------------------------- TrackMalloc */
-    
-    void *TrackMalloc(size_t size)
+
+    __attribute__((noinline)) void *TrackMalloc(size_t size)
     {
-        // Allocate the memory, including space for the prolog.
-        PrologChunk *pProlog = (PrologChunk *)malloc(SIZE_PrologChunk + size);
-        
-        // If the allocation failed, then return NULL.
-        if (pProlog == NULL) return NULL;
-        
-        // Use placement new to construct the block header in place.
-        BlockHeader *pBlockHeader = new (pProlog) BlockHeader(size);
-        
-        // Link the block header into the list of extant block headers.
-        BlockHeader::AddNode(pBlockHeader);
-        
-        // Use placement new to construct the signature in place.
-        Signature *pSignature = new (GetSignatureAddress(pProlog)) Signature;
-        
-        // Get the offset to the user chunk and return it.
-        UserChunk *pUser = GetUserAddress(pProlog);
-        
-        return pUser;
+        BlockHeader *h = (BlockHeader *)malloc(sizeof(BlockHeader) + size);
+        if (h == NULL) return NULL;
+        ThreadCounts &c = ourCounts;
+        if (! c.started) ThreadStart(c);
+        int tag = ourTag;
+        h->size = size;
+        h->site = 0;
+        h->tag = uint16_t(tag);
+        h->magic = BLOCK_MAGIC;
+        c.pending[tag] += int64_t(size);
+        c.churn += int64_t(size);
+        c.allocs++;
+        c.allocBytes += int64_t(size);
+        c.untilSample -= int64_t(size);
+        if (c.untilSample <= 0 && ! c.busy) h->site = SampleBlock(c, size, tag);
+        if (c.churn >= FLUSH_BYTES) Flush();
+        return h + 1;
     }
 
     /* ---------------------------------------- TrackFree */
-    
+
     void TrackFree(void *p)
     {
-        // It's perfectly valid for "p" to be null; return if it is.
         if (p == NULL) return;
-    
-        // Get the prolog address for this memory block.
-        UserChunk *pUser = reinterpret_cast<UserChunk *>(p);    
-        PrologChunk *pProlog = GetPrologAddress(pUser);
-       
-        // Check the signature, and if it's invalid, return immediately.
-        Signature *pSignature = GetSignatureAddress(pProlog);
-        if (!Signature::IsValidSignature(pSignature)) return;
-        
-        // Destroy the signature.
-        pSignature->~Signature();
-        pSignature = NULL;
-
-        // Unlink the block header from the list and destroy it.
-        BlockHeader *pBlockHeader = GetHeaderAddress(pProlog);
-        BlockHeader::RemoveNode(pBlockHeader);
-        pBlockHeader->~BlockHeader();
-        pBlockHeader = NULL;
-
-        // Free the memory block.    
-        free(pProlog);
+        BlockHeader *h = (BlockHeader *)p - 1;
+        if (h->magic != BLOCK_MAGIC)
+        {
+            fprintf(stderr, "MemTrack: deleting a block not allocated by operator new, or deleting it twice\n");
+            abort();
+        }
+        h->magic = 0;
+        ThreadCounts &c = ourCounts;
+        if (! c.started) ThreadStart(c);
+        c.pending[h->tag] -= int64_t(h->size);
+        c.churn += int64_t(h->size);
+        if (h->site != 0) UnsampleBlock(h->site, h->size);
+        if (c.churn >= FLUSH_BYTES) Flush();
+        free(h);
     }
 
-    /* ---------------------------------------- TrackStamp */
+    /* ------------------------------------------------------------ */
+    /* ---------------------- types and phases -------------------- */
+    /* ------------------------------------------------------------ */
+
+    /* ---------------------------------------- TrackTagId */
 
-    void TrackStamp(void *p, const MemStamp &stamp, char const *typeName)
+    int TrackTagId(char const *name)
     {
-        // Get the header and signature address for this pointer.
-        UserChunk *pUser = reinterpret_cast<UserChunk *>(p);
-        PrologChunk *pProlog = GetPrologAddress(pUser);
-        BlockHeader *pHeader = GetHeaderAddress(pProlog);
-        Signature *pSignature = GetSignatureAddress(pProlog);
+        int id = 0;
+        pthread_mutex_lock(&ourMutex);
+        for (int t = 1; t < ourNumTags; t++)
+            if (strcmp(ourTagNames[t], name) == 0) id = t;
+        if (id == 0 && ourNumTags < MAX_TAGS)
+        {
+            id = ourNumTags;
+            ourTagNames[ourNumTags++] = name;
+        }
+        pthread_mutex_unlock(&ourMutex);
+        return id;
+    }
 
-        // If the signature is not valid, then return immediately.
-        if (!Signature::IsValidSignature(pSignature)) return;
+    /* ---------------------------------------- TrackSetTag */
 
-        // "Stamp" the information onto the header.
-        pHeader->Stamp(stamp.filename, stamp.lineNum, typeName);
+    int TrackSetTag(int id)
+    {
+        int prev = ourTag;
+        ourTag = id;
+        return prev;
     }
 
-    /* ---------------------------------------- TrackDumpBlocks */
+    /* ---------------------------------------- TrackBeginPhase */
+
+    // The peaks of a phase start from what is live when it begins.  Phases of
+    // the same name share their peaks.
+
+    static void SetPhase(int phase)
+    {
+        __atomic_store_n(&ourPhase, phase, __ATOMIC_RELAXED);
+        Flush();
+        for (int t = 0; t < MAX_TAGS; t++)
+            RaiseTo(&ourPhaseTagPeak[phase][t], __atomic_load_n(&ourLive[t], __ATOMIC_RELAXED));
+        RaiseTo(&ourPhasePeak[phase], __atomic_load_n(&ourLiveTotal, __ATOMIC_RELAXED));
+    }
 
-    void TrackDumpBlocks()
+    void TrackBeginPhase(char const *name)
     {
-        // Get an array of pointers to all extant blocks.
-        size_t numBlocks = BlockHeader::CountBlocks();
-        BlockHeader **ppBlockHeader =
-            (BlockHeader **)calloc(numBlocks, sizeof(*ppBlockHeader));
-        BlockHeader::GetBlocks(ppBlockHeader);
-
-        // Dump information about the memory blocks.
-        printf("\n");
-        printf("=====================\n");
-        printf("Current Memory Blocks\n");
-        printf("=====================\n");
-        printf("\n");
-        for (size_t i = 0; i < numBlocks; i++)
+        int id = 0;
+        pthread_mutex_lock(&ourMutex);
+        for (int p = 1; p < ourNumPhases; p++)
+            if (strcmp(ourPhaseNames[p], name) == 0) id = p;
+        if (id == 0 && ourNumPhases < MAX_PHASES)
         {
-            BlockHeader *pBlockHeader = ppBlockHeader[i];
-            char const *typeName = pBlockHeader->GetTypeName();
-            size_t size = pBlockHeader->GetRequestedSize();
-            char const *fileName = pBlockHeader->GetFilename();
-            int lineNum = pBlockHeader->GetLineNum();
-            printf("*** #%-6d %5d bytes %-50s\n", i, size, typeName);
-            printf("... %s:%d\n", fileName, lineNum);
+            id = ourNumPhases;
+            ourPhaseNames[ourNumPhases++] = name;
         }
+        pthread_mutex_unlock(&ourMutex);
+        SetPhase(id);
+    }
+
+    /* ---------------------------------------- TrackEndPhase */
 
-        // Clean up.
-        free(ppBlockHeader);
+    void TrackEndPhase()
+    {
+        SetPhase(0);
     }
 
-    /* ---------------------------------------- struct MemDigest */
+    /* ---------------------------------------- TrackSetSampleInterval */
 
-    struct MemDigest
+    void TrackSetSampleInterval(size_t bytes)
     {
-        char const *typeName;
-        int blockCount;
-        size_t totalSize;
+        pthread_once(&ourOnce, Init);
+        __atomic_store_n(&ourSampleInterval, int64_t(bytes), __ATOMIC_RELAXED);
+    }
 
-        static bool TotalSizeGreaterThan(const MemDigest &md1, const MemDigest &md2)
-            { return md1.totalSize > md2.totalSize; }
-    };
+    /* ------------------------------------------------------------ */
+    /* ------------------------- reporting ------------------------ */
+    /* ------------------------------------------------------------ */
 
+    /* ---------------------------------------- PrintFrame */
 
-    /* ---------------------------------------- SummarizeMemoryUsageForType */
+    // Frames within the standard library are skipped, they are the insides of
+    // containers.  False if the frame was skipped.
 
-    static void SummarizeMemoryUsageForType(
-        MemDigest *pMemDigest,
-        BlockHeader **ppBlockHeader,
-        size_t startPost,
-        size_t endPost
-    )
+    static bool PrintFrame(void *frame)
     {
-        pMemDigest->typeName = ppBlockHeader[startPost]->GetTypeName();
-        pMemDigest->blockCount = 0;
-        pMemDigest->totalSize = 0;
-        for (size_t i = startPost; i < endPost; i++)
+        Dl_info info;
+        if (dladdr(frame, &info) == 0 || (info.dli_sname == NULL && info.dli_fname == NULL))
         {
-            pMemDigest->blockCount++;
-            pMemDigest->totalSize += ppBlockHeader[i]->GetRequestedSize();
-            assert(strcmp(ppBlockHeader[i]->GetTypeName(), pMemDigest->typeName) == 0);
+            fprintf(stderr, "            %p\n", frame);
+            return true;
         }
+        if (info.dli_sname != NULL)
+        {
+            int status = 0;
+            char *demangled = abi::__cxa_demangle(info.dli_sname, NULL, NULL, &status);
+            char const *name = status == 0 ? demangled : info.dli_sname;
+            bool skip = strncmp(name, "std::", 5) == 0 || strncmp(name, "void std::", 10) == 0
+                        || strncmp(name, "__gnu_cxx::", 11) == 0 || strncmp(name, "operator new", 12) == 0;
+            if (! skip)
+                fprintf(stderr, "            %.120s+0x%lx\n", name,
+                        (unsigned long)((char *)frame - (char *)info.dli_saddr));
+            free(demangled);
+            return ! skip;
+        }
+        char const *file = strrchr(info.dli_fname, '/');
+        fprintf(stderr, "            %s+0x%lx\n", file != NULL ? file + 1 : info.dli_fname,
+                (unsigned long)((char *)frame - (char *)info.dli_fbase));
+        return true;
+    }
+
+    /* ---------------------------------------- SiteBytesGreaterThan */
+
+    static bool SiteBytesGreaterThan(int i, int j)
+    {
+        return ourSites[i].bytes > ourSites[j].bytes;
     }
 
     /* ---------------------------------------- TrackListMemoryUsage */
 
+    // Peaks by phase, overall and for each type, then the types, then the call
+    // sites that allocated the most.  Sites in functions not exported by the
+    // executable are given as an offset into it, for addr2line.
+
     void TrackListMemoryUsage()
     {
-        // If there are no allocated blocks, then return now.
-        size_t numBlocks = BlockHeader::CountBlocks();
-        if (numBlocks == 0) return;
-
-        // Get an array of pointers to all extant blocks.
-        BlockHeader **ppBlockHeader =
-            (BlockHeader **)calloc(numBlocks, sizeof(*ppBlockHeader));
-        BlockHeader::GetBlocks(ppBlockHeader);
-
-        // Sort the blocks by type name.
-        std::sort(
-            ppBlockHeader,
-            ppBlockHeader + numBlocks,
-            BlockHeader::TypeGreaterThan
-        );
-
-        // Find out how many unique types we have.
-        size_t numUniqueTypes = 1;
-        for (size_t i = 1; i < numBlocks; i++)
-        {
-            char const *prevTypeName = ppBlockHeader[i - 1]->GetTypeName();
-            char const *currTypeName = ppBlockHeader[i]->GetTypeName();
-            if (strcmp(prevTypeName, currTypeName) != 0) numUniqueTypes++;
-        }
-
-        // Create an array of "digests" summarizing memory usage by type.
-        size_t startPost = 0;
-        size_t uniqueTypeIndex = 0;
-        MemDigest *pMemDigestArray =
-            (MemDigest *)calloc(numUniqueTypes, sizeof(*pMemDigestArray));
-        for (size_t i = 1; i <= numBlocks; i++)    // yes, less than or *equal* to
-        {
-            char const *prevTypeName = ppBlockHeader[i - 1]->GetTypeName();
-            char const *currTypeName = (i < numBlocks) ? ppBlockHeader[i]->GetTypeName() : "";
-            if (strcmp(prevTypeName, currTypeName) != 0)
-            {
-                size_t endPost = i;
-                SummarizeMemoryUsageForType(
-                    pMemDigestArray + uniqueTypeIndex,
-                    ppBlockHeader,
-                    startPost,
-                    endPost
-                );
-                startPost = endPost;
-                uniqueTypeIndex++;
-            }
-        }
-        assert(uniqueTypeIndex = numUniqueTypes);
-
-        // Sort the digests by total memory usage.
-        std::sort(
-            pMemDigestArray,
-            pMemDigestArray + numUniqueTypes,
-            MemDigest::TotalSizeGreaterThan
-        );
-
-        // Compute the grand total memory usage.
-        size_t grandTotalNumBlocks = 0;
-        size_t grandTotalSize = 0;
-        for (size_t i = 0; i < numUniqueTypes; i++)
+        static int order[MAX_SITES];
+        const double MB = 1024.0 * 1024.0;
+
+        ThreadCounts &c = ourCounts;
+        if (! c.started) ThreadStart(c);
+        c.busy = 1;
+        Flush();
+
+        pthread_mutex_lock(&ourMutex);
+
+        fprintf(stderr, "\n");
+        fprintf(stderr, "MemTrack: %lld allocations by operator new, %.1f MB, peak %.1f MB live, %.1f MB live now\n",
+                (long long)ourAllocs, ourAllocBytes / MB, ourPeakTotal / MB, ourLiveTotal / MB);
+
+        fprintf(stderr, "MemTrack: peak MB live by phase\n");
+        fprintf(stderr, "    %-16s %10s", "phase", "all");
+        for (int t = 0; t < ourNumTags; t++)
+            fprintf(stderr, " %14s", ourTagNames[t]);
+        fprintf(stderr, "\n");
+        for (int p = 1; p <= ourNumPhases; p++)
         {
-            grandTotalNumBlocks += pMemDigestArray[i].blockCount;
-            grandTotalSize += pMemDigestArray[i].totalSize;
+            int phase = p % ourNumPhases;   // (none) last
+            if (ourPhasePeak[phase] == 0) continue;
+            fprintf(stderr, "    %-16s %10.1f", ourPhaseNames[phase], ourPhasePeak[phase] / MB);
+            for (int t = 0; t < ourNumTags; t++)
+                fprintf(stderr, " %14.1f", ourPhaseTagPeak[phase][t] / MB);
+            fprintf(stderr, "\n");
         }
 
-        // Dump the memory usage statistics.
-        printf("\n");
-        printf("-----------------------\n");
-        printf("Memory Usage Statistics\n");
-        printf("-----------------------\n");
-        printf("\n");
-        printf("%-50s%5s  %5s %7s %s \n", "allocated type", "blocks", "", "bytes", "");
-        printf("%-50s%5s  %5s %7s %s \n", "--------------", "------", "", "-----", "");
-
-        for (size_t i = 0; i < numUniqueTypes; i++)
+        fprintf(stderr, "MemTrack: MB live by type\n");
+        fprintf(stderr, "    %-16s %10s %10s\n", "type", "peak", "now");
+        for (int t = 0; t < ourNumTags; t++)
+            fprintf(stderr, "    %-16s %10.1f %10.1f\n", ourTagNames[t], ourPeak[t] / MB, ourLive[t] / MB);
+
+        int numSites = 0;
+        for (int i = 0; i < MAX_SITES; i++)
+            if (ourSites[i].samples > 0) order[numSites++] = i;
+        std::sort(order, order + numSites, SiteBytesGreaterThan);
+        if (numSites > MAX_REPORTED_SITES) numSites = MAX_REPORTED_SITES;
+
+        fprintf(stderr, "MemTrack: call sites allocating most, estimated from 1 sample per %lld bytes\n",
+                (long long)ourSampleInterval);
+        fprintf(stderr, "    %10s %10s %8s  %s\n", "MB", "MB now", "samples", "type");
+        for (int k = 0; k < numSites; k++)
         {
-            MemDigest *pMD = pMemDigestArray + i;
-            size_t blockCount = pMD->blockCount;
-            double blockCountPct = 100.0 * blockCount / grandTotalNumBlocks;
-            size_t totalSize = pMD->totalSize;
-            double totalSizePct = 100.0 * totalSize / grandTotalSize;
-
-            printf(
-                "%-50s %5d %5.1f%% %7d %5.1f%%\n",
-                pMD->typeName,
-                blockCount,
-                blockCountPct,
-                totalSize,
-                totalSizePct
-            );
+            Site &s = ourSites[order[k]];
+            fprintf(stderr, "    %10.1f %10.1f %8lld  %s\n", s.bytes / MB, s.liveBytes / MB,
+                    (long long)s.samples, ourTagNames[s.tag]);
+            for (int f = 0, printed = 0; f < s.numFrames && printed < MAX_PRINTED_FRAMES; f++)
+                if (PrintFrame(s.frames[f])) printed++;
         }
-        printf("%-50s %5s %5s  %7s %s \n", "--------", "-----", "", "-------", "");
-        printf("%-50s %5d %5s  %7d %s \n", "[totals]", grandTotalNumBlocks, "", grandTotalSize, "");
 
-        // Clean up.
-        free(ppBlockHeader);
-        free(pMemDigestArray);
+        pthread_mutex_unlock(&ourMutex);
+        c.busy = 0;
     }
 
 }    // namespace MemTrack
@@ -577,9 +539,19 @@ void *operator new(size_t size)
     return p;
 }
 
+void *operator new(size_t size, const std::nothrow_t &) throw()
+{
+    return MemTrack::TrackMalloc(size);
+}
+
 /* ---------------------------------------- operator delete */
 
-void operator delete(void *p)
+void operator delete(void *p) throw()
+{
+    MemTrack::TrackFree(p);
+}
+
+void operator delete(void *p, const std::nothrow_t &) throw()
 {
     MemTrack::TrackFree(p);
 }
@@ -593,10 +565,19 @@ void *operator new[](size_t size)
     return p;
 }
 
+void *operator new[](size_t size, const std::nothrow_t &) throw()
+{
+    return MemTrack::TrackMalloc(size);
+}
+
 /* ---------------------------------------- operator delete[] */
 
-void operator delete[](void *p)
+void operator delete[](void *p) throw()
 {
     MemTrack::TrackFree(p);
 }
 
+void operator delete[](void *p, const std::nothrow_t &) throw()
+{
+    MemTrack::TrackFree(p);
+}
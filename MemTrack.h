@@ -31,48 +31,68 @@ ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED
 OF THE POSSIBILITY OF SUCH DAMAGE.
 */
 
+
+/*
+Modified for yoruba by Douglas G. Scofield, douglasgscofield@gmail.com.
+
+The original kept every block on one linked list, with a stamp of the file
+and line of each new, and was not thread-safe.  Here each block carries a
+small header with its size and type, live and peak bytes are kept per type
+and per phase from per-thread counters that are added to the totals now and
+then, and about one allocation in every sample interval of bytes records its
+call stack.  MemTrack.cpp replaces the global operator new and delete when it
+is linked, see 'make profile'.
+
+Types are named by MEMTRACK_TAG(name) at the top of a scope, and everything
+allocated by the thread within the scope is counted as that type.  Phases
+are begun and ended by yoruba's ScopedPhase.  Both are no-ops unless
+_WITH_MEMTRACK is defined, so tags can stay in the code.
+*/
+
 #ifndef MemTrack_H_
 #define MemTrack_H_
 
-#include <typeinfo>
+#include <cstddef>
 
 namespace MemTrack
 {
-    /* ---------------------------------------- class MemStamp */
-
-    class MemStamp
-    {
-        public:        // member variables
-            char const * const filename;
-            int const lineNum;
-        public:        // construction/destruction
-            MemStamp(char const *filename, int lineNum)
-                : filename(filename), lineNum(lineNum) { }
-            ~MemStamp() { }
-    };
-
-    /* ---------------------------------------- memory allocation and stamping prototypes */
+    /* ---------------------------------------- memory allocation and tracking prototypes */
 
     void *TrackMalloc(size_t size);
     void TrackFree(void *p);
-    void TrackStamp(void *p, const MemStamp &stamp, char const *typeName);
-    void TrackDumpBlocks();
-    void TrackListMemoryUsage();
 
-    /* ---------------------------------------- operator * (MemStamp, ptr) */
+    int TrackTagId(char const *name);        // registers a type name, once per name
+    int TrackSetTag(int id);                 // the calling thread's type, returns the previous
+    void TrackBeginPhase(char const *name);
+    void TrackEndPhase();
+    void TrackSetSampleInterval(size_t bytes);
+    void TrackListMemoryUsage();             // report to stderr
+
+    /* ---------------------------------------- class TagScope */
 
-    template <class T> inline T *operator*(const MemStamp &stamp, T *p)
+    class TagScope
     {
-        TrackStamp(p, stamp, typeid(T).name());
-        return p;
-    }
+        private:    // member variables
+            int myPrevTag;
+        public:     // construction/destruction
+            explicit TagScope(int id) : myPrevTag(TrackSetTag(id)) { }
+            ~TagScope() { TrackSetTag(myPrevTag); }
+    };
 
 }    // namespace MemTrack
 
-/* ---------------------------------------- new macro */
+/* ---------------------------------------- tag and phase macros */
 
-#define MEMTRACK_NEW MemTrack::MemStamp(__FILE__, __LINE__) * new
-#define new MEMTRACK_NEW
+#ifdef _WITH_MEMTRACK
+#define MEMTRACK_TAG(name) \
+    static const int memtrack_tag_id_ = MemTrack::TrackTagId(name); \
+    MemTrack::TagScope memtrack_tag_scope_(memtrack_tag_id_)
+#define MEMTRACK_BEGIN_PHASE(name) MemTrack::TrackBeginPhase(name)
+#define MEMTRACK_END_PHASE() MemTrack::TrackEndPhase()
+#else
+#define MEMTRACK_TAG(name)
+#define MEMTRACK_BEGIN_PHASE(name)
+#define MEMTRACK_END_PHASE()
+#endif
 
 #endif    // MemTrack_H_
-
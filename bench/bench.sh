@@ -0,0 +1,132 @@
+#!/bin/sh
+#
+# bench.sh  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+#
+# Times each yoruba command on synthetic BAMs from yoruba-synth, and writes a
+# table of throughput, peak memory and the seconds in each phase, taken from
+# the --stats-json report of each run.  The inputs are made once for each
+# size and kept in the work directory, so later runs, say of another build,
+# are timed on the same bytes.
+#
+# Usage: bench/bench.sh [-s small|medium|large] [-t THREADS] [-w WORKDIR] [-y YORUBA]
+
+set -e
+
+size=small
+threads=$(nproc 2>/dev/null || echo 1)
+bench_dir=$(cd "$(dirname "$0")" && pwd)
+work="$bench_dir/work"
+yoruba="$bench_dir/../yoruba"
+synth="$bench_dir/yoruba-synth"
+
+while getopts "s:t:w:y:" opt; do
+    case $opt in
+        s) size=$OPTARG ;;
+        t) threads=$OPTARG ;;
+        w) work=$OPTARG ;;
+        y) yoruba=$OPTARG ;;
+        *) echo "usage: $0 [-s small|medium|large] [-t THREADS] [-w WORKDIR] [-y YORUBA]" >&2; exit 1 ;;
+    esac
+done
+
+# reads are on 25 references; gbagbe's input has a great many more, of which
+# only those 25 are used
+case $size in
+    small)  ref_length=1000000;  depth=2;  many_refs=100000 ;;
+    medium) ref_length=4000000;  depth=10; many_refs=1000000 ;;
+    large)  ref_length=40000000; depth=10; many_refs=10000000 ;;
+    *) echo "$0: size must be small, medium or large" >&2; exit 1 ;;
+esac
+
+inputs="$work/$size"
+out="$work/$size/results-$(date +%Y%m%d-%H%M%S)"
+mkdir -p "$inputs" "$out"
+common="--refs 25 --ref-length $ref_length --depth $depth --read-groups 2 --seed 1"
+
+if [ ! -s "$inputs/coord.bam" ]; then
+    echo "generating $inputs/coord.bam" >&2
+    "$synth" $common --write-index -o "$inputs/coord.bam"
+fi
+if [ ! -s "$inputs/name.bam" ]; then
+    echo "generating $inputs/name.bam" >&2
+    "$synth" $common --by-name -o "$inputs/name.bam"
+fi
+if [ ! -s "$inputs/refs.bam" ]; then
+    echo "generating $inputs/refs.bam" >&2
+    "$synth" --refs $many_refs --used-refs 25 --ref-length 100000 --depth $depth --seed 1 \
+        -o "$inputs/refs.bam"
+fi
+
+# name, then the command line after 'yoruba'; each writes its BAM to $o,
+# which is removed after the run
+
+run() {
+    name=$1; shift
+    o="$out/$name.bam"
+    echo "running $name" >&2
+    status=0
+    "$yoruba" "$@" --stats-json "$out/$name.json" > /dev/null 2> "$out/$name.log" || status=$?
+    if [ $status -ne 0 ]; then
+        echo "$name failed with status $status, see $out/$name.log" >&2
+    fi
+    rm -f "$o" "$o.bai" "$o.csi"
+}
+
+o_of() { echo "$out/$1.bam"; }
+
+# duplicate's shards must mark the reads one pass would, so the checksums of
+# the two outputs are compared
+mismatch=0
+run duplicate           duplicate --override --checksum "$out/duplicate.sum" \
+                            -o "$(o_of duplicate)" "$inputs/coord.bam"
+if [ "$threads" -gt 1 ]; then
+    run duplicate-t$threads duplicate --override -t "$threads" --checksum "$out/duplicate-t$threads.sum" \
+                            -o "$(o_of duplicate-t$threads)" "$inputs/coord.bam"
+    if [ -s "$out/duplicate.sum" ] && ! cmp -s "$out/duplicate.sum" "$out/duplicate-t$threads.sum"; then
+        echo "duplicate-t$threads output differs from that of duplicate, see $out/duplicate*.sum" >&2
+        mismatch=1
+    fi
+fi
+run duplicate-by-name   duplicate --override --by-name -o "$(o_of duplicate-by-name)" "$inputs/name.bam"
+run sort                sort -o "$(o_of sort)" "$inputs/name.bam"
+if [ "$threads" -gt 1 ]; then
+    run sort-t$threads  sort -t "$threads" -o "$(o_of sort-t$threads)" "$inputs/name.bam"
+fi
+run forget              forget -o "$(o_of forget)" "$inputs/refs.bam"
+run readgroup           readgroup --ID bench --SM bench -t "$threads" -o "$(o_of readgroup)" "$inputs/coord.bam"
+run run                 run readgroup,duplicate --readgroup='--ID bench --SM bench' --duplicate='--override' \
+                            -t "$threads" -o "$(o_of run)" "$inputs/coord.bam"
+run inside              inside --continue "$inputs/coord.bam"
+
+# the table, from the JSON each run wrote, one line for each field that
+# matters here
+
+{
+    echo "# $("$yoruba" 2>&1 | grep -i version | head -1)"
+    echo "# $(uname -srm), $(nproc 2>/dev/null || echo 1) CPUs, size $size, threads $threads"
+    printf "command\treads\twall_sec\tcpu_sec\treads_per_sec\tin_MB_per_sec\tpeak_MB\tphases\n"
+    for j in "$out"/*.json; do
+        awk -v name="$(basename "$j" .json)" '
+            /"wall_seconds"/             { gsub(/[",]/, ""); wall = $2 }
+            /"cpu_seconds"/              { gsub(/[",]/, ""); cpu = $2 }
+            /"peak_rss_bytes"/           { gsub(/[",]/, ""); rss = $2 }
+            /"bam_records_read"/         { gsub(/[",]/, ""); reads = $2 }
+            /"bgzf_compressed_bytes_read"/ { gsub(/[",]/, ""); bytes = $2 }
+            /"name":/ {
+                line = $0
+                gsub(/.*"name": "/, "", line); phase = line; sub(/".*/, "", phase)
+                line = $0
+                gsub(/.*"seconds": /, "", line); sub(/,.*/, "", line)
+                phases = phases (phases == "" ? "" : " ") phase "=" sprintf("%.3f", line)
+            }
+            END {
+                printf "%s\t%d\t%.3f\t%.3f\t%.0f\t%.1f\t%.1f\t%s\n", name, reads, wall, cpu,
+                    (wall > 0 ? reads / wall : 0), (wall > 0 ? bytes / wall / 1048576 : 0),
+                    rss / 1048576, phases
+            }' "$j"
+    done
+} > "$out/results.tsv"
+
+column -t -s "$(printf '\t')" "$out/results.tsv" 2>/dev/null || cat "$out/results.tsv"
+echo "results in $out" >&2
+exit $mismatch
@@ -0,0 +1,108 @@
+// yoruba_bench.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Synthetic records for yoruba_synth.cpp and yoruba_microbench.cpp
+
+// Std C/C++ includes
+#include <cstdio>
+
+// Yoruba includes
+#include "yoruba_bench.h"
+
+using namespace std;
+
+namespace yoruba {
+
+
+//-------------------------------------
+
+
+// the smallest bin holding [begin, end), as in the SAM specification
+
+static uint16_t
+reg2bin(int32_t begin, int32_t end)
+{
+    --end;
+    if (begin >> 14 == end >> 14) return uint16_t(((1 << 15) - 1) / 7 + (begin >> 14));
+    if (begin >> 17 == end >> 17) return uint16_t(((1 << 12) - 1) / 7 + (begin >> 17));
+    if (begin >> 20 == end >> 20) return uint16_t(((1 << 9) - 1) / 7 + (begin >> 20));
+    if (begin >> 23 == end >> 23) return uint16_t(((1 << 6) - 1) / 7 + (begin >> 23));
+    if (begin >> 26 == end >> 26) return uint16_t(((1 << 3) - 1) / 7 + (begin >> 26));
+    return 0;
+}
+
+
+//-------------------------------------
+
+
+template<typename T> static void
+put(string& s, T v)
+{
+    s.append(reinterpret_cast<const char*>(&v), sizeof(T));
+}
+
+
+//-------------------------------------
+
+
+void
+makeRecord(string& rec, const Locus& l, int32_t read_length, int64_t id,
+           bool is_right, bool is_first, Random& rng)
+{
+    const int32_t len = read_length;
+    const int32_t left = l.pos;
+    const int32_t right = l.pos + l.insert - len;
+    const int32_t pos = is_right ? right : left;
+
+    char name[64];
+    int name_len = snprintf(name, sizeof(name), "SYN:1:FC0001:%d:%lld", l.rg + 1, (long long)id);
+
+    uint16_t flag = 0;
+    if (l.paired) {
+        flag |= 0x1 | 0x2 | (is_first ? 0x40 : 0x80);
+        flag |= is_right ? 0x10 : 0x20;
+    } else if (l.flip) {
+        flag |= 0x10;
+    }
+
+    rec.clear();
+    put<int32_t>(rec, l.ref);
+    put<int32_t>(rec, pos);
+    put<uint8_t>(rec, uint8_t(name_len + 1));
+    put<uint8_t>(rec, uint8_t(20 + (uint64_t(id) * 0x9e3779b97f4a7c15ULL >> 32) % 41));  // the same for both mates
+    put<uint16_t>(rec, reg2bin(pos, pos + len));
+    put<uint16_t>(rec, 1);
+    put<uint16_t>(rec, flag);
+    put<int32_t>(rec, len);
+    put<int32_t>(rec, l.paired ? l.ref : -1);
+    put<int32_t>(rec, l.paired ? (is_right ? left : right) : -1);
+    put<int32_t>(rec, l.paired ? (is_right ? -l.insert : l.insert) : 0);
+    rec.append(name, name_len + 1);
+    put<uint32_t>(rec, uint32_t(len) << 4);  // lenM
+
+    static const char base[4] = { 1, 2, 4, 8 };  // A C G T
+    uint64_t bits = 0;
+    for (int32_t i = 0; i < len; i += 2) {
+        if (i % 64 == 0)
+            bits = rng.Next();
+        uint8_t b = uint8_t(base[bits & 3] << 4);
+        if (i + 1 < len)
+            b |= base[(bits >> 2) & 3];
+        bits >>= 4;
+        rec.push_back(char(b));
+    }
+    for (int32_t i = 0; i < len; ++i) {
+        if (i % 16 == 0)
+            bits = rng.Next();
+        rec.push_back(char(25 + (bits & 15)));  // qualities 25-40
+        bits >>= 4;
+    }
+
+    char rg[32];
+    int rg_len = snprintf(rg, sizeof(rg), "rg%d", l.rg + 1);
+    rec.append("RGZ", 3);
+    rec.append(rg, rg_len + 1);
+}
+
+
+}  // namespace yoruba
+
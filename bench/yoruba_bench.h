@@ -0,0 +1,66 @@
+// yoruba_bench.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_bench.cpp
+//
+// What the synthetic BAM generator and the microbenchmarks share: a random
+// number generator that gives the same numbers on every machine, and the
+// records of a template placed at a locus.
+
+#ifndef _YORUBA_BENCH_H_
+#define _YORUBA_BENCH_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <cmath>
+#include <string>
+#include <stdint.h>
+
+namespace yoruba {
+
+// splitmix64, so that nothing depends on the C library's rand()
+
+class Random {
+
+    public:
+        explicit Random(uint64_t seed) : state(seed) { }
+
+        uint64_t    Next(void) {
+            uint64_t z = (state += 0x9e3779b97f4a7c15ULL);
+            z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ULL;
+            z = (z ^ (z >> 27)) * 0x94d049bb133111ebULL;
+            return z ^ (z >> 31);
+        }
+        double      Uniform(void) { return (Next() >> 11) * (1.0 / 9007199254740992.0); }  // [0, 1)
+        uint64_t    Below(uint64_t n) { return n ? Next() % n : 0; }
+        double      Normal(double mean, double sd) {
+            double u1 = Uniform(), u2 = Uniform();
+            return mean + sd * sqrt(-2.0 * log(1.0 - u1)) * cos(6.283185307179586 * u2);
+        }
+
+    private:
+        uint64_t    state;
+
+};
+
+
+// Where a template lies, shared by the template and its duplicates.  Pairs
+// are FR, the rightmost read on the reverse strand.
+
+struct Locus {
+    int32_t     ref, pos;     // leftmost base of the template
+    int32_t     insert;       // template length, the read length if not paired
+    bool        paired;
+    bool        flip;         // first mate is the rightmost read, or a single read is reversed
+    int         rg;           // read group index, tagged RG:Z:rg<rg + 1>
+};
+
+// the record of template id at l, the rightmost read of a pair or the
+// leftmost, without the block_size, into rec; sequence and qualities are
+// drawn from rng, and the mapping quality is from id so that mates share it
+void makeRecord(std::string& rec, const Locus& l, int32_t read_length, int64_t id,
+                bool is_right, bool is_first, Random& rng);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_BENCH_H_
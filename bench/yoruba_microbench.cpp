@@ -0,0 +1,338 @@
+// yoruba_microbench.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Times the kernels the commands spend their time in, on synthetic records,
+// without reading or writing a BAM:
+//
+//   isDuplicate    seda's test of two reads at one position, over every pair
+//                  in a pile of reads as determineDuplicates() makes it
+//   dupMap         inserting read names, finding them and erasing them, and
+//                  the same with one map per reference as test.cpp tried
+//   tags           finding, replacing and removing the RG tag, as readgroup
+//                  and seda do for every read
+//
+// Each is repeated for at least --seconds and reported as nanoseconds per
+// operation.
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <tr1/unordered_map>
+#include <stdint.h>
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_seda.h"
+#include "yoruba_stats.h"
+#include "yoruba_bench.h"
+
+#undef NAME
+#define NAME "[yoruba-microbench]"
+
+using namespace std;
+using namespace yoruba;
+
+static double   opt_seconds = 0.5;
+static string   opt_filter;                 // only benchmarks whose names contain this
+static int      opt_pile = 32;              // reads at one position for isDuplicate
+static int64_t  opt_names = 1000000;        // read names for dupMap
+
+static volatile int64_t sink;               // so results are not optimized away
+
+
+//-------------------------------------
+
+
+static int
+usage(void)
+{
+    cerr << endl;
+    cerr << "\
+Usage:   yoruba-microbench [options]\n\
+\n\
+Times isDuplicate, dupMap operations and tag editing on synthetic records.\n\
+\n\
+Options: --seconds FLOAT           run each benchmark at least this long [" << opt_seconds << "]\n\
+         --filter STR              only run benchmarks with STR in their names\n\
+         --pile INT                reads at one position for isDuplicate [" << opt_pile << "]\n\
+         --names INT               read names for dupMap [" << opt_names << "]\n\
+         -? | --help               this help\n\
+\n";
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+static bool
+selected(const char* name)
+{
+    return opt_filter.empty() || strstr(name, opt_filter.c_str()) != NULL;
+}
+
+static void
+report(const char* name, int64_t ops, double seconds)
+{
+    printf("%-36s %12lld ops %10.3f sec %10.1f ns/op\n", name, (long long)ops, seconds,
+           ops > 0 ? 1.0e9 * seconds / ops : 0.0);
+    fflush(stdout);
+}
+
+
+// records of n templates, the first read of each, with dup_every-th template
+// a duplicate of the one before
+
+static void
+makeRecords(vector<RawRecord>& recs, int64_t n, const Locus& at, int dup_every, Random& rng)
+{
+    string rec;
+    Locus l = at;
+    recs.resize(size_t(n));
+    for (int64_t i = 0; i < n; ++i) {
+        if (dup_every == 0 || i % dup_every != 0) {
+            l.insert = at.insert + int32_t(rng.Below(200));
+            l.rg = int(rng.Below(2));
+        }
+        makeRecord(rec, l, 100, i + 1, false, true, rng);
+        recs[i].Assign(rec.data(), uint32_t(rec.size()));
+    }
+}
+
+
+//-------------------------------------
+
+
+static void
+benchIsDuplicate(const char* name, int dup_every)
+{
+    if (! selected(name))
+        return;
+    Random rng(1);
+    Locus at = { 0, 100000, 300, true, false, 0 };
+    vector<RawRecord> pile;
+    makeRecords(pile, opt_pile, at, dup_every, rng);
+
+    int64_t ops = 0, n_dup = 0;
+    double start = Stats::Now(), elapsed = 0.0;
+    do {
+        for (int rep = 0; rep < 64; ++rep)
+            for (size_t i = 0; i < pile.size(); ++i)
+                for (size_t j = i + 1; j < pile.size(); ++j, ++ops)
+                    n_dup += sedaIsDuplicate(pile[i], pile[j]);
+        elapsed = Stats::Now() - start;
+    } while (elapsed < opt_seconds);
+    sink = n_dup;
+    report(name, ops, elapsed);
+}
+
+
+//-------------------------------------
+
+
+static void
+readNames(vector<string>& names)
+{
+    Random rng(2);
+    Locus l = { 0, 0, 300, true, false, 0 };
+    string rec;
+    names.resize(size_t(opt_names));
+    for (int64_t i = 0; i < opt_names; ++i) {
+        makeRecord(rec, l, 100, i + 1, false, true, rng);
+        RawRecord r;
+        r.SetView(&rec[0], uint32_t(rec.size()));
+        names[i] = r.NameString();
+    }
+}
+
+static void
+benchDupMap(void)
+{
+    const char* n_insert = "dupMap insert";
+    const char* n_find = "dupMap find and update";
+    const char* n_erase = "dupMap erase";
+    const char* n_nested = "dupMap per reference, insert+erase";
+    if (! selected(n_insert) && ! selected(n_find) && ! selected(n_erase) && ! selected(n_nested))
+        return;
+
+    vector<string> names;
+    readNames(names);
+
+    int64_t ops_insert = 0, ops_find = 0, ops_erase = 0, found = 0;
+    double t_insert = 0.0, t_find = 0.0, t_erase = 0.0;
+    do {
+        dupMap dm;
+        double t0 = Stats::Now();
+        for (size_t i = 0; i < names.size(); ++i)
+            dm[names[i]] = dupMap_paired_one;
+        double t1 = Stats::Now();
+        for (size_t i = 0; i < names.size(); ++i) {
+            dupMapI dupI = dm.find(names[i]);
+            if (dupI != dm.end()) {
+                dupI->second = dupMap_paired_both;
+                ++found;
+            }
+        }
+        double t2 = Stats::Now();
+        for (size_t i = 0; i < names.size(); ++i)
+            dm.erase(names[i]);
+        double t3 = Stats::Now();
+        t_insert += t1 - t0;
+        t_find += t2 - t1;
+        t_erase += t3 - t2;
+        ops_insert += names.size();
+        ops_find += names.size();
+        ops_erase += names.size();
+    } while (t_insert + t_find + t_erase < 3 * opt_seconds);
+    sink = found;
+    if (selected(n_insert))
+        report(n_insert, ops_insert, t_insert);
+    if (selected(n_find))
+        report(n_find, ops_find, t_find);
+    if (selected(n_erase))
+        report(n_erase, ops_erase, t_erase);
+
+    if (! selected(n_nested))
+        return;
+    typedef map<size_t, dupMap> nestedMap;
+    const size_t n_refs = 25;
+    int64_t ops = 0;
+    double start = Stats::Now(), elapsed = 0.0;
+    do {
+        nestedMap nm;
+        for (size_t i = 0; i < names.size(); ++i)
+            nm[i % n_refs][names[i]] = dupMap_paired_one;
+        for (size_t i = 0; i < names.size(); ++i)
+            nm[i % n_refs].erase(names[i]);
+        ops += 2 * names.size();
+        elapsed = Stats::Now() - start;
+    } while (elapsed < opt_seconds);
+    report(n_nested, ops, elapsed);
+}
+
+
+//-------------------------------------
+
+
+static void
+benchTags(void)
+{
+    Random rng(3);
+    Locus at = { 0, 100000, 300, true, false, 0 };
+    vector<RawRecord> recs;
+    makeRecords(recs, 4096, at, 0, rng);
+    const string same_length = "rg9";
+    const string longer = "sample1.lane3.library2";
+
+    if (selected("tags get RG")) {
+        int64_t ops = 0, len_sum = 0;
+        double start = Stats::Now(), elapsed = 0.0;
+        do {
+            for (size_t i = 0; i < recs.size(); ++i, ++ops) {
+                const char* val;
+                size_t len;
+                if (recs[i].GetTagString("RG", val, len))
+                    len_sum += len;
+            }
+            elapsed = Stats::Now() - start;
+        } while (elapsed < opt_seconds);
+        sink = len_sum;
+        report("tags get RG", ops, elapsed);
+    }
+    if (selected("tags set RG, same length")) {
+        vector<RawRecord> work(recs);
+        int64_t ops = 0;
+        double start = Stats::Now(), elapsed = 0.0;
+        do {
+            for (size_t i = 0; i < work.size(); ++i, ++ops)
+                work[i].SetTagString("RG", same_length);
+            elapsed = Stats::Now() - start;
+        } while (elapsed < opt_seconds);
+        report("tags set RG, same length", ops, elapsed);
+    }
+    if (selected("tags set RG, longer")) {
+        int64_t ops = 0;
+        double elapsed = 0.0;
+        do {
+            vector<RawRecord> work(recs);  // a fresh copy, so each set grows the record
+            double start = Stats::Now();
+            for (size_t i = 0; i < work.size(); ++i, ++ops)
+                work[i].SetTagString("RG", longer);
+            elapsed += Stats::Now() - start;
+        } while (elapsed < opt_seconds);
+        report("tags set RG, longer", ops, elapsed);
+    }
+    if (selected("tags remove and set RG")) {
+        vector<RawRecord> work(recs);
+        int64_t ops = 0;
+        double start = Stats::Now(), elapsed = 0.0;
+        do {
+            for (size_t i = 0; i < work.size(); ++i, ++ops) {
+                work[i].RemoveTag("RG");
+                work[i].SetTagString("RG", longer);
+            }
+            elapsed = Stats::Now() - start;
+        } while (elapsed < opt_seconds);
+        report("tags remove and set RG", ops, elapsed);
+    }
+}
+
+
+//-------------------------------------
+
+
+int
+main(int argc, char* argv[])
+{
+    enum { OPT_seconds, OPT_filter, OPT_pile, OPT_names, OPT_help };
+
+    CSimpleOpt::SOption microbench_options[] = {
+        { OPT_seconds,         "--seconds",         SO_REQ_SEP },
+        { OPT_filter,          "--filter",          SO_REQ_SEP },
+        { OPT_pile,            "--pile",            SO_REQ_SEP },
+        { OPT_names,           "--names",           SO_REQ_SEP },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, microbench_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage();
+        } else if (args.OptionId() == OPT_seconds) {
+            opt_seconds = atof(args.OptionArg());
+        } else if (args.OptionId() == OPT_filter) {
+            opt_filter = args.OptionArg();
+        } else if (args.OptionId() == OPT_pile) {
+            opt_pile = atoi(args.OptionArg());
+        } else if (args.OptionId() == OPT_names) {
+            opt_names = strtoll(args.OptionArg(), NULL, 10);
+        }
+    }
+    if (opt_pile < 2 || opt_names < 1) {
+        cerr << NAME << " --pile must be at least 2 and --names at least 1" << endl;
+        return usage();
+    }
+
+    benchIsDuplicate("isDuplicate, no duplicates", 0);
+    benchIsDuplicate("isDuplicate, half duplicates", 2);
+    benchDupMap();
+    benchTags();
+
+    return EXIT_SUCCESS;
+}
+
@@ -0,0 +1,369 @@
+// yoruba_synth.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Writes a synthetic BAM for benchmarking yoruba.  The same options and
+// --seed give the same BAM on any machine, so runs on different machines and
+// builds can be compared on the same input without shipping the input.
+//
+// Templates are placed uniformly over the references reads are placed on,
+// with insert sizes drawn from a normal distribution, and a given fraction of
+// them are duplicates of an earlier template: same reference, position,
+// orientation, insert size and read group, but another name and sequence.
+// Output is either coordinate-sorted or grouped by read name as an aligner
+// writes it, with templates in no particular order.
+//
+// Uses BamTools only for header types
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <cstdio>
+#include <cmath>
+#include <cstring>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <map>
+#include <algorithm>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_bench.h"
+
+#define NAME "[yoruba-synth]"
+
+using namespace std;
+using namespace yoruba;
+
+static int64_t  opt_refs = 25;
+static int64_t  opt_ref_length = 4000000;
+static int64_t  opt_used_refs = 0;          // 0 is all of them
+static double   opt_depth = 10.0;
+static int64_t  opt_templates = 0;          // 0 is from --depth
+static int      opt_read_length = 100;
+static double   opt_dup_rate = 0.10;
+static double   opt_pair_fraction = 1.0;
+static int      opt_read_groups = 1;
+static double   opt_insert_mean = 300.0;
+static double   opt_insert_sd = 50.0;
+static bool     opt_by_name = false;
+static uint64_t opt_seed = 1;
+
+
+//-------------------------------------
+
+
+static int
+usage(void)
+{
+    cerr << endl;
+    cerr << "\
+Usage:   yoruba-synth [options] -o out.bam\n\
+\n\
+Writes a synthetic BAM for benchmarking yoruba, the same for the same options\n\
+on any machine.\n\
+\n\
+Options: --refs INT                @SQ lines in the header [" << opt_refs << "]\n\
+         --ref-length INT          length of each reference [" << opt_ref_length << "]\n\
+         --used-refs INT           place reads on only the first INT references [all]\n\
+         --depth FLOAT             mean depth of the references reads are placed on [" << opt_depth << "]\n\
+         -n INT | --templates INT  write INT templates, instead of from --depth\n\
+         --read-length INT         read length [" << opt_read_length << "]\n\
+         --dup-rate FLOAT          fraction of templates that are duplicates [" << opt_dup_rate << "]\n\
+         --pair-fraction FLOAT     fraction of templates that are pairs [" << opt_pair_fraction << "]\n\
+         --read-groups INT         read groups, reads spread evenly among them [" << opt_read_groups << "]\n\
+         --insert-mean FLOAT       mean insert size [" << opt_insert_mean << "]\n\
+         --insert-sd FLOAT         standard deviation of insert size [" << opt_insert_sd << "]\n\
+         --by-name                 group by read name, templates in no order, rather\n\
+                                   than sorting by coordinate\n\
+         --seed INT                random seed [" << opt_seed << "]\n\
+         -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index, if coordinate-sorted\n\
+         -? | --help               this help\n\
+\n";
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+static bool
+saveRecord(RawBamWriter& writer, string& rec)
+{
+    RawRecord r;
+    r.SetView(&rec[0], uint32_t(rec.size()));
+    return writer.SaveRecord(r);
+}
+
+
+// a new locus on ref at pos, or at a random place on the used references if
+// ref is negative
+
+static Locus
+newLocus(int32_t ref, int32_t pos, Random& rng)
+{
+    Locus l;
+    if (ref < 0) {
+        ref = int32_t(rng.Below(opt_used_refs));
+        pos = int32_t(rng.Below(opt_ref_length - opt_read_length + 1));
+    }
+    l.ref = ref;
+    l.pos = pos;
+    l.paired = rng.Uniform() < opt_pair_fraction;
+    l.flip = rng.Below(2) == 1;
+    l.rg = int(rng.Below(opt_read_groups));
+    l.insert = opt_read_length;
+    if (l.paired) {
+        int64_t ins = int64_t(floor(rng.Normal(opt_insert_mean, opt_insert_sd) + 0.5));
+        ins = max<int64_t>(ins, opt_read_length);
+        ins = min<int64_t>(ins, opt_ref_length - pos);
+        l.insert = int32_t(ins);
+    }
+    return l;
+}
+
+
+//-------------------------------------
+
+
+int
+main(int argc, char* argv[])
+{
+    string output_file = "/dev/stdout";
+    OutputOptions output_opts;
+
+    enum { OPT_refs, OPT_reflength, OPT_usedrefs, OPT_depth, OPT_templates, OPT_readlength,
+        OPT_duprate, OPT_pairfraction, OPT_readgroups, OPT_insertmean, OPT_insertsd,
+        OPT_byname, OPT_seed, OPT_output, OPT_level, OPT_uncompressed, OPT_writeindex,
+        OPT_help };
+
+    CSimpleOpt::SOption synth_options[] = {
+        { OPT_refs,            "--refs",            SO_REQ_SEP },
+        { OPT_reflength,       "--ref-length",      SO_REQ_SEP },
+        { OPT_usedrefs,        "--used-refs",       SO_REQ_SEP },
+        { OPT_depth,           "--depth",           SO_REQ_SEP },
+        { OPT_templates,       "--templates",       SO_REQ_SEP },
+        { OPT_templates,       "-n",                SO_REQ_SEP },
+        { OPT_readlength,      "--read-length",     SO_REQ_SEP },
+        { OPT_duprate,         "--dup-rate",        SO_REQ_SEP },
+        { OPT_pairfraction,    "--pair-fraction",   SO_REQ_SEP },
+        { OPT_readgroups,      "--read-groups",     SO_REQ_SEP },
+        { OPT_insertmean,      "--insert-mean",     SO_REQ_SEP },
+        { OPT_insertsd,        "--insert-sd",       SO_REQ_SEP },
+        { OPT_byname,          "--by-name",         SO_NONE },
+        { OPT_seed,            "--seed",            SO_REQ_SEP },
+        { OPT_output,          "--output",          SO_REQ_SEP },
+        { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, synth_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        const char* a = args.OptionArg();
+        if (args.OptionId() == OPT_help) {
+            return usage();
+        } else if (args.OptionId() == OPT_refs) {
+            opt_refs = strtoll(a, NULL, 10);
+        } else if (args.OptionId() == OPT_reflength) {
+            opt_ref_length = strtoll(a, NULL, 10);
+        } else if (args.OptionId() == OPT_usedrefs) {
+            opt_used_refs = strtoll(a, NULL, 10);
+        } else if (args.OptionId() == OPT_depth) {
+            opt_depth = atof(a);
+        } else if (args.OptionId() == OPT_templates) {
+            opt_templates = strtoll(a, NULL, 10);
+        } else if (args.OptionId() == OPT_readlength) {
+            opt_read_length = atoi(a);
+        } else if (args.OptionId() == OPT_duprate) {
+            opt_dup_rate = atof(a);
+        } else if (args.OptionId() == OPT_pairfraction) {
+            opt_pair_fraction = atof(a);
+        } else if (args.OptionId() == OPT_readgroups) {
+            opt_read_groups = atoi(a);
+        } else if (args.OptionId() == OPT_insertmean) {
+            opt_insert_mean = atof(a);
+        } else if (args.OptionId() == OPT_insertsd) {
+            opt_insert_sd = atof(a);
+        } else if (args.OptionId() == OPT_byname) {
+            opt_by_name = true;
+        } else if (args.OptionId() == OPT_seed) {
+            opt_seed = strtoull(a, NULL, 10);
+        } else if (args.OptionId() == OPT_output) {
+            output_file = a;
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(a)) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        }
+    }
+    if (args.FileCount() > 0) {
+        cerr << NAME << " takes no input files" << endl;
+        return usage();
+    }
+
+    if (opt_used_refs <= 0 || opt_used_refs > opt_refs)
+        opt_used_refs = opt_refs;
+    if (opt_refs < 1 || opt_refs > INT32_MAX || opt_ref_length < 1 || opt_ref_length > INT32_MAX
+        || opt_read_length < 1 || opt_read_length > opt_ref_length || opt_read_length > 65535) {
+        cerr << NAME << " need at least one reference, and reads no longer than references" << endl;
+        return usage();
+    }
+    if (opt_read_groups < 1 || opt_dup_rate < 0.0 || opt_dup_rate >= 1.0
+        || opt_pair_fraction < 0.0 || opt_pair_fraction > 1.0 || opt_insert_sd < 0.0) {
+        cerr << NAME << " --read-groups must be at least 1, --dup-rate in [0, 1), --pair-fraction in [0, 1]" << endl;
+        return usage();
+    }
+    if (opt_templates <= 0) {
+        double bases_per_template = opt_read_length * (1.0 + opt_pair_fraction);
+        opt_templates = int64_t(opt_depth * double(opt_used_refs) * double(opt_ref_length)
+                                / bases_per_template + 0.5);
+    }
+    if (opt_by_name && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index is only for coordinate-sorted output" << endl;
+        return usage();
+    }
+
+    // header
+
+    string header = opt_by_name ? "@HD\tVN:1.6\tSO:unsorted\tGO:query\n"
+                                : "@HD\tVN:1.6\tSO:coordinate\n";
+    BamTools::RefVector refs;
+    refs.reserve(opt_refs);
+    char buf[256];
+    for (int64_t i = 0; i < opt_refs; ++i) {
+        snprintf(buf, sizeof(buf), "ref%lld", (long long)(i + 1));
+        refs.push_back(BamTools::RefData(buf, int32_t(opt_ref_length)));
+        snprintf(buf, sizeof(buf), "@SQ\tSN:ref%lld\tLN:%lld\n", (long long)(i + 1), (long long)opt_ref_length);
+        header += buf;
+    }
+    for (int i = 0; i < opt_read_groups; ++i) {
+        snprintf(buf, sizeof(buf), "@RG\tID:rg%d\tSM:synth\tLB:lib%d\tPL:ILLUMINA\tPI:%d\n",
+                 i + 1, i + 1, int(opt_insert_mean));
+        header += buf;
+    }
+    header += "@PG\tID:yoruba-synth\tPN:yoruba-synth\tVN:" YORUBA_VERSION "\tCL:";
+    for (int i = 0; i < argc; ++i)
+        header += string(i ? " " : "") + argv[i];
+    header += "\n";
+
+    RawBamWriter writer;
+    writer.SetCompressionLevel(output_opts.Level());
+    writer.SetWriteIndex(output_opts.WriteIndex());
+    if (! writer.Open(output_file, header, refs)) {
+        cerr << NAME << " could not open output BAM file " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    // templates; a duplicate repeats the locus before it when sorted, so it
+    // stays in order, or one of the recent loci when grouped by name
+
+    Random rng(opt_seed);
+    string rec;
+    int64_t id = 0, n_records = 0, n_dups = 0;
+    bool ok = true;
+
+    if (opt_by_name) {
+        vector<Locus> recent;
+        const size_t n_recent = 4096;
+        for (int64_t t = 0; t < opt_templates && ok; ++t) {
+            Locus l;
+            if (! recent.empty() && rng.Uniform() < opt_dup_rate) {
+                l = recent[rng.Below(recent.size())];
+                ++n_dups;
+            } else {
+                l = newLocus(-1, 0, rng);
+                if (recent.size() < n_recent)
+                    recent.push_back(l);
+                else
+                    recent[rng.Below(n_recent)] = l;
+            }
+            ++id;
+            makeRecord(rec, l, opt_read_length, id, l.flip && l.paired, true, rng);
+            ok = saveRecord(writer, rec);
+            ++n_records;
+            if (l.paired && ok) {
+                makeRecord(rec, l, opt_read_length, id, ! l.flip, false, rng);
+                ok = saveRecord(writer, rec);
+                ++n_records;
+            }
+        }
+    } else {
+        // templates spread evenly over the used references, each reference's
+        // positions drawn and sorted, and rightmost mates held until their turn
+        multimap<int32_t, string> pending;
+        vector<int32_t> positions;
+        for (int64_t r = 0; r < opt_used_refs && ok; ++r) {
+            int64_t n = opt_templates * (r + 1) / opt_used_refs - opt_templates * r / opt_used_refs;
+            positions.resize(size_t(n));
+            for (int64_t i = 0; i < n; ++i)
+                positions[i] = int32_t(rng.Below(opt_ref_length - opt_read_length + 1));
+            sort(positions.begin(), positions.end());
+            Locus l;
+            for (int64_t i = 0; i < n && ok; ++i) {
+                if (i > 0 && rng.Uniform() < opt_dup_rate)
+                    ++n_dups;
+                else
+                    l = newLocus(int32_t(r), positions[i], rng);
+                while (! pending.empty() && pending.begin()->first < l.pos && ok) {
+                    ok = saveRecord(writer, pending.begin()->second);
+                    pending.erase(pending.begin());
+                }
+                ++id;
+                bool first_is_right = l.paired && l.flip;
+                makeRecord(rec, l, opt_read_length, id, first_is_right, true, rng);
+                if (first_is_right)
+                    pending.insert(make_pair(l.pos + l.insert - opt_read_length, rec));
+                else
+                    ok = ok && saveRecord(writer, rec);
+                ++n_records;
+                if (l.paired) {
+                    makeRecord(rec, l, opt_read_length, id, ! first_is_right, false, rng);
+                    if (! first_is_right)
+                        pending.insert(make_pair(l.pos + l.insert - opt_read_length, rec));
+                    else
+                        ok = ok && saveRecord(writer, rec);
+                    ++n_records;
+                }
+            }
+            for ( ; ! pending.empty() && ok; pending.erase(pending.begin()))
+                ok = saveRecord(writer, pending.begin()->second);
+        }
+    }
+
+    if (! writer.Close() || ! ok) {
+        cerr << NAME << " error writing " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+    cerr << NAME << " " << id << " templates, " << n_dups << " of them duplicates, "
+        << n_records << " reads on " << opt_used_refs << " of " << opt_refs << " references" << endl;
+
+    return EXIT_SUCCESS;
+}
+
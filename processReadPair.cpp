@@ -121,35 +121,8 @@ checkLinkPairCandidate(const BamAlignment& al,
 }
 
 
-// old mate-finding code, for position-sorted BAM files, didn't work well
-BamAlignment 
-lookForMate(BamReader& rdr, BamAlignment& al, RefVector& refs)
-{
-    if (! rdr.Jump(al.MateRefID, al.MatePosition)) {
-        cout << "*** Could not jump to " << al.MateRefID << ":" << al.MatePosition << endl;
-        exit(1);
-    }
-    BamAlignment al_jump;
-    while (rdr.GetNextAlignment(al_jump)) {
-        if (al_jump.Name == al.Name 
-            && al_jump.RefID == al.MateRefID
-            && al_jump.Position == al.MatePosition) {
-         cout << "MATE FOUND" << endl;
-            printAlignmentInfo(al_jump, refs);
-            break;
-        } else if (al_jump.Position > al.MatePosition) {
-         cout << "NO MATE FOUND, beyond MatePosition" << endl;
-            break;
-        }
-    }
-    if (! rdr.Jump(al.RefID, al.Position)) {
-        cout << "*** Could not return to " << al.RefID << ":" << al.Position << endl;
-        exit(1);
-    }
-    // need to return to the read we were on after the jump, but how?
-    rdr.GetNextAlignment(al);
-    return(al_jump);
-}
+// the old lookForMate(), which jumped to each mate and back, is replaced by
+// MateFetcher in yoruba_mates.h, which fetches many mates in one pass
 
 
 }  // namespace yoruba;
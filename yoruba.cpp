@@ -30,11 +30,17 @@
 #define _YORUBA_MAIN
 
 #include "yoruba.h"
+#include "yoruba_apeere.h"
+#include "yoruba_aropo.h"
 #include "yoruba_gbagbe.h"
 #include "yoruba_inu.h"
 #include "yoruba_kojopodipo.h"
+#include "yoruba_run.h"
 #include "yoruba_seda.h"
+#include "yoruba_seto.h"
+#include "yoruba_stats.h"
 #include "yoruba_util.h"
+#include "yoruba_yo.h"
 #ifdef _IMPLEMENTED
 #include "yoruba_sefibo.h"
 #include "yoruba_ibeji.h"
@@ -58,19 +64,55 @@ usage()
     cerr << "         inside     | inu          display summary of BAM file contents" << endl;
     cerr << "         readgroup  | kojopodipo   add or modify read group information" << endl;
     cerr << "         duplicate  | seda         mark (and optionally remove) duplicate reads" << endl;
+    cerr << "         sort       | seto         sort reads by coordinate" << endl;
+    cerr << "         run        | sise         chain forget, readgroup and duplicate in one pass" << endl;
+    cerr << "         checksum   | aropo        order-independent checksums of reads, to compare BAMs" << endl;
+    cerr << "         subsample  | apeere       keep a fraction of reads, mates together, by read name" << endl;
+    cerr << "         extract    | yo           reads in regions of an indexed BAM, and their mates" << endl;
 #ifdef _IMPLEMENTED
     cerr << "         insertsize | sefibo       calculates insert sizes" << endl;
     cerr << "         twinreads  | ibeji        find reads paired in various ways" << endl;
 #endif
     cerr << endl;
+    cerr << "Any command also takes" << endl << endl;
+    cerr << "    --stats-json FILE  write phase times, I/O counters and peak memory to FILE as JSON" << endl;
+    cerr << endl;
 
     return EXIT_FAILURE;
 }
 
+// Remove --stats-json FILE from anywhere in the command line, so that each
+// command's option parsing never sees it
+
+static bool
+stripStatsOption(int& argc, char* argv[])
+{
+    const string opt = "--stats-json";
+    int j = 1;
+    for (int i = 1; i < argc; ++i) {
+        string a = argv[i];
+        if (a == opt) {
+            if (i + 1 >= argc) {
+                cerr << NAME << " " << opt << " requires a file name" << endl;
+                return false;
+            }
+            Stats::SetOutput(argv[++i]);
+        } else if (a.compare(0, opt.length() + 1, opt + "=") == 0) {
+            Stats::SetOutput(a.substr(opt.length() + 1));
+        } else {
+            argv[j++] = argv[i];
+        }
+    }
+    argc = j;
+    argv[argc] = NULL;
+    return true;
+}
+
 int
 main (int argc, char* argv[])
 {
-    clock_t time_start = clock();
+    Stats::Start(argc, argv);
+    if (! stripStatsOption(argc, argv)) return EXIT_FAILURE;
     if (argc < 2) return usage();
     string cmd = argv[1];
     int retval = EXIT_SUCCESS;
@@ -82,6 +124,16 @@ main (int argc, char* argv[])
         retval = main_kojopodipo(argc-1, argv+1);
     else if (cmd == "duplicate" || cmd == "seda") 
         retval = main_seda(argc-1, argv+1);
+    else if (cmd == "sort" || cmd == "seto") 
+        retval = main_seto(argc-1, argv+1);
+    else if (cmd == "run" || cmd == "sise") 
+        retval = main_run(argc-1, argv+1);
+    else if (cmd == "checksum" || cmd == "aropo") 
+        retval = main_aropo(argc-1, argv+1);
+    else if (cmd == "subsample" || cmd == "apeere") 
+        retval = main_apeere(argc-1, argv+1);
+    else if (cmd == "extract" || cmd == "yo") 
+        retval = main_yo(argc-1, argv+1);
 #ifdef _IMPLEMENTED
     else if (cmd == "insert" || cmd == "sefibo") 
         retval = main_sefibo(argc-1, argv+1);
@@ -92,8 +144,13 @@ main (int argc, char* argv[])
         cerr << "Unrecognized command '" << argv[1] << "'" << endl;
         retval = EXIT_FAILURE;
     }
-    float runtime = ((float)(clock() - time_start)) / CLOCKS_PER_SEC;
-    cerr << NAME << " runtime " << fixed << setprecision(3) << runtime << " sec" << endl;
+    cerr << NAME << " runtime " << fixed << setprecision(3) << Stats::WallSeconds()
+        << " sec, cpu " << Stats::CPUSeconds() << " sec" << endl;
+    if (! Stats::Finish(retval) && retval == EXIT_SUCCESS)
+        retval = EXIT_FAILURE;
+#ifdef _WITH_MEMTRACK
+    MemTrack::TrackListMemoryUsage();
+#endif
     return retval;
 }
 
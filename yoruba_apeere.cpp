@@ -0,0 +1,576 @@
+// yoruba_apeere.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Apeere (English command is subsample) keeps a fraction of the reads in a
+// BAM file, chosen by a hash of each read's name.
+//
+// Whether a read is kept depends only on its name and the seed, so both
+// reads of a pair, and any secondary and supplementary alignments, are kept
+// or dropped together without one having to be held until the other is
+// found, and the same seed picks the same reads from a BAM however it is
+// sorted or split.  Reads are never decoded beyond their names, and records
+// are judged on the pipeline's worker threads, so the work is mostly
+// inflating and deflating BGZF blocks.
+//
+// Given a number of reads to keep rather than a fraction, the fraction is
+// that number over the reads in the BAM, which come from the counts in its
+// index if it has one and from a first pass through the reads if not.  With
+// --by-read-group, the first pass counts the reads of each read group and
+// each is given its own fraction.
+//
+// Apeere is the Yoruba (Nigeria) noun for 'sample'.
+//
+// Uses pthreads, and BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- per-read-group fractions given directly, without counting
+
+#include <cstring>
+
+#include "yoruba_apeere.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static string       input_file;
+static string       output_file;
+static OutputOptions output_opts;
+static string       checksum_file;     // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
+static double       opt_fraction = -1.0;
+static int64_t      opt_target = -1;   // reads to keep, instead of a fraction
+static bool         opt_by_read_group = false;
+static uint64_t     opt_seed = 0;
+static int          opt_threads = 1;
+static string       spill_dir;  // for stdin, defaults to $TMPDIR or /tmp
+static int64_t      opt_spill_memory = 256;  // MB of stdin kept in memory before spilling
+#ifdef _WITH_DEBUG
+static int32_t      opt_debug = 0;
+static int32_t      debug_progress = 10;  // seconds
+static int64_t      opt_reads = -1;
+static int64_t      opt_progress = 0;  // seconds between progress lines
+#endif
+
+static SamProgram   new_program;  // set in parseOptions()
+
+static int  parseOptions(int argc, char* argv[]);
+static uint64_t threshold(int64_t keep, int64_t n);
+
+
+//-------------------------------------
+
+
+#ifdef _STANDALONE
+int
+main(int argc, char* argv[]) {
+    return main_apeere(argc, argv);
+}
+#endif
+
+
+//-------------------------------------
+
+
+static int
+usage(bool longer = false)
+{
+    cerr << endl;
+    cerr << "Usage:   " << YORUBA_NAME << " subsample [options] <in.bam>" << endl;
+    cerr << "         " << YORUBA_NAME << " apeere [options] <in.bam>" << endl;
+    cerr << "\n\
+Keep a fraction of the reads in <in.bam>, chosen by a hash of the read name,\n\
+so that mates are kept or dropped together.  Either command invokes this\n\
+function.\n\
+\n";
+    if (longer) cerr << "\
+Each read is kept if a 64-bit hash of its name, seeded with --seed, falls in\n\
+the given fraction of the hash's range.  Every alignment of a read name is\n\
+treated alike, so pairs stay pairs, and the same seed always keeps the same\n\
+reads, whatever the order of the input.  Running with different seeds gives\n\
+independent subsamples.\n\
+\n\
+With --target, the fraction is chosen to keep about INT reads.  The number of\n\
+reads in the input is taken from the counts in its index when it has one,\n\
+otherwise the reads are counted in a first pass; input from a pipe is kept for\n\
+the second pass, in memory and then on disk.  With --by-read-group, each read\n\
+group, and the reads without one, is subsampled to about INT reads.  Read\n\
+groups with fewer are kept whole.\n\
+\n";
+    cerr << "\
+Options: -f FLOAT | --fraction FLOAT  keep this fraction of reads, 0 to 1\n\
+         -n INT | --target INT     keep about INT reads\n\
+         --by-read-group           keep about --target reads of each read group\n\
+         -s INT | --seed INT       seed for the read-name hash [" << opt_seed << "]\n\
+         -t INT | --threads INT    worker threads for choosing reads [" << opt_threads << "]\n\
+         -r STR | --region STR     only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            only reads overlapping the regions of BED FILE\n\
+         -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of sorted output\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         --spill-dir DIR           directory for spilling stdin [$TMPDIR or /tmp]\n\
+         --spill-memory INT        MB of stdin to hold in memory before spilling [" << opt_spill_memory << "]\n\
+         -? | --help               longer help\n\
+\n";
+#ifdef _WITH_DEBUG
+    cerr << "\
+         --debug INT      debug info level INT [" << opt_debug << "]\n\
+         --reads INT      only process INT reads [" << opt_reads << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
+\n";
+#endif
+    cerr << "Apeere is the Yoruba (Nigeria) noun for 'sample'." << endl;
+    cerr << endl;
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+// MurmurHash64A of the read name, seeded, so that reads are chosen by name
+// alone and a new seed chooses independently
+static inline uint64_t
+nameHash(const char* s, size_t len, uint64_t seed)
+{
+    const uint64_t m = 0xc6a4a7935bd1e995ULL;
+    const int r = 47;
+    uint64_t h = seed ^ (len * m);
+    const char* end = s + (len & ~size_t(7));
+    for (; s != end; s += 8) {
+        uint64_t k;
+        memcpy(&k, s, 8);
+        k *= m;
+        k ^= k >> r;
+        k *= m;
+        h ^= k;
+        h *= m;
+    }
+    switch (len & 7) {
+        case 7: h ^= uint64_t(uint8_t(s[6])) << 48;
+        case 6: h ^= uint64_t(uint8_t(s[5])) << 40;
+        case 5: h ^= uint64_t(uint8_t(s[4])) << 32;
+        case 4: h ^= uint64_t(uint8_t(s[3])) << 24;
+        case 3: h ^= uint64_t(uint8_t(s[2])) << 16;
+        case 2: h ^= uint64_t(uint8_t(s[1])) << 8;
+        case 1: h ^= uint64_t(uint8_t(s[0]));
+                h *= m;
+    }
+    h ^= h >> r;
+    h *= m;
+    h ^= h >> r;
+    return h;
+}
+
+
+//-------------------------------------
+
+
+// run on the pipeline's worker threads: keep a read if the hash of its name
+// is below the threshold of its read group, or of the whole BAM if there is
+// only one.  A threshold of ~0 keeps every read.
+
+class SubsampleTransform : public RecordTransform {
+
+    public:
+        SubsampleTransform(uint64_t s, const vector<uint64_t>& t, const StringTable* rg)
+            : seed(s), thresholds(t), read_groups(rg) { }
+
+        virtual bool Apply(RawRecord& rec, int worker) { return keep(rec); }
+        // kept reads are written as they are, so a block of them is copied
+        virtual bool Unchanged(const RawRecord& rec) const { return keep(rec); }
+        virtual bool IsOrderIndependent(void) const { return true; }
+
+    private:
+        bool    keep(const RawRecord& rec) const {
+            uint64_t t = thresholds[group(rec)];
+            return t == ~uint64_t(0) || nameHash(rec.Name(), rec.NameLength(), seed) < t;
+        }
+        size_t  group(const RawRecord& rec) const;
+
+        uint64_t                    seed;
+        const vector<uint64_t>&     thresholds;   // by read group, the last for none
+        const StringTable*          read_groups;  // NULL if thresholds has one
+
+};  // class SubsampleTransform
+
+
+//-------------------------------------
+
+
+size_t
+SubsampleTransform::group(const RawRecord& rec) const
+{
+    if (read_groups == NULL)
+        return 0;
+    const char* rg;
+    size_t len;
+    int i = rec.GetTagString("RG", rg, len) ? read_groups->Find(rg, len) : -1;
+    return i < 0 ? read_groups->Size() : size_t(i);
+}
+
+
+//-------------------------------------
+
+
+// the hash threshold keeping about keep of n reads
+static uint64_t
+threshold(int64_t keep, int64_t n)
+{
+    if (keep >= n)
+        return ~uint64_t(0);
+    return uint64_t(double(keep) / double(n) * 18446744073709551616.0);
+}
+
+
+//-------------------------------------
+
+
+int
+yoruba::main_apeere(int argc, char* argv[])
+{
+    //----------------- Command-line options
+
+    if (argc < 2)
+        return usage();
+
+    if (parseOptions(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+
+    //----------------- Open input BAM
+
+
+    ScopedPhase phase_open("open");
+
+    // the whole-BAM count for --target comes from the index when it can;
+    // otherwise it needs a counting pass
+    int64_t n_indexed = -1;
+    if (opt_target >= 0 && ! opt_by_read_group && regions.Empty() && opt_reads < 0) {
+        BamIndex index;
+        if (index.Load(input_file))
+            n_indexed = index.Records();
+    }
+    const bool count_pass = opt_target >= 0 && n_indexed < 0;
+
+    RawBamReader reader;
+
+    // input from a pipe is kept for pass 2, in memory and then on disk
+    if (count_pass)
+        reader.SetSpill(spill_dir, size_t(opt_spill_memory) << 20);
+
+    if (! reader.Open(input_file)) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    RawHeader raw_header = reader.GetRawHeader();  // the @SQ lines are copied as they are
+    SamHeader& header = raw_header.Meta();
+    if (header.Programs.Contains(new_program.ID)) {
+        SamProgram& prog = header.Programs[new_program.ID];
+        prog.Name = new_program.Name;
+        prog.Version = new_program.Version;
+        prog.CommandLine = new_program.CommandLine;
+    } else {
+        header.Programs.Add(new_program);
+    }
+
+    phase_open.End();
+
+
+    //----------------- Pass 1: Count reads, if needed for --target
+
+
+    vector<uint64_t> thresholds(1, ~uint64_t(0));
+    StringTable read_groups;
+    Progress progress;
+
+    if (opt_fraction >= 0.0) {
+        thresholds[0] = opt_fraction >= 1.0 ? ~uint64_t(0)
+                                            : uint64_t(opt_fraction * 18446744073709551616.0);
+    } else if (! count_pass) {
+        thresholds[0] = threshold(opt_target, n_indexed);
+        if (opt_progress || DEBUG(1))
+            cerr << NAME << " " << n_indexed << " reads in the input, from its index" << endl;
+    } else {
+        ScopedPhase phase_pass1("pass1");
+
+        vector<int64_t> n_group;  // by read group, the last for none
+        int64_t n_none = 0;
+        int64_t n_reads = 0;
+        RawRecord rec;
+
+        progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+        while (reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
+            ++n_reads;
+            const char* rg;
+            size_t len;
+            if (opt_by_read_group && rec.GetTagString("RG", rg, len)) {
+                size_t i = size_t(read_groups.Add(rg, len));
+                if (i == n_group.size())
+                    n_group.push_back(0);
+                ++n_group[i];
+            } else if (opt_by_read_group) {
+                ++n_none;
+            }
+            progress.Add(rec, reader.Tell());
+        }
+        progress.Stop();
+        if (reader.Failed()) {
+            cerr << NAME << "[pass1] error reading input" << endl;
+            return EXIT_FAILURE;
+        }
+        if (opt_by_read_group) {
+            thresholds.resize(n_group.size() + 1);
+            for (size_t i = 0; i < n_group.size(); ++i) {
+                thresholds[i] = threshold(opt_target, n_group[i]);
+                if (opt_progress || DEBUG(1))
+                    cerr << NAME << "[pass1] read group " << read_groups[i] << ": "
+                        << n_group[i] << " reads" << endl;
+            }
+            thresholds.back() = threshold(opt_target, n_none);
+            if (n_none && (opt_progress || DEBUG(1)))
+                cerr << NAME << "[pass1] no read group: " << n_none << " reads" << endl;
+        } else {
+            thresholds[0] = threshold(opt_target, n_reads);
+        }
+        if (opt_progress || DEBUG(1))
+            cerr << NAME << "[pass1] " << n_reads << " reads counted" << endl;
+        phase_pass1.End();
+
+        if (reader.IsSpilling() && (opt_progress || DEBUG(1)))
+            cerr << NAME << "[pass2] replaying input, " << (reader.SpilledToDisk() >> 20)
+                << " MB of it from the spill file" << endl;
+        if (! reader.Rewind()) {
+            cerr << NAME << "[pass2] could not rewind input" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+
+    //----------------- Pass 2: Write the reads kept
+
+
+    ScopedPhase phase_pass2("pass2");
+
+    RawBamWriter writer;
+
+    if (! output_opts.Open(writer, output_file, raw_header.ToString(), reader.GetReferenceData())) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    SubsampleTransform transform(opt_seed, thresholds,
+                                 opt_by_read_group ? &read_groups : NULL);
+    Pipeline pipeline(reader, writer, transform, opt_threads);
+
+    pipeline.SetMaxRecords(opt_reads);
+    progress.Start(NAME "[pass2]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+    pipeline.SetProgress(&progress);
+    // blocks whose reads are all kept are copied still compressed, unless
+    // the output compression was asked for
+    pipeline.SetPassthrough(! output_opts.LevelSet());
+
+    if (! pipeline.Run()) {
+        cerr << NAME << "[pass2] error while subsampling reads" << endl;
+        return EXIT_FAILURE;
+    }
+    progress.Stop();
+    int64_t n_kept = pipeline.RecordsWritten();
+
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] " << n_kept << " of " << pipeline.RecordsRead()
+            << " reads kept, " << pipeline.BlocksCopied()
+            << " BGZF blocks of them copied without recompressing" << endl;
+    Stats::Count("apeere_reads_kept", n_kept);
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+    if (! writer.Close())
+        return EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+static int
+parseOptions(int argc, char* argv[])
+{
+    new_program.ID = YORUBA_NAME;
+    new_program.ID = new_program.ID + " " + argv[0];
+    new_program.Name = YORUBA_NAME;
+    new_program.Version = YORUBA_VERSION;
+    new_program.CommandLine = YORUBA_NAME;
+    for (int i = 0; i < argc; ++i)
+        new_program.CommandLine = new_program.CommandLine + " " + argv[i];
+
+    enum { OPT_output, OPT_fraction, OPT_target, OPT_byreadgroup, OPT_seed, OPT_threads,
+        OPT_level, OPT_uncompressed, OPT_writeindex, OPT_checksum, OPT_checksumexclude,
+        OPT_region, OPT_regions, OPT_spilldir, OPT_spillmemory,
+#ifdef _WITH_DEBUG
+        OPT_debug, OPT_reads, OPT_progress,
+#endif
+        OPT_help };
+
+    CSimpleOpt::SOption apeere_options[] = {
+        { OPT_fraction,        "--fraction",        SO_REQ_SEP },
+        { OPT_fraction,        "-f",                SO_REQ_SEP },
+        { OPT_target,          "--target",          SO_REQ_SEP },
+        { OPT_target,          "-n",                SO_REQ_SEP },
+        { OPT_byreadgroup,     "--by-read-group",   SO_NONE },
+        { OPT_seed,            "--seed",            SO_REQ_SEP },
+        { OPT_seed,            "-s",                SO_REQ_SEP },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
+        { OPT_output,          "--output",          SO_REQ_SEP },
+        { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_spilldir,        "--spill-dir",       SO_REQ_SEP },
+        { OPT_spillmemory,     "--spill-memory",    SO_REQ_SEP },
+#ifdef _WITH_DEBUG
+        { OPT_debug,           "--debug",           SO_REQ_SEP },
+        { OPT_reads,           "--reads",           SO_REQ_SEP },
+        { OPT_progress,        "--progress",        SO_REQ_SEP },
+#endif
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, apeere_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage(true);
+        } else if (args.OptionId() == OPT_fraction) {
+            opt_fraction = strtod(args.OptionArg(), NULL);
+            if (opt_fraction < 0.0 || opt_fraction > 1.0) {
+                cerr << NAME << " --fraction must be between 0 and 1" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_target) {
+            opt_target = strtoll(args.OptionArg(), NULL, 10);
+            if (opt_target < 0) {
+                cerr << NAME << " --target must be at least 0" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_byreadgroup) {
+            opt_by_read_group = true;
+        } else if (args.OptionId() == OPT_seed) {
+            opt_seed = strtoull(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
+        } else if (args.OptionId() == OPT_output) {
+            output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_spilldir) {
+            spill_dir = args.OptionArg();
+        } else if (args.OptionId() == OPT_spillmemory) {
+            opt_spill_memory = strtoll(args.OptionArg(), NULL, 10);
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (DEBUG(1) && ! opt_progress)
+        opt_progress = debug_progress;
+
+    if ((opt_fraction >= 0.0) == (opt_target >= 0)) {
+        cerr << NAME << " exactly one of --fraction and --target is required" << endl;
+        return usage();
+    }
+    if (opt_by_read_group && opt_target < 0) {
+        cerr << NAME << " --by-read-group requires --target" << endl;
+        return usage();
+    }
+
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+
+    if (args.FileCount() > 1) {
+        cerr << NAME << " requires at most one BAM file specified as input" << endl;
+        return usage();
+    } else if (args.FileCount() == 1) {
+        input_file = args.File(0);
+    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
+        input_file = "/dev/stdin";
+    }
+    if (opt_spill_memory < 0) {
+        cerr << NAME << " --spill-memory must be at least 0" << endl;
+        return usage();
+    }
+
+    // set up output; if file not specified, use stdout or its equivalent
+    if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+    return EXIT_SUCCESS;
+}
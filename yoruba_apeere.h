@@ -0,0 +1,49 @@
+// yoruba_apeere.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_apeere.cpp
+//
+// Apeere is the Yoruba (Nigeria) noun for 'sample'.
+//
+// Uses pthreads, and BamTools only for header types
+
+#ifndef _YORUBA_APEERE_H_
+#define _YORUBA_APEERE_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+#include "api/SamHeader.h"
+#include "api/SamProgram.h"
+#include "api/SamProgramChain.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_index.h"
+#include "yoruba_pipeline.h"
+#include "yoruba_stats.h"
+
+#ifndef _YORUBA_MAIN
+#define NAME "[yoruba_subsample]"
+#endif
+
+// Functions defined in yoruba_apeere.cpp
+//
+namespace yoruba {
+
+int  main_apeere(int argc, char* argv[]);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_APEERE_H_
@@ -0,0 +1,263 @@
+// yoruba_aropo.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Aropo (English command is checksum) computes order-independent checksums
+// of the reads of BAM files, field by field, to show that a command changed
+// only what it should have; see RecordChecksum in yoruba_checksum.h.  Given
+// more than one BAM, each is compared with the first.
+//
+// Aropo is the Yoruba (Nigeria) noun for 'sum'.
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- read the digests written by --checksum to compare with
+
+#include "yoruba_aropo.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static vector<string> input_files;
+static string       opt_exclude;
+static RegionList   regions;  // -r and --regions
+#ifdef _WITH_DEBUG
+static int32_t      opt_debug = 0;
+static int32_t      debug_progress = 10;  // seconds
+static int64_t      opt_reads = -1;
+static int64_t      opt_progress = 0;  // seconds between progress lines
+#endif
+
+static int  parseOptions(int argc, char* argv[]);
+
+
+//-------------------------------------
+
+
+#ifdef _STANDALONE
+int
+main(int argc, char* argv[]) {
+    return main_aropo(argc, argv);
+}
+#endif
+
+
+//-------------------------------------
+
+
+static int
+usage(bool longer = false)
+{
+    cerr << endl;
+    cerr << "Usage:   " << YORUBA_NAME << " checksum [options] <in.bam> [<in2.bam> ...]" << endl;
+    cerr << "         " << YORUBA_NAME << " aropo [options] <in.bam> [<in2.bam> ...]" << endl;
+    cerr << "\n\
+Write order-independent checksums of the reads in <in.bam>, one for each\n\
+field, to stdout.  If more BAMs are given, the checksums of each are compared\n\
+with those of the first, and the exit status is 1 if any differ.  Either\n\
+command invokes this function.\n\
+\n";
+    if (longer) cerr << "\
+The checksum of a field is the sum of a hash of its value in each read, so\n\
+it does not depend on the order of the reads.  The fields are the read name,\n\
+the flag, the alignment (reference and position, mapping quality, CIGAR, and\n\
+mate reference, position and template length), the sequence, the qualities\n\
+and the tags, whose order within a read does not matter either.  The record\n\
+checksum sums a hash of all of these for each read together, and catches a\n\
+value moved from one read to another.  References are hashed by name, so\n\
+output of forget has the checksums of its input.\n\
+\n\
+--exclude leaves out fields changed on purpose, as a comma-separated list of\n\
+field names (name, flag, alignment, seq, qual, aux), tags, and 'dup' for just\n\
+the duplicate bit of the flag.  The commands that write BAM take --checksum\n\
+FILE to write the checksums of their output as they write it, with\n\
+--checksum-exclude LIST, so for example\n\
+\n\
+    " YORUBA_NAME " checksum --exclude RG in.bam > in.sum\n\
+    " YORUBA_NAME " readgroup --checksum out.sum --checksum-exclude RG ... in.bam > out.bam\n\
+    diff in.sum out.sum\n\
+\n\
+shows readgroup changed nothing but the RG tags, with no second pass over\n\
+its output.  Checksums are computed with CRC32C, using the SSE4.2 crc32\n\
+instruction where the CPU has it.\n\
+\n";
+    cerr << "\
+Options: --exclude LIST          fields and tags to leave out of the checksums\n\
+         -r STR | --region STR   only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                 or CHR:BEG-END; may be given more than once\n\
+         --regions FILE          only reads overlapping the regions of BED FILE\n\
+         -? | --help             longer help\n\
+\n";
+#ifdef _WITH_DEBUG
+    cerr << "\
+         --debug INT      debug info level INT [" << opt_debug << "]\n\
+         --reads INT      only process INT reads [" << opt_reads << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
+\n";
+#endif
+    cerr << "Aropo is the Yoruba (Nigeria) noun for 'sum'." << endl;
+    cerr << endl;
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+// the checksums of the reads of one BAM
+static bool
+checksumFile(const string& filename, RecordChecksum& sum)
+{
+    RawBamReader reader;
+    if (! reader.Open(filename)) {
+        cerr << NAME << " could not open BAM input " << filename << endl;
+        return false;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return false;
+    sum.SetReferences(reader.GetReferenceData());
+
+    RawRecord rec;
+    int64_t n_reads = 0;
+    Progress progress;
+    progress.Start(NAME "[checksum]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+
+    while ((opt_reads < 0 || n_reads < opt_reads) && reader.GetNextRecord(rec)) {
+        ++n_reads;
+        sum.Add(rec);
+        progress.Add(rec, reader.Tell());
+    }
+    progress.Stop();
+    bool ok = ! reader.Failed();
+    reader.Close();
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+int
+yoruba::main_aropo(int argc, char* argv[])
+{
+    if (parseOptions(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    RecordChecksum settings;
+    if (! settings.SetExclude(opt_exclude))
+        return usage();
+
+    ScopedPhase phase_pass1("pass1");
+
+    vector<RecordChecksum> sums(input_files.size(), settings);
+    for (size_t i = 0; i < input_files.size(); ++i)
+        if (! checksumFile(input_files[i], sums[i]))
+            return EXIT_FAILURE;
+
+    phase_pass1.End();
+
+    if (input_files.size() == 1) {
+        sums[0].Write(cout);
+        return EXIT_SUCCESS;
+    }
+
+    int retval = EXIT_SUCCESS;
+    for (size_t i = 0; i < input_files.size(); ++i) {
+        cout << "# " << input_files[i] << "\n";
+        sums[i].Write(cout);
+    }
+    for (size_t i = 1; i < input_files.size(); ++i) {
+        vector<int> diffs = sums[0].Differences(sums[i]);
+        cout << NAME << " " << input_files[i] << " ";
+        if (diffs.empty()) {
+            cout << "matches " << input_files[0] << "\n";
+            continue;
+        }
+        cout << "differs from " << input_files[0] << " in";
+        for (size_t j = 0; j < diffs.size(); ++j)
+            cout << " " << RecordChecksum::FieldName(diffs[j]);
+        cout << "\n";
+        retval = EXIT_FAILURE;
+    }
+    cout.flush();
+    return retval;
+}
+
+
+//-------------------------------------
+
+
+static int
+parseOptions(int argc, char* argv[])
+{
+    if (argc < 2)
+        return usage();
+
+    enum { OPT_exclude, OPT_region, OPT_regions,
+#ifdef _WITH_DEBUG
+        OPT_debug, OPT_reads, OPT_progress,
+#endif
+        OPT_help };
+
+    CSimpleOpt::SOption aropo_options[] = {
+        { OPT_exclude,         "--exclude",         SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+#ifdef _WITH_DEBUG
+        { OPT_debug,           "--debug",           SO_REQ_SEP },
+        { OPT_reads,           "--reads",           SO_REQ_SEP },
+        { OPT_progress,        "--progress",        SO_REQ_SEP },
+#endif
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, aropo_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage(true);
+        } else if (args.OptionId() == OPT_exclude) {
+            opt_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (DEBUG(1) && ! opt_progress)
+        opt_progress = debug_progress;
+
+    if (args.FileCount() == 0) {
+        input_files.push_back("/dev/stdin");
+    } else {
+        for (int i = 0; i < args.FileCount(); ++i)
+            input_files.push_back(args.File(i));
+    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,44 @@
+// yoruba_aropo.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_aropo.cpp
+//
+// Aropo is the Yoruba (Nigeria) noun for 'sum'.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_AROPO_H_
+#define _YORUBA_AROPO_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_checksum.h"
+#include "yoruba_stats.h"
+
+#ifndef _YORUBA_MAIN
+#define NAME "[yoruba_checksum]"
+#endif
+
+// Functions defined in yoruba_aropo.cpp
+//
+namespace yoruba {
+
+int  main_aropo(int argc, char* argv[]);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_AROPO_H_
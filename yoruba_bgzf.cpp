@@ -0,0 +1,1335 @@
+// yoruba_bgzf.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Raw BGZF block and BAM record I/O.
+//
+// The BGZF format is described in the SAM specification
+// (http://samtools.sourceforge.net/SAM1.pdf): a series of gzip members, each
+// with a 'BC' extra field giving the compressed size of the member, each
+// holding at most 64KB of uncompressed data, and an empty member at the end.
+//
+// Uses zlib for (de)compression and BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- an option to skip the CRC32 check of each block read, for trusted input
+
+#include <cerrno>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+#include "yoruba_bgzf.h"
+#include "yoruba_stats.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static const size_t  IN_BUF_SIZE = 1 << 20;
+static const size_t  OUT_BUF_SIZE = 1 << 20;
+static const size_t  BGZF_HEADER_SIZE = 18;
+static const size_t  BGZF_FOOTER_SIZE = 8;
+static const uint8_t BGZF_EOF[28] = {
+    0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00, 0x00, 0xff, 0x06, 0x00, 0x42, 0x43,
+    0x02, 0x00, 0x1b, 0x00, 0x03, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00, 0x00
+};
+
+static inline uint32_t
+le32(const char* p)
+{
+    uint32_t v; memcpy(&v, p, 4); return v;
+}
+
+
+//-------------------------------------
+//-------------------------------------  BgzfReader
+//-------------------------------------
+
+
+BgzfReader::BgzfReader(void)
+    : fd(-1), seekable(false), zs_init(false),
+      in_pos(0), in_len(0), in_address(0), in_eof(false), source_address(0), source_done(false),
+      spill_enabled(false), spill_memory_cap(0), spilling(false), spill_fd(-1), spill_length(0),
+      block_length(0), block_offset(0), block_address(0), next_block_address(0), block_csize(0),
+      last_block_empty(false), failed(false), n_blocks(0), n_compressed(0), n_inflated(0)
+{
+    memset(&zs, 0, sizeof(zs));
+}
+
+
+//-------------------------------------
+
+
+BgzfReader::~BgzfReader(void)
+{
+    Close();
+}
+
+
+//-------------------------------------
+
+
+void
+BgzfReader::SetSpill(const string& dir, size_t memory_cap)
+{
+    spill_enabled = true;
+    spill_dir = dir;
+    if (spill_dir.empty())
+        spill_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+    spill_memory_cap = memory_cap;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfReader::Open(const string& filename)
+{
+    Close();
+    fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0) {
+        cerr << "yoruba::BgzfReader::Open(): could not open " << filename
+            << ": " << strerror(errno) << endl;
+        return false;
+    }
+    seekable = (lseek(fd, 0, SEEK_CUR) >= 0);
+    spilling = ! seekable && spill_enabled;
+    if (spilling)
+        spill_memory.reserve(spill_memory_cap);  // address space only until used
+    spill_length = 0;
+    source_address = 0;
+    source_done = false;
+    if (inflateInit2(&zs, -15) != Z_OK) {
+        cerr << "yoruba::BgzfReader::Open(): could not initialise zlib" << endl;
+        Close();
+        return false;
+    }
+    zs_init = true;
+    in_buf.resize(IN_BUF_SIZE);
+    block.resize(BGZF_MAX_BLOCK_SIZE);
+    in_pos = in_len = 0;
+    in_address = 0;
+    in_eof = false;
+    block_length = block_offset = 0;
+    block_address = next_block_address = 0;
+    last_block_empty = false;
+    failed = false;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+BgzfReader::Close(void)
+{
+    reportStats();
+    if (zs_init) {
+        inflateEnd(&zs);
+        zs_init = false;
+    }
+    if (fd >= 0) {
+        close(fd);
+        fd = -1;
+    }
+    if (spill_fd >= 0) {
+        close(spill_fd);  // already unlinked
+        spill_fd = -1;
+    }
+    vector<char>().swap(spill_memory);
+    spill_length = 0;
+    spilling = false;
+}
+
+
+//-------------------------------------
+
+
+int64_t
+BgzfReader::SpilledToDisk(void) const
+{
+    return spill_length - int64_t(spill_memory.size());
+}
+
+
+//-------------------------------------
+
+
+int64_t
+BgzfReader::InputSize(void) const
+{
+    if (spilling)
+        return source_done ? spill_length : 0;
+    struct stat st;
+    if (fd < 0 || fstat(fd, &st) < 0 || ! S_ISREG(st.st_mode))
+        return 0;
+    return int64_t(st.st_size);
+}
+
+
+//-------------------------------------
+
+
+void
+BgzfReader::reportStats(void)
+{
+    Stats::Count("bgzf_blocks_read", n_blocks);
+    Stats::Count("bgzf_compressed_bytes_read", n_compressed);
+    Stats::Count("bgzf_bytes_inflated", n_inflated);
+    n_blocks = n_compressed = n_inflated = 0;
+}
+
+
+//-------------------------------------
+
+
+// read from the input, or from what we've kept of it if we've gone back
+ssize_t
+BgzfReader::readSource(char* dst, size_t len)
+{
+    ssize_t n;
+    if (spilling && source_address < spill_length) {
+        size_t avail = size_t(spill_length - source_address);
+        if (len > avail)
+            len = avail;
+        if (source_address < int64_t(spill_memory.size())) {
+            n = min(len, spill_memory.size() - size_t(source_address));
+            memcpy(dst, &spill_memory[source_address], n);
+        } else {
+            n = pread(spill_fd, dst, len, source_address - spill_memory.size());
+        }
+    } else {
+        n = read(fd, dst, len);
+        if (n > 0 && spilling && ! spill(dst, n))
+            return -1;
+        if (n == 0)
+            source_done = true;
+    }
+    if (n > 0)
+        source_address += n;
+    return n;
+}
+
+
+//-------------------------------------
+
+
+// keep len bytes just read from a pipe, in memory while under the cap and
+// then in a temporary file, unlinked as soon as it is created
+bool
+BgzfReader::spill(const char* d, size_t len)
+{
+    if (spill_memory.size() < spill_memory_cap) {
+        size_t n = min(len, spill_memory_cap - spill_memory.size());
+        spill_memory.insert(spill_memory.end(), d, d + n);
+        spill_length += n;
+        d += n;
+        len -= n;
+    }
+    if (len == 0)
+        return true;
+    if (spill_fd < 0) {
+        string path = spill_dir + "/yoruba_spill.XXXXXX";
+        vector<char> templ(path.begin(), path.end());
+        templ.push_back('\0');
+        spill_fd = mkstemp(&templ[0]);
+        if (spill_fd < 0) {
+            cerr << "yoruba::BgzfReader: could not create spill file in " << spill_dir
+                << ": " << strerror(errno) << endl;
+            return false;
+        }
+        unlink(&templ[0]);
+    }
+    while (len > 0) {
+        ssize_t n = write(spill_fd, d, len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "yoruba::BgzfReader: error writing spill file: " << strerror(errno) << endl;
+            return false;
+        }
+        d += n;
+        len -= n;
+        spill_length += n;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// make sure at least need bytes of compressed input are buffered at in_pos
+bool
+BgzfReader::fillInput(size_t need)
+{
+    if (in_len - in_pos >= need)
+        return true;
+    if (in_pos > 0) {
+        memmove(&in_buf[0], &in_buf[in_pos], in_len - in_pos);
+        in_address += in_pos;
+        in_len -= in_pos;
+        in_pos = 0;
+    }
+    if (in_buf.size() < need)
+        in_buf.resize(need);
+    while (in_len < need && ! in_eof) {
+        ssize_t n = readSource(&in_buf[in_len], in_buf.size() - in_len);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "yoruba::BgzfReader: read error: " << strerror(errno) << endl;
+            failed = true;
+            return false;
+        } else if (n == 0) {
+            in_eof = true;
+        } else {
+            in_len += n;
+        }
+    }
+    return in_len - in_pos >= need;
+}
+
+
+//-------------------------------------
+
+
+// read and inflate the block at next_block_address; false at end of file,
+// or after setting failed if the block is truncated or corrupt
+bool
+BgzfReader::readBlock(void)
+{
+    block_address = next_block_address;
+    block_offset = block_length = 0;
+    if (failed)
+        return false;
+
+    if (! fillInput(BGZF_HEADER_SIZE)) {
+        if (failed)
+            return false;
+        if (in_len - in_pos > 0) {
+            cerr << "yoruba::BgzfReader: truncated BGZF block header at " << block_address << endl;
+            failed = true;
+        } else if (! last_block_empty) {
+            // a file cut on a block boundary ends without the empty EOF block
+            cerr << "yoruba::BgzfReader: no BGZF EOF marker block at end of input, which may be truncated" << endl;
+            failed = true;
+        }
+        return false;
+    }
+    const unsigned char* h = reinterpret_cast<unsigned char*>(&in_buf[in_pos]);
+    if (h[0] != 31 || h[1] != 139 || h[2] != 8 || ! (h[3] & 4)) {
+        cerr << "yoruba::BgzfReader: input is not BGZF-compressed at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    size_t xlen = h[10] | (h[11] << 8);
+    if (! fillInput(12 + xlen)) {
+        cerr << "yoruba::BgzfReader: truncated BGZF block header at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    h = reinterpret_cast<unsigned char*>(&in_buf[in_pos]);
+    size_t bsize = 0;
+    for (size_t x = 12; x + 4 <= 12 + xlen; ) {
+        size_t slen = h[x + 2] | (h[x + 3] << 8);
+        if (h[x] == 'B' && h[x + 1] == 'C' && slen == 2) {
+            bsize = (h[x + 4] | (h[x + 5] << 8)) + 1;
+            break;
+        }
+        x += 4 + slen;
+    }
+    if (bsize < 12 + xlen + BGZF_FOOTER_SIZE) {
+        cerr << "yoruba::BgzfReader: no BGZF block size in gzip header at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    if (! fillInput(bsize)) {
+        cerr << "yoruba::BgzfReader: truncated BGZF block at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    char* b = &in_buf[in_pos];
+    uint32_t isize = le32(b + bsize - 4);
+    if (isize > BGZF_MAX_BLOCK_SIZE) {
+        cerr << "yoruba::BgzfReader: BGZF block too large at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    inflateReset(&zs);
+    zs.next_in = reinterpret_cast<Bytef*>(b + 12 + xlen);
+    zs.avail_in = bsize - 12 - xlen - BGZF_FOOTER_SIZE;
+    zs.next_out = reinterpret_cast<Bytef*>(&block[0]);
+    zs.avail_out = block.size();
+    if (inflate(&zs, Z_FINISH) != Z_STREAM_END || zs.total_out != isize) {
+        cerr << "yoruba::BgzfReader: error inflating BGZF block at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    if (crc32(crc32(0, NULL, 0), reinterpret_cast<Bytef*>(&block[0]), isize) != le32(b + bsize - 8)) {
+        cerr << "yoruba::BgzfReader: CRC32 mismatch in BGZF block at " << block_address << endl;
+        failed = true;
+        return false;
+    }
+    block_length = isize;
+    last_block_empty = (isize == 0);
+    block_csize = bsize;
+    ++n_blocks;
+    n_compressed += bsize;
+    n_inflated += isize;
+    in_pos += bsize;
+    next_block_address = block_address + bsize;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfReader::Seek(int64_t voffset)
+{
+    if (! IsSeekable()) {
+        cerr << "yoruba::BgzfReader::Seek(): input is not seekable" << endl;
+        return false;
+    }
+    int64_t coffset = voffset >> 16;
+    size_t  uoffset = size_t(voffset & 0xffff);
+    if (coffset >= in_address && coffset <= in_address + int64_t(in_len)) {
+        in_pos = size_t(coffset - in_address);  // still buffered
+    } else if (spilling) {
+        if (coffset > spill_length) {
+            cerr << "yoruba::BgzfReader::Seek(): cannot seek forward in a pipe" << endl;
+            return false;
+        }
+        source_address = coffset;
+        in_address = coffset;
+        in_pos = in_len = 0;
+        in_eof = false;
+    } else {
+        if (lseek(fd, coffset, SEEK_SET) < 0) {
+            cerr << "yoruba::BgzfReader::Seek(): " << strerror(errno) << endl;
+            return false;
+        }
+        in_address = coffset;
+        in_pos = in_len = 0;
+        in_eof = false;
+    }
+    next_block_address = coffset;
+    last_block_empty = true;  // a seek straight to the end of the input is not a truncation
+    if (! readBlock()) {
+        block_address = coffset;
+        return uoffset == 0 && ! failed;  // at end of file
+    }
+    if (uoffset > block_length) {
+        cerr << "yoruba::BgzfReader::Seek(): bad virtual offset " << voffset << endl;
+        return false;
+    }
+    block_offset = uoffset;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+size_t
+BgzfReader::Read(char* dst, size_t len)
+{
+    size_t done = 0;
+    while (done < len) {
+        if (block_offset >= block_length) {
+            if (! readBlock())
+                break;
+            continue;
+        }
+        size_t n = min(len - done, block_length - block_offset);
+        memcpy(dst + done, &block[block_offset], n);
+        block_offset += n;
+        done += n;
+    }
+    return done;
+}
+
+
+//-------------------------------------
+
+
+char*
+BgzfReader::Peek(size_t len)
+{
+    while (block_offset >= block_length) {
+        if (! readBlock())
+            return NULL;
+    }
+    if (block_length - block_offset < len)
+        return NULL;
+    char* p = &block[block_offset];
+    block_offset += len;
+    return p;
+}
+
+
+bool
+BgzfReader::PeekBlock(const char*& data, size_t& length, const char*& raw, size_t& raw_length)
+{
+    if (block_offset == block_length) {
+        if (! readBlock())
+            return false;
+    } else if (block_offset != 0) {
+        return false;  // within a block
+    }
+    data = &block[0];
+    length = block_length;
+    raw = &in_buf[in_pos - block_csize];  // readBlock() leaves it in the buffer
+    raw_length = block_csize;
+    return true;
+}
+
+
+//-------------------------------------
+//-------------------------------------  BgzfWriter
+//-------------------------------------
+
+
+BgzfWriter::BgzfWriter(void)
+    : fd(-1), compression_level(Z_DEFAULT_COMPRESSION), zs_init(false),
+      block_length(0), block_address(0), out_len(0),
+      n_blocks(0), n_blocks_copied(0), n_compressed(0), n_deflated(0)
+{
+    memset(&zs, 0, sizeof(zs));
+}
+
+
+//-------------------------------------
+
+
+BgzfWriter::~BgzfWriter(void)
+{
+    if (IsOpen())
+        Close();
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::Open(const string& filename)
+{
+    if (IsOpen())
+        Close();
+    fd = open(filename.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0666);
+    if (fd < 0) {
+        cerr << "yoruba::BgzfWriter::Open(): could not open " << filename
+            << ": " << strerror(errno) << endl;
+        return false;
+    }
+    block.resize(BGZF_BLOCK_DATA_SIZE);
+    out_buf.resize(OUT_BUF_SIZE + BGZF_MAX_BLOCK_SIZE);
+    block_length = 0;
+    block_address = 0;
+    out_len = 0;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+BgzfWriter::SetCompressionLevel(int level)
+{
+    compression_level = level;
+    if (zs_init) {  // started already, pick up the new level with the next block
+        deflateEnd(&zs);
+        zs_init = false;
+    }
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::Write(const char* d, size_t len)
+{
+    while (len > 0) {
+        size_t n = min(len, block.size() - block_length);
+        memcpy(&block[block_length], d, n);
+        block_length += n;
+        d += n;
+        len -= n;
+        if (block_length == block.size() && ! deflateBlock())
+            return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::Flush(void)
+{
+    return block_length == 0 || deflateBlock();
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::WriteBlock(const char* raw, size_t raw_length)
+{
+    if (! Flush() || ! writeOutput(raw, raw_length))
+        return false;
+    block_address += raw_length;
+    ++n_blocks_copied;
+    n_compressed += raw_length;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::AppendFile(const string& filename)
+{
+    if (! Flush() || ! flushOutput())
+        return false;
+    int in = open(filename.c_str(), O_RDONLY);
+    struct stat st;
+    if (in < 0 || fstat(in, &st) < 0) {
+        cerr << "yoruba::BgzfWriter::AppendFile(): could not open " << filename
+            << ": " << strerror(errno) << endl;
+        if (in >= 0)
+            close(in);
+        return false;
+    }
+
+    // its EOF block would end the file early for readers that stop there
+    off_t length = st.st_size;
+    uint8_t tail[sizeof(BGZF_EOF)];
+    if (length >= off_t(sizeof(tail))
+        && pread(in, tail, sizeof(tail), length - sizeof(tail)) == ssize_t(sizeof(tail))
+        && memcmp(tail, BGZF_EOF, sizeof(tail)) == 0)
+        length -= sizeof(tail);
+
+    // straight through the output buffer, which is empty
+    off_t done = 0;
+    bool ok = true;
+    while (ok && done < length) {
+        ssize_t n = read(in, &out_buf[0], size_t(min(off_t(out_buf.size()), length - done)));
+        if (n < 0 && errno == EINTR)
+            continue;
+        if (n <= 0) {
+            cerr << "yoruba::BgzfWriter::AppendFile(): could not read " << filename << endl;
+            ok = false;
+            break;
+        }
+        out_len = size_t(n);
+        ok = flushOutput();
+        done += n;
+    }
+    close(in);
+    block_address += done;
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+// compress the current block directly into the output buffer.  A block that
+// deflate cannot fit is stored instead, so that blocks are never split and
+// the virtual offsets of records written into them stay right.
+bool
+BgzfWriter::deflateBlock(void)
+{
+    if (compression_level != 0 && ! zs_init) {
+        if (deflateInit2(&zs, compression_level, Z_DEFLATED, -15, 8,
+                         Z_DEFAULT_STRATEGY) != Z_OK) {
+            cerr << "yoruba::BgzfWriter: could not initialise zlib" << endl;
+            return false;
+        }
+        zs_init = true;
+    }
+    if (out_len + BGZF_MAX_BLOCK_SIZE > out_buf.size() && ! flushOutput())
+        return false;
+
+    char* b = &out_buf[out_len];
+    size_t input = block_length;
+    size_t compressed = 0;
+    if (compression_level != 0) {
+        deflateReset(&zs);
+        zs.next_in = reinterpret_cast<Bytef*>(&block[0]);
+        zs.avail_in = input;
+        zs.next_out = reinterpret_cast<Bytef*>(b + BGZF_HEADER_SIZE);
+        zs.avail_out = BGZF_MAX_BLOCK_SIZE - BGZF_HEADER_SIZE - BGZF_FOOTER_SIZE;
+        int ret = deflate(&zs, Z_FINISH);
+        if (ret == Z_STREAM_END) {
+            compressed = zs.total_out;
+        } else if (ret != Z_OK && ret != Z_BUF_ERROR) {
+            cerr << "yoruba::BgzfWriter: error deflating BGZF block" << endl;
+            return false;
+        }
+    }
+    if (compressed == 0)  // level 0, or incompressible
+        compressed = storeBlock(b + BGZF_HEADER_SIZE);
+    size_t bsize = BGZF_HEADER_SIZE + compressed + BGZF_FOOTER_SIZE;
+
+    static const uint8_t header[16] = {
+        0x1f, 0x8b, 0x08, 0x04, 0x00, 0x00, 0x00, 0x00,
+        0x00, 0xff, 0x06, 0x00, 0x42, 0x43, 0x02, 0x00
+    };
+    memcpy(b, header, 16);
+    uint16_t bsize_1 = uint16_t(bsize - 1);
+    memcpy(b + 16, &bsize_1, 2);
+    uint32_t crc = crc32(crc32(0L, Z_NULL, 0), reinterpret_cast<Bytef*>(&block[0]), input);
+    uint32_t isize = uint32_t(input);
+    memcpy(b + bsize - 8, &crc, 4);
+    memcpy(b + bsize - 4, &isize, 4);
+    out_len += bsize;
+    block_address += bsize;
+    ++n_blocks;
+    n_compressed += bsize;
+    n_deflated += input;
+    block_length = 0;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// the whole block as a single final stored deflate block, without zlib;
+// blocks are never more than 0xff00 bytes so always fit
+size_t
+BgzfWriter::storeBlock(char* b)
+{
+    uint16_t len = uint16_t(block_length);
+    uint16_t nlen = uint16_t(~len);
+    b[0] = 1;  // BFINAL set, BTYPE 00
+    memcpy(b + 1, &len, 2);
+    memcpy(b + 3, &nlen, 2);
+    memcpy(b + 5, &block[0], block_length);
+    return 5 + block_length;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::writeOutput(const char* d, size_t len)
+{
+    if (out_len + len > out_buf.size() && ! flushOutput())
+        return false;
+    if (len > out_buf.size()) {
+        out_buf.resize(len);
+    }
+    memcpy(&out_buf[out_len], d, len);
+    out_len += len;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::flushOutput(void)
+{
+    size_t done = 0;
+    while (done < out_len) {
+        ssize_t n = write(fd, &out_buf[done], out_len - done);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "yoruba::BgzfWriter: write error: " << strerror(errno) << endl;
+            return false;
+        }
+        done += n;
+    }
+    out_len = 0;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+BgzfWriter::Close(void)
+{
+    if (! IsOpen())
+        return false;
+    bool ok = Flush()
+        && writeOutput(reinterpret_cast<const char*>(BGZF_EOF), sizeof(BGZF_EOF))
+        && flushOutput();
+    block_address += sizeof(BGZF_EOF);
+    if (close(fd) < 0)
+        ok = false;
+    fd = -1;
+    if (zs_init) {
+        deflateEnd(&zs);
+        zs_init = false;
+    }
+    reportStats();
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+// blocks appended from shards were counted when their shard was written
+void
+BgzfWriter::reportStats(void)
+{
+    Stats::Count("bgzf_blocks_written", n_blocks);
+    Stats::Count("bgzf_blocks_copied", n_blocks_copied);
+    Stats::Count("bgzf_compressed_bytes_written", n_compressed);
+    Stats::Count("bgzf_bytes_deflated", n_deflated);
+    n_blocks = n_blocks_copied = n_compressed = n_deflated = 0;
+}
+
+
+//-------------------------------------
+//-------------------------------------  RawBamReader
+//-------------------------------------
+
+
+bool
+RawBamReader::Open(const string& fname)
+{
+    filename = fname;
+    failed = false;
+    regions.clear();
+    region_offsets.clear();
+    if (! bgzf.Open(filename))
+        return false;
+
+    char magic[4];
+    int32_t l_text, n_ref;
+    if (bgzf.Read(magic, 4) != 4 || memcmp(magic, "BAM\1", 4) != 0) {
+        cerr << "yoruba::RawBamReader::Open(): " << filename << " is not a BAM file" << endl;
+        Close();
+        return false;
+    }
+    if (bgzf.Read(reinterpret_cast<char*>(&l_text), 4) != 4 || l_text < 0) {
+        cerr << "yoruba::RawBamReader::Open(): truncated BAM header" << endl;
+        Close();
+        return false;
+    }
+    header_text.resize(l_text);
+    if (l_text > 0 && bgzf.Read(&header_text[0], l_text) != size_t(l_text)) {
+        cerr << "yoruba::RawBamReader::Open(): truncated BAM header" << endl;
+        Close();
+        return false;
+    }
+    size_t nul = header_text.find('\0');  // the text may be NUL-padded
+    if (nul != string::npos)
+        header_text.resize(nul);
+    raw_header.SetText(header_text);
+    header_parsed = false;
+
+    if (bgzf.Read(reinterpret_cast<char*>(&n_ref), 4) != 4 || n_ref < 0) {
+        cerr << "yoruba::RawBamReader::Open(): truncated BAM references" << endl;
+        Close();
+        return false;
+    }
+    refs.clear();
+    refs.reserve(n_ref);
+    vector<char> name;
+    for (int32_t i = 0; i < n_ref; ++i) {
+        int32_t l_name, l_ref;
+        if (bgzf.Read(reinterpret_cast<char*>(&l_name), 4) != 4 || l_name < 1) {
+            cerr << "yoruba::RawBamReader::Open(): truncated BAM references" << endl;
+            Close();
+            return false;
+        }
+        name.resize(l_name);
+        if (bgzf.Read(&name[0], l_name) != size_t(l_name)
+            || bgzf.Read(reinterpret_cast<char*>(&l_ref), 4) != 4) {
+            cerr << "yoruba::RawBamReader::Open(): truncated BAM references" << endl;
+            Close();
+            return false;
+        }
+        refs.push_back(RefData(string(&name[0], l_name - 1), l_ref));
+    }
+    records_voffset = bgzf.Tell();
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+RawBamReader::Close(void)
+{
+    Stats::Count("bam_records_read", n_records);
+    n_records = 0;
+    bgzf.Close();
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamReader::Rewind(void)
+{
+    if (HasRegions()) {
+        region = 0;
+        return bgzf.Seek(region_offsets[0]);
+    }
+    return bgzf.Seek(records_voffset);
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamReader::SetRegions(const RegionList& list)
+{
+    if (! list.Resolve(refs, regions))
+        return false;
+    BamIndex index;
+    if (! bgzf.IsSeekable() || ! index.Load(filename)) {
+        cerr << "yoruba::RawBamReader: regions need an indexed BAM file as input, and none was found for "
+            << filename << endl;
+        return false;
+    }
+    region_offsets.resize(regions.size());
+    for (size_t i = 0; i < regions.size(); ++i)
+        region_offsets[i] = max(int64_t(index.Offset(regions[i].ref, regions[i].begin)), records_voffset);
+    if (regions.empty()) {  // every region was skipped, so nothing is read
+        Region none = { -1, 0, 0 };
+        regions.push_back(none);
+        region_offsets.push_back(records_voffset);
+    }
+    return Rewind();
+}
+
+
+//-------------------------------------
+
+
+const SamHeader&
+RawBamReader::GetConstSamHeader(void) const
+{
+    if (! header_parsed) {
+        header.SetHeaderText(header_text);
+        header_parsed = true;
+    }
+    return header;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamReader::GetNextRecord(RawRecord& rec)
+{
+    if (! HasRegions())
+        return readRecord(rec);
+    while (region < regions.size()) {
+        if (! readRecord(rec))
+            return false;
+        const int32_t ref = rec.RefID();
+        const int32_t pos = rec.Position();
+        // while the record is past the region, on a later reference or on
+        // none, move to the next region, seeking if it starts in a later
+        // block; otherwise the record may be in it
+        bool seeked = false;
+        while (ref < 0 || ref > regions[region].ref 
+               || (ref == regions[region].ref && pos >= regions[region].end)) {
+            if (++region >= regions.size())
+                return false;
+            if ((region_offsets[region] >> 16) > (bgzf.Tell() >> 16)) {
+                if (! bgzf.Seek(region_offsets[region])) {
+                    failed = true;
+                    return false;
+                }
+                seeked = true;
+                break;
+            }
+        }
+        if (seeked)
+            continue;
+        const Region& r = regions[region];
+        if (ref == r.ref && max(rec.EndPosition(), pos + 1) > r.begin)
+            return true;
+    }
+    return false;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamReader::readRecord(RawRecord& rec)
+{
+    record_voffset = bgzf.Tell();
+    int32_t block_size;
+    char* p = bgzf.Peek(4);
+    if (p != NULL) {
+        memcpy(&block_size, p, 4);
+    } else {
+        size_t n = bgzf.Read(reinterpret_cast<char*>(&block_size), 4);
+        if (n == 0)
+            return false;  // end of file
+        if (n < 4) {
+            cerr << "yoruba::RawBamReader: truncated BAM record" << endl;
+            failed = true;
+            return false;
+        }
+    }
+    if (block_size < 32) {
+        cerr << "yoruba::RawBamReader: malformed BAM record, block_size "
+            << block_size << endl;
+        failed = true;
+        return false;
+    }
+    p = bgzf.Peek(block_size);
+    if (p != NULL) {
+        rec.SetView(p, block_size);
+    } else if (bgzf.Read(rec.Allocate(block_size), block_size) != size_t(block_size)) {
+        cerr << "yoruba::RawBamReader: truncated BAM record" << endl;
+        failed = true;
+        return false;
+    }
+    ++n_records;
+    return true;
+}
+
+
+//-------------------------------------
+//-------------------------------------  RawBamWriter
+//-------------------------------------
+
+
+bool
+RawBamWriter::Open(const string& fname,
+                   const string& header_text,
+                   const RefVector& refs)
+{
+    filename = fname;
+    if (! bgzf.Open(filename))
+        return false;
+    if (write_index)
+        index.Start(refs);
+    if (checksumming)
+        checksum.SetReferences(refs);
+
+    int32_t l_text = int32_t(header_text.length());
+    int32_t n_ref = int32_t(refs.size());
+    bool ok = bgzf.Write("BAM\1", 4)
+        && bgzf.Write(reinterpret_cast<const char*>(&l_text), 4)
+        && bgzf.Write(header_text.data(), l_text)
+        && bgzf.Write(reinterpret_cast<const char*>(&n_ref), 4);
+    for (int32_t i = 0; ok && i < n_ref; ++i) {
+        int32_t l_name = int32_t(refs[i].RefName.length() + 1);
+        int32_t l_ref = refs[i].RefLength;
+        ok = bgzf.Write(reinterpret_cast<const char*>(&l_name), 4)
+            && bgzf.Write(refs[i].RefName.c_str(), l_name)
+            && bgzf.Write(reinterpret_cast<const char*>(&l_ref), 4);
+    }
+    // records start in a fresh block, as with samtools
+    if (! ok || ! bgzf.Flush()) {
+        cerr << "yoruba::RawBamWriter::Open(): could not write header to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamWriter::OpenShard(const string& fname, const RefVector& refs)
+{
+    filename = fname;
+    is_shard = true;
+    if (! bgzf.Open(filename))
+        return false;
+    if (write_index)
+        index.Start(refs);
+    if (checksumming)
+        checksum.SetReferences(refs);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// the shard, already closed, goes after the records written so far, its
+// blocks starting where the current block ends
+bool
+RawBamWriter::AppendShard(RawBamWriter& shard)
+{
+    if (write_index && ! shard.write_index) {
+        cerr << "yoruba::RawBamWriter: shard " << shard.filename 
+            << " has no index to add to that of " << filename << endl;
+        return false;
+    }
+    if (! bgzf.Flush())
+        return false;
+    uint64_t coffset = uint64_t(bgzf.Tell()) >> 16;
+    if (! bgzf.AppendFile(shard.filename))
+        return false;
+    if (write_index)
+        index.Append(shard.index, coffset);
+    if (checksumming)
+        checksum.Add(shard.checksum);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+RawBamWriter::SetChecksum(const RecordChecksum& settings, RecordChecksum* total)
+{
+    checksumming = true;
+    checksum = settings;
+    checksum.Clear();
+    checksum_total = total;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamWriter::SaveRecord(const RawRecord& rec)
+{
+    int32_t block_size = int32_t(rec.Size());
+    if (4 + rec.Size() > bgzf.Available() && 4 + rec.Size() <= BGZF_BLOCK_DATA_SIZE
+        && ! bgzf.Flush())
+        return false;
+    int64_t voffset = bgzf.Tell();
+    if (! bgzf.Write(reinterpret_cast<const char*>(&block_size), 4)
+        || ! bgzf.Write(rec.Data(), rec.Size()))
+        return false;
+    if (write_index)
+        index.Add(rec, voffset, bgzf.Tell());
+    if (checksumming)
+        checksum.Add(rec);
+    ++n_records;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamWriter::SaveRecords(const char* d, size_t len)
+{
+    while (len > 0) {
+        // as many whole records as fit in the current block, in one write
+        size_t n = 0;
+        size_t avail = bgzf.Available();
+        size_t n_recs = 0;
+        int32_t block_size = 0;
+        while (n < len) {
+            memcpy(&block_size, d + n, 4);
+            if (n + 4 + block_size > avail)
+                break;
+            n += 4 + block_size;
+            ++n_recs;
+        }
+        if (n == 0) {  // the next record does not fit
+            if (4 + size_t(block_size) <= BGZF_BLOCK_DATA_SIZE && avail < BGZF_BLOCK_DATA_SIZE) {
+                if (! bgzf.Flush())
+                    return false;
+                continue;  // it will fit in a new block
+            }
+            n = 4 + block_size;  // too large for any block
+            n_recs = 1;
+        }
+        int64_t voffset = bgzf.Tell();
+        if (! bgzf.Write(d, n))
+            return false;
+        if (write_index && ! indexRecords(d, n, voffset, bgzf.Tell()))
+            return false;
+        if (checksumming)
+            checksum.AddRecords(d, n);
+        n_records += int64_t(n_recs);
+        d += n;
+        len -= n;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamWriter::SaveBlock(const char* raw, size_t raw_length, size_t n_records_in_block,
+                        const char* d, size_t len)
+{
+    if (! bgzf.Flush())
+        return false;
+    int64_t voffset = bgzf.Tell();
+    if (! bgzf.WriteBlock(raw, raw_length))
+        return false;
+    if (write_index && ! indexRecords(d, len, voffset, bgzf.Tell()))
+        return false;
+    if (checksumming) {
+        if (d == NULL && len == 0)
+            return false;
+        checksum.AddRecords(d, len);
+    }
+    n_records += int64_t(n_records_in_block);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// index the records in d, just written starting at voffset; they lie within
+// one block, the last may end it, and then it ends at voffset_after.  One
+// record too large for a block is the exception, and also ends at
+// voffset_after.
+bool
+RawBamWriter::indexRecords(const char* d, size_t len, int64_t voffset, int64_t voffset_after)
+{
+    if (d == NULL && len == 0)
+        return false;
+    RawRecord rec;
+    for (size_t off = 0; off < len; ) {
+        int32_t block_size;
+        memcpy(&block_size, d + off, 4);
+        rec.SetView(const_cast<char*>(d + off + 4), block_size);
+        int64_t begin = voffset + int64_t(off);
+        off += 4 + block_size;
+        int64_t end = off < len ? voffset + int64_t(off) : voffset_after;
+        if (! index.Add(rec, begin, end))
+            return true;  // not sorted, so no index; not an error in writing
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawBamWriter::Close(void)
+{
+    Stats::Count("bam_records_written", n_records);
+    n_records = 0;
+    if (checksum_total != NULL) {
+        checksum_total->AddShared(checksum);
+        checksum.Clear();
+    }
+    bool ok = bgzf.Close();
+    if (! ok)
+        cerr << "yoruba::RawBamWriter: error closing " << filename << endl;
+    if (write_index && ok && ! is_shard) {  // a shard's index goes with it to AppendShard()
+        if (index.IsSorted()) {
+            ok = index.Write(filename);
+        } else {
+            cerr << "yoruba::RawBamWriter: " << filename 
+                << " is not coordinate-sorted, no index written" << endl;
+            // don't leave an old index beside the new BAM
+            unlink((filename + ".bai").c_str());
+            unlink((filename + ".csi").c_str());
+        }
+    }
+    return ok;
+}
+
+
+//-------------------------------------
+//-------------------------------------  OutputOptions
+//-------------------------------------
+
+
+bool
+OutputOptions::SetLevel(const char* arg)
+{
+    if (arg == NULL || arg[0] < '0' || arg[0] > '9' || arg[1] != '\0')
+        return false;
+    level = arg[0] - '0';
+    level_set = true;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+OutputOptions::Open(RawBamWriter& writer,
+                    const string& filename,
+                    const string& header_text,
+                    const RefVector& refs,
+                    bool checksummed) const
+{
+    writer.SetCompressionLevel(level);
+    writer.SetWriteIndex(write_index);
+    if (Checksumming() && checksummed)
+        writer.SetChecksum(checksum_settings, &checksum);
+    return writer.Open(filename, header_text, refs);
+}
+
+
+//-------------------------------------
+
+
+bool
+OutputOptions::OpenShard(RawBamWriter& writer,
+                         const string& filename,
+                         const RefVector& refs,
+                         bool checksummed) const
+{
+    writer.SetCompressionLevel(level);
+    writer.SetWriteIndex(write_index);
+    if (Checksumming() && checksummed)
+        writer.SetChecksum(checksum_settings, NULL);  // added to the BAM's by AppendShard()
+    return writer.OpenShard(filename, refs);
+}
+
+
+//-------------------------------------
+
+
+bool
+OutputOptions::SetChecksum(const string& filename, const string& exclude)
+{
+    checksum_file = filename;
+    if (! checksum_settings.SetExclude(exclude))
+        return false;
+    checksum = checksum_settings;
+    return true;
+}
+
+
+bool
+OutputOptions::WriteChecksum(void) const
+{
+    if (! Checksumming())
+        return true;
+    return checksum.Write(checksum_file);
+}
@@ -0,0 +1,416 @@
+// yoruba_bgzf.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_bgzf.cpp
+//
+// Raw BGZF block and BAM record I/O.  BamTools decodes every record into a
+// BamAlignment, which owns several std::strings; these classes instead hand
+// out RawRecord views of records where they sit in decompressed BGZF blocks,
+// and write records back out as the bytes they are.
+//
+// Uses zlib for (de)compression and BamTools only for header types
+
+#ifndef _YORUBA_BGZF_H_
+#define _YORUBA_BGZF_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+#include <zlib.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+#include "api/SamHeader.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_checksum.h"
+#include "yoruba_header.h"
+#include "yoruba_index.h"
+
+namespace yoruba {
+
+// BGZF blocks hold at most 64KB; like samtools we fill blocks with a little
+// less so that incompressible data still fits after deflate
+const size_t BGZF_MAX_BLOCK_SIZE  = 0x10000;
+const size_t BGZF_BLOCK_DATA_SIZE = 0xff00;
+
+
+// BgzfReader reads BGZF blocks from a file descriptor and inflates them one
+// at a time.  Positions are BGZF virtual offsets, the compressed address of
+// a block shifted left 16 bits plus the offset within the decompressed block.
+//
+// If SetSpill() is called before Open() and the input turns out to be a pipe,
+// the compressed input is kept as it is read, in memory up to a cap and then
+// in an unlinked temporary file, so that Seek() back into it still works.
+// This is what lets the two-pass commands read from stdin.
+
+class BgzfReader {
+
+    public:
+        BgzfReader(void);
+        ~BgzfReader(void);
+
+        void        SetSpill(const std::string& dir, size_t memory_cap);  // dir "" is $TMPDIR or /tmp
+        bool        Open(const std::string& filename);
+        void        Close(void);
+        bool        IsOpen(void) const { return fd >= 0; }
+        bool        IsSeekable(void) const { return seekable || spilling; }
+        bool        IsSpilling(void) const { return spilling; }
+        int64_t     SpilledToDisk(void) const;  // bytes of input spilled beyond memory
+        // compressed size of the input: of a file, or of a pipe once it has
+        // been read to the end and kept; otherwise 0
+        int64_t     InputSize(void) const;
+        bool        Seek(int64_t voffset);
+        int64_t     Tell(void) const { return (block_address << 16) | int64_t(block_offset); }
+        // a read stopped short because of a truncated or corrupt block, a
+        // failed inflate or CRC check, or an end of file without the BGZF
+        // EOF marker block, rather than at a clean end of file
+        bool        Failed(void) const { return failed; }
+
+        // copy len decompressed bytes to dst, crossing blocks as needed;
+        // returns the number of bytes copied, short only at end of file
+        size_t      Read(char* dst, size_t len);
+
+        // pointer to the next len bytes if they all lie within the current
+        // block, advancing past them, otherwise NULL and nothing is consumed
+        char*       Peek(size_t len);
+
+        // if the next byte starts a block, that whole block both decompressed
+        // and compressed as it is in the input, otherwise false; nothing is
+        // consumed, SkipBlock() moves past it.  Valid until the next read.
+        bool        PeekBlock(const char*& data, size_t& length,
+                              const char*& raw, size_t& raw_length);
+        void        SkipBlock(void) { block_offset = block_length; }
+
+    private:
+        bool        readBlock(void);
+        void        reportStats(void);
+        bool        fillInput(size_t need);
+        ssize_t     readSource(char* dst, size_t len);
+        bool        spill(const char* d, size_t len);
+
+        int                 fd;
+        bool                seekable;
+        z_stream            zs;
+        bool                zs_init;
+
+        // compressed input, buffered from fd
+        std::vector<char>   in_buf;
+        size_t              in_pos, in_len;
+        int64_t             in_address;      // file offset of in_buf[0]
+        bool                in_eof;
+        int64_t             source_address;  // file offset of the next byte read
+        bool                source_done;     // read(2) of fd has returned 0
+
+        // input kept from a pipe so it can be read again
+        bool                spill_enabled;
+        std::string         spill_dir;
+        size_t              spill_memory_cap;
+        bool                spilling;
+        std::vector<char>   spill_memory;    // the first spill_memory_cap bytes
+        int                 spill_fd;        // the rest
+        int64_t             spill_length;    // bytes kept so far, memory and file
+
+        // the current decompressed block
+        std::vector<char>   block;
+        size_t              block_length, block_offset;
+        int64_t             block_address, next_block_address;
+        size_t              block_csize;     // compressed size, ending at in_buf[in_pos]
+        bool                last_block_empty;  // as the EOF marker is, or nothing read since Seek()
+        bool                failed;
+
+        // for Stats, reported and cleared by Close()
+        int64_t             n_blocks, n_compressed, n_inflated;
+
+        BgzfReader(const BgzfReader&);             // not copyable
+        BgzfReader& operator=(const BgzfReader&);
+
+};  // class BgzfReader
+
+
+// BgzfWriter collects bytes into blocks, deflates each when it fills, and
+// writes them along with the empty EOF block when closed.
+
+class BgzfWriter {
+
+    public:
+        BgzfWriter(void);
+        ~BgzfWriter(void);
+
+        bool        Open(const std::string& filename);
+        bool        Close(void);
+        bool        IsOpen(void) const { return fd >= 0; }
+        void        SetCompressionLevel(int level);  // zlib level, 0 for stored blocks
+        bool        Write(const char* d, size_t len);
+        bool        Flush(void);  // end the current block, if anything is in it
+        size_t      Available(void) const { return block.size() - block_length; }
+        // a complete BGZF block, written as it is after ending the current one
+        bool        WriteBlock(const char* raw, size_t raw_length);
+        // the BGZF blocks of another file, copied as they are after ending
+        // the current block, without its EOF block
+        bool        AppendFile(const std::string& filename);
+        int64_t     Tell(void) const { return (block_address << 16) | int64_t(block_length); }
+
+    private:
+        bool        deflateBlock(void);
+        size_t      storeBlock(char* b);
+        bool        writeOutput(const char* d, size_t len);
+        bool        flushOutput(void);
+        void        reportStats(void);
+
+        int                 fd;
+        int                 compression_level;
+        z_stream            zs;
+        bool                zs_init;
+
+        std::vector<char>   block;           // uncompressed, awaiting deflate
+        size_t              block_length;
+        int64_t             block_address;   // compressed address of the current block
+
+        std::vector<char>   out_buf;         // compressed, awaiting write(2)
+        size_t              out_len;
+
+        // for Stats, reported and cleared by Close()
+        int64_t             n_blocks, n_blocks_copied, n_compressed, n_deflated;
+
+        BgzfWriter(const BgzfWriter&);             // not copyable
+        BgzfWriter& operator=(const BgzfWriter&);
+
+};  // class BgzfWriter
+
+
+// RawBamReader reads the BAM header and references and then hands out
+// records as RawRecords, borrowing the bytes from the current BGZF block when
+// a record lies entirely within it.  The method names follow BamReader.
+//
+// The header is kept as a RawHeader, with its @SQ lines unparsed; only
+// GetHeader() and GetConstSamHeader() parse all of it, which for BAMs with
+// millions of references is slow, so use GetRawHeader() where possible.
+//
+// After SetRegions(), only the records overlapping the regions are handed
+// out.  The regions are read in order, seeking from the BAM's index to where
+// each starts, but only ever forward and only to a later BGZF block than
+// the current one, so no block is decompressed twice and the blocks between
+// regions are not decompressed at all.  Rewind() returns to the first.
+
+class RawBamReader {
+
+    public:
+        RawBamReader(void) 
+            : header_parsed(false), records_voffset(0), record_voffset(0), n_records(0), 
+              failed(false), region(0) { }
+        ~RawBamReader(void) { Close(); }
+
+        // allow Rewind() on pipes, see BgzfReader
+        void        SetSpill(const std::string& dir, size_t memory_cap) { 
+            bgzf.SetSpill(dir, memory_cap); 
+        }
+        bool        IsSpilling(void) const { return bgzf.IsSpilling(); }
+        int64_t     SpilledToDisk(void) const { return bgzf.SpilledToDisk(); }
+        int64_t     InputSize(void) const { return bgzf.InputSize(); }
+        bool        Open(const std::string& filename);
+        void        Close(void);
+        bool        IsOpen(void) const { return bgzf.IsOpen(); }
+        bool        Rewind(void);
+        bool        Seek(int64_t voffset) { return bgzf.Seek(voffset); }  // of a record, from an index
+        int64_t     Tell(void) const { return bgzf.Tell(); }
+
+        // restrict reading to regions, after Open(); false after saying why
+        // if the BAM has no index or a region is not on its references
+        bool        SetRegions(const RegionList& list);
+        bool        HasRegions(void) const { return ! region_offsets.empty(); }
+        const std::vector<Region>&  GetRegions(void) const { return regions; }  // merged
+
+        // the next record, which is only valid until the next call if
+        // rec.IsView(); copy it to keep it longer
+        bool        GetNextRecord(RawRecord& rec);
+        // the virtual offset of the record last returned, which with regions
+        // is not always where Tell() was before
+        int64_t     RecordOffset(void) const { return record_voffset; }
+        // GetNextRecord() returned false for a truncated or malformed record
+        // or BGZF block rather than at the end of the file
+        bool        Failed(void) const { return failed || bgzf.Failed(); }
+
+        // the BGZF block starting at the next record, if one does, for
+        // copying it to output as it is; see BgzfReader::PeekBlock().  Never
+        // with regions, whose blocks may hold records outside them.
+        bool        PeekBlock(const char*& data, size_t& length,
+                              const char*& raw, size_t& raw_length) {
+            return ! HasRegions() && bgzf.PeekBlock(data, length, raw, raw_length);
+        }
+        void        SkipBlock(size_t n_records_in_block) {
+            bgzf.SkipBlock();
+            n_records += int64_t(n_records_in_block);
+        }
+
+        const std::string&          GetHeaderText(void) const { return header_text; }
+        const RawHeader&            GetRawHeader(void) const { return raw_header; }
+        BamTools::SamHeader         GetHeader(void) const { return GetConstSamHeader(); }
+        const BamTools::SamHeader&  GetConstSamHeader(void) const;
+        int                         GetReferenceCount(void) const { return int(refs.size()); }
+        const BamTools::RefVector&  GetReferenceData(void) const { return refs; }
+
+    private:
+        bool        readRecord(RawRecord& rec);
+        bool        nextRegion(int64_t voffset);
+
+        BgzfReader                  bgzf;
+        std::string                 filename;
+        std::string                 header_text;
+        RawHeader                   raw_header;
+        BamTools::RefVector         refs;
+        mutable BamTools::SamHeader header;  // parsed from header_text when first asked
+        mutable bool                header_parsed;
+        int64_t                     records_voffset;
+        int64_t                     record_voffset;  // of the last record
+        int64_t                     n_records;  // for Stats, reported by Close()
+        bool                        failed;
+        std::vector<Region>         regions;
+        std::vector<int64_t>        region_offsets;  // to seek to for each region
+        size_t                      region;          // the region being read
+
+};  // class RawBamReader
+
+
+// RawBamWriter writes a BAM header and references and then records as they
+// are given.  As with samtools, a record is not split across BGZF blocks
+// unless it is too large for one.  The method names follow BamWriter.
+//
+// With SetWriteIndex() before Open(), a BAI or CSI index is built as records
+// are written and saved next to the BAM by Close(), if the records turned out
+// to be coordinate-sorted; see BamIndexBuilder.
+//
+// Threads can each write a shard of one BAM: a writer opened with
+// OpenShard() writes only records, and once closed, AppendShard() on the
+// writer of the BAM copies its compressed blocks into it without inflating
+// them.  The shard's index, if it built one, is merged into the BAM's with
+// its virtual offsets moved to where its blocks landed.
+//
+// With SetChecksum(), a RecordChecksum of the records is kept as they are
+// written, and Close() adds it to total, shared by every writer of a
+// command; a shard's is added to its BAM's by AppendShard().
+
+class RawBamWriter {
+
+    public:
+        RawBamWriter(void) 
+            : write_index(false), is_shard(false), n_records(0), checksumming(false), 
+              checksum_total(NULL) { }
+
+        bool        Open(const std::string& filename,
+                         const std::string& header_text,
+                         const BamTools::RefVector& refs);
+        bool        Open(const std::string& filename,
+                         const BamTools::SamHeader& header,
+                         const BamTools::RefVector& refs) {
+            return Open(filename, header.ToString(), refs);
+        }
+        bool        OpenShard(const std::string& filename, const BamTools::RefVector& refs);
+        bool        AppendShard(RawBamWriter& shard);
+        bool        SaveRecord(const RawRecord& rec);
+        // len bytes of records, each preceded by its block_size
+        bool        SaveRecords(const char* d, size_t len);
+        // a BGZF block of n_records whole records from
+        // RawBamReader::PeekBlock(); when indexing, its decompressed records
+        // are needed too
+        bool        SaveBlock(const char* raw, size_t raw_length, size_t n_records_in_block,
+                              const char* d = NULL, size_t len = 0);
+        // false after saying why if the last of the BAM, or its index, could
+        // not be written; a command must then fail
+        bool        Close(void);
+        bool        IsOpen(void) const { return bgzf.IsOpen(); }
+        void        SetCompressionLevel(int level) { bgzf.SetCompressionLevel(level); }
+        void        SetWriteIndex(bool ok) { write_index = ok; }
+        bool        IsIndexing(void) const { return write_index; }
+        // checksum the records with the exclusions of total, adding the sums
+        // to total when closed, or if total is NULL, only keeping them
+        void        SetChecksum(const RecordChecksum& settings, RecordChecksum* total);
+        const RecordChecksum& GetChecksum(void) const { return checksum; }
+        // SaveBlock() needs the decompressed records as well
+        bool        NeedsRecords(void) const { return write_index || checksumming; }
+
+    private:
+        bool        indexRecords(const char* d, size_t len, int64_t voffset, int64_t voffset_after);
+
+        BgzfWriter          bgzf;
+        bool                write_index;
+        BamIndexBuilder     index;
+        std::string         filename;
+        bool                is_shard;
+        int64_t             n_records;  // for Stats, reported by Close()
+        bool                checksumming;
+        RecordChecksum      checksum;
+        RecordChecksum*     checksum_total;
+
+};  // class RawBamWriter
+
+
+// OutputOptions are the BAM output settings common to every command that
+// writes BAM, given with -l/--level INT, -u, --write-index and --checksum
+// FILE.  Level 0 still writes valid BGZF, with stored rather than deflated
+// blocks, which saves nearly all the compression work when piping one
+// command to another or writing scratch files that will be read once.
+//
+// With --checksum, every writer opened here checksums what it writes, and
+// WriteChecksum() writes the sum over all of them once they are closed, to
+// compare with that of the input from the checksum command.
+
+class OutputOptions {
+
+    public:
+        OutputOptions(void) 
+            : level(Z_DEFAULT_COMPRESSION), level_set(false), write_index(false) { }
+
+        bool        SetLevel(const char* arg);  // false unless arg is 0-9
+        void        SetUncompressed(void) { level = 0; level_set = true; }
+        int         Level(void) const { return level; }
+        bool        LevelSet(void) const { return level_set; }  // -l or -u was given
+        void        SetWriteIndex(void) { write_index = true; }  // --write-index
+        bool        WriteIndex(void) const { return write_index; }
+        // --checksum FILE, excluding the fields the command changes; see
+        // RecordChecksum::SetExclude()
+        bool        SetChecksum(const std::string& filename, const std::string& exclude);
+        bool        Checksumming(void) const { return ! checksum_file.empty(); }
+        // write the checksum of everything written, if checksumming; call
+        // after closing every writer
+        bool        WriteChecksum(void) const;
+
+        // open writer with these settings; the records of a writer opened
+        // with checksummed false, such as a side file of duplicates, are
+        // left out of the checksum
+        bool        Open(RawBamWriter& writer,
+                         const std::string& filename,
+                         const std::string& header_text,
+                         const BamTools::RefVector& refs,
+                         bool checksummed = true) const;
+        bool        Open(RawBamWriter& writer,
+                         const std::string& filename,
+                         const BamTools::SamHeader& header,
+                         const BamTools::RefVector& refs,
+                         bool checksummed = true) const {
+            return Open(writer, filename, header.ToString(), refs, checksummed);
+        }
+        // open a shard of a BAM to be opened with these settings
+        bool        OpenShard(RawBamWriter& writer,
+                              const std::string& filename,
+                              const BamTools::RefVector& refs,
+                              bool checksummed = true) const;
+
+    private:
+        int         level;
+        bool        level_set;
+        bool        write_index;
+        std::string             checksum_file;
+        RecordChecksum          checksum_settings;
+        mutable RecordChecksum  checksum;  // the sum of every writer's
+
+};  // class OutputOptions
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_BGZF_H_
@@ -0,0 +1,362 @@
+// yoruba_checksum.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Order-independent checksums of BAM records, see yoruba_checksum.h
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- use the ARMv8 crc32c instructions where they are available
+
+#include <cstring>
+#include <fstream>
+#include <iomanip>
+#include <sstream>
+
+#include <pthread.h>
+
+#if defined(__x86_64__)
+#include <nmmintrin.h>
+#endif
+
+#include "yoruba_checksum.h"
+
+using namespace std;
+using namespace yoruba;
+
+
+static const char* FIELD_NAMES[RecordChecksum::N_FIELDS] = {
+    "name", "flag", "alignment", "seq", "qual", "aux", "record"
+};
+
+static pthread_mutex_t shared_lock = PTHREAD_MUTEX_INITIALIZER;  // for AddShared()
+
+
+//-------------------------------------
+//-------------------------------------  CRC32C
+//-------------------------------------
+
+
+// slicing-by-8 tables of the reflected Castagnoli polynomial, for CPUs
+// without the crc32 instruction
+static struct Crc32cTables {
+    uint32_t    t[8][256];
+    Crc32cTables(void) {
+        for (uint32_t i = 0; i < 256; ++i) {
+            uint32_t c = i;
+            for (int k = 0; k < 8; ++k)
+                c = (c & 1) ? (c >> 1) ^ 0x82f63b78 : c >> 1;
+            t[0][i] = c;
+        }
+        for (uint32_t i = 0; i < 256; ++i)
+            for (int s = 1; s < 8; ++s)
+                t[s][i] = (t[s - 1][i] >> 8) ^ t[0][t[s - 1][i] & 0xff];
+    }
+} crc_tables;
+
+
+static uint32_t
+crc32cSoftware(uint32_t c, const uint8_t* p, size_t len)
+{
+    const uint32_t (*t)[256] = crc_tables.t;
+    while (len >= 8) {
+        uint32_t lo, hi;
+        memcpy(&lo, p, 4);
+        memcpy(&hi, p + 4, 4);
+        lo ^= c;
+        c = t[7][lo & 0xff] ^ t[6][(lo >> 8) & 0xff] ^ t[5][(lo >> 16) & 0xff] ^ t[4][lo >> 24]
+          ^ t[3][hi & 0xff] ^ t[2][(hi >> 8) & 0xff] ^ t[1][(hi >> 16) & 0xff] ^ t[0][hi >> 24];
+        p += 8;
+        len -= 8;
+    }
+    while (len-- > 0)
+        c = (c >> 8) ^ t[0][(c ^ *p++) & 0xff];
+    return c;
+}
+
+
+#if defined(__x86_64__)
+
+// eight bytes per instruction; compiled for SSE4.2 whatever the rest of
+// yoruba is compiled for, and only called if the CPU has it
+__attribute__((target("sse4.2")))
+static uint32_t
+crc32cHardware(uint32_t c, const uint8_t* p, size_t len)
+{
+    uint64_t c64 = c;
+    while (len >= 8) {
+        uint64_t v;
+        memcpy(&v, p, 8);
+        c64 = _mm_crc32_u64(c64, v);
+        p += 8;
+        len -= 8;
+    }
+    c = uint32_t(c64);
+    while (len-- > 0)
+        c = _mm_crc32_u8(c, *p++);
+    return c;
+}
+
+static bool
+cpuHasSse42(void)
+{
+    __builtin_cpu_init();  // this may run before the constructor that would call it
+    return __builtin_cpu_supports("sse4.2");
+}
+
+static const bool has_sse42 = cpuHasSse42();
+
+#endif
+
+
+uint32_t
+yoruba::crc32c(uint32_t crc, const char* d, size_t len)
+{
+    const uint8_t* p = reinterpret_cast<const uint8_t*>(d);
+#if defined(__x86_64__)
+    if (has_sse42)
+        return ~crc32cHardware(~crc, p, len);
+#endif
+    return ~crc32cSoftware(~crc, p, len);
+}
+
+
+//-------------------------------------
+//-------------------------------------  RecordChecksum
+//-------------------------------------
+
+
+// the splitmix64 finalizer, which spreads each bit of x over the result
+static inline uint64_t
+mix64(uint64_t x)
+{
+    x ^= x >> 30;
+    x *= 0xbf58476d1ce4e5b9ULL;
+    x ^= x >> 27;
+    x *= 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x;
+}
+
+// the hash of a value of field f, from its CRC and length
+static inline uint64_t
+fieldHash(int f, uint32_t crc, size_t len)
+{
+    return mix64((uint64_t(crc) << 32) ^ (uint64_t(len) << 3) ^ uint64_t(f));
+}
+
+
+const char*
+RecordChecksum::FieldName(int f)
+{
+    return (f >= 0 && f < N_FIELDS) ? FIELD_NAMES[f] : "reads";
+}
+
+
+RecordChecksum::RecordChecksum(void)
+    : flag_mask(0xffff), n_records(0)
+{
+    for (int f = 0; f < N_FIELDS; ++f)
+        exclude_field[f] = false;
+    Clear();
+}
+
+
+void
+RecordChecksum::Clear(void)
+{
+    n_records = 0;
+    for (int f = 0; f < N_FIELDS; ++f)
+        digest[f] = 0;
+}
+
+
+//-------------------------------------
+
+
+bool
+RecordChecksum::SetExclude(const string& list)
+{
+    exclude = list;
+    stringstream ss(list);
+    string item;
+    while (getline(ss, item, ',')) {
+        if (item.empty())
+            continue;
+        int f = 0;
+        while (f < N_FIELDS && item != FIELD_NAMES[f])
+            ++f;
+        if (f == RECORD) {
+            cerr << "yoruba::RecordChecksum: the record digest cannot be excluded" << endl;
+            return false;
+        } else if (f < N_FIELDS) {
+            exclude_field[f] = true;
+        } else if (item == "dup") {
+            flag_mask &= uint16_t(~0x0400);
+        } else if (item.length() == 2 && isalpha(uint8_t(item[0])) && isalnum(uint8_t(item[1]))) {
+            exclude_tags.push_back(uint16_t(uint8_t(item[0]) << 8 | uint8_t(item[1])));
+        } else {
+            cerr << "yoruba::RecordChecksum: cannot exclude '" << item
+                << "', not name, flag, dup, alignment, seq, qual, aux or a tag" << endl;
+            return false;
+        }
+    }
+    return true;
+}
+
+
+void
+RecordChecksum::SetReferences(const BamTools::RefVector& refs)
+{
+    ref_crc.resize(refs.size());
+    for (size_t i = 0; i < refs.size(); ++i)
+        ref_crc[i] = crc32c(0, refs[i].RefName.data(), refs[i].RefName.length());
+}
+
+
+bool
+RecordChecksum::excludeTag(const char* t) const
+{
+    uint16_t code = uint16_t(uint8_t(t[0]) << 8 | uint8_t(t[1]));
+    for (size_t i = 0; i < exclude_tags.size(); ++i)
+        if (exclude_tags[i] == code)
+            return true;
+    return false;
+}
+
+
+//-------------------------------------
+
+
+void
+RecordChecksum::Add(const RawRecord& rec)
+{
+    uint64_t h[N_FIELDS];
+    const char* d = rec.Data();
+
+    h[READ_NAME] = fieldHash(READ_NAME, crc32c(0, rec.Name(), rec.NameLength()), rec.NameLength());
+    h[FLAG] = fieldHash(FLAG, rec.Flag() & flag_mask, 2);
+
+    // reference and position, mapping quality, mate fields and CIGAR; the
+    // bin follows from these and the name and sequence lengths are hashed
+    // with their fields.  References are hashed by name.
+    uint32_t ref[2] = { refHash(rec.RefID()), refHash(rec.MateRefID()) };
+    uint32_t crc = crc32c(0, reinterpret_cast<const char*>(ref), 8);
+    crc = crc32c(crc, d + 4, 4);
+    crc = crc32c(crc, d + 9, 1);
+    crc = crc32c(crc, d + 24, 8);
+    const char* cigar = rec.Name() + rec.NameLength() + 1;
+    crc = crc32c(crc, cigar, 4 * size_t(rec.CigarCount()));
+    h[ALIGNMENT] = fieldHash(ALIGNMENT, crc, 4 * size_t(rec.CigarCount()));
+
+    const size_t l_seq = size_t(rec.QueryLength());
+    h[SEQUENCE] = fieldHash(SEQUENCE, crc32c(0, rec.SeqData(), (l_seq + 1) / 2), l_seq);
+    h[QUALITY] = fieldHash(QUALITY, crc32c(0, rec.QualData(), l_seq), l_seq);
+
+    h[AUX] = 0;
+    const char* p = rec.AuxData();
+    const char* end = d + rec.Size();
+    while (p + 3 <= end) {
+        size_t vs = auxValueSize(p[2], p + 3, end);
+        if (vs == 0 || p + 3 + vs > end) {  // malformed, hash the rest as it is
+            h[AUX] += fieldHash(AUX, crc32c(0, p, end - p), end - p);
+            break;
+        }
+        if (exclude_tags.empty() || ! excludeTag(p))
+            h[AUX] += fieldHash(AUX, crc32c(0, p, 3 + vs), 3 + vs);
+        p += 3 + vs;
+    }
+
+    uint64_t r = 0;
+    for (int f = 0; f < RECORD; ++f)
+        if (! exclude_field[f]) {
+            digest[f] += h[f];
+            r = mix64(r + h[f]);
+        }
+    digest[RECORD] += r;
+    ++n_records;
+}
+
+
+void
+RecordChecksum::AddRecords(const char* d, size_t len)
+{
+    RawRecord rec;
+    for (size_t off = 0; off < len; ) {
+        int32_t block_size;
+        memcpy(&block_size, d + off, 4);
+        rec.SetView(const_cast<char*>(d + off + 4), block_size);
+        Add(rec);
+        off += 4 + block_size;
+    }
+}
+
+
+void
+RecordChecksum::Add(const RecordChecksum& other)
+{
+    n_records += other.n_records;
+    for (int f = 0; f < N_FIELDS; ++f)
+        digest[f] += other.digest[f];
+}
+
+
+void
+RecordChecksum::AddShared(const RecordChecksum& other)
+{
+    pthread_mutex_lock(&shared_lock);
+    Add(other);
+    pthread_mutex_unlock(&shared_lock);
+}
+
+
+//-------------------------------------
+
+
+void
+RecordChecksum::Write(ostream& os) const
+{
+    os << "reads\t" << n_records << "\n";
+    for (int f = 0; f < N_FIELDS; ++f) {
+        os << FIELD_NAMES[f] << "\t";
+        if (exclude_field[f])
+            os << "excluded\n";
+        else
+            os << hex << setw(16) << setfill('0') << digest[f] << dec << setfill(' ') << "\n";
+    }
+    if (! exclude.empty())
+        os << "exclude\t" << exclude << "\n";
+}
+
+
+bool
+RecordChecksum::Write(const string& filename) const
+{
+    ofstream os(filename.c_str());
+    Write(os);
+    os.close();
+    if (! os) {
+        cerr << "yoruba::RecordChecksum: could not write checksum to " << filename << endl;
+        return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+vector<int>
+RecordChecksum::Differences(const RecordChecksum& other) const
+{
+    vector<int> diffs;
+    if (n_records != other.n_records)
+        diffs.push_back(N_FIELDS);
+    for (int f = 0; f < N_FIELDS; ++f)
+        if (! exclude_field[f] && ! other.exclude_field[f] && digest[f] != other.digest[f])
+            diffs.push_back(f);
+    return diffs;
+}
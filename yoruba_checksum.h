@@ -0,0 +1,104 @@
+// yoruba_checksum.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_checksum.cpp
+//
+// Order-independent checksums of the records of a BAM, for showing that a
+// command changed nothing but what it meant to.  Each field of each record
+// is hashed with CRC32C, using the SSE4.2 crc32 instruction where the CPU
+// has it, and the hashes are summed, so the digest of a field is that of the
+// multiset of its values however the records are ordered or sharded, and
+// digests of parts of a BAM add up to that of the whole.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_CHECKSUM_H_
+#define _YORUBA_CHECKSUM_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+
+namespace yoruba {
+
+// CRC32C (Castagnoli) of len bytes, continuing from crc as zlib's crc32()
+// does, so crc32c(0, ...) starts one
+uint32_t    crc32c(uint32_t crc, const char* d, size_t len);
+
+
+// RecordChecksum sums hashes of the fields of the records added to it: the
+// read name, the flag, the alignment (reference, position, mapping quality,
+// CIGAR, mate reference and position, and template length), the sequence,
+// the qualities and the aux tags.  The tags of a record are hashed one by
+// one and summed too, so their order within the record does not matter.
+// The record digest sums a hash of each record's fields taken together,
+// which catches a value moved from one record to another.  References are
+// hashed by their names, from SetReferences(), so renumbering them, as
+// forget does, leaves the digests as they were.
+//
+// SetExclude() leaves fields out of every digest, given as a comma-separated
+// list of field names, tags to leave out of the aux digest, and "dup" for
+// just the duplicate bit (0x400) of the flag; e.g. "RG" for readgroup or
+// "dup" for duplicate.
+
+class RecordChecksum {
+
+    public:
+        enum Field { READ_NAME, FLAG, ALIGNMENT, SEQUENCE, QUALITY, AUX, RECORD, N_FIELDS };
+        static const char*  FieldName(int f);  // "reads" for N_FIELDS
+
+        RecordChecksum(void);
+
+        bool        SetExclude(const std::string& list);  // false after saying why
+        const std::string& GetExclude(void) const { return exclude; }
+        bool        IsExcluded(int f) const { return exclude_field[f]; }
+        void        SetReferences(const BamTools::RefVector& refs);
+
+        void        Add(const RawRecord& rec);
+        // len bytes of records, each preceded by its block_size
+        void        AddRecords(const char* d, size_t len);
+        // the records of another checksum with the same exclusions
+        void        Add(const RecordChecksum& other);
+        // Add(other) under a lock, for writers closing on several threads
+        void        AddShared(const RecordChecksum& other);
+        void        Clear(void);  // the sums, keeping the exclusions
+
+        int64_t     Count(void) const { return n_records; }
+        uint64_t    Digest(int f) const { return digest[f]; }
+
+        // one line for the number of reads, one per field with its digest in
+        // hex or "excluded", and one of the exclusions if there are any
+        void        Write(std::ostream& os) const;
+        bool        Write(const std::string& filename) const;  // false after saying why
+        // the count and fields that differ, the count as N_FIELDS
+        std::vector<int> Differences(const RecordChecksum& other) const;
+
+    private:
+        bool        excludeTag(const char* t) const;
+        uint32_t    refHash(int32_t id) const {
+            return (id >= 0 && size_t(id) < ref_crc.size()) ? ref_crc[id] : uint32_t(id);
+        }
+
+        bool                    exclude_field[N_FIELDS];
+        uint16_t                flag_mask;
+        std::vector<uint16_t>   exclude_tags;
+        std::vector<uint32_t>   ref_crc;  // of each reference name
+        std::string             exclude;  // as given to SetExclude()
+        int64_t                 n_records;
+        uint64_t                digest[N_FIELDS];
+
+};  // class RecordChecksum
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_CHECKSUM_H_
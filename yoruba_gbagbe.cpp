@@ -29,6 +29,7 @@
 //
 
 #include "yoruba_gbagbe.h"
+#include "yoruba_run.h"
 
 using namespace std;
 using namespace BamTools;
@@ -36,17 +37,40 @@ using namespace yoruba;
 
 static string       input_file;
 static string       output_file;
+static OutputOptions output_opts;
+static string       checksum_file;     // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
 static bool         opt_usageonly = false;
 static string       usage_file;
 static bool         opt_mate = true;
 static string       list_file;
+static int          opt_threads = 1;
+static string       spill_dir;  // for stdin, defaults to $TMPDIR or /tmp
+static int64_t      opt_spill_memory = 256;  // MB of stdin kept in memory before spilling
 #ifdef _WITH_DEBUG
 static int32_t      opt_debug = 0;
-static int32_t      debug_progress = 100000;
+static int32_t      debug_progress = 10;  // seconds
 static int64_t      opt_reads = -1;
-static int64_t      opt_progress = 0; // 1000000;
+static int64_t      opt_progress = 0;  // seconds between progress lines
 #endif
 static const string sep = "\t";
+
+static SamProgram   new_program;  // set in parseOptions()
+typedef std::tr1::unordered_map<string, bool> nameMap;
+static nameMap      name_map;  // references named by --list
+
+// pass 1 counts of mentions by reads and their mates, by reference ID
+static vector<int64_t> refs_mentioned;
+static vector<int64_t> refs_mentioned_mate;
+static int64_t      n_unref_mentioned = 0;
+static int64_t      n_unref_mentioned_mate = 0;
+
+static int  parseOptions(int argc, char* argv[], bool in_run);
+static void readList(void);
+static void countReferences(const RawRecord& rec);
+static bool forgetReferences(SamHeader& header, RefVector& refs);
+
 class refStats {  // holds statistics for reference sequences
     public:
         string  ref; 
@@ -112,14 +136,25 @@ Options: --no-mate                 also forget references for paired-end mates\n
          --usage-only              analyze reference usage, do not produce output BAM\n\
          --usage-file FILE         write per-reference usage details to FILE\n\
          -L FILE | --list FILE     file containing names of reference sequences to keep\n\
+         -t INT | --threads INT    worker threads for rereferencing reads [" << opt_threads << "]\n\
+         -r STR | --region STR     only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            only reads overlapping the regions of BED FILE\n\
          -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of sorted output\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         --spill-dir DIR           directory for spilling stdin [$TMPDIR or /tmp]\n\
+         --spill-memory INT        MB of stdin to hold in memory before spilling [" << opt_spill_memory << "]\n\
          -? | --help               longer help\n\
 \n";
 #ifdef _WITH_DEBUG
     cerr << "\
          --debug INT      debug info level INT [" << opt_debug << "]\n\
          --reads INT      only process INT reads [" << opt_reads << "]\n\
-         --progress INT   print reads processed mod INT [" << opt_progress << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
 \n";
 #endif
     cerr << "Gbagbe is the Yoruba (Nigeria) verb for 'to forget'." << endl;
@@ -132,11 +167,259 @@ Options: --no-mate                 also forget references for paired-end mates\n
 //-------------------------------------
 
 
+// pass 2 of gbagbe, run on the pipeline's worker threads: give each read
+// and its mate their new reference IDs
+
+class RereferenceTransform : public RecordTransform {
+
+    public:
+        RereferenceTransform(const vector<int64_t>& ids, int n_workers) 
+            : new_id(ids), counts(n_workers) { }
+
+        virtual bool Apply(RawRecord& rec, int worker);
+        virtual bool Unchanged(const RawRecord& rec) const;
+        virtual bool IsOrderIndependent(void) const { return true; }
+
+        int64_t MatesDereferenced(void) const;
+
+    private:
+        const vector<int64_t>& new_id;  // new reference ID indexed by old, -1 if dropped
+        struct Counts { 
+            Counts(void) : n_mates_derefd(0) { }
+            int64_t n_mates_derefd; 
+            char    pad[56];  // one cache line per worker
+        };
+        vector<Counts> counts;
+
+};
+
+
+//-------------------------------------
+
+
+bool
+RereferenceTransform::Apply(RawRecord& rec, int worker)
+{
+    // edits are made in place, within the pipeline's batch.  An unmapped read
+    // placed with its mate carries the mate's reference ID, and so does the
+    // mate of an unmapped read, so IDs are changed whether mapped or not
+    if (rec.RefID() >= 0) {
+        assert(! rec.IsMapped() || new_id[rec.RefID()] >= 0);  // mentions are kept
+        rec.SetRefID(new_id[rec.RefID()]);
+    }
+    if (rec.MateRefID() >= 0) {
+        if (new_id[rec.MateRefID()] < 0 && rec.IsPaired() && rec.IsMateMapped())
+            ++counts[worker].n_mates_derefd;  // mate ref is now unavailable
+        rec.SetMateRefID(new_id[rec.MateRefID()]);
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// records whose IDs are kept as they are pass through byte for byte, which
+// lets the pipeline copy whole BGZF blocks of them without recompressing
+bool
+RereferenceTransform::Unchanged(const RawRecord& rec) const
+{
+    return (rec.RefID() < 0 || new_id[rec.RefID()] == rec.RefID())
+        && (rec.MateRefID() < 0 || new_id[rec.MateRefID()] == rec.MateRefID());
+}
+
+
+//-------------------------------------
+
+
+int64_t
+RereferenceTransform::MatesDereferenced(void) const
+{
+    int64_t n = 0;
+    for (size_t i = 0; i < counts.size(); ++i)
+        n += counts[i].n_mates_derefd;
+    return n;
+}
+
+
+//-------------------------------------
+
+
 int 
 yoruba::main_gbagbe(int argc, char* argv[])
 {
-    SamProgram new_program;
+    //----------------- Command-line options
+
+	if( argc < 2 ) {
+		return usage();
+	}
+
+    if (parseOptions(argc, argv, false) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    readList();
+
+
+    //----------------- Open input BAM
+
+
+    ScopedPhase phase_open("open");
+
+    RawBamReader reader;
+
+    // input from a pipe is kept for pass 2, in memory and then on disk
+    reader.SetSpill(spill_dir, size_t(opt_spill_memory) << 20);
+
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass1] opening input BAM and reading references..." << endl;
+
+    if (! reader.Open(input_file)) {
+        cerr << NAME << "[pass1] could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    if (reader.GetReferenceCount() == 0) {
+        cerr << NAME << "[pass1] no reference sequences found in BAM header" << endl;
+        reader.Close();
+        return EXIT_FAILURE;
+    }
+
+
+    phase_open.End();
+
 
+    //----------------- Pass 1: Determine which references are used
+
+
+    ScopedPhase phase_pass1("pass1");
+
+    if (true || opt_progress || DEBUG(1))
+        cerr << NAME << "[pass1] " << reader.GetReferenceCount() 
+            << " references in the input BAM" << endl;
+
+    refs_mentioned.assign(reader.GetReferenceCount(), 0);
+    refs_mentioned_mate.assign(reader.GetReferenceCount(), 0);
+
+    int64_t n_reads = 0;  // number of reads processed
+    RawRecord rec;  // holds the current read from the BAM file
+    Progress progress;
+
+    progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+
+    while (reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
+
+        ++n_reads;
+        countReferences(rec);
+        progress.Add(rec, reader.Tell());
+ 
+    }
+    progress.Stop();
+    if (reader.Failed()) {
+        cerr << NAME << "[pass1] error reading input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass1] " << n_reads << " reads examined" << endl;
+    phase_pass1.End();
+
+
+    //----------------- Pass 2: Create new reference set and header
+
+
+    SamHeader new_header = reader.GetHeader();
+    RefVector new_refs = reader.GetReferenceData();
+
+    if (! forgetReferences(new_header, new_refs))
+        return EXIT_FAILURE;
+
+    if (opt_usageonly) {
+	    reader.Close();
+        cerr << NAME << " no output BAM produced (--usage-only)" << endl;
+	    return EXIT_SUCCESS;
+    }
+
+
+    //----------------- Pass 2: Second pass through reads, write new BAM file
+
+
+    ScopedPhase phase_pass2("pass2");
+
+    RawBamWriter writer;
+
+    IF_DEBUG(2) {
+        cerr << "********* BEGIN new_header.ToString()" << endl;
+        cerr << new_header.ToString();
+        cerr << "********* END   new_header.ToString()" << endl;
+    }
+
+
+    if (! output_opts.Open(writer, output_file, new_header, new_refs)) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    int64_t n_reads_pass1 = n_reads;
+
+    if (reader.IsSpilling() && (opt_progress || DEBUG(1)))
+        cerr << NAME << "[pass2] replaying input, " << (reader.SpilledToDisk() >> 20) 
+            << " MB of it from the spill file" << endl;
+    if (! reader.Rewind()) {
+        cerr << NAME << "[pass2] could not rewind input" << endl;
+        return EXIT_FAILURE;
+    }
+
+    RereferenceTransform transform(refs_mentioned, opt_threads);
+    Pipeline pipeline(reader, writer, transform, opt_threads);
+
+    pipeline.SetMaxRecords(opt_reads);
+    progress.Start(NAME "[pass2]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+    pipeline.SetProgress(&progress);
+    // runs of unchanged references are copied still compressed, unless the
+    // output compression was asked for
+    pipeline.SetPassthrough(! output_opts.LevelSet());
+
+    if (! pipeline.Run()) {
+        cerr << NAME << "[pass2] error while rereferencing reads" << endl;
+        return EXIT_FAILURE;
+    }
+    progress.Stop();
+    n_reads = pipeline.RecordsRead();
+    int64_t n_mates_derefd = transform.MatesDereferenced();
+
+    if (true || opt_progress || DEBUG(1)) {
+        cerr << NAME << "[pass2] " << n_reads << " reads rereferenced";
+        if (! opt_mate)
+            cerr << ", "<< n_mates_derefd << " mates dereferenced";
+        cerr << endl;
+    }
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] " << pipeline.BlocksCopied() 
+            << " BGZF blocks of unchanged reads copied without recompressing" << endl;
+    assert(n_reads == n_reads_pass1);
+    Stats::Count("gbagbe_mates_dereferenced", n_mates_derefd);
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+    if (! writer.Close())
+        return EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+// parse options into the file-static option variables; in_run is true for
+// a step of 'yoruba run', which does its own input and output
+static int
+parseOptions(int argc, char* argv[], bool in_run)
+{
     new_program.ID = YORUBA_NAME;
     new_program.ID = new_program.ID + " " + argv[0];
     new_program.Name = YORUBA_NAME;
@@ -145,13 +428,9 @@ yoruba::main_gbagbe(int argc, char* argv[])
     for (int i = 0; i < argc; ++i)
         new_program.CommandLine = new_program.CommandLine + " " + argv[i];
 
-    //----------------- Command-line options
-
-	if( argc < 2 ) {
-		return usage();
-	}
-    
-    enum { OPT_output, OPT_nomate, OPT_usageonly, OPT_usagefile, OPT_list,
+    enum { OPT_output, OPT_nomate, OPT_usageonly, OPT_usagefile, OPT_list, OPT_threads,
+        OPT_level, OPT_uncompressed, OPT_writeindex, OPT_checksum, OPT_checksumexclude,
+        OPT_region, OPT_regions, OPT_spilldir, OPT_spillmemory,
 #ifdef _WITH_DEBUG
         OPT_debug, OPT_reads, OPT_progress,
 #endif
@@ -165,8 +444,21 @@ yoruba::main_gbagbe(int argc, char* argv[])
         { OPT_help,            "-?",                SO_NONE }, 
         { OPT_list,            "--list",            SO_REQ_SEP },
         { OPT_list,            "-L",                SO_REQ_SEP },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
         { OPT_output,          "--output",          SO_REQ_SEP },
         { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_spilldir,        "--spill-dir",       SO_REQ_SEP },
+        { OPT_spillmemory,     "--spill-memory",    SO_REQ_SEP },
 #ifdef _WITH_DEBUG
         { OPT_debug,           "--debug",           SO_REQ_SEP },
         { OPT_reads,           "--reads",           SO_REQ_SEP },
@@ -192,8 +484,32 @@ yoruba::main_gbagbe(int argc, char* argv[])
             usage_file = args.OptionArg();
         } else if (args.OptionId() == OPT_list) {
             list_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
         } else if (args.OptionId() == OPT_output) {
             output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_spilldir) {
+            spill_dir = args.OptionArg();
+        } else if (args.OptionId() == OPT_spillmemory) {
+            opt_spill_memory = strtoll(args.OptionArg(), NULL, 10);
 #ifdef _WITH_DEBUG
         } else if (args.OptionId() == OPT_debug) {
             opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
@@ -211,28 +527,59 @@ yoruba::main_gbagbe(int argc, char* argv[])
     if (DEBUG(1) && ! opt_progress)
         opt_progress = debug_progress;
 
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+
+    if (in_run) {
+        if (args.FileCount() > 0 || ! output_file.empty() || opt_usageonly || output_opts.WriteIndex()
+            || ! checksum_file.empty() || ! regions.Empty()) {
+            cerr << NAME << " input, output, regions, --usage-only, --write-index and --checksum are for 'yoruba run', not its steps" << endl;
+            return usage();
+        }
+        return EXIT_SUCCESS;
+    }
+
     if (args.FileCount() > 1) {
         cerr << NAME << " requires at most one BAM file specified as input" << endl;
         return usage();
     } else if (args.FileCount() == 1) {
         input_file = args.File(0);
-    } else if (input_file.empty()) {
-        cerr << NAME << " can't currently read from stdin, ask Doug about it" << endl;
-        return EXIT_FAILURE;
+    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
         input_file = "/dev/stdin";
     }
+    if (opt_spill_memory < 0) {
+        cerr << NAME << " --spill-memory must be at least 0" << endl;
+        return usage();
+    }
 
     // set up output; if file not specified, use stdout or its equivalent
-    if (output_file.empty()) {
+    if (output_file.empty() && output_opts.WriteIndex() && ! opt_usageonly) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
         output_file = "/dev/stdout";
     }
 
+    return EXIT_SUCCESS;
+}
 
-    //----------------- If --list option used, open file and read in list of references.
 
-    //typedef std::tr1::unordered_map<string, int32_t> bedMap;
-    typedef std::tr1::unordered_map<string, bool> nameMap;
-    nameMap name_map;
+//-------------------------------------
+
+
+// if --list option used, open file and read in list of references
+static void
+readList(void)
+{
     // I can do much better than this...
     if (! list_file.empty()) {
         if (opt_progress || DEBUG(1))
@@ -256,107 +603,48 @@ yoruba::main_gbagbe(int argc, char* argv[])
         }
         list_stream.close();
     }
+}
 
 
-    //----------------- Open input BAM, create header for output BAM
-
-
-	BamReader reader;
-
-    if (opt_progress || DEBUG(1))
-        cerr << NAME << "[pass1] opening input BAM and reading references..." << endl;
-
-	if (! reader.Open(input_file)) {
-        cerr << NAME << "[pass1] could not open BAM input" << endl;
-        return EXIT_FAILURE;
-    }
-
-    if (reader.GetReferenceCount() == 0) {
-        cerr << NAME << "[pass1] no reference sequences found in BAM header" << endl;
-        reader.Close();
-        return EXIT_FAILURE;
-    }
-
-#ifdef _IF_BAMTOOLS_IS_BROKEN
-    SamHeader header = reader.GetHeader();
-#else
-    const SamHeader& header = reader.GetConstSamHeader();
-#endif
-
-    //----------------- Create the header for the new BAM
-
-    SamHeader new_header;
-
-    new_header.Version = header.Version;
-    new_header.SortOrder = header.SortOrder;
-    new_header.GroupOrder = header.GroupOrder;
+//-------------------------------------
 
-    new_header.ReadGroups = header.ReadGroups;
 
-    for (SamProgramConstIterator pcI = header.Programs.ConstBegin(); 
-            pcI != header.Programs.End(); ++pcI) {
-        if (pcI->ID != new_program.ID) {
-            // I would prefer to use duplicate program IDs in the SAM header,
-            // if the same program worked over the file twice or more, but the
-            // SAM spec says no, so move this one to last if it's already there
-            SamProgram this_program = *pcI;  // workaround for weird overloading issue
-            new_header.Programs.Add(this_program);
+// pass 1: note the references mentioned by a read and its mate
+static void
+countReferences(const RawRecord& rec)
+{
+    if (rec.IsMapped()) {
+        if (rec.RefID() < 0) {
+            ++n_unref_mentioned;
+            // cerr << NAME << "[pass1] missing reference sequence from input bam" << endl;
+            // return EXIT_FAILURE;
+        } else {
+            ++refs_mentioned[rec.RefID()];
         }
     }
-    new_header.Programs.Add(new_program);
-
-    new_header.Comments = header.Comments;
-
-
-    //----------------- Pass 1: Determine which references are used
-
-
-    if (true || opt_progress || DEBUG(1))
-        cerr << NAME << "[pass1] " << reader.GetReferenceCount() 
-            << " references in the input BAM" << endl;
-
-    vector<int64_t> refs_mentioned( reader.GetReferenceCount() );
-    vector<int64_t> refs_mentioned_mate( reader.GetReferenceCount() );
-    int64_t n_unref_mentioned = 0;
-    int64_t n_unref_mentioned_mate = 0;
-
-    int64_t n_reads = 0;  // number of reads processed
-	BamAlignment al;  // holds the current read from the BAM file
-
-	while (reader.GetNextAlignmentCore(al) && (opt_reads < 0 || n_reads < opt_reads)) {
-
-        ++n_reads;
-        if (al.IsMapped()) {
-            if (al.RefID < 0) {
-                ++n_unref_mentioned;
-                // cerr << NAME << "[pass1] missing reference sequence from input bam" << endl;
-                // return EXIT_FAILURE;
-            } else {
-                ++refs_mentioned[al.RefID];
-            }
-        }
-        if (al.IsPaired() && al.IsMateMapped() && al.MateRefID >= 0) {
-            // an unmapped mate has our RefID and Position, so not a reference "use"
-            ++refs_mentioned_mate[al.MateRefID];
-        } else if (al.IsPaired() && al.IsMateMapped() && al.MateRefID < 0) {
-            // if a reference is missing for a mapped mate then MateRefID == -1,
-            ++n_unref_mentioned_mate;
-        }
-        // FIXME handle at least a subset of reference mentions within tags
-
-        if ((opt_progress || DEBUG(1)) && n_reads % opt_progress == 0)
-            cerr << NAME << "[pass1] " << n_reads << " reads examined..." << endl;
- 
-	}
-    if (opt_progress || DEBUG(1))
-        cerr << NAME << "[pass1] " << n_reads << " reads examined" << endl;
+    if (rec.IsPaired() && rec.IsMateMapped() && rec.MateRefID() >= 0) {
+        // an unmapped mate has our RefID and Position, so not a reference "use"
+        ++refs_mentioned_mate[rec.MateRefID()];
+    } else if (rec.IsPaired() && rec.IsMateMapped() && rec.MateRefID() < 0) {
+        // if a reference is missing for a mapped mate then MateRefID == -1,
+        ++n_unref_mentioned_mate;
+    }
+    // FIXME handle at least a subset of reference mentions within tags
+}
 
 
-    //----------------- Pass 2: Create new reference set
+//-------------------------------------
 
 
-    const RefVector& old_refs = reader.GetReferenceData();
-    RefVector        new_refs;
+// pass 2: decide which references to keep, given the counts from pass 1 and
+// --list, and rewrite the header and references to match.  Afterwards
+// refs_mentioned[old ID] holds the new reference ID, or -1 if not kept.
+static bool
+forgetReferences(SamHeader& header, RefVector& refs)
+{
+    const RefVector  old_refs = refs;
+    RefVector&       new_refs = refs;
+    new_refs.clear();
     int32_t          n_refs_mention = 0;
     int32_t          n_refs_mate = 0;
     int32_t          n_refs_mate_not_kept = 0;
@@ -364,7 +652,7 @@ yoruba::main_gbagbe(int argc, char* argv[])
 
     vector<refStats> refs_stats; // don't allocate vector if not needed
     if (! usage_file.empty()) {
-        refs_stats.resize(reader.GetReferenceCount() + 1);
+        refs_stats.resize(old_refs.size() + 1);
         size_t i_unref = refs_stats.size() - 1;  // last entry, for mentions of ref -1
         for (size_t i = 0; i < refs_mentioned.size(); ++i) {
             refs_stats[i].ref = old_refs[i].RefName;
@@ -384,7 +672,24 @@ yoruba::main_gbagbe(int argc, char* argv[])
         refs_stats[i_unref].new_id = -1;
     }
 
-    assert(new_header.Sequences.IsEmpty());  // new_refs contains the new @SQ info
+    // the @SQ lines are rebuilt to match new_refs
+    SamSequenceDictionary old_sequences = header.Sequences;
+    header.Sequences.Clear();
+
+    // I would prefer to use duplicate program IDs in the SAM header, if the
+    // same program worked over the file twice or more, but the SAM spec says
+    // no, so move this one to last if it's already there
+    const SamProgramChain old_programs = header.Programs;
+    header.Programs.Clear();
+    for (SamProgramConstIterator pcI = old_programs.ConstBegin(); 
+            pcI != old_programs.ConstEnd(); ++pcI) {
+        if (pcI->ID != new_program.ID) {
+            SamProgram this_program = *pcI;  // workaround for weird overloading issue
+            header.Programs.Add(this_program);
+        }
+    }
+    header.Programs.Add(new_program);
+
     int32_t new_RefID = 0;
     for (size_t i = 0; i < refs_mentioned.size(); ++i) {
 
@@ -402,17 +707,17 @@ yoruba::main_gbagbe(int argc, char* argv[])
 
             new_refs.push_back(old_refs[i]);
 #if defined(_BAMTOOLS_EXTENSION)  && ! defined(_IF_BAMTOOLS_IS_BROKEN)
-            SamSequenceConstIterator refI = header.Sequences.ConstFind(old_refs[i].RefName);
-            if (refI == header.Sequences.ConstEnd()) {
+            SamSequenceConstIterator refI = old_sequences.ConstFind(old_refs[i].RefName);
+            if (refI == old_sequences.ConstEnd()) {
                 cerr << NAME << "[pass2] internal error, " << old_refs[i].RefName 
                     << " not found in the input header" << endl;
-                return EXIT_FAILURE;
+                return false;
             }
             const SamSequence& existing_ref = (*refI);
 #else
-            const SamSequence& existing_ref = header.Sequences[old_refs[i].RefName];
+            const SamSequence& existing_ref = old_sequences[old_refs[i].RefName];
 #endif
-            new_header.Sequences.Add(existing_ref);
+            header.Sequences.Add(existing_ref);
             refs_mentioned[i] = new_RefID;  // entry now contains new reference ID
             ++new_RefID;
 
@@ -456,11 +761,11 @@ yoruba::main_gbagbe(int argc, char* argv[])
                 << "  LN:" << new_refs[i].RefLength << endl;
         }
         IF_DEBUG(3) {
-            SamSequenceConstIterator sscI = new_header.Sequences.ConstBegin();
-            if (sscI == new_header.Sequences.ConstEnd()) {
+            SamSequenceConstIterator sscI = header.Sequences.ConstBegin();
+            if (sscI == header.Sequences.ConstEnd()) {
                 cerr << NAME "[pass2] no entries in new_header.Sequences" << endl;
             } else {
-                for (; sscI != new_header.Sequences.ConstEnd(); ++sscI)
+                for (; sscI != header.Sequences.ConstEnd(); ++sscI)
                     cerr << NAME << "[pass2] new_header " << " Sequences RefName=" << sscI->Name
                         << "  RefLength=" << sscI->Length << endl;
             }
@@ -485,82 +790,63 @@ yoruba::main_gbagbe(int argc, char* argv[])
         cerr << NAME << " per-reference usage in " << usage_file << " (--usage-file)" << endl;
     }
 
-    if (opt_usageonly) {
-	    reader.Close();
-        cerr << NAME << " no output BAM produced (--usage-only)" << endl;
-	    return EXIT_SUCCESS;
-    }
-
-
-    //----------------- Pass 2: Second pass through reads, write new BAM file
-
+    return true;
+}
 
-    BamWriter writer;
 
-    IF_DEBUG(2) {
-        cerr << "********* BEGIN new_header.ToString()" << endl;
-        cerr << new_header.ToString();
-        cerr << "********* END   new_header.ToString()" << endl;
-    }
+//-------------------------------------
 
 
-    if (! writer.Open(output_file, new_header, new_refs)) {
-        cerr << NAME << " could not open output " << output_file << endl;
-        return EXIT_FAILURE;
-    }
+// gbagbe as a step of 'yoruba run'; its pass 1 counts mentions as records
+// reach it, its header rewrite forgets unmentioned references, and its
+// transform rereferences the reads
 
-    int64_t n_reads_pass1 = n_reads;
-    n_reads = 0;
-    int64_t n_reads_rerefd = 0;  // number of reads given re-references
-    int64_t n_mates_derefd = 0;  // number of mates that have references removed
+class GbagbeStep : public RunStep {
 
-    reader.Rewind();
+    public:
+        GbagbeStep(void) : transform(NULL) { }
+        virtual ~GbagbeStep(void) { delete transform; }
 
-	while (reader.GetNextAlignmentCore(al) && (opt_reads < 0 || n_reads < opt_reads)) {
+        virtual int ParseOptions(int argc, char* argv[]) {
+            if (parseOptions(argc, argv, true) != EXIT_SUCCESS)
+                return EXIT_FAILURE;
+            readList();
+            return EXIT_SUCCESS;
+        }
+        virtual bool NeedsPass1(void) const { return true; }
+        virtual bool BeginPass1(const RefVector& refs) {
+            refs_mentioned.assign(refs.size(), 0);
+            refs_mentioned_mate.assign(refs.size(), 0);
+            return true;
+        }
+        virtual bool Pass1(const RawRecord& rec) { countReferences(rec); return true; }
+        virtual bool RewriteHeader(SamHeader& header, RefVector& refs) {
+            return forgetReferences(header, refs);
+        }
+        virtual RecordTransform& Transform(int n_workers) {
+            delete transform;
+            transform = new RereferenceTransform(refs_mentioned, n_workers);
+            return *transform;
+        }
+        virtual bool Finish(void) {
+            if (! opt_mate)
+                cerr << NAME << "[pass2] " << transform->MatesDereferenced() 
+                    << " mates dereferenced" << endl;
+            return true;
+        }
 
-        ++n_reads;
+    private:
+        RereferenceTransform* transform;
 
-        if (al.IsMapped()) {
-            assert(al.RefID >= 0);  // it was valid before...
-            if (al.RefID != refs_mentioned[al.RefID]) {  // the reference ID is different
-                ++n_reads_rerefd;  // strictly rereferenced
-                if (al.IsPaired()) {
-                    if (al.MateRefID == al.RefID
-                        || refs_mentioned[al.MateRefID] >= 0) {
-                        // update the mate RefID
-                        al.MateRefID = refs_mentioned[al.MateRefID];
-                    } else if (al.IsMateMapped()) {
-                        // mate ref is now unavailable
-                        al.MateRefID = -1;
-                        ++n_mates_derefd;
-                    }
-                }
-                al.RefID = refs_mentioned[al.RefID];
-                assert(al.RefID >= 0);  // and it is valid after
-            }
-        }
+};
 
-        writer.SaveAlignment(al);
 
-        if (opt_progress && n_reads % opt_progress == 0) {
-            cerr << NAME << "[pass2] " << n_reads << " reads rereferenced";
-            if (! opt_mate)
-                cerr << ", "<< n_mates_derefd << " mates dereferenced";
-            cerr << "..." << endl;
-        }
- 
-	}
-    if (true || opt_progress || DEBUG(1)) {
-        cerr << NAME << "[pass2] " << n_reads << " reads rereferenced";
-        if (! opt_mate)
-            cerr << ", "<< n_mates_derefd << " mates dereferenced";
-        cerr << endl;
-    }
-    assert(n_reads == n_reads_pass1);
+//-------------------------------------
 
-	reader.Close();
-	writer.Close();
 
-	return EXIT_SUCCESS;
+RunStep*
+yoruba::newGbagbeStep(void)
+{
+    return new GbagbeStep;
 }
 
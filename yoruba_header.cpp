@@ -0,0 +1,142 @@
+// yoruba_header.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// SAM header text with the @SQ lines left unparsed, see yoruba_header.h
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+
+#include <cstring>
+
+#include "yoruba_header.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+
+//-------------------------------------
+
+
+// one pass over the text, keeping where each @SQ line starts and collecting
+// the other lines for BamTools to parse
+void
+RawHeader::SetText(const string& t)
+{
+    text = t;
+    sq.clear();
+    names_indexed = false;
+    names = StringTable();
+    name_line.clear();
+
+    string rest;
+    for (size_t start = 0; start < text.length(); ) {
+        size_t end = text.find('\n', start);
+        size_t next = (end == string::npos) ? text.length() : end + 1;
+        if (text.compare(start, 3, "@SQ") == 0)
+            sq.push_back(uint32_t(start));
+        else
+            rest.append(text, start, next - start);
+        start = next;
+    }
+    meta.SetHeaderText(rest);
+}
+
+
+//-------------------------------------
+
+
+string
+RawHeader::SequenceLine(size_t i) const
+{
+    size_t end = text.find('\n', sq[i]);
+    if (end == string::npos)
+        end = text.length();
+    return text.substr(sq[i], end - sq[i]);
+}
+
+
+//-------------------------------------
+
+
+long
+RawHeader::FindSequence(const string& name) const
+{
+    if (! names_indexed) {
+        for (size_t i = 0; i < sq.size(); ++i) {
+            const char* line = text.data() + sq[i];
+            const char* text_end = text.data() + text.length();
+            const char* end = static_cast<const char*>(memchr(line, '\n', text_end - line));
+            if (end == NULL)
+                end = text_end;
+            for (const char* p = line; p + 3 < end; ++p) {
+                if (p[0] == '\t' && p[1] == 'S' && p[2] == 'N' && p[3] == ':') {
+                    const char* sn = p + 4;
+                    const char* sn_end = static_cast<const char*>(memchr(sn, '\t', end - sn));
+                    if (sn_end == NULL)
+                        sn_end = end;
+                    if (names.Add(sn, sn_end - sn) == int(name_line.size()))
+                        name_line.push_back(i);  // the first line with this name
+                    break;
+                }
+            }
+        }
+        names_indexed = true;
+    }
+    int n = names.Find(name);
+    return n < 0 ? -1 : long(name_line[n]);
+}
+
+
+//-------------------------------------
+
+
+void
+RawHeader::AddSequenceLine(const string& line)
+{
+    if (! text.empty() && text[text.length() - 1] != '\n')
+        text += '\n';
+    sq.push_back(uint32_t(text.length()));
+    text += line;
+    text += '\n';
+    if (names_indexed) {  // index again when next asked
+        names_indexed = false;
+        names = StringTable();
+        name_line.clear();
+    }
+}
+
+
+//-------------------------------------
+
+
+string
+RawHeader::ToString(const SamHeader& m) const
+{
+    string meta_text = m.ToString();
+    size_t hd_end = 0;  // BamTools writes @HD first, and then would come @SQ
+    if (meta_text.compare(0, 3, "@HD") == 0) {
+        hd_end = meta_text.find('\n');
+        hd_end = (hd_end == string::npos) ? meta_text.length() : hd_end + 1;
+    }
+
+    string s;
+    s.reserve(text.length() + meta_text.length());
+    s.append(meta_text, 0, hd_end);
+    if (hd_end > 0 && s[s.length() - 1] != '\n')
+        s += '\n';
+    for (size_t i = 0; i < sq.size(); ++i) {
+        size_t end = text.find('\n', sq[i]);
+        if (end == string::npos)
+            end = text.length();
+        s.append(text, sq[i], end - sq[i]);
+        s += '\n';
+    }
+    s.append(meta_text, hd_end, string::npos);
+    return s;
+}
+
@@ -0,0 +1,79 @@
+// yoruba_header.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_header.cpp
+//
+// RawHeader keeps the SAM header text of a BAM as it was read.  BamTools
+// parses every line of the text into SamHeader objects, which for assemblies
+// with millions of references means millions of SamSequences, tens of
+// seconds and gigabytes before the first record is read.  Commands that only
+// change read groups or programs never look at the @SQ lines, and the binary
+// reference list after the text already gives each reference's name and
+// length, so here only the other lines are parsed.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_HEADER_H_
+#define _YORUBA_HEADER_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/SamHeader.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+
+namespace yoruba {
+
+// The @HD, @RG, @PG and @CO lines are parsed into Meta(), a SamHeader whose
+// Sequences are empty, which is changed as a SamHeader would be.  The @SQ
+// lines are only found, as offsets into the text, and are written back out
+// as they are by ToString().  FindSequence() indexes them by name when first
+// called, which is not thread-safe; nothing else changes a const RawHeader.
+
+class RawHeader {
+
+    public:
+        RawHeader(void) : names_indexed(false) { }
+        explicit RawHeader(const std::string& t) : names_indexed(false) { SetText(t); }
+
+        void        SetText(const std::string& t);
+
+        // @HD, @RG, @PG and @CO, parsed
+        BamTools::SamHeader&        Meta(void) { return meta; }
+        const BamTools::SamHeader&  Meta(void) const { return meta; }
+
+        size_t      SequenceCount(void) const { return sq.size(); }
+        std::string SequenceLine(size_t i) const;  // without its newline
+        // the @SQ line with SN:name, -1 if there is none
+        long        FindSequence(const std::string& name) const;
+        void        AddSequenceLine(const std::string& line);
+
+        // the header text: meta's @HD line, then the @SQ lines, then the
+        // rest of meta, by default that of this header
+        std::string ToString(void) const { return ToString(meta); }
+        std::string ToString(const BamTools::SamHeader& m) const;
+        // the whole header parsed by BamTools, the cost RawHeader avoids;
+        // only for the rare command that needs the SamSequences
+        BamTools::SamHeader ToSamHeader(void) const { return BamTools::SamHeader(ToString()); }
+
+    private:
+        std::string                 text;   // as given, and then any added @SQ lines
+        std::vector<uint32_t>       sq;     // offset of each @SQ line in text
+        BamTools::SamHeader         meta;
+
+        mutable bool                names_indexed;
+        mutable StringTable         names;      // SN values, indexed on first FindSequence()
+        mutable std::vector<size_t> name_line;  // the @SQ line of each name
+
+};  // class RawHeader
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_HEADER_H_
@@ -20,6 +20,7 @@
 // FastQ file writing
 // debugging options
 // lightweight alignment class to reduce memory usage?
+// fetch the mates of link pair candidates with MateFetcher, rather than holding reads in read1Map
 //
 // Command line options
 //
@@ -0,0 +1,780 @@
+// yoruba_index.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// BAM index (BAI and CSI) construction as records are written.
+//
+// Both formats are described in the SAM specification
+// (http://samtools.github.io/hts-specs/SAMv1.pdf).  Each reference has a set
+// of bins, each bin a list of chunks of the file, and a pseudo-bin with the
+// span of the reference's records and its mapped and unmapped counts.  BAI
+// adds a linear index of the first record in each 16kb window; CSI instead
+// gives each bin the offset of the first record overlapping its first window.
+// As in htslib, consecutive records in the same bin form one chunk, and a
+// chunk that starts in the BGZF block where the last one ended extends it.
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- merge sparse bins into their parents, as htslib does, for smaller indices
+
+#include <algorithm>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <fstream>
+#include <iostream>
+#include <sstream>
+
+#include "yoruba_index.h"
+#include "yoruba_bgzf.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+// BAI bins are fixed for 2^29 bp; samtools pads lengths by 256 when sizing CSI
+static const int64_t BAI_MAX_LENGTH = int64_t(1) << 29;
+static const int64_t CSI_LENGTH_PAD = 256;
+
+const uint64_t BamIndexBuilder::UNSET;
+const uint32_t BamIndexBuilder::NO_BIN;
+
+template<typename T> static inline void
+put(string& s, T v)
+{
+    s.append(reinterpret_cast<const char*>(&v), sizeof(v));
+}
+
+
+//-------------------------------------
+
+
+void
+BamIndexBuilder::Start(const RefVector& references)
+{
+    int64_t max_length = 0;
+    for (size_t i = 0; i < references.size(); ++i)
+        max_length = max(max_length, int64_t(references[i].RefLength));
+
+    min_shift = 14;
+    if (max_length < BAI_MAX_LENGTH) {
+        csi = false;
+        n_levels = 5;
+    } else {
+        csi = true;
+        int64_t span = int64_t(1) << min_shift;
+        for (n_levels = 0; max_length + CSI_LENGTH_PAD > span; ++n_levels)
+            span <<= 3;
+    }
+
+    refs.clear();
+    refs.resize(references.size());
+    sorted = true;
+    first_ref = last_ref = -2;
+    first_pos = last_pos = -1;
+    chunk_bin = NO_BIN;
+    chunk_begin = last_end = 0;
+    n_no_coor = 0;
+}
+
+
+//-------------------------------------
+
+
+bool
+BamIndexBuilder::Add(const RawRecord& rec, int64_t voffset_begin, int64_t voffset_end)
+{
+    if (! sorted)
+        return false;
+
+    int32_t ref = rec.RefID();
+    int32_t pos = rec.Position();
+    if (ref >= int32_t(refs.size()) || ref < -1
+        || ! isCoordinateSorted(ref, pos, last_ref, last_pos)) {
+        sorted = false;
+        return false;
+    }
+    if (first_ref == -2) {
+        first_ref = ref;
+        first_pos = pos;
+    }
+
+    if (ref < 0) {  // unplaced reads are only counted
+        if (last_ref >= 0)
+            endReference();
+        ++n_no_coor;
+        last_ref = ref;
+        last_pos = pos;
+        last_end = voffset_end;
+        return true;
+    }
+
+    // as in samtools, an unmapped or zero-length record covers one base
+    int64_t begin = max(pos, 0);
+    int64_t end = rec.IsMapped() ? rec.EndPosition() : begin + 1;
+    if (end <= begin)
+        end = begin + 1;
+    uint32_t bin = reg2bin(begin, end);
+
+    RefIndex& r = refs[ref];
+    if (ref != last_ref) {
+        if (last_ref >= 0)
+            endReference();
+        r.seen = true;
+        r.off_begin = voffset_begin;
+        chunk_bin = bin;
+        chunk_begin = voffset_begin;
+    } else if (bin != chunk_bin) {
+        if (chunk_bin != NO_BIN)
+            addChunk(chunk_bin, chunk_begin, voffset_begin);
+        chunk_bin = bin;
+        chunk_begin = voffset_begin;
+    }
+
+    if (rec.IsMapped()) {
+        size_t w_begin = size_t(begin >> min_shift);
+        size_t w_end = size_t((end - 1) >> min_shift);
+        if (r.linear.size() <= w_end)
+            r.linear.resize(w_end + 1, UNSET);
+        for (size_t w = w_begin; w <= w_end; ++w)
+            if (r.linear[w] == UNSET)
+                r.linear[w] = voffset_begin;
+        ++r.n_mapped;
+    } else {
+        ++r.n_unmapped;
+    }
+
+    last_ref = ref;
+    last_pos = pos;
+    last_end = voffset_end;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+BamIndexBuilder::endReference(void)
+{
+    if (chunk_bin != NO_BIN)
+        addChunk(chunk_bin, chunk_begin, last_end);
+    chunk_bin = NO_BIN;
+    refs[last_ref].off_end = last_end;
+}
+
+
+//-------------------------------------
+
+
+bool
+BamIndexBuilder::Append(BamIndexBuilder& shard, uint64_t coffset)
+{
+    if (! sorted || ! shard.sorted || shard.refs.size() != refs.size()) {
+        sorted = false;
+        return false;
+    }
+    if (shard.last_ref == -2)  // no records
+        return true;
+    if (! isCoordinateSorted(shard.first_ref, shard.first_pos, last_ref, last_pos)) {
+        sorted = false;
+        return false;
+    }
+    if (last_ref >= 0)
+        endReference();
+    if (shard.last_ref >= 0)
+        shard.endReference();
+
+    const uint64_t shift = coffset << 16;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        RefIndex& r = refs[i];
+        const RefIndex& s = shard.refs[i];
+        if (! s.seen)
+            continue;
+        for (map<uint32_t, vector<Chunk> >::const_iterator it = s.bins.begin(); it != s.bins.end(); ++it) {
+            vector<Chunk>& chunks = r.bins[it->first];
+            for (size_t j = 0; j < it->second.size(); ++j) {
+                Chunk c;
+                c.begin = it->second[j].begin + shift;
+                c.end = it->second[j].end + shift;
+                chunks.push_back(c);
+            }
+        }
+        if (r.linear.size() < s.linear.size())
+            r.linear.resize(s.linear.size(), UNSET);
+        for (size_t w = 0; w < s.linear.size(); ++w)
+            if (r.linear[w] == UNSET && s.linear[w] != UNSET)
+                r.linear[w] = s.linear[w] + shift;
+        if (! r.seen) {
+            r.seen = true;
+            r.off_begin = s.off_begin + shift;
+        }
+        r.off_end = s.off_end + shift;
+        r.n_mapped += s.n_mapped;
+        r.n_unmapped += s.n_unmapped;
+    }
+    n_no_coor += shard.n_no_coor;
+
+    if (first_ref == -2) {
+        first_ref = shard.first_ref;
+        first_pos = shard.first_pos;
+    }
+    last_ref = shard.last_ref;
+    last_pos = shard.last_pos;
+    last_end = shard.last_end + shift;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+BamIndexBuilder::addChunk(uint32_t bin, uint64_t begin, uint64_t end)
+{
+    vector<Chunk>& chunks = refs[last_ref].bins[bin];
+    if (! chunks.empty() && (chunks.back().end >> 16) == (begin >> 16)) {
+        chunks.back().end = end;
+        return;
+    }
+    Chunk c;
+    c.begin = begin;
+    c.end = end;
+    chunks.push_back(c);
+}
+
+
+//-------------------------------------
+
+
+// windows before the first record get the reference's first offset, and
+// later empty windows the offset of the window before them
+void
+BamIndexBuilder::fillLinear(RefIndex& r) const
+{
+    size_t w = 0;
+    for ( ; w < r.linear.size() && r.linear[w] == UNSET; ++w)
+        r.linear[w] = r.off_begin;
+    for ( ; w < r.linear.size(); ++w)
+        if (r.linear[w] == UNSET)
+            r.linear[w] = r.linear[w - 1];
+}
+
+
+//-------------------------------------
+
+
+// the smallest bin holding [begin, end), as hts_reg2bin() in htslib
+uint32_t
+BamIndexBuilder::reg2bin(int64_t begin, int64_t end) const
+{
+    int shift = min_shift;
+    uint32_t first = ((1U << (3 * n_levels)) - 1) / 7;
+    --end;
+    for (int level = n_levels; level > 0; --level, shift += 3, first -= 1U << (3 * level))
+        if ((begin >> shift) == (end >> shift))
+            return first + uint32_t(begin >> shift);
+    return 0;
+}
+
+
+//-------------------------------------
+
+
+// the first window covered by bin
+uint32_t
+BamIndexBuilder::binBottom(uint32_t bin) const
+{
+    int level = 0;
+    for (uint32_t b = bin; b > 0; b = (b - 1) >> 3)
+        ++level;
+    uint32_t first = ((1U << (3 * level)) - 1) / 7;
+    return (bin - first) << (3 * (n_levels - level));
+}
+
+
+//-------------------------------------
+
+
+bool
+BamIndexBuilder::Write(const string& bam_filename)
+{
+    if (! sorted)
+        return false;
+    if (last_ref >= 0) {
+        endReference();
+        last_ref = -1;  // so a second Write() does not end it again
+    }
+
+    string s;
+    if (csi) {
+        s.append("CSI\1", 4);
+        put(s, int32_t(min_shift));
+        put(s, int32_t(n_levels));
+        put(s, int32_t(0));  // no aux data
+    } else {
+        s.append("BAI\1", 4);
+    }
+    put(s, int32_t(refs.size()));
+
+    for (size_t i = 0; i < refs.size(); ++i) {
+        RefIndex& r = refs[i];
+        fillLinear(r);
+        put(s, int32_t(r.bins.size() + (r.seen ? 1 : 0)));
+        for (map<uint32_t, vector<Chunk> >::const_iterator it = r.bins.begin(); it != r.bins.end(); ++it) {
+            put(s, it->first);
+            if (csi) {
+                uint32_t w = binBottom(it->first);
+                put(s, w < r.linear.size() ? r.linear[w] : uint64_t(0));
+            }
+            put(s, int32_t(it->second.size()));
+            for (size_t j = 0; j < it->second.size(); ++j) {
+                put(s, it->second[j].begin);
+                put(s, it->second[j].end);
+            }
+        }
+        if (r.seen) {
+            put(s, metaBin());
+            if (csi)
+                put(s, uint64_t(0));
+            put(s, int32_t(2));
+            put(s, r.off_begin);
+            put(s, r.off_end);
+            put(s, r.n_mapped);
+            put(s, r.n_unmapped);
+        }
+        if (! csi) {
+            put(s, int32_t(r.linear.size()));
+            for (size_t j = 0; j < r.linear.size(); ++j)
+                put(s, r.linear[j]);
+        }
+    }
+    put(s, n_no_coor);
+
+    // CSI is always BGZF-compressed; BAI never is
+    string filename = bam_filename + Suffix();
+    bool ok;
+    if (csi) {
+        BgzfWriter bgzf;
+        ok = bgzf.Open(filename) && bgzf.Write(s.data(), s.length());
+        ok = bgzf.Close() && ok;
+    } else {
+        FILE* f = fopen(filename.c_str(), "wb");
+        ok = f != NULL && fwrite(s.data(), 1, s.length(), f) == s.length();
+        ok = (f != NULL && fclose(f) == 0) && ok;
+    }
+    if (! ok)
+        cerr << "yoruba::BamIndexBuilder: could not write index " << filename
+            << ": " << strerror(errno) << endl;
+    return ok;
+}
+
+
+//-------------------------------------
+//-------------------------------------  BamIndex
+//-------------------------------------
+
+
+template<typename T> static inline bool
+get(const string& s, size_t& p, T& v)
+{
+    if (s.length() - p < sizeof(v))
+        return false;
+    memcpy(&v, s.data() + p, sizeof(v));
+    p += sizeof(v);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+static bool
+readFile(const string& filename, bool bgzf_compressed, string& s)
+{
+    s.clear();
+    char buf[65536];
+    if (bgzf_compressed) {
+        BgzfReader bgzf;
+        if (! bgzf.Open(filename))
+            return false;
+        size_t n;
+        while ((n = bgzf.Read(buf, sizeof(buf))) > 0)
+            s.append(buf, n);
+        bool ok = ! bgzf.Failed();
+        bgzf.Close();
+        return ok;
+    }
+    FILE* f = fopen(filename.c_str(), "rb");
+    if (f == NULL)
+        return false;
+    size_t n;
+    while ((n = fread(buf, 1, sizeof(buf), f)) > 0)
+        s.append(buf, n);
+    bool ok = ! ferror(f);
+    fclose(f);
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+bool
+BamIndex::Load(const string& bam_filename)
+{
+    loaded = false;
+    string stem = bam_filename;
+    if (stem.length() > 4 && stem.compare(stem.length() - 4, 4, ".bam") == 0)
+        stem.erase(stem.length() - 4);
+    const string candidates[4] = { bam_filename + ".bai", bam_filename + ".csi",
+                                   stem + ".bai", stem + ".csi" };
+    for (size_t i = 0; i < 4; ++i) {
+        bool is_csi = (i % 2 == 1);
+        FILE* f = fopen(candidates[i].c_str(), "rb");
+        if (f == NULL)
+            continue;
+        fclose(f);
+        string s;
+        if (! readFile(candidates[i], is_csi, s) || ! parse(s)) {
+            cerr << "yoruba::BamIndex: could not read index " << candidates[i] << endl;
+            return false;
+        }
+        filename = candidates[i];
+        loaded = true;
+        return true;
+    }
+    return false;
+}
+
+
+//-------------------------------------
+
+
+bool
+BamIndex::parse(const string& s)
+{
+    size_t p = 4;
+    int32_t n_ref;
+    if (s.compare(0, 4, "CSI\1") == 0) {
+        int32_t shift, depth, l_aux;
+        if (! get(s, p, shift) || ! get(s, p, depth) || ! get(s, p, l_aux) 
+            || l_aux < 0 || s.length() - p < size_t(l_aux))
+            return false;
+        csi = true;
+        min_shift = shift;
+        n_levels = depth;
+        p += l_aux;
+    } else if (s.compare(0, 4, "BAI\1") == 0) {
+        csi = false;
+        min_shift = 14;
+        n_levels = 5;
+    } else {
+        return false;
+    }
+    if (! get(s, p, n_ref) || n_ref < 0)
+        return false;
+
+    const uint32_t meta_bin = ((1U << (3 * n_levels + 3)) - 1) / 7 + 1;
+    refs.clear();
+    refs.resize(n_ref);
+    for (int32_t i = 0; i < n_ref; ++i) {
+        RefIndex& r = refs[i];
+        int32_t n_bin;
+        if (! get(s, p, n_bin))
+            return false;
+        for (int32_t b = 0; b < n_bin; ++b) {
+            uint32_t bin;
+            uint64_t loffset = 0;
+            int32_t n_chunk;
+            if (! get(s, p, bin) || (csi && ! get(s, p, loffset)) || ! get(s, p, n_chunk) 
+                || n_chunk < 0 || (s.length() - p) / 16 < size_t(n_chunk))
+                return false;
+            if (bin == meta_bin) {
+                if (n_chunk >= 1) {
+                    r.seen = true;
+                    memcpy(&r.off_begin, s.data() + p, 8);
+                    memcpy(&r.off_end, s.data() + p + 8, 8);
+                }
+                if (n_chunk >= 2) {
+                    uint64_t n_mapped, n_unmapped;
+                    memcpy(&n_mapped, s.data() + p + 16, 8);
+                    memcpy(&n_unmapped, s.data() + p + 24, 8);
+                    r.counted = true;
+                    r.n_records = n_mapped + n_unmapped;
+                }
+            } else if (csi) {
+                r.loffset[bin] = loffset;
+            }
+            p += 16 * size_t(n_chunk);
+        }
+        if (! csi) {
+            int32_t n_intv;
+            if (! get(s, p, n_intv) || n_intv < 0 || (s.length() - p) / 8 < size_t(n_intv))
+                return false;
+            r.linear.resize(n_intv);
+            if (n_intv > 0)
+                memcpy(&r.linear[0], s.data() + p, 8 * size_t(n_intv));
+            p += 8 * size_t(n_intv);
+        }
+    }
+    uint64_t n;
+    n_no_coor = get(s, p, n) ? int64_t(n) : -1;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+uint64_t
+BamIndex::Offset(int32_t ref, int32_t pos) const
+{
+    if (ref < 0)
+        return 0;
+
+    // failing anything better, the end of the last reference before with records
+    uint64_t lower = 0;
+    for (int32_t i = min(ref, int32_t(refs.size())) - 1; i >= 0; --i) {
+        if (refs[i].seen) {
+            lower = refs[i].off_end;
+            break;
+        }
+    }
+    if (ref >= int32_t(refs.size()) || ! refs[ref].seen)
+        return lower;
+
+    const RefIndex& r = refs[ref];
+    lower = max(lower, r.off_begin);
+    if (pos < 0)
+        pos = 0;
+    if (! csi) {
+        if (! r.linear.empty())
+            lower = max(lower, r.linear[min(size_t(pos >> min_shift), r.linear.size() - 1)]);
+    } else {
+        // each existing bin holding pos gives the first record to overlap its first window
+        uint32_t first = 0;
+        int shift = min_shift + 3 * n_levels;
+        for (int level = 0; level <= n_levels; ++level, shift -= 3) {
+            map<uint32_t, uint64_t>::const_iterator it = r.loffset.find(first + uint32_t(pos >> shift));
+            if (it != r.loffset.end())
+                lower = max(lower, it->second);
+            first += 1U << (3 * level);
+        }
+    }
+    return lower;
+}
+
+
+//-------------------------------------
+
+
+int64_t
+BamIndex::Records(void) const
+{
+    if (! loaded || n_no_coor < 0)
+        return -1;
+    int64_t n = n_no_coor;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        if (refs[i].seen && ! refs[i].counted)
+            return -1;
+        n += int64_t(refs[i].n_records);
+    }
+    return n;
+}
+
+
+//-------------------------------------
+
+
+void
+BamIndex::Shards(const RefVector& references, size_t n, vector<BamShard>& shards) const
+{
+    shards.clear();
+    BamShard shard;
+    shard.ref = 0;
+    shard.pos = 0;
+    shard.offset = 0;
+    shards.push_back(shard);
+
+    // the compressed span of the placed records, which the shards divide
+    int64_t begin = -1, end = -1;
+    for (size_t i = 0; i < refs.size(); ++i) {
+        if (! refs[i].seen)
+            continue;
+        if (begin < 0)
+            begin = int64_t(refs[i].off_begin >> 16);
+        end = max(end, int64_t(refs[i].off_end >> 16));
+    }
+    if (begin < 0 || n < 2)
+        return;
+
+    int32_t n_refs = int32_t(min(refs.size(), references.size()));
+    int32_t ref = 0;
+    for (size_t k = 1; k < n; ++k) {
+        int64_t target = begin + (end - begin) * int64_t(k) / int64_t(n);
+        while (ref + 1 < n_refs 
+               && (! refs[ref + 1].seen || int64_t(refs[ref + 1].off_begin >> 16) <= target))
+            ++ref;
+        if (! refs[ref].seen)
+            continue;
+
+        // the last window of ref starting at or before target
+        int32_t lo = 0, hi = references[ref].RefLength >> min_shift;
+        while (lo < hi) {
+            int32_t mid = lo + (hi - lo + 1) / 2;
+            if (int64_t(Offset(ref, mid << min_shift) >> 16) <= target)
+                lo = mid;
+            else
+                hi = mid - 1;
+        }
+        shard.ref = ref;
+        shard.pos = lo << min_shift;
+        if (shard.ref < shards.back().ref 
+            || (shard.ref == shards.back().ref && shard.pos <= shards.back().pos))
+            continue;
+        shard.offset = Offset(shard.ref, shard.pos);
+        shards.push_back(shard);
+    }
+}
+
+
+
+//-------------------------------------
+//-------------------------------------  RegionList
+//-------------------------------------
+
+
+// a 1-based coordinate of a region, allowing commas as samtools does
+static bool
+parseCoordinate(const string& s, int64_t& value)
+{
+    string digits;
+    for (size_t i = 0; i < s.length(); ++i)
+        if (s[i] != ',')
+            digits += s[i];
+    if (digits.empty() || digits.length() > 12)
+        return false;
+    char* end = NULL;
+    value = strtoll(digits.c_str(), &end, 10);
+    return *end == '\0' && value >= 1;
+}
+
+
+// reference names, looked up by hash as a BED file may name millions of
+// regions on as many references; ref_of holds the first reference with each
+static void
+tableReferences(const RefVector& refs, StringTable& names, vector<int32_t>& ref_of)
+{
+    for (size_t i = 0; i < refs.size(); ++i)
+        if (names.Add(refs[i].RefName) == int(ref_of.size()))
+            ref_of.push_back(int32_t(i));
+}
+
+
+static int32_t
+findReference(const StringTable& names, const vector<int32_t>& ref_of, const string& name)
+{
+    int i = names.Find(name);
+    return i < 0 ? -1 : ref_of[i];
+}
+
+
+bool
+RegionList::AddBed(const string& filename)
+{
+    ifstream is(filename.c_str());
+    if (! is) {
+        cerr << "yoruba::RegionList: could not open BED file " << filename << endl;
+        return false;
+    }
+    string line;
+    for (int64_t n = 1; getline(is, line); ++n) {
+        if (line.empty() || line[0] == '#' || line.compare(0, 5, "track") == 0
+            || line.compare(0, 7, "browser") == 0)
+            continue;
+        istringstream ss(line);
+        BedRegion r;
+        if (! (ss >> r.name >> r.begin >> r.end) || r.begin < 0 || r.end < r.begin) {
+            cerr << "yoruba::RegionList: malformed BED line " << n << " of " << filename << endl;
+            return false;
+        }
+        bed.push_back(r);
+    }
+    return true;
+}
+
+
+bool
+RegionList::Resolve(const RefVector& refs, vector<Region>& regions) const
+{
+    regions.clear();
+    StringTable names;
+    vector<int32_t> ref_of;
+    tableReferences(refs, names, ref_of);
+
+    for (size_t i = 0; i < specs.size(); ++i) {
+        const string& spec = specs[i];
+        string name = spec;
+        int64_t begin = 1, end = -1;
+        int32_t ref = findReference(names, ref_of, name);
+        size_t colon = spec.rfind(':');
+        if (ref < 0 && colon != string::npos) {
+            name = spec.substr(0, colon);
+            string range = spec.substr(colon + 1);
+            size_t dash = range.find('-');
+            if (! parseCoordinate(range.substr(0, dash), begin)
+                || (dash != string::npos && ! parseCoordinate(range.substr(dash + 1), end))
+                || (end >= 0 && end < begin)) {
+                cerr << "yoruba::RegionList: malformed region '" << spec << "'" << endl;
+                return false;
+            }
+            ref = findReference(names, ref_of, name);
+        }
+        if (ref < 0) {
+            cerr << "yoruba::RegionList: reference '" << name << "' of region '" << spec
+                << "' is not in the BAM" << endl;
+            return false;
+        }
+        int64_t length = refs[ref].RefLength;
+        Region r;
+        r.ref = ref;
+        r.begin = int32_t(min(begin - 1, length));
+        r.end = int32_t(end < 0 ? length : min(end, length));
+        regions.push_back(r);
+    }
+    int64_t n_skipped = 0;
+    for (size_t i = 0; i < bed.size(); ++i) {
+        int32_t ref = findReference(names, ref_of, bed[i].name);
+        if (ref < 0) {
+            ++n_skipped;
+            continue;
+        }
+        int64_t length = refs[ref].RefLength;
+        Region r;
+        r.ref = ref;
+        r.begin = int32_t(min(bed[i].begin, length));
+        r.end = int32_t(min(bed[i].end, length));
+        regions.push_back(r);
+    }
+    if (n_skipped > 0)
+        cerr << "yoruba::RegionList: skipped " << n_skipped
+            << " BED regions on references not in the BAM" << endl;
+
+    // sort, then merge each region into the one before if they overlap or abut
+    sort(regions.begin(), regions.end());
+    size_t n = 0;
+    for (size_t i = 0; i < regions.size(); ++i) {
+        if (regions[i].begin >= regions[i].end)
+            continue;
+        if (n > 0 && regions[n - 1].ref == regions[i].ref && regions[i].begin <= regions[n - 1].end)
+            regions[n - 1].end = max(regions[n - 1].end, regions[i].end);
+        else
+            regions[n++] = regions[i];
+    }
+    regions.resize(n);
+    return true;
+}
@@ -0,0 +1,192 @@
+// yoruba_index.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_index.cpp
+//
+// BamIndexBuilder builds a BAM index as records are written, so that sorted
+// output does not need a separate 'samtools index' pass over it.  The index is
+// BAI unless a reference is too long for BAI's fixed binning, past 2^29 bp,
+// when it is CSI, as samtools does.  BamIndex reads either kind back, to find
+// where in a BAM to start reading for a position, and RegionList holds the
+// regions given to a command to restrict it to.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_INDEX_H_
+#define _YORUBA_INDEX_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <map>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+
+namespace yoruba {
+
+// Records are given with the virtual offsets at which they start and end in
+// the BAM.  The first record that is not coordinate-sorted, by
+// isCoordinateSorted(), stops indexing and Write() then writes nothing.
+// Append() adds the index of a shard written elsewhere, whose records follow
+// those added so far and whose blocks start coffset bytes into the BAM.
+
+class BamIndexBuilder {
+
+    public:
+        BamIndexBuilder(void) : csi(false), min_shift(14), n_levels(5) { Start(BamTools::RefVector()); }
+
+        void        Start(const BamTools::RefVector& refs);
+        bool        Add(const RawRecord& rec, int64_t voffset_begin, int64_t voffset_end);
+        bool        Append(BamIndexBuilder& shard, uint64_t coffset);
+        bool        IsSorted(void) const { return sorted; }
+        const char* Suffix(void) const { return csi ? ".csi" : ".bai"; }
+
+        // the index for bam_filename, written to bam_filename + Suffix()
+        bool        Write(const std::string& bam_filename);
+
+    private:
+        struct Chunk {
+            uint64_t    begin, end;
+        };
+        struct RefIndex {
+            RefIndex(void) : seen(false), off_begin(0), off_end(0), n_mapped(0), n_unmapped(0) { }
+            bool                                    seen;
+            std::map<uint32_t, std::vector<Chunk> > bins;
+            std::vector<uint64_t>                   linear;   // UNSET where no record starts
+            uint64_t                                off_begin, off_end;
+            uint64_t                                n_mapped, n_unmapped;
+        };
+        static const uint64_t UNSET = ~uint64_t(0);
+        static const uint32_t NO_BIN = ~uint32_t(0);  // no chunk is open
+
+        uint32_t    reg2bin(int64_t begin, int64_t end) const;
+        uint32_t    binBottom(uint32_t bin) const;
+        uint32_t    metaBin(void) const { return ((1U << (3 * n_levels + 3)) - 1) / 7 + 1; }
+        void        addChunk(uint32_t bin, uint64_t begin, uint64_t end);
+        void        endReference(void);
+        void        fillLinear(RefIndex& r) const;
+
+        bool                    csi;
+        int                     min_shift, n_levels;
+        std::vector<RefIndex>   refs;
+        bool                    sorted;
+        int32_t                 first_ref, first_pos;
+        int32_t                 last_ref, last_pos;  // last_ref -2 before any record
+        uint32_t                chunk_bin;
+        uint64_t                chunk_begin, last_end;
+        uint64_t                n_no_coor;
+
+};  // class BamIndexBuilder
+
+
+// A shard of a coordinate-sorted BAM holds the records from (ref, pos) up to
+// the next shard's (ref, pos), or to the end of the placed records for the
+// last shard.  Reading for it starts at offset, which may be some way before
+// its first record; offset 0 means from the first record of the BAM.
+
+struct BamShard {
+    int32_t     ref, pos;
+    uint64_t    offset;
+};
+
+class BamIndex {
+
+    public:
+        BamIndex(void) : loaded(false), csi(false), min_shift(14), n_levels(5), n_no_coor(-1) { }
+
+        // the index next to bam_filename, as samtools looks for it: 
+        // bam_filename.bai, .csi, or with .bam replaced by .bai or .csi
+        bool        Load(const std::string& bam_filename);
+        bool        IsLoaded(void) const { return loaded; }
+        const std::string& Filename(void) const { return filename; }
+
+        // a virtual offset at or before the first record at or after pos on
+        // ref, or 0 if the index does not place one
+        uint64_t    Offset(int32_t ref, int32_t pos) const;
+
+        // the number of records in the BAM, from the mapped and unmapped
+        // counts of each reference and the count of those with none, or -1
+        // if the index does not give them all
+        int64_t     Records(void) const;
+
+        // about n shards of similar compressed size, in order, the first
+        // starting at (0, 0); there are fewer if the BAM is too small
+        void        Shards(const BamTools::RefVector& references, size_t n,
+                           std::vector<BamShard>& shards) const;
+
+    private:
+        struct RefIndex {
+            RefIndex(void) : seen(false), counted(false), off_begin(0), off_end(0), n_records(0) { }
+            bool                            seen;
+            bool                            counted;  // the index gave n_records
+            uint64_t                        off_begin, off_end;
+            uint64_t                        n_records;  // mapped and unmapped
+            std::vector<uint64_t>           linear;   // BAI
+            std::map<uint32_t, uint64_t>    loffset;  // CSI, by bin
+        };
+
+        bool        parse(const std::string& s);
+
+        bool                    loaded;
+        std::string             filename;
+        bool                    csi;
+        int                     min_shift, n_levels;
+        std::vector<RefIndex>   refs;
+        int64_t                 n_no_coor;  // -1 if not given
+
+};  // class BamIndex
+
+
+// A Region is the half-open interval [begin, end) of reference ref, in
+// 0-based coordinates as in BED.
+//
+// RegionList gathers the regions given with -r and --regions, and Resolve()
+// turns them into Regions for the references of a BAM, sorted, with those
+// that overlap or abut merged, so that reading them in order with seeks
+// from a BamIndex only ever moves forward through the BAM.
+
+struct Region {
+    int32_t     ref, begin, end;
+    bool operator<(const Region& o) const {
+        return ref < o.ref || (ref == o.ref && begin < o.begin);
+    }
+};
+
+class RegionList {
+
+    public:
+        RegionList(void) { }
+
+        // CHR, CHR:BEG or CHR:BEG-END, 1-based and inclusive as for
+        // samtools; a reference name that itself holds a ':' is taken whole
+        void        Add(const std::string& spec) { specs.push_back(spec); }
+        // the regions of a BED file; false after saying why
+        bool        AddBed(const std::string& filename);
+        bool        Empty(void) const { return specs.empty() && bed.empty(); }
+
+        // the merged regions on refs; false after saying why if a region of
+        // -r is not on refs or is malformed.  BED regions on references not
+        // in refs are skipped, with a warning.
+        bool        Resolve(const BamTools::RefVector& refs, std::vector<Region>& regions) const;
+
+    private:
+        struct BedRegion {
+            std::string name;
+            int64_t     begin, end;
+        };
+
+        std::vector<std::string>    specs;
+        std::vector<BedRegion>      bed;
+
+};  // class RegionList
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_INDEX_H_
@@ -3,11 +3,11 @@
 // Inu (English command is inside) summarizes the contents of a BAM file.
 //
 // Inu reads the BAM file structure and summarizes the header, references and read
-// contents.  It can also check the validity of the header.
+// contents.  It can also check the validity of the header and of every read.
 //
 // Inu is the Yoruba (Nigeria) noun for 'inside'.
 //
-// Uses BamTools C++ API for handling BAM files
+// Uses BamTools only for header types
 
 // CHANGELOG
 //
@@ -24,12 +24,17 @@ static string       input_file;  // defaults to stdin, set from command line
 static int64_t      opt_reads_to_report = 10;
 static bool         opt_continue = false;
 static bool         opt_validate = false;
+static int64_t      opt_max_errors = 100;
 static int32_t      opt_refs_to_report = 10;
+static bool         opt_sam = false;
+static bool         opt_sam_header = false;
+static int          opt_threads = 1;
+static RegionList   regions;  // -r and --regions
 #ifdef _WITH_DEBUG
 static int32_t      opt_debug = 0;
-static int32_t      debug_progress = 100000;
+static int32_t      debug_progress = 10;  // seconds
 static int64_t      opt_reads = -1;
-static int64_t      opt_progress = 0; // 100000;
+static int64_t      opt_progress = 0;  // seconds between progress lines
 #endif
 static const string delim = "'";
 static const string sep = "\t";
@@ -69,16 +74,42 @@ Output includes:\n\
 Options: --reads-to-report INT   print this many reads [" << opt_reads_to_report << "]\n\
          --refs-to-report INT    print this many references [" << opt_refs_to_report << "]\n\
          --continue              continue counting reads until the end of the BAM\n\
-         --validate              check validity using BamTools API; very strict\n\
+         --validate              check validity of the header using BamTools API, very\n\
+                                 strict, and of every read\n\
+         --max-errors INT        list at most INT problems with reads, -1 for all [" << opt_max_errors << "]\n\
+         --sam                   write reads as SAM text instead of the summary\n\
+         --sam-header            write the header too, implies --sam\n\
+         -t INT | --threads INT  threads formatting SAM text or validating [" << opt_threads << "]\n\
+         -r STR | --region STR   only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                 or CHR:BEG-END; may be given more than once\n\
+         --regions FILE          only reads overlapping the regions of BED FILE\n\
          -? | --help             longer help\n\
 \n";
 #ifdef _WITH_DEBUG
     cerr << "\
          --debug INT      debug info level INT [" << opt_debug << "]\n\
          --reads INT      only process INT reads [" << opt_reads << "]\n\
-         --progress INT   print reads processed mod INT [" << opt_progress << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
 \n";
 #endif
+    cerr << "\
+With --sam, all reads are written to stdout as SAM text, or the first\n\
+INT of them if --reads-to-report INT is given, and nothing else is written\n\
+there.  The text is formatted into large buffers written a few megabytes at\n\
+a time, so is limited by the speed of reading the BAM and of the output,\n\
+and with --threads, batches of reads are formatted on several threads.\n\
+\n";
+    cerr << "\
+With --validate, every read is checked: that its fields fit within it, its\n\
+name, reference IDs and positions against the references, its CIGAR against\n\
+the sequence length, its bin, its mate fields against its flags, its\n\
+qualities, the types and lengths of its tags, and if the header says\n\
+SO:coordinate, that it follows the read before in coordinate order.  Each\n\
+problem is listed with the virtual offset of the read, also given as the\n\
+compressed address of its BGZF block and its offset within the block, and\n\
+counts of each kind of problem follow.  The exit status is 1 if any problem\n\
+was found.  With --threads, batches of reads are checked on several threads.\n\
+\n";
     cerr << "Inu is the Yoruba (Nigeria) noun for 'inside'." << endl;
     cerr << endl;
 
@@ -89,6 +120,46 @@ Options: --reads-to-report INT   print this many reads [" << opt_reads_to_report
 //-------------------------------------
 
 
+// write the reads, and the header if asked, to stdout as SAM
+static int
+writeSam(RawBamReader& reader)
+{
+    ScopedPhase phase_pass1("pass1");
+
+    cout.flush();  // the SAM text goes to the descriptor directly
+    SamWriter writer(STDOUT_FILENO, reader.GetReferenceData(), opt_threads);
+
+    if (opt_sam_header && ! writer.WriteHeader(reader.GetHeaderText()))
+        return EXIT_FAILURE;
+
+    RawRecord rec;
+    int64_t n_reads = 0;
+    Progress progress;
+    progress.Start(NAME "[sam]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+
+    while ((opt_reads_to_report < 0 || n_reads < opt_reads_to_report)
+           && (opt_reads < 0 || n_reads < opt_reads)
+           && reader.GetNextRecord(rec)) {
+        ++n_reads;
+        if (! writer.SaveRecord(rec))
+            break;
+        progress.Add(rec, reader.Tell());
+    }
+    progress.Stop();
+    phase_pass1.End();
+
+    ScopedPhase phase_close("close");
+    bool ok = writer.Close();
+    reader.Close();
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[sam] " << n_reads << " reads written" << endl;
+    return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
 int 
 yoruba::main_inu(int argc, char* argv[])
 {
@@ -99,6 +170,7 @@ yoruba::main_inu(int argc, char* argv[])
 	}
 
     enum { OPT_reads_to_report, OPT_refs_to_report, OPT_continue, OPT_validate, 
+        OPT_max_errors, OPT_sam, OPT_sam_header, OPT_threads, OPT_region, OPT_regions,
 #ifdef _WITH_DEBUG
         OPT_debug, OPT_reads, OPT_progress,
 #endif
@@ -109,6 +181,14 @@ yoruba::main_inu(int argc, char* argv[])
         { OPT_reads_to_report, "--reads-to-report", SO_REQ_SEP },
         { OPT_continue,        "--continue",        SO_NONE },
         { OPT_validate,        "--validate",        SO_NONE },
+        { OPT_max_errors,      "--max-errors",      SO_REQ_SEP },
+        { OPT_sam,             "--sam",             SO_NONE },
+        { OPT_sam_header,      "--sam-header",      SO_NONE },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
         { OPT_help,            "--help",            SO_NONE },
         { OPT_help,            "-?",                SO_NONE }, 
 #ifdef _WITH_DEBUG
@@ -121,18 +201,32 @@ yoruba::main_inu(int argc, char* argv[])
 
     CSimpleOpt args(argc, argv, inu_options);
 
+    bool reads_to_report_set = false;
+
     while (args.Next()) {
         if (args.LastError() != SO_SUCCESS) {
             cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
             return usage();
         }
         if (args.OptionId() == OPT_help)       return usage();
-        else if (args.OptionId() == OPT_reads_to_report) 
+        else if (args.OptionId() == OPT_reads_to_report) {
             opt_reads_to_report = strtoll(args.OptionArg(), NULL, 10);
+            reads_to_report_set = true;
+        }
         else if (args.OptionId() == OPT_refs_to_report) 
             opt_refs_to_report = strtol(args.OptionArg(), NULL, 10);
         else if (args.OptionId() == OPT_continue)  opt_continue = true;
         else if (args.OptionId() == OPT_validate) opt_validate = true;
+        else if (args.OptionId() == OPT_max_errors)
+            opt_max_errors = strtoll(args.OptionArg(), NULL, 10);
+        else if (args.OptionId() == OPT_sam)      opt_sam = true;
+        else if (args.OptionId() == OPT_sam_header) opt_sam = opt_sam_header = true;
+        else if (args.OptionId() == OPT_threads)  opt_threads = atoi(args.OptionArg());
+        else if (args.OptionId() == OPT_region)   regions.Add(args.OptionArg());
+        else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        }
 #ifdef _WITH_DEBUG
         else if (args.OptionId() == OPT_debug) 
             opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
@@ -150,6 +244,13 @@ yoruba::main_inu(int argc, char* argv[])
     if (DEBUG(1) && ! opt_progress)
         opt_progress = debug_progress;
 
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+    if (opt_sam && ! reads_to_report_set)
+        opt_reads_to_report = -1;  // all of them
+
     if (args.FileCount() > 1) {
         cerr << NAME << " requires at most one BAM file specified as input" << endl;
         return usage();
@@ -161,28 +262,48 @@ yoruba::main_inu(int argc, char* argv[])
 
     //----------------- Open file, start reading data
 
-	BamReader reader;
+    ScopedPhase phase_open("open");
+
+	RawBamReader reader;
 
 	if (! reader.Open(input_file)) {
         cerr << NAME << " could not open BAM input" << endl;
         return EXIT_FAILURE;
     }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
 
-#ifdef _IF_BAMTOOLS_IS_BROKEN
-    SamHeader header = reader.GetHeader();
-#else
-    const SamHeader& header = reader.GetConstSamHeader();
-#endif
+    // the @SQ lines are left unparsed, references are reported from the
+    // reference list that follows the header text
+    const RawHeader& raw_header = reader.GetRawHeader();
+    const SamHeader& header = raw_header.Meta();
+
+    bool valid = true;
 
     if (opt_validate) {
-        if (! header.IsValid(true)) { // this check is very strict
+        SamHeader full_header = raw_header.ToSamHeader();  // validating needs every line parsed
+        if (! full_header.IsValid(true)) { // this check is very strict
             cout << NAME << " header not well-formed, errors are:" << endl;
-            cout << header.GetErrorString() << endl;
+            cout << full_header.GetErrorString() << endl;
+            valid = false;
+        }
+        if (raw_header.SequenceCount() != size_t(reader.GetReferenceCount())) {
+            cout << NAME << "[validate] header has " << raw_header.SequenceCount()
+                << " @SQ lines but the BAM has " << reader.GetReferenceCount() 
+                << " references" << endl;
+            valid = false;
         }
     }
 
+    phase_open.End();
+
+    if (opt_sam)
+        return writeSam(reader);
+
     //----------------- Header metadata
 
+    ScopedPhase phase_header("header");
+
     if (header.HasVersion() || header.HasSortOrder() || header.HasGroupOrder()) {
         cout << NAME << "[headerline]";
         if (header.HasVersion()) 
@@ -198,7 +319,7 @@ yoruba::main_inu(int argc, char* argv[])
 
     const RefVector& refs = reader.GetReferenceData();
 
-    if (header.HasSequences()) {
+    if (raw_header.SequenceCount() > 0 || ! refs.empty()) {
         int32_t ref_count = reader.GetReferenceCount();
         if (ref_count > opt_refs_to_report)
             cout << NAME << "[ref] displaying the first " << opt_refs_to_report 
@@ -254,9 +375,13 @@ yoruba::main_inu(int argc, char* argv[])
         }
     } else cout << NAME << "[comment] no comment lines found" << endl;
 
+    phase_header.End();
+
     //----------------- Reads
 
-	BamAlignment al;  // holds the current read from the BAM file
+    ScopedPhase phase_pass1("pass1");
+
+	RawRecord rec;  // the current read, a view into the BAM block
 
     int64_t n_reads = 0;  // number of reads processed
 
@@ -264,27 +389,61 @@ yoruba::main_inu(int argc, char* argv[])
         cout << NAME << "[read] printing the first " << opt_reads_to_report << " reads" << endl;
     }
 
-	while (reader.GetNextAlignmentCore(al) && (opt_reads < 0 || n_reads < opt_reads)) {
+    // reads are only checked if validating, and then every one of them
+    BamValidator validator(refs, header.HasSortOrder() && header.SortOrder == "coordinate",
+                           cout, NAME "[validate] ", opt_max_errors, 
+                           opt_validate ? opt_threads : 1);
+
+    Progress progress;
+    progress.Start(NAME "[read]", opt_progress, reader.InputSize(), &refs);
+
+	while (reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
 
         ++n_reads;
 
         if (n_reads <= opt_reads_to_report) {
-            al.BuildCharData();
             cout << NAME << "[read] ";
-            printAlignmentInfo(cout, al, refs, 99);
+            printAlignmentInfo(cout, rec, refs, 99);
         }
 
-        if (opt_progress && n_reads % opt_progress == 0)
-            cerr << NAME << "[read] " << n_reads << " reads processed..." << endl;
+        if (opt_validate)
+            validator.Check(rec, reader.RecordOffset());
+
+        progress.Add(rec, reader.Tell());
 
-        if (! opt_continue && n_reads == opt_reads_to_report)
+        if (! opt_continue && ! opt_validate && n_reads == opt_reads_to_report)
             break;
 	}
 
+    progress.Stop();
+
     cout << NAME << "[read] " << n_reads << " reads examined from the BAM file" << endl;
 
+    if (opt_validate) {
+        validator.Close();
+        if (reader.Failed()) {
+            int64_t voffset = reader.RecordOffset();
+            cout << NAME << "[validate] reading stopped at a truncated or malformed read at "
+                << voffset << " (" << (voffset >> 16) << ":" << (voffset & 0xffff) << ")" << endl;
+            valid = false;
+        }
+        int64_t n_problems = validator.Problems();
+        if (n_problems > 0) {
+            cout << NAME << "[validate] " << n_problems << " problems found in " 
+                << n_reads << " reads" << endl;
+            for (int p = 0; p < RecordValidator::N_PROBLEMS; ++p)
+                if (validator.Count(p) > 0)
+                    cout << NAME << "[validate] " << RecordValidator::ProblemName(p) 
+                        << " " << validator.Count(p) << endl;
+            valid = false;
+        } else cout << NAME << "[validate] no problems found in " << n_reads << " reads" << endl;
+    }
+
+    phase_pass1.End();
+
+    ScopedPhase phase_close("close");
 	reader.Close();
 
-	return EXIT_SUCCESS;
+	return valid ? EXIT_SUCCESS : EXIT_FAILURE;
 }
 
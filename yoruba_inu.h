@@ -4,7 +4,7 @@
 //
 // Inu is the Yoruba (Nigeria) noun for 'inside'.
 //
-// Uses BamTools C++ API for reading BAM files
+// Uses BamTools only for header types
 
 #ifndef _YORUBA_INU_H_
 #define _YORUBA_INU_H_
@@ -16,6 +16,7 @@
 #include <iomanip>
 #include <string>
 #include <list>
+#include <unistd.h>
 
 // BamTools includes: https://github.com/pezmaster31/bamtools
 #include "api/BamReader.h"
@@ -32,6 +33,10 @@
 // Yoruba includes
 #include "yoruba.h"
 #include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_sam.h"
+#include "yoruba_validate.h"
+#include "yoruba_stats.h"
 
 #ifndef _YORUBA_MAIN
 #define NAME "[yoruba_inside]"
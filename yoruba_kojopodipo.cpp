@@ -19,28 +19,47 @@
 
 
 #include "yoruba_kojopodipo.h"
+#include "yoruba_run.h"
+
+#include <fstream>
+#include <set>
 
 using namespace std;
 using namespace BamTools;
 using namespace yoruba;
 
 // options
-static string       input_file;  // defaults to stdin, set from command line
+static vector<string> input_files;  // defaults to stdin, set from command line; several are merged
 static string       output_file;  // defaults to stdout, set with -o FILE
+static string       split_prefix;  // one output per read group instead, set with --split PREFIX
+static OutputOptions output_opts;  // set with -l INT, -u
+static string       checksum_file;     // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
 static bool         other_rg_opts = false;  // read group options other than --ID were given
 static bool         opt_dictionary; 
 static string       dictionary_string; 
 static bool         opt_replace;
 static string       replace_string;
 static bool         opt_clear = false;
+static string       rg_map_file;  // read groups assigned by rules, set with --rg-map FILE
+static int          opt_threads = 1;
+static SamReadGroup new_rg;  // the read group we are creating
+static vector<SamReadGroup> input_rgs;  // with --ID given again, those of the second and later inputs
+static SamProgram   new_program;  // the program info for yoruba, added to the header
 #ifdef _WITH_DEBUG
 static int32_t      opt_debug = 0;
-static int32_t      debug_progress = 100000;
+static int32_t      debug_progress = 10;  // seconds
 static int64_t      opt_reads = -1;
-static int64_t      opt_progress = 0; // 1000000;
+static int64_t      opt_progress = 0;  // seconds between progress lines
 static int64_t      debug_reads_to_report = 1;
 #endif
 
+static int  parseOptions(int argc, char* argv[], bool in_run);
+static bool rewriteHeader(SamHeader& header);
+static bool addSplitOutputs(SplitWriter& split, const RawHeader& header);
+static bool setReadGroupField(SamReadGroup& rg, const string& tag, const string& val);
+
 
 //-------------------------------------
 
@@ -61,11 +80,12 @@ usage(bool long_help = false)
 {
     cerr << endl;
     cerr << "\
-Usage:   " << YORUBA_NAME << " readgroup [options] <in.bam>\n\
-         " << YORUBA_NAME << " kojopodipo [options] <in.bam>\n\
+Usage:   " << YORUBA_NAME << " readgroup [options] <in.bam> [<in2.bam> ...]\n\
+         " << YORUBA_NAME << " kojopodipo [options] <in.bam> [<in2.bam> ...]\n\
 \n\
 Add or replace read group information in the BAM file <in.bam>.  Either\n\
-command invokes this function.\n\
+command invokes this function.  Several coordinate-sorted BAM files are\n\
+merged into one, each with its own read group.\n\
 \n";
     if (long_help) {
     cerr << "\
@@ -101,15 +121,26 @@ The only argument required to specify a valid read group is --ID or --id.\n\
     cerr << "         --KS STR | --key-sequence STR       read group key sequence" << endl;
     cerr << "         --CN STR | --sequencing-center STR  read group sequencing center" << endl;
     cerr << endl;
+    cerr << "         -r STR | --region STR               only reads overlapping region STR, as CHR, CHR:BEG" << endl;
+    cerr << "                                             or CHR:BEG-END; may be given more than once" << endl;
+    cerr << "         --regions FILE                      only reads overlapping the regions of BED FILE" << endl;
     cerr << "         -o FILE | --output FILE             output file name [default is stdout]" << endl;
+    cerr << "         -l INT | --level INT                output compression level 0-9 [6]" << endl;
+    cerr << "         -u                                  uncompressed output, same as --level 0" << endl;
+    cerr << "         --write-index                       also write a BAI (or CSI) index of sorted output" << endl;
+    cerr << "         --checksum FILE                     write order-independent checksums of the output to FILE" << endl;
+    cerr << "         --checksum-exclude LIST             fields and tags to leave out of them, see checksum" << endl;
+    cerr << "         --split PREFIX                      write one BAM per read group, named PREFIX<ID>.bam" << endl;
+    cerr << "         --rg-map FILE                       assign read groups to reads by the rules in FILE" << endl;
     cerr << "         --replace STR                       replace read group STR with --ID" << endl;
     cerr << "         --clear                             clear all read group information" << endl;
+    cerr << "         -t INT | --threads INT              worker threads for tagging reads [" << opt_threads << "]" << endl;
     cerr << "         -? | --help                         longer help" << endl;
     cerr << endl;
 #ifdef _WITH_DEBUG
     cerr << "         --debug INT     debug info level INT [" << opt_debug << "]" << endl;
     cerr << "         --reads INT     process at most this many reads [" << opt_reads << "]" << endl;
-    cerr << "         --progress INT  print reads processed mod INT [" << opt_progress << "]" << endl;
+    cerr << "         --progress INT  print progress every INT seconds [" << opt_progress << "]" << endl;
     cerr << endl;
 #endif
     if (long_help) {
@@ -129,7 +160,44 @@ The --clear option removes all read group information from all reads.  If\n\
 specified with options defining a read group, then the read group dictionary\n\
 will be cleared prior to defining the new read group.\n\
 \n\
-Only one of these may be supplied at a time.  To summarizing the effects of these options:\n\
+Given several input BAM files, which must each be sorted by coordinate, the\n\
+reads of all of them are merged into one coordinate-sorted output as they are\n\
+read, each input being read on its own thread.  --ID may then be given once\n\
+for each input, in the same order as the inputs, and the read group options\n\
+following each --ID define that input's read group; given only once, its\n\
+read group is given to the reads of every input.  The headers of the inputs\n\
+are combined: references not in the first input are added after its own,\n\
+as are read groups, programs and comments.  Inputs that share references\n\
+must have them in the same order.  --replace takes only one input.\n\
+\n\
+The --split option writes the reads of each read group in the final\n\
+dictionary to a BAM file of its own, named PREFIX followed by the read group\n\
+ID and .bam, in place of a single output; characters of the ID other than\n\
+letters, digits, '.', '-' and '_' are written as '_'.  Each file's header has\n\
+only its own read group.  Reads with no read group, or one not in the\n\
+dictionary, are written to PREFIXunassigned.bam, which is only created if\n\
+there are any.  Read groups are set as usual before splitting, so --split\n\
+may be combined with the other options.  Each output is written by a thread\n\
+of its own, so hundreds of read groups can be split in one pass.\n\
+\n\
+The --rg-map option assigns read groups read by read, according to rules in\n\
+FILE, one to a line of tab-separated fields:\n\
+\n\
+    name:FLOWCELL:LANE   ID   [TAG:VALUE ...]\n\
+    rg:OLD_ID            ID   [TAG:VALUE ...]\n\
+\n\
+A name: rule matches reads whose names have the given flowcell and lane, the\n\
+third and fourth fields of INSTRUMENT:RUN:FLOWCELL:LANE:TILE:X:Y, or for older\n\
+five-field names INSTRUMENT:LANE:TILE:X:Y, the instrument and lane.  An rg:\n\
+rule matches reads with read group OLD_ID.  Name rules are tried first.  The\n\
+TAG:VALUE fields define the read group ID as on an @RG header line, e.g.\n\
+SM:sample1; if none are given for an ID, the definition of OLD_ID is kept\n\
+under the new ID.  Read groups matched by rg: rules are removed from the\n\
+dictionary.  Reads that match no rule are given --ID if it is given, lose\n\
+their read group with --clear, and are otherwise left as they are.  Lines\n\
+beginning with '#' are skipped.  --rg-map cannot be used with --replace.\n\
+\n\
+Only one of --replace and --clear may be supplied at a time.  To summarizing the effects of these options:\n\
 \n\
                       Read read group (RG) tag status                        \n\
                 --------------------------------------------                 \n\
@@ -162,12 +230,527 @@ only --ID etc.           new RG set for all reads             RG added       \n\
 //-------------------------------------
 
 
+// the rules of --rg-map FILE, which give each read a read group according to
+// the flowcell and lane in its name, or according to the read group it
+// already has.  Keys and new IDs are interned as the file is read, so
+// finding the read group for a read looks up its key where it lies within
+// the record, and no strings are made
+
+class ReadGroupMap {
+
+    public:
+        bool            Read(const string& file);
+        bool            Empty(void) const { return ids.Size() == 0; }
+
+        enum Match { match_none, match_name, match_rg };
+        // the index of the read group for rec, or -1 if no rule matches it
+        int             Find(const RawRecord& rec, Match& match) const;
+        const string&   ID(int g) const { return ids[g]; }
+
+        // fill in the definitions of read groups only renamed by 'rg:' rules
+        // from the dictionary as read, before it is changed
+        void            Resolve(SamReadGroupDictionary& rgd);
+        // replace the read groups of 'rg:' rules with the groups of the map
+        void            Apply(SamReadGroupDictionary& rgd) const;
+
+    private:
+        StringTable             ids;         // new read group IDs
+        vector<SamReadGroup>    groups;      // definitions, indexed as ids
+        vector<bool>            defined;     // the file gave more than the ID
+        StringTable             name_keys;   // FLOWCELL:LANE from read names
+        vector<int>             name_group;  // read group for each name key
+        StringTable             rg_keys;     // existing RG values
+        vector<int>             rg_group;    // read group for each RG key
+
+};
+
+
+//-------------------------------------
+
+
+// the flowcell and lane within an Illumina read name, as one span including
+// the colon between them: fields 3 and 4 of the seven fields of
+// INSTRUMENT:RUN:FLOWCELL:LANE:TILE:X:Y, or for older five-field names
+// INSTRUMENT:LANE:TILE:X:Y, which have no flowcell, fields 1 and 2
+static bool
+flowcellLane(const char* name, size_t len, const char*& key, size_t& key_len)
+{
+    size_t colon[7];
+    int n = 0;
+    for (size_t i = 0; i < len && n < 7; ++i)
+        if (name[i] == ':')
+            colon[n++] = i;
+    if (n >= 6) {
+        key = name + colon[1] + 1;
+        key_len = colon[3] - colon[1] - 1;
+        return true;
+    } else if (n == 4) {
+        key = name;
+        key_len = colon[1];
+        return true;
+    }
+    return false;
+}
+
+
+//-------------------------------------
+
+
+// lines are KEY<tab>ID[<tab>TAG:VALUE...], where KEY is name:FLOWCELL:LANE or
+// rg:OLD_ID and the TAG:VALUE fields define the read group as in @RG lines.
+// Blank lines and lines beginning with '#' are skipped
+bool
+ReadGroupMap::Read(const string& file)
+{
+    ifstream in(file.c_str());
+    if (! in) {
+        cerr << NAME << " could not open read group map " << file << endl;
+        return false;
+    }
+    string line;
+    for (int line_num = 1; getline(in, line); ++line_num) {
+        if (! line.empty() && line[line.length() - 1] == '\r')
+            line.erase(line.length() - 1);
+        if (line.empty() || line[0] == '#')
+            continue;
+        vector<string> fields;
+        for (size_t b = 0, e; b <= line.length(); b = e + 1) {
+            e = line.find('\t', b);
+            if (e == string::npos)
+                e = line.length();
+            fields.push_back(line.substr(b, e - b));
+        }
+        const char* where = " read group map line ";
+        if (fields.size() < 2 || fields[1].empty()) {
+            cerr << NAME << where << file << ":" << line_num << " needs a key and a read group ID" << endl;
+            return false;
+        }
+        int g = ids.Add(fields[1]);
+        if (size_t(g) == groups.size()) {
+            groups.push_back(SamReadGroup(fields[1]));
+            defined.push_back(false);
+        }
+        if (fields.size() > 2) {
+            if (defined[g]) {
+                cerr << NAME << where << file << ":" << line_num << " defines read group " 
+                    << fields[1] << " again" << endl;
+                return false;
+            }
+            for (size_t i = 2; i < fields.size(); ++i) {
+                if (fields[i].length() < 3 || fields[i][2] != ':' || fields[i].substr(0, 2) == "ID"
+                    || ! setReadGroupField(groups[g], fields[i].substr(0, 2), fields[i].substr(3))) {
+                    cerr << NAME << where << file << ":" << line_num << " has unknown read group field '" 
+                        << fields[i] << "'" << endl;
+                    return false;
+                }
+            }
+            defined[g] = true;
+        }
+        const string& key = fields[0];
+        StringTable* keys;
+        vector<int>* key_group;
+        if (key.compare(0, 5, "name:") == 0 && key.find(':', 5) != string::npos) {
+            keys = &name_keys; key_group = &name_group;
+        } else if (key.compare(0, 3, "rg:") == 0 && key.length() > 3) {
+            keys = &rg_keys; key_group = &rg_group;
+        } else {
+            cerr << NAME << where << file << ":" << line_num << " key '" << key 
+                << "' is not name:FLOWCELL:LANE or rg:ID" << endl;
+            return false;
+        }
+        size_t k0 = keys->Size();
+        int k = keys->Add(key.substr(key.find(':') + 1));
+        if (size_t(k) < k0) {
+            cerr << NAME << where << file << ":" << line_num << " repeats key '" << key << "'" << endl;
+            return false;
+        }
+        key_group->push_back(g);
+    }
+    if (Empty()) {
+        cerr << NAME << " read group map " << file << " has no rules" << endl;
+        return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// name rules are tried before rg rules
+int
+ReadGroupMap::Find(const RawRecord& rec, Match& match) const
+{
+    const char* key;
+    size_t key_len;
+    int k;
+    if (name_keys.Size() > 0 && flowcellLane(rec.Name(), rec.NameLength(), key, key_len)
+        && (k = name_keys.Find(key, key_len)) >= 0) {
+        match = match_name;
+        return name_group[k];
+    }
+    if (rg_keys.Size() > 0 && rec.GetTagString("RG", key, key_len)
+        && (k = rg_keys.Find(key, key_len)) >= 0) {
+        match = match_rg;
+        return rg_group[k];
+    }
+    match = match_none;
+    return -1;
+}
+
+
+//-------------------------------------
+
+
+void
+ReadGroupMap::Resolve(SamReadGroupDictionary& rgd)
+{
+    for (size_t k = 0; k < rg_keys.Size(); ++k) {
+        int g = rg_group[k];
+        if (! defined[g] && rgd.Contains(rg_keys[k])) {
+            groups[g] = rgd[rg_keys[k]];
+            groups[g].ID = ids[g];
+            defined[g] = true;
+        }
+    }
+}
+
+
+//-------------------------------------
+
+
+void
+ReadGroupMap::Apply(SamReadGroupDictionary& rgd) const
+{
+    for (size_t k = 0; k < rg_keys.Size(); ++k)
+        if (rgd.Contains(rg_keys[k]))
+            rgd.Remove(rg_keys[k]);
+    for (size_t g = 0; g < groups.size(); ++g) {
+        if (rgd.Contains(groups[g].ID))
+            rgd.Remove(groups[g].ID);
+        rgd.Add(groups[g]);
+    }
+}
+
+
+static ReadGroupMap rg_map;
+
+
+//-------------------------------------
+
+
+// the per-read work of kojopodipo, run on the pipeline's worker threads
+
+class ReadGroupTransform : public RecordTransform {
+
+    public:
+        ReadGroupTransform(const string& id, int n_workers) 
+            : rg_id(id), n_reads(0), counts(n_workers) { }
+
+        virtual bool Apply(RawRecord& rec, int worker);
+        // debug output reports the first reads in order
+        virtual bool IsOrderIndependent(void) const { return ! DEBUG(1); }
+
+        // add the reads matched by each kind of --rg-map rule, and by none, to n
+        void         AddMapCounts(int64_t n[3]) const;
+
+    private:
+        const string rg_id;
+        int64_t      n_reads;  // only counted for debug output, when there is one worker
+        struct Counts {
+            Counts(void) { memset(n, 0, sizeof(n)); }
+            int64_t n[3];     // indexed by ReadGroupMap::Match
+            char    pad[40];  // one cache line per worker
+        };
+        vector<Counts> counts;
+
+};
+
+
+//-------------------------------------
+
+
+bool
+ReadGroupTransform::Apply(RawRecord& rec, int worker)
+{
+    bool report = DEBUG(1) && ++n_reads <= debug_reads_to_report;
+
+    if (report) {
+        cerr << NAME << " " << n_reads << " read before processing: ";
+        printAlignmentInfo(cerr, rec);
+    }
+
+    ReadGroupMap::Match match = ReadGroupMap::match_none;
+    int g = rg_map.Empty() ? -1 : rg_map.Find(rec, match);
+    if (! rg_map.Empty())
+        ++counts[worker].n[match];
+
+    if (opt_clear) {
+        rec.RemoveTag("RG");
+    }
+
+    if (g >= 0) {
+
+        rec.SetTagString("RG", rg_map.ID(g));
+
+    } else if (opt_replace) {
+
+        // only modify reads with an RG tag matching replace_string
+        const char* RG_tag;
+        size_t RG_len;
+        if (rec.GetTagString("RG", RG_tag, RG_len) 
+            && RG_len == replace_string.length()
+            && replace_string.compare(0, RG_len, RG_tag, RG_len) == 0) {
+            rec.SetTagString("RG", rg_id);
+        }
+
+    } else if (! rg_id.empty()) {
+
+        rec.SetTagString("RG", rg_id);  // replaces any existing RG
+
+    }
+
+    if (report) {
+        cerr << NAME << " " << n_reads << " read after processing: ";
+        printAlignmentInfo(cerr, rec);
+    }
+
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+ReadGroupTransform::AddMapCounts(int64_t n[3]) const
+{
+    for (size_t i = 0; i < counts.size(); ++i)
+        for (int m = 0; m < 3; ++m)
+            n[m] += counts[i].n[m];
+}
+
+
+static void
+reportMap(const int64_t n[3])
+{
+    cerr << NAME << " " << n[ReadGroupMap::match_name] << " reads assigned by name, " 
+        << n[ReadGroupMap::match_rg] << " by read group, " 
+        << n[ReadGroupMap::match_none] << " matched no rule" << endl;
+}
+
+
+//-------------------------------------
+
+
+// with several inputs, each input's read group is set on the input's own
+// thread as it is read, see MergeReader, and the pipeline only carries the
+// merged records to the output
+
+class MergedTransform : public RecordTransform {
+
+    public:
+        virtual bool Apply(RawRecord& rec, int worker) { return true; }
+        virtual bool IsOrderIndependent(void) const { return true; }
+
+};
+
+
+// the read group for input i: that given for it with --ID, or with only one
+// --ID, that one
+static const SamReadGroup&
+inputReadGroup(size_t i)
+{
+    return (i == 0 || input_rgs.empty()) ? new_rg : input_rgs[i - 1];
+}
+
+
+// the read group being given by options, the last begun by --ID
+static SamReadGroup&
+currentReadGroup(void)
+{
+    return input_rgs.empty() ? new_rg : input_rgs.back();
+}
+
+
+//-------------------------------------
+
+
 int 
 yoruba::main_kojopodipo(int argc, char* argv[])
 {
-    SamReadGroup new_rg;  // the read group we are creating
-    SamProgram   new_program;    // the program info for yoruba, added to the header
+    // first process options
+
+	if( argc < 2 ) {
+		return usage();
+	}
+
+    if (parseOptions(argc, argv, false) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    ScopedPhase phase_open("open");
 
+    // one input is read by the pipeline; several are merged as they are
+    // read, each on its own thread
+    bool merging = input_files.size() > 1;
+	RawBamReader reader;
+    MergeReader merge;
+
+    if (merging ? ! merge.Open(input_files) : ! reader.Open(input_files[0])) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && (merging ? ! merge.SetRegions(regions) : ! reader.SetRegions(regions)))
+        return EXIT_FAILURE;
+
+    // only the read groups and programs change, so the @SQ lines, of which
+    // there may be millions, are left unparsed and copied as they are
+    RawHeader header = merging ? merge.GetHeader() : reader.GetRawHeader();
+    const RefVector& refs = merging ? merge.GetReferenceData() : reader.GetReferenceData();
+
+    if (! rewriteHeader(header.Meta()))
+        return EXIT_FAILURE;
+	
+    //-------------------------------------  open output
+
+    RawBamWriter writer;
+    SplitWriter split(output_opts, refs);
+
+    if (! split_prefix.empty()) {
+        if (! addSplitOutputs(split, header))
+            return EXIT_FAILURE;
+    } else if (! output_opts.Open(writer, output_file, header.ToString(), refs)) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    phase_open.End();
+
+    //-------------------------------------  tag reads, see ReadGroupTransform::Apply()
+
+    ScopedPhase phase_pass1("pass1");
+
+    vector<ReadGroupTransform*> transforms;
+    MergedTransform merged;
+    Pipeline* pipeline;
+    if (merging) {
+        for (size_t i = 0; i < input_files.size(); ++i) {
+            transforms.push_back(new ReadGroupTransform(inputReadGroup(i).ID, 1));
+            merge.SetTransform(i, transforms[i]);
+        }
+        pipeline = split_prefix.empty() ? new Pipeline(merge, writer, merged)
+                                        : new Pipeline(merge, split, merged);
+    } else {
+        transforms.push_back(new ReadGroupTransform(new_rg.ID, opt_threads));
+        pipeline = split_prefix.empty() ? new Pipeline(reader, writer, *transforms[0], opt_threads)
+                                        : new Pipeline(reader, split, *transforms[0], opt_threads);
+    }
+
+    pipeline->SetMaxRecords(opt_reads);
+    Progress progress;
+    progress.Start(NAME, opt_progress, merging ? merge.InputSize() : reader.InputSize(), &refs);
+    pipeline->SetProgress(&progress);
+
+    bool ok = pipeline->Run();
+    progress.Stop();
+    int64_t n_reads = pipeline->RecordsRead();
+    delete pipeline;
+    if (merging)
+        merge.Close();  // the input threads are done with the transforms
+    int64_t n_map[3] = { 0, 0, 0 };
+    for (size_t i = 0; i < transforms.size(); ++i) {
+        transforms[i]->AddMapCounts(n_map);
+        delete transforms[i];
+    }
+    if (! ok) {
+        cerr << NAME << " error while processing reads" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (opt_progress || DEBUG(1)) {
+        cerr << NAME << " " << n_reads << " reads processed";
+        if (merging)
+            cerr << " from " << input_files.size() << " inputs";
+        cerr << endl;
+    }
+    if (! rg_map.Empty())
+        reportMap(n_map);
+    phase_pass1.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+    if (! split_prefix.empty()) {
+        if (! split.Close()) {
+            cerr << NAME << " error writing split outputs" << endl;
+            return EXIT_FAILURE;
+        }
+        if (opt_progress || DEBUG(1))
+            for (size_t i = 0; i < split.Outputs(); ++i)
+                cerr << NAME << " " << split.RecordsWritten(i) << " reads written to " 
+                    << split.Filename(i) << endl;
+    } else if (! writer.Close()) {
+        return EXIT_FAILURE;
+    }
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+// the read group ID as part of a file name
+static string
+fileNameID(const string& id)
+{
+    string s = id;
+    for (size_t i = 0; i < s.length(); ++i)
+        if (! isalnum(static_cast<unsigned char>(s[i])) && s[i] != '.' && s[i] != '-' && s[i] != '_')
+            s[i] = '_';
+    return s;
+}
+
+
+// one output for each read group in header, which has only that read group,
+// and one for reads of none of them
+static bool
+addSplitOutputs(SplitWriter& split, const RawHeader& header)
+{
+    const string unassigned = split_prefix + "unassigned.bam";
+    set<string> filenames;
+    filenames.insert(unassigned);
+
+    const SamHeader& meta = header.Meta();
+    for (SamReadGroupConstIterator rgI = meta.ReadGroups.ConstBegin();
+            rgI != meta.ReadGroups.ConstEnd(); ++rgI) {
+        string filename = split_prefix + fileNameID(rgI->ID) + ".bam";
+        if (! filenames.insert(filename).second) {
+            cerr << NAME << " read group " << rgI->ID << " would be written to " << filename 
+                << ", which another output already uses" << endl;
+            return false;
+        }
+        SamHeader rg_meta = meta;
+        rg_meta.ReadGroups.Clear();
+        SamReadGroup rg = *rgI;
+        rg_meta.ReadGroups.Add(rg);
+        if (! split.Add(rgI->ID, filename, header, rg_meta))
+            return false;
+    }
+
+    SamHeader none_meta = meta;
+    none_meta.ReadGroups.Clear();
+    split.SetDefault(unassigned, header, none_meta);
+    return true;
+}
+
+
+// parse options into the file-static option variables; in_run is true for
+// a step of 'yoruba run', which does its own input and output
+static int
+parseOptions(int argc, char* argv[], bool in_run)
+{
     new_program.ID = YORUBA_NAME;
     new_program.ID = new_program.ID + " " + argv[0];
     new_program.Name = YORUBA_NAME;
@@ -176,14 +759,10 @@ yoruba::main_kojopodipo(int argc, char* argv[])
     for (int i = 0; i < argc; ++i)
         new_program.CommandLine = new_program.CommandLine + " " + argv[i];
 
-    // first process options
-
-	if( argc < 2 ) {
-		return usage();
-	}
-
     enum { OPT_ID, OPT_LB, OPT_SM, OPT_DS, OPT_DT, OPT_PG, OPT_PL, OPT_PU, OPT_PI, OPT_FO,
-        OPT_KS, OPT_CN, OPT_dictionary, OPT_output, OPT_replace, OPT_clear,
+        OPT_KS, OPT_CN, OPT_dictionary, OPT_rg_map, OPT_output, OPT_replace, OPT_clear, OPT_threads,
+        OPT_level, OPT_uncompressed, OPT_writeindex, OPT_checksum, OPT_checksumexclude,
+        OPT_region, OPT_regions, OPT_split,
 #ifdef _WITH_DEBUG
         OPT_debug, OPT_reads, OPT_progress,
 #endif
@@ -204,9 +783,22 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         { OPT_CN, "--CN", SO_REQ_SEP }, { OPT_CN, "--sequencing-center", SO_REQ_SEP },
         { OPT_output,      "--output", SO_REQ_SEP },
         { OPT_output,      "-o", SO_REQ_SEP }, 
+        { OPT_level,       "--level", SO_REQ_SEP },
+        { OPT_level,       "-l", SO_REQ_SEP },
+        { OPT_uncompressed, "-u", SO_NONE },
+        { OPT_writeindex,  "--write-index", SO_NONE },
+        { OPT_checksum,    "--checksum", SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,      "--region", SO_REQ_SEP },
+        { OPT_region,      "-r", SO_REQ_SEP },
+        { OPT_regions,     "--regions", SO_REQ_SEP },
+        { OPT_split,       "--split", SO_REQ_SEP },
         { OPT_dictionary,  "--dictionary", SO_REQ_SEP },
+        { OPT_rg_map,      "--rg-map", SO_REQ_SEP },
         { OPT_replace,     "--replace", SO_REQ_SEP },
         { OPT_clear,       "--clear", SO_NONE },
+        { OPT_threads,     "--threads", SO_REQ_SEP },
+        { OPT_threads,     "-t", SO_REQ_SEP },
         { OPT_help,        "--help", SO_NONE },
         { OPT_help,        "-?", SO_NONE }, 
 #ifdef _WITH_DEBUG
@@ -227,37 +819,63 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         if (args.OptionId() == OPT_help) {
             return usage(true);
         } else if (args.OptionId() == OPT_ID) {
-            new_rg.ID = args.OptionArg();
+            if (! currentReadGroup().ID.empty())  // --ID again begins the next input's read group
+                input_rgs.push_back(SamReadGroup());
+            currentReadGroup().ID = args.OptionArg();
         } else if (args.OptionId() == OPT_LB) {
-            new_rg.Library = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().Library = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_SM) {
-            new_rg.Sample = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().Sample = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_DS) {
-            new_rg.Description = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().Description = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_DT) {
-            new_rg.ProductionDate = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().ProductionDate = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_PG) {
-            new_rg.Program = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().Program = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_PL) {
-            new_rg.SequencingTechnology = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().SequencingTechnology = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_PU) {
-            new_rg.PlatformUnit = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().PlatformUnit = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_PI) {
-            new_rg.PredictedInsertSize = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().PredictedInsertSize = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_FO) {
-            new_rg.FlowOrder = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().FlowOrder = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_KS) {
-            new_rg.KeySequence = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().KeySequence = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_CN) {
-            new_rg.SequencingCenter = args.OptionArg(); other_rg_opts = true;
+            currentReadGroup().SequencingCenter = args.OptionArg(); other_rg_opts = true;
         } else if (args.OptionId() == OPT_output) {
             output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_split) {
+            split_prefix = args.OptionArg();
         } else if (args.OptionId() == OPT_dictionary) {
             opt_dictionary = true; dictionary_string = args.OptionArg();
+        } else if (args.OptionId() == OPT_rg_map) {
+            rg_map_file = args.OptionArg();
         } else if (args.OptionId() == OPT_replace) {
             opt_replace = true; replace_string = args.OptionArg();
         } else if (args.OptionId() == OPT_clear) {
             opt_clear = true;
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
 #ifdef _WITH_DEBUG
         } else if (args.OptionId() == OPT_debug) {
             opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
@@ -275,27 +893,15 @@ yoruba::main_kojopodipo(int argc, char* argv[])
     if (DEBUG(1) && ! opt_progress)
         opt_progress = debug_progress;
 
-    // set up input location; if file not specified, use /dev/stdin
-    IF_DEBUG(1) {
-        for (int i = 0; i < args.FileCount(); ++i)
-            cerr << NAME << " file argument " << i << ": " << args.File(i) << endl;
-    }
-    if (args.FileCount() > 1) {
-        cerr << NAME << " requires at most one BAM file specified as input" << endl;
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
         return usage();
-    } else if (args.FileCount() == 1) {
-        input_file = args.File(0);
-    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
-        input_file = "/dev/stdin";
-    }
-
-    // set up output; if file not specified, use stdout or its equivalent
-    if (output_file.empty()) {
-        output_file = "/dev/stdout";
     }
 
     // check option semantics
-    if (! opt_clear && ! opt_dictionary && new_rg.ID.empty()) {
+    if (! opt_clear && ! opt_dictionary && rg_map_file.empty() && new_rg.ID.empty()) {
         cerr << NAME << " must define a read group using --ID or --id" << endl;
         return usage();
     }
@@ -303,16 +909,77 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         cerr << NAME << " use only one of --replace or --clear" << endl;
         return usage(true);
     }
+    if (! input_rgs.empty() && opt_replace) {
+        cerr << NAME << " --replace takes only one --ID" << endl;
+        return usage(true);
+    }
+    if (opt_replace && ! rg_map_file.empty()) {
+        cerr << NAME << " --replace cannot be used with --rg-map, use an rg: rule instead" << endl;
+        return usage(true);
+    }
+    if (! rg_map_file.empty() && ! rg_map.Read(rg_map_file))
+        return EXIT_FAILURE;
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
 
-	BamReader reader;
+    if (in_run) {
+        if (args.FileCount() > 0 || ! output_file.empty() || output_opts.WriteIndex()
+            || ! split_prefix.empty() || ! checksum_file.empty() || ! regions.Empty()) {
+            cerr << NAME << " input, output, regions, --write-index, --checksum and --split are for 'yoruba run', not its steps" << endl;
+            return usage();
+        }
+        if (! input_rgs.empty()) {
+            cerr << NAME << " --ID may be given only once in 'yoruba run'" << endl;
+            return usage();
+        }
+        return EXIT_SUCCESS;
+    }
 
-	if (! reader.Open(input_file)) {
-        cerr << NAME << " could not open BAM input" << endl;
-        return EXIT_FAILURE;
+    // set up input location; if file not specified, use /dev/stdin
+    IF_DEBUG(1) {
+        for (int i = 0; i < args.FileCount(); ++i)
+            cerr << NAME << " file argument " << i << ": " << args.File(i) << endl;
+    }
+    for (int i = 0; i < args.FileCount(); ++i)
+        input_files.push_back(args.File(i));
+    if (input_files.empty())  // if unset, read from stdin or its equivalent
+        input_files.push_back("/dev/stdin");
+    if (! input_rgs.empty() && input_rgs.size() + 1 != input_files.size()) {
+        cerr << NAME << " --ID was given " << input_rgs.size() + 1 << " times, but there are " 
+            << input_files.size() << " inputs; give it once, or once for each input" << endl;
+        return usage();
+    }
+    if (input_files.size() > 1 && opt_replace) {
+        cerr << NAME << " --replace can be used only with one input" << endl;
+        return usage();
     }
 
-    SamHeader header = reader.GetHeader();
+    // set up output; if file not specified, use stdout or its equivalent
+    if (! split_prefix.empty()) {
+        if (! output_file.empty()) {
+            cerr << NAME << " use only one of -o/--output or --split" << endl;
+            return usage();
+        }
+    } else if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
 
+// add or change the read group dictionary and add our @PG to the header
+static bool
+rewriteHeader(SamHeader& header)
+{
     IF_DEBUG(2) { 
         if (opt_reads >= 0) 
             cerr << NAME << " modifying up to " << opt_reads << " reads" << endl; 
@@ -349,6 +1016,9 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         printReadGroupDictionary(cerr, header.ReadGroups);
     }
 
+    if (! rg_map.Empty())
+        rg_map.Resolve(header.ReadGroups);
+
     if (opt_clear && header.HasReadGroups())
         header.ReadGroups.Clear();
 
@@ -358,7 +1028,7 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         SamReadGroupDictionary rgd = parseReadGroupDictionaryString(dictionary_string);
         if (rgd.IsEmpty()) {
             cerr << NAME << " error parsing read group dictionary" << endl;
-            return EXIT_FAILURE;
+            return false;
         }
         header.ReadGroups.Add(rgd);
         IF_DEBUG(1) {
@@ -367,6 +1037,9 @@ yoruba::main_kojopodipo(int argc, char* argv[])
         }
     }
 
+    if (! rg_map.Empty())
+        rg_map.Apply(header.ReadGroups);
+
     if (opt_replace) {
 
         if (header.ReadGroups.Contains(replace_string)) {
@@ -382,11 +1055,14 @@ yoruba::main_kojopodipo(int argc, char* argv[])
             header.ReadGroups.Add(new_rg);
         }
 
-    }  else {
+    }  else if (! new_rg.ID.empty()) {
 
-        if (header.ReadGroups.Contains(new_rg.ID))
-            header.ReadGroups.Remove(new_rg.ID);
-        header.ReadGroups.Add(new_rg);
+        for (size_t i = 0; i <= input_rgs.size(); ++i) {
+            const SamReadGroup& rg = inputReadGroup(i);
+            if (header.ReadGroups.Contains(rg.ID))
+                header.ReadGroups.Remove(rg.ID);
+            header.ReadGroups.Add(rg);
+        }
 
     }
 
@@ -407,70 +1083,32 @@ yoruba::main_kojopodipo(int argc, char* argv[])
     } else {
         header.Programs.Add(new_program);
     }
-	
-    //-------------------------------------  open output
-
-    BamWriter writer;
-
-    if (! writer.Open(output_file, header, reader.GetReferenceData())) {
-        cerr << NAME << " could not open output " << output_file << endl;
-        return EXIT_FAILURE;
-    }
-
-	BamAlignment al;  // holds the current read from the BAM file
-    int64_t n_reads = 0;  // number of reads processed
-
-    //-------------------------------------  loop through reads in BAM file
-
-	while (reader.GetNextAlignment(al) && (opt_reads < 0 || n_reads < opt_reads)) {
-
-        ++n_reads;
-
-        if (DEBUG(1) && n_reads <= debug_reads_to_report) {
-            cerr << NAME << " " << n_reads << " read before processing: ";
-            printAlignmentInfo(cerr, al);
-        }
 
-        string RG_tag;
-
-        if (opt_clear) {
-            al.RemoveTag("RG");
-        }
-
-        if (opt_replace) {
-
-            // only modify reads with an RG tag matching replace_string
-            if (al.GetTag("RG", RG_tag) && RG_tag == replace_string) {
-                if (! al.EditTag("RG", "Z", new_rg.ID)) {
-                    cerr << NAME << " could not edit tag for read " << al.Name << endl;
-                    return EXIT_FAILURE;
-                }
-            }
-
-        } else if (! new_rg.ID.empty()) {
-
-            al.AddTag("RG", "Z", new_rg.ID);
-
-        }
-
-        if (DEBUG(1) && n_reads <= debug_reads_to_report) {
-            cerr << NAME << " " << n_reads << " read after processing: ";
-            printAlignmentInfo(cerr, al);
-        }
-
-        writer.SaveAlignment(al);
+    return true;
+}
 
-        if ((opt_progress || DEBUG(1)) && n_reads % opt_progress == 0)
-            cerr << NAME << " " << n_reads << " reads processed..." << endl;
-	}
 
-    if (opt_progress || DEBUG(1)) 
-        cerr << NAME << " " << n_reads << " reads processed" << endl;
+//-------------------------------------
 
-	reader.Close();
-	writer.Close();
 
-	return EXIT_SUCCESS;
+// set the field of rg named by its two-letter SAM tag, false if tag is not one
+static bool
+setReadGroupField(SamReadGroup& rg, const string& tag, const string& val)
+{
+    if (tag == "ID") rg.ID = val;
+    else if (tag == "LB") rg.Library = val;
+    else if (tag == "SM") rg.Sample = val;
+    else if (tag == "DS") rg.Description = val;
+    else if (tag == "DT") rg.ProductionDate = val;
+    else if (tag == "PG") rg.Program = val;
+    else if (tag == "PL") rg.SequencingTechnology = val;
+    else if (tag == "PU") rg.PlatformUnit = val;
+    else if (tag == "PI") rg.PredictedInsertSize = val;
+    else if (tag == "FO") rg.FlowOrder = val;
+    else if (tag == "KS") rg.KeySequence = val;
+    else if (tag == "CN") rg.SequencingCenter = val;
+    else return false;
+    return true;
 }
 
 
@@ -538,19 +1176,8 @@ yoruba::parseReadGroupDictionaryString(const string& in)
                 if (prev_pos < pos) {
                     this_val = dict.substr(prev_pos, (pos - prev_pos));
                     IF_DEBUG(1) cerr << "after escape character, this_val = " << this_val << endl;
-                    if (this_tag == "ID") rg.ID = this_val;
-                    else if (this_tag == "LB") rg.Library = this_val;
-                    else if (this_tag == "SM") rg.Sample = this_val;
-                    else if (this_tag == "DS") rg.Description = this_val;
-                    else if (this_tag == "DT") rg.ProductionDate = this_val;
-                    else if (this_tag == "PG") rg.Program = this_val;
-                    else if (this_tag == "PL") rg.SequencingTechnology = this_val;
-                    else if (this_tag == "PU") rg.PlatformUnit = this_val;
-                    else if (this_tag == "PI") rg.PredictedInsertSize = this_val;
-                    else if (this_tag == "FO") rg.FlowOrder = this_val;
-                    else if (this_tag == "KS") rg.KeySequence = this_val;
-                    else if (this_tag == "CN") rg.SequencingCenter = this_val;
-                    else return empty_rgd;
+                    if (! setReadGroupField(rg, this_tag, this_val))
+                        return empty_rgd;
                     if (dict[pos] == '\n') {
                         if (pos + 1 < dict.length() && dict.substr((pos + 1), 4) != "@RG\t") {
                             cerr << NAME << dict_begin_err << endl;
@@ -577,3 +1204,49 @@ yoruba::parseReadGroupDictionaryString(const string& in)
     return rgd;
 }
 
+
+//-------------------------------------
+
+
+// kojopodipo as a step of 'yoruba run'
+
+class KojopodipoStep : public RunStep {
+
+    public:
+        KojopodipoStep(void) : transform(NULL) { }
+        virtual ~KojopodipoStep(void) { delete transform; }
+
+        virtual int ParseOptions(int argc, char* argv[]) {
+            return parseOptions(argc, argv, true);
+        }
+        virtual bool RewriteHeader(SamHeader& header, RefVector& refs) {
+            return rewriteHeader(header);
+        }
+        virtual RecordTransform& Transform(int n_workers) {
+            delete transform;
+            transform = new ReadGroupTransform(new_rg.ID, n_workers);
+            return *transform;
+        }
+        virtual bool Finish(void) {
+            int64_t n_map[3] = { 0, 0, 0 };
+            transform->AddMapCounts(n_map);
+            if (! rg_map.Empty())
+                reportMap(n_map);
+            return true;
+        }
+
+    private:
+        ReadGroupTransform* transform;
+
+};
+
+
+//-------------------------------------
+
+
+RunStep*
+yoruba::newKojopodipoStep(void)
+{
+    return new KojopodipoStep;
+}
+
@@ -26,6 +26,9 @@
 // Yoruba includes
 #include "yoruba.h"
 #include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_pipeline.h"
+#include "yoruba_stats.h"
 
 #ifndef _YORUBA_MAIN
 #define NAME "[yoruba_readgroup]"
@@ -0,0 +1,212 @@
+// yoruba_mates.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Fetching the mates of reads in batches, see yoruba_mates.h
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- fetch on a thread of its own while the caller gathers the next requests
+
+#include <algorithm>
+#include <cstring>
+
+#include "yoruba_mates.h"
+
+using namespace std;
+using namespace yoruba;
+
+
+//-------------------------------------
+
+
+// FNV-1a of the name, with the segment flag bits folded in and mixed
+static inline uint64_t
+fingerprint(const char* s, size_t len, uint16_t segment)
+{
+    uint64_t h = 14695981039346656037ULL;
+    for (size_t i = 0; i < len; ++i)
+        h = (h ^ uint8_t(s[i])) * 1099511628211ULL;
+    h ^= uint64_t(segment) << 56;
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdULL;
+    h ^= h >> 33;
+    return h;
+}
+
+
+// requests ordered by position and then fingerprint, so those for one
+// position can be searched by fingerprint; ties keep the request order
+struct MateFetcher::byPosition {
+    const vector<MateRequest>& r;
+    explicit byPosition(const vector<MateRequest>& req) : r(req) { }
+    bool operator()(size_t a, size_t b) const {
+        if (r[a].ref != r[b].ref)
+            return r[a].ref < r[b].ref;
+        if (r[a].pos != r[b].pos)
+            return r[a].pos < r[b].pos;
+        if (r[a].fingerprint != r[b].fingerprint)
+            return r[a].fingerprint < r[b].fingerprint;
+        return a < b;
+    }
+};
+
+
+//-------------------------------------
+
+
+bool
+MateFetcher::Open(const string& filename)
+{
+    if (! reader.Open(filename)) {
+        cerr << "yoruba::MateFetcher: could not open " << filename << endl;
+        return false;
+    }
+    if (! index.Load(filename)) {
+        cerr << "yoruba::MateFetcher: fetching mates needs an indexed BAM file, and none was found for "
+            << filename << endl;
+        return false;
+    }
+    start_voffset = reader.Tell();
+    return true;
+}
+
+
+//-------------------------------------
+
+
+size_t
+MateFetcher::Request(const RawRecord& rec)
+{
+    MateRequest r;
+    const uint16_t flag = rec.Flag();
+    // the mate is the other read of the pair: first for second, second for first
+    r.segment = uint16_t(((flag & 0x0040) << 1) | ((flag & 0x0080) >> 1));
+    r.ref = rec.IsPaired() && rec.MatePosition() >= 0 ? rec.MateRefID() : -1;
+    r.pos = rec.MatePosition();
+    r.fingerprint = fingerprint(rec.Name(), rec.NameLength(), r.segment);
+    r.name = names.length();
+    r.name_length = uint16_t(rec.NameLength());
+    r.mate = -1;
+    names.append(rec.Name(), rec.NameLength());
+    requests.push_back(r);
+    return requests.size() - 1;
+}
+
+
+//-------------------------------------
+
+
+void
+MateFetcher::Clear(void)
+{
+    requests.clear();
+    names.clear();
+    mates.clear();
+    n_found = 0;
+}
+
+
+//-------------------------------------
+
+
+bool
+MateFetcher::matches(const MateRequest& r, const RawRecord& rec) const
+{
+    return (rec.Flag() & 0x00c0) == r.segment
+        && rec.NameLength() == r.name_length
+        && memcmp(rec.Name(), names.data() + r.name, r.name_length) == 0;
+}
+
+
+//-------------------------------------
+
+
+bool
+MateFetcher::Fetch(void)
+{
+    vector<size_t> order;
+    order.reserve(requests.size());
+    for (size_t i = 0; i < requests.size(); ++i)
+        if (requests[i].ref >= 0 && requests[i].mate < 0)
+            order.push_back(i);
+    sort(order.begin(), order.end(), byPosition(requests));
+
+    // the sweep only ever moves forward, so it starts from the first record
+    n_seeks = 0;
+    if (reader.Tell() != start_voffset && ! reader.Seek(start_voffset)) {
+        cerr << "yoruba::MateFetcher: could not seek to the first record" << endl;
+        return false;
+    }
+
+    RawRecord rec;
+    bool have = false;  // rec was read and not yet passed
+    for (size_t i = 0; i < order.size(); ) {
+        const int32_t ref = requests[order[i]].ref;
+        const int32_t pos = requests[order[i]].pos;
+        size_t j = i + 1;
+        while (j < order.size() && requests[order[j]].ref == ref && requests[order[j]].pos == pos)
+            ++j;
+
+        // seek only to skip past the block being read; a mate in it, or
+        // where the index cannot place it any later, is reached by reading on
+        const int64_t voffset = max(int64_t(index.Offset(ref, pos)), start_voffset);
+        if ((voffset >> 16) > (reader.Tell() >> 16)) {
+            if (! reader.Seek(voffset)) {
+                cerr << "yoruba::MateFetcher: could not seek to " << ref << ":" << pos << endl;
+                return false;
+            }
+            have = false;
+            ++n_seeks;
+        }
+
+        while (true) {
+            if (! have && ! reader.GetNextRecord(rec)) {
+                if (reader.Failed()) {
+                    cerr << "yoruba::MateFetcher: error reading BAM" << endl;
+                    return false;
+                }
+                return true;  // the rest are not in the BAM
+            }
+            have = true;
+            // reads without a reference sort last
+            if (uint32_t(rec.RefID()) < uint32_t(ref) || (rec.RefID() == ref && rec.Position() < pos)) {
+                have = false;
+                continue;
+            }
+            if (rec.RefID() != ref || rec.Position() > pos)
+                break;  // past this position, and maybe at the next
+            have = false;
+            if (rec.Flag() & 0x0900)  // only primary alignments are mates
+                continue;
+
+            // the requests for this position are ordered by fingerprint
+            const uint64_t fp = fingerprint(rec.Name(), rec.NameLength(), rec.Flag() & 0x00c0);
+            size_t lo = i, hi = j;
+            while (lo < hi) {
+                size_t mid = lo + (hi - lo) / 2;
+                if (requests[order[mid]].fingerprint < fp)
+                    lo = mid + 1;
+                else
+                    hi = mid;
+            }
+            int64_t m = -1;
+            for (; lo < j && requests[order[lo]].fingerprint == fp; ++lo) {
+                MateRequest& r = requests[order[lo]];
+                if (r.mate >= 0 || ! matches(r, rec))
+                    continue;
+                if (m < 0) {
+                    m = int64_t(mates.size());
+                    mates.push_back(rec);
+                }
+                r.mate = m;
+                ++n_found;
+            }
+        }
+        i = j;
+    }
+    return true;
+}
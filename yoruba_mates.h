@@ -0,0 +1,102 @@
+// yoruba_mates.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_mates.cpp
+//
+// MateFetcher finds the mates of reads in a coordinate-sorted, indexed BAM,
+// many at a time.  Jumping to each mate and back again, as the old
+// lookForMate() did, inflates the blocks around both reads for every pair
+// and loses the place of the reader it jumps; fetching the mates together in
+// position order reads each block holding them once.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_MATES_H_
+#define _YORUBA_MATES_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_index.h"
+
+namespace yoruba {
+
+// Requests are gathered first, each for the mate of a read, from the read's
+// MateRefID and MatePosition and a fingerprint of its name and of which read
+// of the pair the mate is.  Fetch() then sorts them by position, and makes
+// one forward sweep through the BAM on a reader of its own, seeking with the
+// index only where the next mate is in a later BGZF block than the one being
+// read, so requests for mates in the same block share the block.  A record
+// is the mate if it is at the position asked for, is the primary alignment
+// of the other read of the pair, and its name matches.  Mates are kept, and
+// handed back by the index Request() gave, in the order requested.
+//
+// Reads that are not paired, or whose mate has no reference, can be
+// requested and are never found, so callers can request for every read.
+
+class MateFetcher {
+
+    public:
+        MateFetcher(void) : start_voffset(0), n_found(0), n_seeks(0) { }
+
+        // open filename and its index; false after saying why
+        bool        Open(const std::string& filename);
+        void        Close(void) { reader.Close(); }
+        const BamTools::RefVector&  GetReferenceData(void) const { return reader.GetReferenceData(); }
+
+        // ask for the mate of rec; returns the index of the request
+        size_t      Request(const RawRecord& rec);
+        size_t      Requests(void) const { return requests.size(); }
+
+        // read the mates of every request; false after saying why if the
+        // BAM could not be read
+        bool        Fetch(void);
+        // the mate of request i, or NULL if it was not found
+        const RawRecord* Mate(size_t i) const {
+            return requests[i].mate < 0 ? NULL : &mates[size_t(requests[i].mate)];
+        }
+        int64_t     Found(void) const { return n_found; }
+        int64_t     Seeks(void) const { return n_seeks; }  // by the last Fetch()
+
+        // forget the requests and their mates, to gather more
+        void        Clear(void);
+
+    private:
+        struct MateRequest {
+            int32_t     ref;
+            int32_t     pos;
+            uint64_t    fingerprint;  // of the name and segment
+            size_t      name;         // offset of the name in names
+            uint16_t    name_length;
+            uint16_t    segment;      // the mate's first/second flag bits
+            int64_t     mate;         // index into mates, -1 if not found
+        };
+        struct byPosition;
+
+        bool        matches(const MateRequest& r, const RawRecord& rec) const;
+
+        RawBamReader                reader;
+        BamIndex                    index;
+        int64_t                     start_voffset;  // of the first record
+        std::vector<MateRequest>    requests;
+        std::string                 names;          // of every request, one after another
+        std::vector<RawRecord>      mates;
+        int64_t                     n_found;
+        int64_t                     n_seeks;
+
+};  // class MateFetcher
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_MATES_H_
@@ -0,0 +1,1005 @@
+// yoruba_pipeline.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// A reader -> worker(s) -> writer pipeline for RawRecords, see yoruba_pipeline.h
+//
+// Uses pthreads and the GCC __atomic builtins
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- deflate in parallel; the writer thread is the bottleneck with fast transforms
+
+#include <iostream>
+#include <sstream>
+#include <algorithm>
+#include <tr1/unordered_map>
+#include <sched.h>
+#include <time.h>
+
+#include "yoruba_pipeline.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+const size_t RecordBatch::BATCH_BYTES;
+
+
+// spin briefly, then yield, then sleep while waiting on another thread
+static void
+backoff(unsigned& n)
+{
+    if (++n < 64) {
+        return;
+    } else if (n < 128) {
+        sched_yield();
+    } else {
+        struct timespec ts = { 0, 50000 };  // 50 microseconds
+        nanosleep(&ts, NULL);
+    }
+}
+
+
+//-------------------------------------
+//-------------------------------------  RecordBatch
+//-------------------------------------
+
+
+void
+RecordBatch::append(vector<char>& buf, size_t& len, const RawRecord& rec)
+{
+    size_t need = len + 4 + rec.Size();
+    if (need > buf.size()) {
+        MEMTRACK_TAG("RecordBatch");
+        buf.resize(need < BATCH_BYTES + BATCH_BYTES / 4 ? BATCH_BYTES + BATCH_BYTES / 4 : need * 2);
+    }
+    int32_t block_size = int32_t(rec.Size());
+    memcpy(&buf[len], &block_size, 4);
+    memcpy(&buf[len + 4], rec.Data(), rec.Size());
+    len = need;
+}
+
+
+//-------------------------------------
+//-------------------------------------  Pipeline
+//-------------------------------------
+
+
+Pipeline::Pipeline(RawBamReader& r, RawBamWriter& w, RecordTransform& t, int n_workers)
+    : reader(&r), merge(NULL), writer(&w), split(NULL), transform(t), free_batches(0),
+      max_records(-1), progress(NULL), passthrough(false), n_read(0), n_written(0),
+      n_blocks_copied(0), failed(0)
+{
+    init(n_workers);
+}
+
+
+Pipeline::Pipeline(MergeReader& m, RawBamWriter& w, RecordTransform& t, int n_workers)
+    : reader(NULL), merge(&m), writer(&w), split(NULL), transform(t), free_batches(0),
+      max_records(-1), progress(NULL), passthrough(false), n_read(0), n_written(0),
+      n_blocks_copied(0), failed(0)
+{
+    init(n_workers);
+}
+
+
+Pipeline::Pipeline(RawBamReader& r, SplitWriter& s, RecordTransform& t, int n_workers)
+    : reader(&r), merge(NULL), writer(NULL), split(&s), transform(t), free_batches(0),
+      max_records(-1), progress(NULL), passthrough(false), n_read(0), n_written(0),
+      n_blocks_copied(0), failed(0)
+{
+    init(n_workers);
+}
+
+
+Pipeline::Pipeline(MergeReader& m, SplitWriter& s, RecordTransform& t, int n_workers)
+    : reader(NULL), merge(&m), writer(NULL), split(&s), transform(t), free_batches(0),
+      max_records(-1), progress(NULL), passthrough(false), n_read(0), n_written(0),
+      n_blocks_copied(0), failed(0)
+{
+    init(n_workers);
+}
+
+
+//-------------------------------------
+
+
+void
+Pipeline::init(int n_workers)
+{
+    if (n_workers < 1 || ! transform.IsOrderIndependent())
+        n_workers = 1;
+    // enough batches for each worker to have one in, one out and one being
+    // worked on, plus one each for the reader and writer; with rings this
+    // large a push never finds a ring full
+    size_t n_batches = 4 * n_workers + 2;
+    batches.resize(n_batches);
+    for (size_t i = 0; i < n_batches; ++i)
+        batches[i] = new RecordBatch;
+    free_batches.Reset(n_batches);
+    for (size_t i = 0; i < n_batches; ++i)
+        free_batches.TryPush(batches[i]);
+    workers.resize(n_workers);
+    for (int i = 0; i < n_workers; ++i) {
+        workers[i] = new Worker(n_batches);
+        workers[i]->pipeline = this;
+        workers[i]->index = i;
+    }
+}
+
+
+//-------------------------------------
+
+
+Pipeline::~Pipeline(void)
+{
+    for (size_t i = 0; i < workers.size(); ++i)
+        delete workers[i];
+    for (size_t i = 0; i < batches.size(); ++i)
+        delete batches[i];
+}
+
+
+//-------------------------------------
+
+
+bool
+Pipeline::pop(SpscRing<RecordBatch*>& ring, RecordBatch*& b)
+{
+    unsigned n = 0;
+    while (! ring.TryPop(b)) {
+        if (isFailed())
+            return false;
+        backoff(n);
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+Pipeline::push(SpscRing<RecordBatch*>& ring, RecordBatch* b)
+{
+    unsigned n = 0;
+    while (! ring.TryPush(b))
+        backoff(n);  // should not happen, the rings hold every batch
+}
+
+
+//-------------------------------------
+
+
+bool
+Pipeline::Run(void)
+{
+    pthread_t reader_thread;
+    size_t n_started = 0;
+    bool ok = true;
+
+    if (pthread_create(&reader_thread, NULL, readerThread, this) != 0) {
+        cerr << "yoruba::Pipeline::Run(): could not start reader thread" << endl;
+        return false;
+    }
+    for (; n_started < workers.size(); ++n_started) {
+        if (pthread_create(&workers[n_started]->thread, NULL, workerThread, workers[n_started]) != 0) {
+            cerr << "yoruba::Pipeline::Run(): could not start worker thread" << endl;
+            fail();
+            ok = false;
+            break;
+        }
+    }
+
+    if (ok)
+        ok = writerLoop();
+    if (! ok)
+        fail();  // release any thread still waiting
+
+    pthread_join(reader_thread, NULL);
+    for (size_t i = 0; i < n_started; ++i)
+        pthread_join(workers[i]->thread, NULL);
+
+    // a reader stopped by a truncated or corrupt input looks like one at
+    // its end to the reader thread
+    if (ok && reader != NULL && reader->Failed()) {
+        cerr << "yoruba::Pipeline: error reading input" << endl;
+        ok = false;
+    }
+    return ok && ! isFailed() && (merge == NULL || ! merge->Failed());
+}
+
+
+//-------------------------------------
+
+
+void*
+Pipeline::readerThread(void* arg)
+{
+    static_cast<Pipeline*>(arg)->readerLoop();
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+void*
+Pipeline::workerThread(void* arg)
+{
+    Worker* w = static_cast<Worker*>(arg);
+    w->pipeline->workerLoop(*w);
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+void
+Pipeline::readerLoop(void)
+{
+    RawRecord rec;
+    int64_t sequence = 0;
+    bool more = true;
+
+    while (more) {
+        RecordBatch* b;
+        if (! pop(free_batches, b))
+            return;
+        b->Clear();
+        b->sequence = sequence;
+        while (! b->IsFull()) {
+            const char* raw;
+            const char* data;
+            size_t raw_length, length, n_block;
+            if (passthrough && reader != NULL && writer != NULL && unchangedBlock(data, length, raw, raw_length, n_block)) {
+                if (b->n_records == 0) {  // the block is a batch by itself
+                    b->data.assign(raw, raw + raw_length);
+                    b->length = raw_length;
+                    b->n_records = n_block;
+                    b->raw = true;
+                    if (writer->NeedsRecords()) {  // the index or checksum needs the records too
+                        b->out.assign(data, data + length);
+                        b->out_length = length;
+                    }
+                    reader->SkipBlock(n_block);
+                    n_read += n_block;
+                    if (progress != NULL)
+                        progress->Add(int64_t(n_block), reader->Tell());
+                }
+                break;  // otherwise it starts the next batch
+            }
+            if ((max_records >= 0 && n_read >= max_records) || ! nextRecord(rec)) {
+                more = false;
+                break;
+            }
+            b->Append(rec);
+            ++n_read;
+            if (progress != NULL)
+                progress->Add(rec, tell());
+        }
+        b->last = ! more;
+        push(workers[sequence % workers.size()]->in, b);
+        ++sequence;
+    }
+
+    // the worker that got the last batch stops after it, the rest stop now
+    for (size_t i = 0; i < workers.size(); ++i)
+        if (i != size_t((sequence - 1) % workers.size()))
+            push(workers[i]->in, NULL);
+}
+
+
+//-------------------------------------
+
+
+// true if the next input block holds only whole records that the transform
+// leaves unchanged, and all of it may be read
+bool
+Pipeline::unchangedBlock(const char*& data, size_t& length,
+                         const char*& raw, size_t& raw_length, size_t& n_records)
+{
+    if (! reader->PeekBlock(data, length, raw, raw_length) || length == 0)
+        return false;
+
+    RawRecord rec;
+    n_records = 0;
+    for (size_t off = 0; off < length; ) {
+        int32_t block_size;
+        if (length - off < 4)
+            return false;  // a record continues into the next block
+        memcpy(&block_size, data + off, 4);
+        if (block_size < 32 || length - off - 4 < size_t(block_size))
+            return false;
+        rec.SetView(const_cast<char*>(data + off + 4), block_size);
+        if (! transform.Unchanged(rec))
+            return false;
+        off += 4 + block_size;
+        ++n_records;
+    }
+    return max_records < 0 || n_read + int64_t(n_records) <= max_records;
+}
+
+
+//-------------------------------------
+
+
+void
+Pipeline::workerLoop(Worker& w)
+{
+    RawRecord rec;
+    RecordBatch* b;
+
+    while (pop(w.in, b) && b != NULL) {
+        if (b->raw) {
+            bool last = b->last;
+            push(w.out, b);
+            if (last)
+                break;
+            continue;
+        }
+        b->out_length = 0;
+        size_t n_kept = 0;
+        for (size_t off = 0; off < b->length; ) {
+            int32_t block_size;
+            memcpy(&block_size, &b->data[off], 4);
+            rec.SetView(&b->data[off + 4], block_size);
+            off += 4 + block_size;
+            if (transform.Apply(rec, w.index)) {
+                RecordBatch::append(b->out, b->out_length, rec);
+                ++n_kept;
+            }
+        }
+        if (transform.Failed())
+            fail();
+        b->data.swap(b->out);
+        b->length = b->out_length;
+        b->n_records = n_kept;
+        bool last = b->last;
+        push(w.out, b);
+        if (last)
+            break;
+    }
+}
+
+
+//-------------------------------------
+
+
+bool
+Pipeline::writerLoop(void)
+{
+    for (int64_t sequence = 0; ; ++sequence) {
+        RecordBatch* b;
+        if (! pop(workers[sequence % workers.size()]->out, b))
+            return false;
+        if (b->raw) {
+            bool ok = writer->NeedsRecords()
+                ? writer->SaveBlock(&b->data[0], b->length, b->n_records, &b->out[0], b->out_length)
+                : writer->SaveBlock(&b->data[0], b->length, b->n_records);
+            if (! ok) {
+                cerr << "yoruba::Pipeline: error writing output" << endl;
+                return false;
+            }
+            ++n_blocks_copied;
+        } else if (b->length > 0 && ! (split != NULL ? split->SaveRecords(&b->data[0], b->length)
+                                                     : writer->SaveRecords(&b->data[0], b->length))) {
+            cerr << "yoruba::Pipeline: error writing output" << endl;
+            return false;
+        }
+        n_written += b->n_records;
+        bool last = b->last;
+        push(free_batches, b);
+        if (last)
+            return true;
+    }
+}
+
+
+
+//-------------------------------------
+//-------------------------------------  MergeReader
+//-------------------------------------
+
+
+const size_t MergeReader::BATCHES_PER_INPUT;
+
+
+bool
+MergeReader::Open(const vector<string>& filenames)
+{
+    Close();
+    tr1::unordered_map<string, int32_t> ref_index;  // output ID by reference name
+
+    for (size_t i = 0; i < filenames.size(); ++i) {
+        Input* in = new Input;
+        inputs.push_back(in);
+        in->filename = filenames[i];
+        in->merge = this;
+        if (! in->reader.Open(filenames[i])) {
+            cerr << "yoruba::MergeReader: could not open " << filenames[i] << endl;
+            Close();
+            return false;
+        }
+        const RefVector& in_refs = in->reader.GetReferenceData();
+        in->ref_id.resize(in_refs.size());
+        in->translate = false;
+        int32_t prev_id = -1;
+        for (size_t r = 0; r < in_refs.size(); ++r) {
+            tr1::unordered_map<string, int32_t>::const_iterator rI = ref_index.find(in_refs[r].RefName);
+            int32_t id;
+            if (rI == ref_index.end()) {
+                id = int32_t(refs.size());
+                ref_index[in_refs[r].RefName] = id;
+                refs.push_back(in_refs[r]);
+            } else {
+                id = rI->second;
+                if (refs[id].RefLength != in_refs[r].RefLength) {
+                    cerr << "yoruba::MergeReader: reference " << in_refs[r].RefName << " of " 
+                        << filenames[i] << " has length " << in_refs[r].RefLength << ", not " 
+                        << refs[id].RefLength << " as in an earlier input" << endl;
+                    Close();
+                    return false;
+                }
+            }
+            if (id <= prev_id) {
+                cerr << "yoruba::MergeReader: the references of " << filenames[i] 
+                    << " are not in the same order as in an earlier input" << endl;
+                Close();
+                return false;
+            }
+            prev_id = id;
+            in->ref_id[r] = id;
+            in->translate = in->translate || id != int32_t(r);
+        }
+        for (size_t b = 0; b < BATCHES_PER_INPUT; ++b)
+            in->free.TryPush(&in->batches[b]);
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+MergeReader::SetRegions(const RegionList& list)
+{
+    for (size_t i = 0; i < inputs.size(); ++i)
+        if (! inputs[i]->reader.SetRegions(list))
+            return false;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+MergeReader::Close(void)
+{
+    if (started) {
+        fail();  // an input thread still reading stops at its next batch
+        for (size_t i = 0; i < inputs.size(); ++i)
+            pthread_join(inputs[i]->thread, NULL);
+        started = false;
+    }
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        inputs[i]->reader.Close();
+        delete inputs[i];
+    }
+    inputs.clear();
+    refs.clear();
+    failed = 0;
+    last = -1;
+}
+
+
+//-------------------------------------
+
+
+RawHeader
+MergeReader::GetHeader(void) const
+{
+    RawHeader header = GetInputHeader(0);
+    SamHeader& meta = header.Meta();
+    size_t n_refs = inputs[0]->reader.GetReferenceData().size();  // in the header so far
+
+    for (size_t i = 1; i < inputs.size(); ++i) {
+        const RawHeader& in_header = GetInputHeader(i);
+        const SamHeader& in_meta = in_header.Meta();
+        const RefVector& in_refs = inputs[i]->reader.GetReferenceData();
+        for (size_t r = 0; r < in_refs.size(); ++r) {
+            if (size_t(inputs[i]->ref_id[r]) < n_refs)
+                continue;
+            long sq = in_header.FindSequence(in_refs[r].RefName);
+            if (sq >= 0) {
+                header.AddSequenceLine(in_header.SequenceLine(sq));
+            } else {
+                ostringstream line;
+                line << "@SQ\tSN:" << in_refs[r].RefName << "\tLN:" << in_refs[r].RefLength;
+                header.AddSequenceLine(line.str());
+            }
+            ++n_refs;
+        }
+        for (SamReadGroupConstIterator rgI = in_meta.ReadGroups.ConstBegin();
+                rgI != in_meta.ReadGroups.ConstEnd(); ++rgI) {
+            if (! meta.ReadGroups.Contains(rgI->ID)) {
+                SamReadGroup rg = *rgI;
+                meta.ReadGroups.Add(rg);
+            }
+        }
+        for (SamProgramConstIterator pgI = in_meta.Programs.ConstBegin();
+                pgI != in_meta.Programs.ConstEnd(); ++pgI) {
+            if (! meta.Programs.Contains(pgI->ID)) {
+                SamProgram pg = *pgI;
+                meta.Programs.Add(pg);
+            }
+        }
+        for (size_t c = 0; c < in_meta.Comments.size(); ++c)
+            if (find(meta.Comments.begin(), meta.Comments.end(), in_meta.Comments[c])
+                    == meta.Comments.end())
+                meta.Comments.push_back(in_meta.Comments[c]);
+    }
+    meta.SortOrder = "coordinate";
+    return header;
+}
+
+
+//-------------------------------------
+
+
+int64_t
+MergeReader::InputSize(void) const
+{
+    int64_t size = 0;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (inputs[i]->reader.InputSize() == 0)
+            return 0;
+        size += inputs[i]->reader.InputSize();
+    }
+    return size;
+}
+
+
+//-------------------------------------
+
+
+int64_t
+MergeReader::Tell(void) const
+{
+    int64_t address = 0;
+    for (size_t i = 0; i < inputs.size(); ++i)
+        address += inputs[i]->address;
+    return address << 16;
+}
+
+
+//-------------------------------------
+
+
+bool
+MergeReader::pop(SpscRing<RecordBatch*>& ring, RecordBatch*& b)
+{
+    unsigned n = 0;
+    while (! ring.TryPop(b)) {
+        if (Failed())
+            return false;
+        backoff(n);
+    }
+    return true;
+}
+
+
+void
+MergeReader::push(SpscRing<RecordBatch*>& ring, RecordBatch* b)
+{
+    unsigned n = 0;
+    while (! ring.TryPush(b))
+        backoff(n);  // should not happen, the rings hold every batch
+}
+
+
+//-------------------------------------
+
+
+void*
+MergeReader::inputThread(void* arg)
+{
+    Input* in = static_cast<Input*>(arg);
+    in->merge->inputLoop(*in);
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+// fill batches with the input's records, translated and transformed, until
+// the input runs out or the merge stops
+void
+MergeReader::inputLoop(Input& in)
+{
+    RawRecord rec;
+    uint64_t prev_key = 0;
+    bool more = true;
+
+    while (more) {
+        RecordBatch* b;
+        if (! pop(in.free, b))
+            return;
+        b->Clear();
+        while (! b->IsFull()) {
+            if (! in.reader.GetNextRecord(rec)) {
+                if (in.reader.Failed()) {
+                    cerr << "yoruba::MergeReader: error reading " << in.filename << endl;
+                    fail();
+                    return;
+                }
+                more = false;
+                break;
+            }
+            uint64_t k = coordinateSortKey(rec);
+            if (k < prev_key) {
+                cerr << "yoruba::MergeReader: " << in.filename << " is not sorted by coordinate, " 
+                    << rec.NameString() << " is out of order" << endl;
+                fail();
+                return;
+            }
+            prev_key = k;
+            if (in.translate) {
+                if (rec.RefID() >= 0)
+                    rec.SetRefID(in.ref_id[rec.RefID()]);
+                if (rec.MateRefID() >= 0)
+                    rec.SetMateRefID(in.ref_id[rec.MateRefID()]);
+            }
+            if (in.transform != NULL && ! in.transform->Apply(rec, 0))
+                continue;
+            b->Append(rec);
+        }
+        if (in.transform != NULL && in.transform->Failed()) {
+            fail();
+            return;
+        }
+        b->last = ! more;
+        b->end_voffset = in.reader.Tell();
+        push(in.full, b);
+    }
+}
+
+
+//-------------------------------------
+
+
+bool
+MergeReader::start(void)
+{
+    started = true;
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (pthread_create(&inputs[i]->thread, NULL, inputThread, inputs[i]) != 0) {
+            cerr << "yoruba::MergeReader: could not start input thread" << endl;
+            fail();
+            for (size_t j = 0; j < i; ++j)
+                pthread_join(inputs[j]->thread, NULL);
+            started = false;
+            return false;
+        }
+    }
+    tree.Reset(inputs.size());
+    for (size_t i = 0; i < inputs.size(); ++i) {
+        if (next(i))
+            tree.Set(i, key(i));
+        else if (Failed())
+            return false;
+    }
+    tree.Build();
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// the next record of input i is at current->data[offset]
+bool
+MergeReader::next(size_t i)
+{
+    Input& in = *inputs[i];
+    if (in.current != NULL) {
+        int32_t block_size;
+        memcpy(&block_size, &in.current->data[in.offset], 4);
+        in.offset += 4 + block_size;
+    }
+    while (in.current == NULL || in.offset >= in.current->length) {
+        if (in.current != NULL) {
+            bool last = in.current->last;
+            push(in.free, in.current);
+            in.current = NULL;
+            if (last)
+                return false;
+        }
+        if (! pop(in.full, in.current))
+            return false;
+        in.offset = 0;
+        in.address = in.current->end_voffset >> 16;
+    }
+    return true;
+}
+
+
+uint64_t
+MergeReader::key(size_t i) const
+{
+    RawRecord rec;
+    const Input& in = *inputs[i];
+    int32_t block_size;
+    memcpy(&block_size, &in.current->data[in.offset], 4);
+    rec.SetView(const_cast<char*>(&in.current->data[in.offset + 4]), block_size);
+    return coordinateSortKey(rec);
+}
+
+
+//-------------------------------------
+
+
+bool
+MergeReader::GetNextRecord(RawRecord& rec)
+{
+    if (! started && ! start())
+        return false;
+    if (last >= 0) {  // done with the record last returned
+        if (next(size_t(last)))
+            tree.Update(size_t(last), key(size_t(last)));
+        else
+            tree.Finish(size_t(last));
+    }
+    if (Failed() || tree.Empty()) {
+        last = -1;
+        return false;
+    }
+    last = long(tree.Winner());
+    Input& in = *inputs[last];
+    int32_t block_size;
+    memcpy(&block_size, &in.current->data[in.offset], 4);
+    rec.SetView(&in.current->data[in.offset + 4], block_size);
+    return true;
+}
+
+
+
+//-------------------------------------
+//-------------------------------------  SplitWriter
+//-------------------------------------
+
+
+const size_t SplitWriter::BATCH_BYTES;
+const size_t SplitWriter::BATCHES_PER_OUTPUT;
+
+
+bool
+SplitWriter::Add(const string& value, const string& filename,
+                 const RawHeader& header, const SamHeader& meta)
+{
+    if (values.Find(value) >= 0) {
+        cerr << "yoruba::SplitWriter: " << tag << " value " << value << " already has an output" << endl;
+        return false;
+    }
+    Output* out = start(filename, header, meta);
+    if (out == NULL)
+        return false;
+    values.Add(value);
+    outputs.push_back(out);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// a new output with its thread started, which opens the file
+SplitWriter::Output*
+SplitWriter::start(const string& filename, const RawHeader& header, const SamHeader& meta)
+{
+    Output* out = new Output;
+    out->filename = filename;
+    out->header = &header;
+    out->meta = meta;
+    out->split = this;
+    for (size_t b = 0; b < BATCHES_PER_OUTPUT; ++b)
+        out->free.push_back(&out->batches[b]);
+    pthread_mutex_init(&out->lock, NULL);
+    pthread_cond_init(&out->wake, NULL);
+    if (pthread_create(&out->thread, NULL, outputThread, out) != 0) {
+        cerr << "yoruba::SplitWriter: could not start output thread for " << filename << endl;
+        pthread_cond_destroy(&out->wake);
+        pthread_mutex_destroy(&out->lock);
+        delete out;
+        return NULL;
+    }
+    return out;
+}
+
+
+//-------------------------------------
+
+
+void*
+SplitWriter::outputThread(void* arg)
+{
+    Output* out = static_cast<Output*>(arg);
+    out->split->outputLoop(*out);
+    return NULL;
+}
+
+
+// write batches until closed; after an error, batches are still taken and
+// given back so the caller never waits on this output
+void
+SplitWriter::outputLoop(Output& out)
+{
+    // with millions of @SQ lines the text is large, so it is made here and
+    // let go of as soon as it is written
+    bool ok = opts.Open(out.writer, out.filename, out.header->ToString(out.meta), refs);
+    if (! ok) {
+        cerr << "yoruba::SplitWriter: could not open " << out.filename << endl;
+        fail();
+    }
+
+    pthread_mutex_lock(&out.lock);
+    while (true) {
+        while (out.full.empty() && ! out.closing)
+            pthread_cond_wait(&out.wake, &out.lock);
+        if (out.full.empty())
+            break;
+        RecordBatch* b = out.full.front();
+        out.full.pop_front();
+        pthread_mutex_unlock(&out.lock);
+
+        if (ok && ! out.writer.SaveRecords(&b->data[0], b->length)) {
+            cerr << "yoruba::SplitWriter: error writing " << out.filename << endl;
+            ok = false;
+            fail();
+        }
+        out.n_records += int64_t(b->n_records);
+        b->Clear();
+
+        pthread_mutex_lock(&out.lock);
+        out.free.push_back(b);
+        pthread_cond_signal(&out.wake);
+    }
+    pthread_mutex_unlock(&out.lock);
+
+    if (out.writer.IsOpen() && ! out.writer.Close()) {
+        cerr << "yoruba::SplitWriter: error closing " << out.filename << endl;
+        fail();
+    }
+}
+
+
+//-------------------------------------
+
+
+// the output for rec, the default output if its tag has no output of its own
+SplitWriter::Output*
+SplitWriter::find(const RawRecord& rec)
+{
+    const char* val;
+    size_t len;
+    int i = rec.GetTagString(tag, val, len) ? values.Find(val, len) : -1;
+    if (i >= 0)
+        return outputs[i];
+    if (fallback == NULL && ! default_filename.empty() && ! fallback_failed) {
+        fallback = start(default_filename, *default_header, default_meta);
+        if (fallback == NULL) {  // tried once, and the split has failed
+            fallback_failed = true;
+            fail();
+        }
+    }
+    return fallback;
+}
+
+
+// hand the current batch of out to its thread
+void
+SplitWriter::submit(Output& out)
+{
+    pthread_mutex_lock(&out.lock);
+    out.full.push_back(out.current);
+    out.current = NULL;
+    pthread_cond_signal(&out.wake);
+    pthread_mutex_unlock(&out.lock);
+}
+
+
+//-------------------------------------
+
+
+bool
+SplitWriter::SaveRecord(const RawRecord& rec)
+{
+    Output* out = find(rec);
+    if (out == NULL)  // no default output, the record is dropped
+        return ! Failed();
+
+    if (out->current == NULL) {
+        pthread_mutex_lock(&out->lock);
+        while (out->free.empty())
+            pthread_cond_wait(&out->wake, &out->lock);
+        out->current = out->free.front();
+        out->free.pop_front();
+        pthread_mutex_unlock(&out->lock);
+        if (out->current->data.size() < BATCH_BYTES + BATCH_BYTES / 4) {
+            // sized here, as RecordBatch::append() would size it for a pipeline
+            MEMTRACK_TAG("RecordBatch");
+            out->current->data.resize(BATCH_BYTES + BATCH_BYTES / 4);
+        }
+    }
+    out->current->Append(rec);
+    if (out->current->length >= BATCH_BYTES)
+        submit(*out);
+    return ! Failed();
+}
+
+
+//-------------------------------------
+
+
+bool
+SplitWriter::SaveRecords(const char* d, size_t len)
+{
+    RawRecord rec;
+    for (size_t off = 0; off < len; ) {
+        int32_t block_size;
+        memcpy(&block_size, d + off, 4);
+        rec.SetView(const_cast<char*>(d + off + 4), block_size);
+        off += 4 + block_size;
+        if (! SaveRecord(rec))
+            return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+
+
+SplitWriter::~SplitWriter(void)
+{
+    Close();
+    for (size_t i = 0; i < outputs.size(); ++i)
+        delete outputs[i];
+    delete fallback;
+}
+
+
+//-------------------------------------
+
+
+bool
+SplitWriter::Close(void)
+{
+    if (closed)
+        return ! Failed();
+    closed = true;
+    // tell every output first, so they all finish at once
+    for (size_t i = 0; i < Outputs(); ++i) {
+        Output& out = output(i);
+        if (out.current != NULL && out.current->length > 0)
+            submit(out);
+        pthread_mutex_lock(&out.lock);
+        out.closing = true;
+        pthread_cond_signal(&out.wake);
+        pthread_mutex_unlock(&out.lock);
+    }
+    for (size_t i = 0; i < Outputs(); ++i) {
+        Output& out = output(i);
+        pthread_join(out.thread, NULL);
+        pthread_cond_destroy(&out.wake);
+        pthread_mutex_destroy(&out.lock);
+    }
+    // the outputs are kept for Filename() and RecordsWritten() until destroyed
+    return ! Failed();
+}
@@ -0,0 +1,585 @@
+// yoruba_pipeline.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_pipeline.cpp
+//
+// A reader -> worker(s) -> writer pipeline for commands whose main loop reads
+// a record, changes it, and writes it.  Records move between threads in
+// batches over lock-free single-producer/single-consumer rings, so decoding,
+// the per-record transform and encoding overlap.
+//
+//    reader thread:  RawBamReader -> batch -> worker[seq % n]
+//    worker threads: RecordTransform::Apply() on each record in the batch
+//    calling thread: worker[seq % n] -> RawBamWriter, batch back to the reader
+//
+// The reader thread can instead take its records from a MergeReader, which
+// merges several coordinate-sorted BAMs, each inflated on a thread of its own,
+// and the calling thread can hand records to a SplitWriter, which writes each
+// to one of many BAMs by a tag value, each deflated on a thread of its own.
+//
+// Batches are handed to workers round-robin and collected in the same order,
+// so the output order is the input order however many workers there are.
+//
+// With SetPassthrough(), an input BGZF block holding only whole records that
+// the transform leaves Unchanged() becomes a batch of its own, which is
+// copied to the output still compressed; only the blocks in between are
+// inflated into records and deflated again.
+
+#ifndef _YORUBA_PIPELINE_H_
+#define _YORUBA_PIPELINE_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <deque>
+#include <stdint.h>
+
+#include <pthread.h>
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_stats.h"
+
+namespace yoruba {
+
+
+// SpscRing is a fixed-capacity queue between exactly one producer thread and
+// exactly one consumer thread.  Neither side blocks; callers spin or back off.
+
+template <typename T>
+class SpscRing {
+
+    public:
+        explicit SpscRing(size_t capacity = 16) : slots(capacity + 1), head(0), tail(0) { }
+
+        // empty, holding up to capacity; only while neither thread uses it
+        void Reset(size_t capacity) {
+            slots.assign(capacity + 1, T());
+            head = tail = 0;
+        }
+
+        bool TryPush(const T& v) {
+            size_t t = __atomic_load_n(&tail, __ATOMIC_RELAXED);
+            size_t next = (t + 1 == slots.size()) ? 0 : t + 1;
+            if (next == __atomic_load_n(&head, __ATOMIC_ACQUIRE))
+                return false;  // full
+            slots[t] = v;
+            __atomic_store_n(&tail, next, __ATOMIC_RELEASE);
+            return true;
+        }
+        bool TryPop(T& v) {
+            size_t h = __atomic_load_n(&head, __ATOMIC_RELAXED);
+            if (h == __atomic_load_n(&tail, __ATOMIC_ACQUIRE))
+                return false;  // empty
+            v = slots[h];
+            __atomic_store_n(&head, (h + 1 == slots.size()) ? 0 : h + 1, __ATOMIC_RELEASE);
+            return true;
+        }
+
+    private:
+        std::vector<T>  slots;
+        size_t          head;       // written only by the consumer
+        char            pad[64];    // keep head and tail on separate cache lines
+        size_t          tail;       // written only by the producer
+
+        SpscRing(const SpscRing&);             // not copyable
+        SpscRing& operator=(const SpscRing&);
+
+};  // class SpscRing
+
+
+// RecordBatch holds records as they appear in a BAM file, each preceded by
+// its block_size, so a finished batch is written with a single call.  A raw
+// batch instead holds one compressed BGZF block of records, and in out its
+// records decompressed if the writer is building an index.
+
+class RecordBatch {
+
+    public:
+        RecordBatch(void) 
+            : length(0), n_records(0), sequence(0), last(false), raw(false), end_voffset(0) { }
+
+        static const size_t BATCH_BYTES = 1 << 20;
+
+        void        Clear(void) { length = 0; n_records = 0; last = false; raw = false; }
+        bool        IsFull(void) const { return length >= BATCH_BYTES; }
+        void        Append(const RawRecord& rec) { append(data, length, rec); ++n_records; }
+
+        std::vector<char>   data;
+        size_t              length;     // bytes of data in use
+        size_t              n_records;  // records in data
+        int64_t             sequence;
+        bool                last;       // no batches follow this one
+        bool                raw;        // data is a BGZF block copied from input
+        int64_t             end_voffset;  // input position after the batch, for a MergeReader
+
+        std::vector<char>   out;        // the worker's output, swapped with data
+        size_t              out_length;
+
+        static void append(std::vector<char>& buf, size_t& len, const RawRecord& rec);
+
+};  // class RecordBatch
+
+
+// BatchWorkers hands batches to threads in turn and finishes them in the
+// order given, for work done on many threads whose results must come out in
+// input order.  Each thread has a Task of its own, whose state needs no
+// locking: Work() is called on the thread for each batch it is given, and
+// Done() on the calling thread once that batch is the oldest not yet done.
+// There is a batch for each thread and Current(), being filled, which
+// Submit() hands on.  Batch needs Clear().
+
+template <class Batch>
+class BatchWorkers {
+
+    public:
+        class Task {
+            public:
+                virtual ~Task(void) { }
+                virtual void Work(Batch& b) = 0;  // on the task's thread
+                virtual void Done(Batch& b) = 0;  // on the calling thread, in order
+        };
+
+        BatchWorkers(void) : current(NULL), next(0) { }
+        ~BatchWorkers(void) { Close(); }
+
+        // a thread for task, which must outlast it; false if it could not
+        // be started, and with no threads the caller does the work itself
+        bool        Start(Task* task);
+        size_t      Threads(void) const { return workers.size(); }
+        Batch&      Current(void) { return *current; }
+        // hand on the current batch, first finishing the next thread's last
+        void        Submit(void);
+        // finish every batch handed on, and stop the threads
+        void        Close(void);
+
+    private:
+        struct Worker {
+            Worker(Task* t) : task(t), batch(new Batch), has_work(false), has_result(false),
+                              stopping(false) { }
+            Task*               task;
+            Batch*              batch;
+            bool                has_work;   // these three under lock
+            bool                has_result;
+            bool                stopping;
+            pthread_mutex_t     lock;
+            pthread_cond_t      wake;       // only one side is ever waiting
+            pthread_t           thread;
+        };
+
+        static void*    workerThread(void* arg);
+        void            finish(Worker& w);
+
+        std::vector<Worker*>    workers;
+        Batch*                  current;    // being filled
+        size_t                  next;       // the worker given the next batch
+
+        BatchWorkers(const BatchWorkers&);             // not copyable
+        BatchWorkers& operator=(const BatchWorkers&);
+
+};  // class BatchWorkers
+
+
+template <class Batch>
+bool
+BatchWorkers<Batch>::Start(Task* task)
+{
+    Worker* w = new Worker(task);
+    pthread_mutex_init(&w->lock, NULL);
+    pthread_cond_init(&w->wake, NULL);
+    if (pthread_create(&w->thread, NULL, workerThread, w) != 0) {
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+        delete w->batch;
+        delete w;
+        return false;
+    }
+    workers.push_back(w);
+    if (current == NULL)
+        current = new Batch;
+    return true;
+}
+
+
+// work on each batch given until stopped
+template <class Batch>
+void*
+BatchWorkers<Batch>::workerThread(void* arg)
+{
+    Worker& w = *static_cast<Worker*>(arg);
+    pthread_mutex_lock(&w.lock);
+    while (true) {
+        while (! w.has_work && ! w.stopping)
+            pthread_cond_wait(&w.wake, &w.lock);
+        if (! w.has_work)
+            break;
+        pthread_mutex_unlock(&w.lock);
+
+        w.task->Work(*w.batch);
+
+        pthread_mutex_lock(&w.lock);
+        w.has_work = false;
+        w.has_result = true;
+        pthread_cond_signal(&w.wake);
+    }
+    pthread_mutex_unlock(&w.lock);
+    return NULL;
+}
+
+
+// wait for w to finish its batch and have its task deal with the result
+template <class Batch>
+void
+BatchWorkers<Batch>::finish(Worker& w)
+{
+    pthread_mutex_lock(&w.lock);
+    while (w.has_work)
+        pthread_cond_wait(&w.wake, &w.lock);
+    bool has_result = w.has_result;
+    w.has_result = false;
+    pthread_mutex_unlock(&w.lock);
+    if (has_result)
+        w.task->Done(*w.batch);
+}
+
+
+// the next worker's last batch is the oldest not yet done
+template <class Batch>
+void
+BatchWorkers<Batch>::Submit(void)
+{
+    Worker& w = *workers[next];
+    next = (next + 1) % workers.size();
+    finish(w);
+
+    pthread_mutex_lock(&w.lock);
+    Batch* b = w.batch;
+    w.batch = current;
+    w.has_work = true;
+    pthread_cond_signal(&w.wake);
+    pthread_mutex_unlock(&w.lock);
+
+    current = b;
+    current->Clear();
+}
+
+
+template <class Batch>
+void
+BatchWorkers<Batch>::Close(void)
+{
+    // the workers from next on have the batches not yet done, oldest first
+    for (size_t i = 0; i < workers.size(); ++i)
+        finish(*workers[(next + i) % workers.size()]);
+    for (size_t i = 0; i < workers.size(); ++i) {
+        Worker* w = workers[i];
+        pthread_mutex_lock(&w->lock);
+        w->stopping = true;
+        pthread_cond_signal(&w->wake);
+        pthread_mutex_unlock(&w->lock);
+        pthread_join(w->thread, NULL);
+        pthread_cond_destroy(&w->wake);
+        pthread_mutex_destroy(&w->lock);
+        delete w->batch;
+        delete w;
+    }
+    workers.clear();
+    delete current;
+    current = NULL;
+    next = 0;
+}
+
+
+// RecordTransform is what a command plugs into the pipeline.  Apply() is
+// given each record in input order within a batch along with the index of the
+// worker calling it, so that per-worker counts need no locking.  Transforms
+// for which IsOrderIndependent() is false are only ever run on one worker.
+
+class RecordTransform {
+
+    public:
+        virtual ~RecordTransform(void) { }
+
+        // change rec as needed, return false to drop it from the output
+        virtual bool Apply(RawRecord& rec, int worker) = 0;
+
+        // true if batches may be transformed concurrently and out of order
+        virtual bool IsOrderIndependent(void) const { return false; }
+
+        // true if Apply() would leave rec exactly as it is and keep it; called
+        // from the reader thread while workers are in Apply(), so read only
+        virtual bool Unchanged(const RawRecord& rec) const { return false; }
+
+        // true if Apply() has hit an error that should stop the pipeline
+        virtual bool Failed(void) const { return false; }
+
+};  // class RecordTransform
+
+
+// MergeReader reads several coordinate-sorted BAMs at once and hands out
+// their records merged into one coordinate-sorted stream, picking each next
+// record with a LoserTree.  Each input is read on a thread of its own, which
+// inflates records a few batches ahead of the merge and runs them through
+// the input's own RecordTransform, if SetTransform() gave it one, so work
+// done per input is done in parallel.
+//
+// The inputs' references are unified: those of the first input in its order,
+// then those of each later input not seen before, and reference IDs are
+// translated as records are read.  An input that has references in common
+// with an earlier one must have them in the same order.  GetHeader() is the
+// headers combined to match.
+
+class MergeReader {
+
+    public:
+        MergeReader(void) : started(false), failed(0), last(-1) { }
+        ~MergeReader(void) { Close(); }
+
+        // open each file and unify their references; false after saying why
+        bool        Open(const std::vector<std::string>& filenames);
+        void        Close(void);
+        size_t      Inputs(void) const { return inputs.size(); }
+        // read only the records of each input overlapping the regions, see
+        // RawBamReader::SetRegions(); set before the first GetNextRecord()
+        bool        SetRegions(const RegionList& list);
+
+        // t is given each record of input i on the input's thread, as worker
+        // 0; set before the first GetNextRecord()
+        void        SetTransform(size_t i, RecordTransform* t) { inputs[i]->transform = t; }
+
+        // the first input's header, with the @SQ, @RG and @PG lines and the
+        // comments of later inputs added where they are not already there,
+        // and sorted by coordinate
+        RawHeader                   GetHeader(void) const;
+        const RawHeader&            GetInputHeader(size_t i) const { 
+            return inputs[i]->reader.GetRawHeader(); 
+        }
+        const BamTools::RefVector&  GetReferenceData(void) const { return refs; }
+        int64_t     InputSize(void) const;  // of all inputs, 0 if that of any is unknown
+
+        // the next record, valid until the next call; false at the end of
+        // all inputs or if there was an error, see Failed()
+        bool        GetNextRecord(RawRecord& rec);
+        // the input of the record last returned
+        size_t      Source(void) const { return size_t(last); }
+        // the compressed bytes merged so far as a virtual offset, for Progress
+        int64_t     Tell(void) const;
+        bool        Failed(void) const { return __atomic_load_n(&failed, __ATOMIC_ACQUIRE) != 0; }
+
+        static const size_t BATCHES_PER_INPUT = 3;  // one filling, one ready, one merging
+
+    private:
+        struct Input {
+            Input(void) : transform(NULL), full(BATCHES_PER_INPUT), free(BATCHES_PER_INPUT), 
+                current(NULL), offset(0), address(0) { }
+            RawBamReader            reader;
+            std::string             filename;
+            std::vector<int32_t>    ref_id;     // output reference ID of each of the input's
+            bool                    translate;  // ref_id is not the identity
+            RecordTransform*        transform;
+            SpscRing<RecordBatch*>  full;       // from the input's thread to the merge
+            SpscRing<RecordBatch*>  free;       // back from the merge
+            RecordBatch             batches[BATCHES_PER_INPUT];
+            RecordBatch*            current;    // batch being merged, and where in it
+            size_t                  offset;
+            int64_t                 address;    // compressed input read through current
+            pthread_t               thread;
+            MergeReader*            merge;
+        };
+
+        static void*    inputThread(void* arg);
+        void            inputLoop(Input& in);
+        bool            start(void);
+        bool            next(size_t i);  // move input i to its next record, false at its end
+        uint64_t        key(size_t i) const;
+        bool            pop(SpscRing<RecordBatch*>& ring, RecordBatch*& b);
+        void            push(SpscRing<RecordBatch*>& ring, RecordBatch* b);
+        void            fail(void) { __atomic_store_n(&failed, 1, __ATOMIC_RELEASE); }
+
+        std::vector<Input*>     inputs;
+        BamTools::RefVector     refs;
+        LoserTree               tree;
+        bool                    started;
+        int                     failed;
+        long                    last;  // input of the record last returned, -1 before the first
+
+        MergeReader(const MergeReader&);             // not copyable
+        MergeReader& operator=(const MergeReader&);
+
+};  // class MergeReader
+
+
+// SplitWriter writes records to one of many BAMs according to the value of
+// a string tag, as kojopodipo --split does by read group.  Tag values are
+// interned in a StringTable, so finding a record's output is a lookup of the
+// value where it lies in the record.  Each output gathers records into
+// batches of its own and has a thread of its own that opens its file and
+// deflates and writes its batches, so the files are opened concurrently and
+// the caller waits on an output only once all of its batches are full.
+
+class SplitWriter {
+
+    public:
+        SplitWriter(const OutputOptions& o, const BamTools::RefVector& r, const char* t = "RG")
+            : opts(o), refs(r), tag(t), fallback(NULL), default_header(NULL),
+              fallback_failed(false), closed(false), failed(0) { }
+        ~SplitWriter(void);
+
+        // records with tag value go to filename, opened on the output's own
+        // thread with the text of header with meta in place of its own, so
+        // the text is made on that thread too; header must outlast Close().
+        // False if value already has an output or the thread could not be
+        // started.
+        bool        Add(const std::string& value, const std::string& filename,
+                        const RawHeader& header, const BamTools::SamHeader& meta);
+        // records without the tag, or with a value not added, go to
+        // filename, which is created only if there are any; otherwise they
+        // are dropped
+        void        SetDefault(const std::string& filename,
+                               const RawHeader& header, const BamTools::SamHeader& meta) {
+            default_filename = filename;
+            default_header = &header;
+            default_meta = meta;
+        }
+
+        bool        SaveRecord(const RawRecord& rec);
+        // len bytes of records, each preceded by its block_size
+        bool        SaveRecords(const char* d, size_t len);
+        // write what remains and close every output; false if any failed
+        bool        Close(void);
+        bool        Failed(void) const { return __atomic_load_n(&failed, __ATOMIC_ACQUIRE) != 0; }
+
+        // outputs in the order added, then the default output if it was created
+        size_t              Outputs(void) const { return outputs.size() + (fallback != NULL ? 1 : 0); }
+        const std::string&  Filename(size_t i) const { return output(i).filename; }
+        int64_t             RecordsWritten(size_t i) const { return output(i).n_records; }
+
+        static const size_t BATCH_BYTES = 1 << 18;  // smaller than a pipeline's, there may be hundreds
+        static const size_t BATCHES_PER_OUTPUT = 3;  // one filling, one waiting, one being written
+
+    private:
+        struct Output {
+            Output(void) : current(NULL), closing(false), n_records(0) { }
+            std::string                 filename;
+            const RawHeader*            header;
+            BamTools::SamHeader         meta;
+            RawBamWriter                writer;
+            RecordBatch                 batches[BATCHES_PER_OUTPUT];
+            RecordBatch*                current;  // being filled by the caller
+            std::deque<RecordBatch*>    free;     // these three under lock
+            std::deque<RecordBatch*>    full;
+            bool                        closing;
+            pthread_mutex_t             lock;
+            pthread_cond_t              wake;     // only one side is ever waiting
+            pthread_t                   thread;
+            SplitWriter*                split;
+            int64_t                     n_records;
+        };
+
+        static void*    outputThread(void* arg);
+        void            outputLoop(Output& out);
+        Output*         start(const std::string& filename,
+                              const RawHeader& header, const BamTools::SamHeader& meta);
+        Output*         find(const RawRecord& rec);
+        void            submit(Output& out);
+        void            fail(void) { __atomic_store_n(&failed, 1, __ATOMIC_RELEASE); }
+        const Output&   output(size_t i) const { return i < outputs.size() ? *outputs[i] : *fallback; }
+        Output&         output(size_t i) { return i < outputs.size() ? *outputs[i] : *fallback; }
+
+        const OutputOptions&        opts;
+        const BamTools::RefVector&  refs;
+        const char*                 tag;
+        StringTable                 values;
+        std::vector<Output*>        outputs;  // indexed as values
+        Output*                     fallback;
+        std::string                 default_filename;
+        const RawHeader*            default_header;
+        BamTools::SamHeader         default_meta;
+        bool                        fallback_failed;  // its thread could not be started
+        bool                        closed;
+        int                         failed;
+
+        SplitWriter(const SplitWriter&);             // not copyable
+        SplitWriter& operator=(const SplitWriter&);
+
+};  // class SplitWriter
+
+
+class Pipeline {
+
+    public:
+        Pipeline(RawBamReader& r, RawBamWriter& w, RecordTransform& t, int n_workers = 1);
+        // records from m; passthrough of input blocks is not possible
+        Pipeline(MergeReader& m, RawBamWriter& w, RecordTransform& t, int n_workers = 1);
+        // records to s, which is not closed; nor is passthrough possible
+        Pipeline(RawBamReader& r, SplitWriter& s, RecordTransform& t, int n_workers = 1);
+        Pipeline(MergeReader& m, SplitWriter& s, RecordTransform& t, int n_workers = 1);
+        ~Pipeline(void);
+
+        int         Workers(void) const { return int(workers.size()); }
+        void        SetMaxRecords(int64_t n) { max_records = n; }
+        void        SetProgress(Progress* p) { progress = p; }  // told of each record read
+        void        SetPassthrough(bool on) { passthrough = on; }
+
+        // runs to the end of input, returns false on any error
+        bool        Run(void);
+
+        int64_t     RecordsRead(void) const { return n_read; }
+        int64_t     RecordsWritten(void) const { return n_written; }
+        int64_t     BlocksCopied(void) const { return n_blocks_copied; }
+
+    private:
+        struct Worker {
+            Worker(size_t capacity) : in(capacity), out(capacity) { }
+            SpscRing<RecordBatch*>  in;     // from the reader
+            SpscRing<RecordBatch*>  out;    // to the writer
+            pthread_t               thread;
+            Pipeline*               pipeline;
+            int                     index;
+        };
+
+        static void*    readerThread(void* arg);
+        static void*    workerThread(void* arg);
+        void            readerLoop(void);
+        void            workerLoop(Worker& w);
+        bool            writerLoop(void);
+        void            init(int n_workers);
+        bool            unchangedBlock(const char*& data, size_t& length,
+                                       const char*& raw, size_t& raw_length, size_t& n_records);
+        bool            nextRecord(RawRecord& rec) { 
+            return merge != NULL ? merge->GetNextRecord(rec) : reader->GetNextRecord(rec);
+        }
+        int64_t         tell(void) const { return merge != NULL ? merge->Tell() : reader->Tell(); }
+
+        bool            pop(SpscRing<RecordBatch*>& ring, RecordBatch*& b);
+        void            push(SpscRing<RecordBatch*>& ring, RecordBatch* b);
+        void            fail(void) { __atomic_store_n(&failed, 1, __ATOMIC_RELEASE); }
+        bool            isFailed(void) const { return __atomic_load_n(&failed, __ATOMIC_ACQUIRE) != 0; }
+
+        RawBamReader*               reader;         // one of these is NULL
+        MergeReader*                merge;
+        RawBamWriter*               writer;         // and one of these
+        SplitWriter*                split;
+        RecordTransform&            transform;
+        std::vector<Worker*>        workers;
+        std::vector<RecordBatch*>   batches;
+        SpscRing<RecordBatch*>      free_batches;   // from the writer back to the reader
+        int64_t                     max_records;
+        Progress*                   progress;
+        bool                        passthrough;
+        int64_t                     n_read;
+        int64_t                     n_written;
+        int64_t                     n_blocks_copied;
+        int                         failed;
+
+        Pipeline(const Pipeline&);             // not copyable
+        Pipeline& operator=(const Pipeline&);
+
+};  // class Pipeline
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_PIPELINE_H_
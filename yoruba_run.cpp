@@ -0,0 +1,593 @@
+// yoruba_run.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Run (Yoruba command is sise) chains gbagbe, kojopodipo and seda over one
+// record stream.
+//
+// Each command run alone decompresses, parses and recompresses the whole BAM
+// file, and the two-pass commands do it twice.  Run reads the input once for
+// a single first pass shared by all two-pass steps, composes the header
+// rewrites of the steps in order, then reads it once more and applies every
+// step's per-record transform in the pipeline before writing the output once.
+//
+// Sise is the Yoruba (Nigeria) verb for 'to work'.
+//
+// Uses BamTools C++ API for handling BAM headers
+
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- let a two-pass step see the rewrites of two-pass steps ahead of it in
+//     pass 1; exact for now because only gbagbe rewrites, and it preserves
+//     the order and equality of records
+
+
+#include "yoruba_run.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static string       input_file;  // defaults to stdin
+static string       output_file;  // defaults to stdout
+static OutputOptions output_opts;
+static string       checksum_file;  // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
+static int          opt_threads = 1;
+static string       spill_dir;  // for stdin, defaults to $TMPDIR or /tmp
+static int64_t      opt_spill_memory = 256;  // MB of stdin kept in memory before spilling
+#ifdef _WITH_DEBUG
+static int32_t      opt_debug = 0;
+static int64_t      opt_reads = -1;
+static int64_t      opt_progress = 0;  // seconds between progress lines
+#endif
+
+// the commands that may be chained, under either name
+struct stepName {
+    const char* yoruba;
+    const char* english;
+    RunStep*    (*factory)(void);
+};
+static const stepName step_names[] = {
+    { "gbagbe",      "forget",     newGbagbeStep },
+    { "kojopodipo",  "readgroup",  newKojopodipoStep },
+    { "seda",        "duplicate",  newSedaStep },
+    { NULL,          NULL,         NULL }
+};
+static int setupSteps(const string& step_list, const vector<string>& step_opts, vector<RunStep*>& steps);
+static int runSteps(vector<RunStep*>& steps);
+static int findStep(const string& name);
+static void splitOptions(const string& name, const string& opts, vector< vector<char> >& words);
+
+
+//-------------------------------------
+
+
+#ifdef _STANDALONE
+int
+main(int argc, char* argv[]) {
+    return main_run(argc, argv);
+}
+#endif
+
+
+//-------------------------------------
+
+
+static int
+usage(bool longer = false)
+{
+    cerr << endl;
+    cerr << "Usage:   " << YORUBA_NAME << " run STEP,STEP,... [options] [--STEP='step options']... <in.bam>" << endl;
+    cerr << "         " << YORUBA_NAME << " sise STEP,STEP,... [options] [--STEP='step options']... <in.bam>" << endl;
+    cerr << "\n\
+Run several commands over <in.bam> in one process, in the order given, as if\n\
+each read the output of the one before.  Either command invokes this function.\n\
+STEP is one of gbagbe|forget, kojopodipo|readgroup, seda|duplicate, each at\n\
+most once.\n\
+\n";
+    if (longer) cerr << "\
+The input is decompressed and parsed once for a first pass shared by all steps\n\
+that need one (gbagbe and seda), and once more for the second pass, during\n\
+which each read passes through every step before the output is compressed once.\n\
+Each step rewrites the header in turn.\n\
+\n\
+Options for a step are given in one argument, in the form --STEP='options',\n\
+for example\n\
+\n\
+    " << YORUBA_NAME << " run readgroup,duplicate --readgroup='--ID s1 --SM s1' \\\n\
+        --duplicate='--override --remove' -o out.bam in.bam\n\
+\n\
+Input, output, compression, threads and stdin spilling are options of run and\n\
+not of its steps.  In the shared first pass, a step sees reads as changed by\n\
+the single-pass steps ahead of it but not by the two-pass steps ahead of it;\n\
+gbagbe only changes reference IDs, so duplicates found by seda are the same\n\
+whichever of the two comes first.\n\
+\n";
+    cerr << "\
+Options: --STEP='options'          options for STEP, see 'yoruba STEP --help'\n\
+         -t INT | --threads INT    worker threads for transforming reads [" << opt_threads << "]\n\
+         -r STR | --region STR     only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            only reads overlapping the regions of BED FILE\n\
+         -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of sorted output\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         --spill-dir DIR           directory for spilling stdin [$TMPDIR or /tmp]\n\
+         --spill-memory INT        MB of stdin to hold in memory before spilling [" << opt_spill_memory << "]\n\
+         -? | --help               longer help\n\
+\n";
+#ifdef _WITH_DEBUG
+    cerr << "\
+         --debug INT      debug info level INT [" << opt_debug << "]\n\
+         --reads INT      only process INT reads [" << opt_reads << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
+\n";
+#endif
+    cerr << "Sise is the Yoruba (Nigeria) verb for 'to work'." << endl;
+    cerr << endl;
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+// the steps' transforms one after the other, on each worker
+
+class ChainTransform : public RecordTransform {
+
+    public:
+        ChainTransform(const vector<RecordTransform*>& t) : transforms(t) { }
+
+        virtual bool Apply(RawRecord& rec, int worker) {
+            for (size_t i = 0; i < transforms.size(); ++i)
+                if (! transforms[i]->Apply(rec, worker))
+                    return false;  // dropped, later steps never see it
+            return true;
+        }
+        virtual bool Unchanged(const RawRecord& rec) const {
+            for (size_t i = 0; i < transforms.size(); ++i)
+                if (! transforms[i]->Unchanged(rec))
+                    return false;
+            return true;
+        }
+        virtual bool IsOrderIndependent(void) const {
+            for (size_t i = 0; i < transforms.size(); ++i)
+                if (! transforms[i]->IsOrderIndependent())
+                    return false;
+            return true;
+        }
+        virtual bool Failed(void) const {
+            for (size_t i = 0; i < transforms.size(); ++i)
+                if (transforms[i]->Failed())
+                    return true;
+            return false;
+        }
+
+    private:
+        const vector<RecordTransform*> transforms;
+
+};
+
+
+//-------------------------------------
+
+
+int
+yoruba::main_run(int argc, char* argv[])
+{
+    //----------------- Command-line options
+
+	if( argc < 2 ) {
+		return usage();
+	}
+
+    enum { OPT_output, OPT_threads, OPT_level, OPT_uncompressed, OPT_writeindex,
+        OPT_checksum, OPT_checksumexclude, OPT_region, OPT_regions,
+        OPT_spilldir, OPT_spillmemory,
+        OPT_gbagbe, OPT_kojopodipo, OPT_seda,
+#ifdef _WITH_DEBUG
+        OPT_debug, OPT_reads, OPT_progress,
+#endif
+        OPT_help };
+
+    CSimpleOpt::SOption run_options[] = {
+        { OPT_gbagbe,          "--gbagbe",          SO_REQ_SEP },
+        { OPT_gbagbe,          "--forget",          SO_REQ_SEP },
+        { OPT_kojopodipo,      "--kojopodipo",      SO_REQ_SEP },
+        { OPT_kojopodipo,      "--readgroup",       SO_REQ_SEP },
+        { OPT_seda,            "--seda",            SO_REQ_SEP },
+        { OPT_seda,            "--duplicate",       SO_REQ_SEP },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
+        { OPT_output,          "--output",          SO_REQ_SEP },
+        { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_spilldir,        "--spill-dir",       SO_REQ_SEP },
+        { OPT_spillmemory,     "--spill-memory",    SO_REQ_SEP },
+#ifdef _WITH_DEBUG
+        { OPT_debug,           "--debug",           SO_REQ_SEP },
+        { OPT_reads,           "--reads",           SO_REQ_SEP },
+        { OPT_progress,        "--progress",        SO_REQ_SEP },
+#endif
+        SO_END_OF_OPTIONS
+    };
+
+    // options for each entry of step_names, in the same order
+    vector<string> step_opts(sizeof(step_names) / sizeof(step_names[0]) - 1);
+
+    CSimpleOpt args(argc, argv, run_options);
+
+    while (args.Next()) {
+        if (args.LastError() == SO_ARG_INVALID_DATA) {
+            cerr << NAME << " give step options as " << args.OptionText() << "='options'" << endl;
+            return usage();
+        } else if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage(true);
+        } else if (args.OptionId() == OPT_gbagbe) {
+            step_opts[findStep("gbagbe")] = args.OptionArg();
+        } else if (args.OptionId() == OPT_kojopodipo) {
+            step_opts[findStep("kojopodipo")] = args.OptionArg();
+        } else if (args.OptionId() == OPT_seda) {
+            step_opts[findStep("seda")] = args.OptionArg();
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
+        } else if (args.OptionId() == OPT_output) {
+            output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_spilldir) {
+            spill_dir = args.OptionArg();
+        } else if (args.OptionId() == OPT_spillmemory) {
+            opt_spill_memory = strtoll(args.OptionArg(), NULL, 10);
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (args.FileCount() < 1) {
+        cerr << NAME << " requires the steps to run" << endl;
+        return usage();
+    } else if (args.FileCount() > 2) {
+        cerr << NAME << " requires at most one BAM file specified as input" << endl;
+        return usage();
+    } else if (args.FileCount() == 2) {
+        input_file = args.File(1);
+    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
+        input_file = "/dev/stdin";
+    }
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+    if (opt_spill_memory < 0) {
+        cerr << NAME << " --spill-memory must be at least 0" << endl;
+        return usage();
+    }
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    // set up output; if file not specified, use stdout or its equivalent
+    if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+
+    //----------------- Set up the steps and run them
+
+
+    vector<RunStep*> steps;
+
+    int ret = setupSteps(args.File(0), step_opts, steps);
+    if (ret == EXIT_SUCCESS)
+        ret = runSteps(steps);
+
+    for (size_t i = 0; i < steps.size(); ++i)
+        delete steps[i];
+
+    return ret;
+}
+
+
+//-------------------------------------
+
+
+// create the steps named in step_list, in order, and have each parse its
+// options from step_opts
+static int
+setupSteps(const string& step_list, const vector<string>& step_opts, vector<RunStep*>& steps)
+{
+    vector<bool> step_seen(step_opts.size(), false);
+
+    for (size_t pos = 0; pos <= step_list.length(); ) {
+        size_t comma = step_list.find(',', pos);
+        if (comma == string::npos)
+            comma = step_list.length();
+        string name = step_list.substr(pos, comma - pos);
+        pos = comma + 1;
+
+        int s = findStep(name);
+        if (s < 0) {
+            cerr << NAME << " unknown step '" << name << "'" << endl;
+            return usage();
+        }
+        if (step_seen[s]) {
+            cerr << NAME << " step '" << name << "' given more than once" << endl;
+            return EXIT_FAILURE;
+        }
+        step_seen[s] = true;
+
+        // argv[0] is the name as given, so the step's @PG matches a lone run
+        vector< vector<char> > words;
+        splitOptions(name, step_opts[s], words);
+        vector<char*> step_argv;
+        for (size_t i = 0; i < words.size(); ++i)
+            step_argv.push_back(&words[i][0]);
+        step_argv.push_back(NULL);
+
+        steps.push_back(step_names[s].factory());
+        if (steps.back()->ParseOptions(int(words.size()), &step_argv[0]) != EXIT_SUCCESS)
+            return EXIT_FAILURE;
+    }
+    for (size_t s = 0; s < step_opts.size(); ++s) {
+        if (! step_opts[s].empty() && ! step_seen[s]) {
+            cerr << NAME << " options given for " << step_names[s].yoruba
+                << ", which is not one of the steps" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+// both passes over the input with the steps, in order
+static int
+runSteps(vector<RunStep*>& steps)
+{
+    //----------------- Open input BAM
+
+
+    ScopedPhase phase_open("open");
+
+    RawBamReader reader;
+    bool         needs_pass1 = false;
+
+    for (size_t i = 0; i < steps.size(); ++i)
+        needs_pass1 = needs_pass1 || steps[i]->NeedsPass1();
+
+    // input from a pipe is kept for pass 2, in memory and then on disk
+    if (needs_pass1)
+        reader.SetSpill(spill_dir, size_t(opt_spill_memory) << 20);
+
+    if (! reader.Open(input_file)) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    vector<RecordTransform*> transforms(steps.size(), (RecordTransform*)NULL);
+
+    phase_open.End();
+
+    Progress progress;
+
+
+    //----------------- Pass 1: shared by the steps that need it
+
+
+    if (needs_pass1) {
+        ScopedPhase phase_pass1("pass1");
+
+        for (size_t i = 0; i < steps.size(); ++i)
+            if (steps[i]->NeedsPass1() && ! steps[i]->BeginPass1(reader.GetReferenceData()))
+                return EXIT_FAILURE;
+
+        // the single-pass steps ahead of a two-pass step change the records
+        // it sees, so their transforms are applied in pass 1 too, by
+        // instances of their own whose counts are dropped for pass 2's
+        for (size_t i = 0; i < steps.size(); ++i)
+            if (! steps[i]->NeedsPass1())
+                transforms[i] = &steps[i]->Transform(1);
+
+        int64_t   n_reads = 0;
+        RawRecord rec;
+        RawRecord changed;  // a copy, if a step ahead changes it
+
+        progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+
+        while (reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
+            ++n_reads;
+            RawRecord* r = &rec;
+            for (size_t i = 0; i < steps.size(); ++i) {
+                if (steps[i]->NeedsPass1()) {
+                    if (! steps[i]->Pass1(*r))
+                        return EXIT_FAILURE;
+                } else {
+                    if (r == &rec) {
+                        changed.Assign(rec.Data(), rec.Size());
+                        r = &changed;
+                    }
+                    if (! transforms[i]->Apply(*r, 0))
+                        break;  // dropped
+                }
+            }
+            progress.Add(rec, reader.Tell());
+        }
+        progress.Stop();
+        if (reader.Failed()) {
+            cerr << NAME << "[pass1] error reading input" << endl;
+            return EXIT_FAILURE;
+        }
+        if (opt_progress || DEBUG(1))
+            cerr << NAME << "[pass1] " << n_reads << " reads examined" << endl;
+
+        for (size_t i = 0; i < steps.size(); ++i)
+            if (steps[i]->NeedsPass1() && ! steps[i]->EndPass1())
+                return EXIT_FAILURE;
+    }
+
+
+    //----------------- Compose the header rewrites
+
+
+    SamHeader header = reader.GetHeader();
+    RefVector refs = reader.GetReferenceData();
+
+    for (size_t i = 0; i < steps.size(); ++i)
+        if (! steps[i]->RewriteHeader(header, refs))
+            return EXIT_FAILURE;
+
+    for (size_t i = 0; i < steps.size(); ++i)
+        transforms[i] = &steps[i]->Transform(opt_threads);
+
+
+    //----------------- Pass 2: every step's transform, then write
+
+
+    ScopedPhase phase_pass2("pass2");
+
+    RawBamWriter writer;
+
+    if (! output_opts.Open(writer, output_file, header, refs)) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (needs_pass1) {
+        if (reader.IsSpilling() && (opt_progress || DEBUG(1)))
+            cerr << NAME << "[pass2] replaying input, " << (reader.SpilledToDisk() >> 20)
+                << " MB of it from the spill file" << endl;
+        if (! reader.Rewind()) {
+            cerr << NAME << "[pass2] could not rewind input" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    ChainTransform chain(transforms);
+    Pipeline pipeline(reader, writer, chain, opt_threads);
+
+    pipeline.SetMaxRecords(opt_reads);
+    progress.Start(NAME "[pass2]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+    pipeline.SetProgress(&progress);
+    pipeline.SetPassthrough(! output_opts.LevelSet());
+
+    if (! pipeline.Run()) {
+        cerr << NAME << "[pass2] error while processing reads" << endl;
+        return EXIT_FAILURE;
+    }
+    progress.Stop();
+
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] " << pipeline.RecordsRead() << " reads processed, "
+            << pipeline.RecordsWritten() << " written" << endl;
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+
+    int ret = EXIT_SUCCESS;
+    if (! writer.Close())
+        ret = EXIT_FAILURE;
+    for (size_t i = 0; i < steps.size(); ++i)
+        if (! steps[i]->Finish())
+            ret = EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        ret = EXIT_FAILURE;
+
+    return ret;
+}
+
+
+//-------------------------------------
+
+
+// index of the step in step_names, or -1
+static int
+findStep(const string& name)
+{
+    for (int i = 0; step_names[i].yoruba != NULL; ++i)
+        if (name == step_names[i].yoruba || name == step_names[i].english)
+            return i;
+    return -1;
+}
+
+
+//-------------------------------------
+
+
+// split opts on whitespace into words, after name; each word is
+// nul-terminated so it can be handed on as argv
+static void
+splitOptions(const string& name, const string& opts, vector< vector<char> >& words)
+{
+    words.clear();
+    words.push_back(vector<char>(name.begin(), name.end()));
+    words.back().push_back('\0');
+
+    stringstream ss(opts);
+    string word;
+    while (ss >> word) {
+        words.push_back(vector<char>(word.begin(), word.end()));
+        words.back().push_back('\0');
+    }
+}
+
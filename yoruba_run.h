@@ -0,0 +1,96 @@
+// yoruba_run.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_run.cpp
+//
+// Run (Yoruba command is sise) chains several commands over one decoded
+// record stream, so that the BAM is decompressed and recompressed once
+// rather than once per command.
+//
+// Sise is the Yoruba (Nigeria) verb for 'to work'.
+
+#ifndef _YORUBA_RUN_H_
+#define _YORUBA_RUN_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+#include "api/SamHeader.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_pipeline.h"
+#include "yoruba_stats.h"
+
+// commands include this after their own header, so keep their NAME
+#if ! defined(_YORUBA_MAIN) && ! defined(NAME)
+#define NAME "[yoruba_run]"
+#endif
+
+namespace yoruba {
+
+// RunStep is a command's part in 'yoruba run'.  Each command that can be
+// chained provides one from a factory declared in its own header.  The steps
+// are driven in chain order:
+//
+//   ParseOptions()                 the step's own options
+//   BeginPass1()                   two-pass steps only, one shared first pass;
+//   Pass1() for every record       records are as left by the single-pass
+//   EndPass1()                     steps ahead in the chain, but not by the
+//                                  two-pass steps ahead
+//   RewriteHeader()                on the header as left by the steps ahead
+//   Transform()->Apply()           each record, in chain order, in the pipeline
+//   Finish()
+//
+// A single-pass step's Transform() is also called before pass 1, when there
+// is one, for a transform applied there.  Each call replaces the transform
+// the step made before, so Finish() reports only that of the pipeline.
+
+class RunStep {
+
+    public:
+        virtual ~RunStep(void) { }
+
+        // argv[0] is the step's name; EXIT_SUCCESS, or EXIT_FAILURE after
+        // saying why
+        virtual int  ParseOptions(int argc, char* argv[]) = 0;
+
+        virtual bool NeedsPass1(void) const { return false; }
+        virtual bool BeginPass1(const BamTools::RefVector& refs) { return true; }
+        virtual bool Pass1(const RawRecord& rec) { return true; }  // false on error
+        virtual bool EndPass1(void) { return true; }
+
+        virtual bool RewriteHeader(BamTools::SamHeader& header, BamTools::RefVector& refs) = 0;
+
+        // the transform for the pipeline, which has n_workers workers
+        virtual RecordTransform& Transform(int n_workers) = 0;
+
+        virtual bool Finish(void) { return true; }
+
+};  // class RunStep
+
+
+// Functions defined in yoruba_run.cpp
+//
+int  main_run(int argc, char* argv[]);
+
+// Step factories, defined with each command
+//
+RunStep* newGbagbeStep(void);
+RunStep* newKojopodipoStep(void);
+RunStep* newSedaStep(void);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_RUN_H_
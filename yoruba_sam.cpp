@@ -0,0 +1,363 @@
+// yoruba_sam.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// SAM text output of RawRecords, see yoruba_sam.h
+//
+// Uses pthreads, and BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <iostream>
+#include <unistd.h>
+
+#include "yoruba_sam.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+const size_t SamWriter::WRITE_BYTES;
+
+
+// lookup tables: each packed sequence byte as its two bases, and each
+// number below 100 as two digits
+static struct SamTables {
+    char    bases[256][2];
+    char    digits[100][2];
+    SamTables(void) {
+        static const char nt16[] = "=ACMGRSVTWYHKDBN";
+        for (int b = 0; b < 256; ++b) {
+            bases[b][0] = nt16[b >> 4];
+            bases[b][1] = nt16[b & 0xf];
+        }
+        for (int d = 0; d < 100; ++d) {
+            digits[d][0] = char('0' + d / 10);
+            digits[d][1] = char('0' + d % 10);
+        }
+    }
+} tables;
+
+static const char CIGAR_OPS[] = "MIDNSHP=X";
+
+static const size_t MIN_BUFFER_BYTES = 1 << 16;
+
+
+//-------------------------------------
+//-------------------------------------  SamFormatter
+//-------------------------------------
+
+
+void
+SamFormatter::grow(size_t need)
+{
+    MEMTRACK_TAG("SamFormatter");
+    buf.resize(need < MIN_BUFFER_BYTES ? MIN_BUFFER_BYTES : need + need / 2);
+}
+
+
+//-------------------------------------
+
+
+void
+SamFormatter::putInt(int64_t v)
+{
+    char* p = reserve(21);
+    uint64_t u = v < 0 ? uint64_t(-(v + 1)) + 1 : uint64_t(v);
+    if (v < 0)
+        *p++ = '-';
+    char tmp[20];
+    char* t = tmp + sizeof(tmp);
+    while (u >= 100) {
+        t -= 2;
+        memcpy(t, tables.digits[u % 100], 2);
+        u /= 100;
+    }
+    if (u >= 10) {
+        t -= 2;
+        memcpy(t, tables.digits[u], 2);
+    } else {
+        *--t = char('0' + u);
+    }
+    size_t n = tmp + sizeof(tmp) - t;
+    memcpy(p, t, n);
+    len = (p + n) - &buf[0];
+}
+
+
+void
+SamFormatter::putRefName(int32_t id)
+{
+    if (id < 0 || size_t(id) >= refs->size()) {
+        Append("*", 1);
+    } else {
+        const string& name = (*refs)[id].RefName;
+        Append(name.data(), name.length());
+    }
+}
+
+
+//-------------------------------------
+
+
+// one aux tag at p as \tTG:T:VALUE, moving p past it; false if it is malformed
+bool
+SamFormatter::putTag(const char*& p, const char* end)
+{
+    if (p + 3 > end)
+        return false;
+    char type = p[2];
+    const char* v = p + 3;
+    size_t vs = auxValueSize(type, v, end);
+    if (vs == 0 || v + vs > end)
+        return false;
+
+    char* o = reserve(6);
+    o[0] = '\t'; o[1] = p[0]; o[2] = p[1]; o[3] = ':'; o[5] = ':';
+    o[4] = (type == 'A' || type == 'Z' || type == 'H' || type == 'B' || type == 'f') ? type : 'i';
+    len += 6;
+
+    switch (type) {
+        case 'A': Append(v, 1); break;
+        case 'c': putInt(int8_t(v[0])); break;
+        case 'C': putInt(uint8_t(v[0])); break;
+        case 's': { int16_t x; memcpy(&x, v, 2); putInt(x); break; }
+        case 'S': { uint16_t x; memcpy(&x, v, 2); putInt(x); break; }
+        case 'i': { int32_t x; memcpy(&x, v, 4); putInt(x); break; }
+        case 'I': { uint32_t x; memcpy(&x, v, 4); putInt(x); break; }
+        case 'f': {
+            float x; memcpy(&x, v, 4);
+            char* f = reserve(32);
+            len += snprintf(f, 32, "%g", x);
+            break;
+        }
+        case 'Z': case 'H': Append(v, vs - 1); break;
+        case 'B': {
+            char sub = v[0];
+            int32_t n; memcpy(&n, v + 1, 4);
+            size_t ss = auxValueSize(sub, NULL, NULL);
+            Append(&sub, 1);
+            const char* e = v + 5;
+            for (int32_t i = 0; i < n; ++i, e += ss) {
+                Append(",", 1);
+                switch (sub) {
+                    case 'c': putInt(int8_t(e[0])); break;
+                    case 'C': putInt(uint8_t(e[0])); break;
+                    case 's': { int16_t x; memcpy(&x, e, 2); putInt(x); break; }
+                    case 'S': { uint16_t x; memcpy(&x, e, 2); putInt(x); break; }
+                    case 'i': { int32_t x; memcpy(&x, e, 4); putInt(x); break; }
+                    case 'I': { uint32_t x; memcpy(&x, e, 4); putInt(x); break; }
+                    case 'f': {
+                        float x; memcpy(&x, e, 4);
+                        char* f = reserve(32);
+                        len += snprintf(f, 32, "%g", x);
+                        break;
+                    }
+                }
+            }
+            break;
+        }
+    }
+    p = v + vs;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+SamFormatter::Append(const RawRecord& rec)
+{
+    Append(rec.Name(), rec.NameLength());
+    Append("\t", 1);
+    putInt(rec.Flag());
+    Append("\t", 1);
+    putRefName(rec.RefID());
+    Append("\t", 1);
+    putInt(int64_t(rec.Position()) + 1);
+    Append("\t", 1);
+    putInt(rec.MapQuality());
+    Append("\t", 1);
+
+    uint16_t n_cigar = rec.CigarCount();
+    if (n_cigar == 0) {
+        Append("*", 1);
+    } else {
+        for (uint16_t i = 0; i < n_cigar; ++i) {
+            uint32_t op = rec.CigarOp(i);
+            putInt(op >> 4);
+            Append(&CIGAR_OPS[(op & 0xf) < 9 ? (op & 0xf) : 0], 1);
+        }
+    }
+    Append("\t", 1);
+
+    if (rec.MateRefID() >= 0 && rec.MateRefID() == rec.RefID())
+        Append("=", 1);
+    else
+        putRefName(rec.MateRefID());
+    Append("\t", 1);
+    putInt(int64_t(rec.MatePosition()) + 1);
+    Append("\t", 1);
+    putInt(rec.InsertSize());
+    Append("\t", 1);
+
+    int32_t l_seq = rec.QueryLength();
+    if (l_seq <= 0) {
+        Append("*\t*", 3);
+    } else {
+        // two bases per byte; the last byte's second base is padding if l_seq is odd
+        char* o = reserve(2 * size_t(l_seq) + 2);
+        const uint8_t* s = reinterpret_cast<const uint8_t*>(rec.SeqData());
+        for (int32_t i = 0; i < l_seq / 2; ++i, o += 2)
+            memcpy(o, tables.bases[s[i]], 2);
+        if (l_seq & 1)
+            *o++ = tables.bases[s[l_seq / 2]][0];
+        *o++ = '\t';
+        const uint8_t* q = reinterpret_cast<const uint8_t*>(rec.QualData());
+        if (q[0] == 0xff) {
+            *o++ = '*';
+        } else {
+            for (int32_t i = 0; i < l_seq; ++i)
+                *o++ = char(q[i] + 33);
+        }
+        len = o - &buf[0];
+    }
+
+    const char* p = rec.AuxData();
+    const char* end = p + rec.AuxLength();
+    while (p < end && putTag(p, end))
+        ;
+    Append("\n", 1);
+}
+
+
+//-------------------------------------
+
+
+bool
+SamFormatter::WriteTo(int fd)
+{
+    const char* p = Data();
+    size_t left = len;
+    while (left > 0) {
+        ssize_t n = write(fd, p, left);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            cerr << "yoruba::SamFormatter: write failed: " << strerror(errno) << endl;
+            return false;
+        }
+        p += n;
+        left -= size_t(n);
+    }
+    Clear();
+    return true;
+}
+
+
+//-------------------------------------
+//-------------------------------------  SamWriter
+//-------------------------------------
+
+
+SamWriter::SamWriter(int f, const RefVector& refs, int n_threads)
+    : fd(f), formatter(refs), closed(false), ok(true)
+{
+    if (n_threads <= 1)
+        return;
+    for (int i = 0; i < n_threads; ++i) {
+        FormatTask* t = new FormatTask(*this, refs);
+        if (! workers.Start(t)) {
+            cerr << "yoruba::SamWriter: could not start worker thread, continuing with "
+                << workers.Threads() << endl;
+            delete t;
+            break;
+        }
+        tasks.push_back(t);
+    }
+}
+
+
+//-------------------------------------
+
+
+bool
+SamWriter::WriteHeader(const string& text)
+{
+    formatter.Append(text.data(), text.length());
+    if (! text.empty() && text[text.length() - 1] != '\n')
+        formatter.Append("\n", 1);
+    return ok = formatter.WriteTo(fd) && ok;
+}
+
+
+//-------------------------------------
+
+
+bool
+SamWriter::SaveRecord(const RawRecord& rec)
+{
+    if (workers.Threads() == 0) {
+        formatter.Append(rec);
+        if (formatter.Length() >= WRITE_BYTES)
+            ok = formatter.WriteTo(fd) && ok;
+        return ok;
+    }
+    workers.Current().Append(rec);
+    if (workers.Current().IsFull())
+        workers.Submit();
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+void
+SamWriter::FormatTask::Work(RecordBatch& b)
+{
+    RawRecord rec;
+    for (size_t off = 0; off < b.length; ) {
+        int32_t block_size;
+        memcpy(&block_size, &b.data[off], 4);
+        rec.SetView(&b.data[off + 4], block_size);
+        off += 4 + block_size;
+        formatter.Append(rec);
+    }
+}
+
+
+void
+SamWriter::FormatTask::Done(RecordBatch& b)
+{
+    writer.ok = formatter.WriteTo(writer.fd) && writer.ok;
+}
+
+
+//-------------------------------------
+
+
+bool
+SamWriter::Close(void)
+{
+    if (closed)
+        return ok;
+    closed = true;
+    if (workers.Threads() == 0) {
+        ok = formatter.WriteTo(fd) && ok;
+        return ok;
+    }
+    if (workers.Current().length > 0)
+        workers.Submit();
+    workers.Close();
+    for (size_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+    tasks.clear();
+    return ok;
+}
@@ -0,0 +1,109 @@
+// yoruba_sam.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_sam.cpp
+//
+// SAM text output of RawRecords.  Writing each field through std::ostream
+// costs far more than decoding the record, so SamFormatter instead converts
+// integers and decodes sequence and qualities by table into one reusable
+// buffer, and SamWriter hands that buffer to write(2) a few megabytes at a
+// time, formatting batches of records on worker threads if asked.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_SAM_H_
+#define _YORUBA_SAM_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_pipeline.h"
+
+namespace yoruba {
+
+// SamFormatter appends records to its buffer as SAM lines, each with its
+// newline.  Reference names come from refs, which must outlast it.
+
+class SamFormatter {
+
+    public:
+        explicit SamFormatter(const BamTools::RefVector& r) : refs(&r), len(0) { }
+
+        void        Append(const RawRecord& rec);
+        void        Append(const char* d, size_t n) { memcpy(reserve(n), d, n); len += n; }
+        const char* Data(void) const { return buf.empty() ? NULL : &buf[0]; }
+        size_t      Length(void) const { return len; }
+        void        Clear(void) { len = 0; }
+        // write(2) all of the buffer to fd and clear it
+        bool        WriteTo(int fd);
+
+    private:
+        char*       reserve(size_t n) {  // room for n more bytes at buf[len]
+            if (len + n > buf.size())
+                grow(len + n);
+            return &buf[len];
+        }
+        void        grow(size_t need);
+        void        putInt(int64_t v);
+        void        putRefName(int32_t id);
+        bool        putTag(const char*& p, const char* end);
+
+        const BamTools::RefVector*  refs;
+        std::vector<char>           buf;
+        size_t                      len;
+
+};  // class SamFormatter
+
+
+// SamWriter writes records to a file descriptor as SAM text.  With more than
+// one thread, records are gathered into batches that are formatted on the
+// threads in turn and written in the order given.
+
+class SamWriter {
+
+    public:
+        SamWriter(int fd, const BamTools::RefVector& refs, int n_threads = 1);
+        ~SamWriter(void) { Close(); }
+
+        bool        WriteHeader(const std::string& text);
+        bool        SaveRecord(const RawRecord& rec);
+        bool        Close(void);  // write what is left; false if any write failed
+
+        static const size_t WRITE_BYTES = 4 << 20;  // formatted before each write(2)
+
+    private:
+        // formats the batches of one thread, and writes them in turn
+        class FormatTask : public BatchWorkers<RecordBatch>::Task {
+            public:
+                FormatTask(SamWriter& w, const BamTools::RefVector& refs) : writer(w), formatter(refs) { }
+                virtual void Work(RecordBatch& b);
+                virtual void Done(RecordBatch& b);
+            private:
+                SamWriter&      writer;
+                SamFormatter    formatter;
+        };
+
+        int                     fd;
+        SamFormatter            formatter;  // with one thread
+        std::vector<FormatTask*> tasks;
+        BatchWorkers<RecordBatch> workers;
+        bool                    closed;
+        bool                    ok;
+
+        SamWriter(const SamWriter&);             // not copyable
+        SamWriter& operator=(const SamWriter&);
+
+};  // class SamWriter
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_SAM_H_
@@ -55,6 +55,7 @@
 
 
 #include "yoruba_seda.h"
+#include "yoruba_run.h"
 
 using namespace std;
 using namespace BamTools;
@@ -62,18 +63,25 @@ using namespace yoruba;
 
 static string       input_file;         // set from command line
 static string       output_file;        // defaults to stdout, set with -o FILE
+static OutputOptions output_opts;       // set with -l INT, -u, for both outputs
+static string       checksum_file;      // set with --checksum FILE, of the output but not the duplicates
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
 enum detect_t { DETECT_as_single, DETECT_paired_only, DETECT_single_only, DETECT_all };
 static detect_t     opt_detect = DETECT_all;
 static bool         opt_remove;         // set with --remove
+static bool         opt_byname;         // set with --by-name
 static bool         opt_duplicatefile;  // set with --duplicate-file FILE
 static string       duplicate_file;     // set with --duplicate-file FILE, holds FILE
+static string       spill_dir;          // for stdin, defaults to $TMPDIR or /tmp
+static int64_t      opt_spill_memory = 0;  // MB of stdin kept in memory, the dupMap needs it more
+static int          opt_threads = 1;    // above 1, pass 1 is run over shards of an indexed input
 #ifdef _WITH_DEBUG
 static bool         opt_override = false;
 static int32_t      opt_debug = 1;
-static int32_t      debug_progress = 100000;
+static int32_t      debug_progress = 10;  // seconds
 static int64_t      opt_reads = -1;
-static int64_t      opt_progress = 100000; // 100000;
-static int64_t      last_n_reads_mod = 0;  // helps with progress output during pass1
+static int64_t      opt_progress = 60;  // seconds between progress lines
 #endif
 static const string delim = "'";
 static const string sep = "\t";
@@ -107,20 +115,35 @@ them on option.  Either command invokes this function.\n\
 \n\
 NOTE: THIS COMMAND IS INCOMPLETE AND IN AN UNKNOWN STATE OF READINESS\n\
 \n\
-Options: --as-single-end           all reads treated as single-end, ignore pairing\n\
+Options: --by-name                 input is grouped by read name, as from an aligner;\n\
+                                   mark in one pass, by the unclipped 5' ends of both\n\
+                                   mates, keeping the first fragment seen of each\n\
+         --as-single-end           all reads treated as single-end, ignore pairing\n\
          --single-end-only         only look for duplicates in single-end reads\n\
          --paired-end-only         only look for duplicates in paired-end reads\n\
          --remove                  remove reads from the output BAM\n\
+         -t INT | --threads INT    threads finding duplicates, each in its own regions\n\
+                                   of the input, which must be indexed [" << opt_threads << "]\n\
          --duplicate-file FILE     write duplicate reads to BAM file FILE,\n\
                                    note this does not currently imply --remove\n\
+         -r STR | --region STR     only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            only reads overlapping the regions of BED FILE\n\
          -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of each output BAM\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         --spill-dir DIR           directory for spilling stdin [$TMPDIR or /tmp]\n\
+         --spill-memory INT        MB of stdin to hold in memory before spilling [" << opt_spill_memory << "]\n\
          -? | --help               onger help\n\
 \n";
 #ifdef _WITH_DEBUG
     cerr << "\
          --debug INT      debug info level INT [" << opt_debug << "]\n\
          --reads INT      only process INT reads [" << opt_reads << "]\n\
-         --progress INT   print reads processed mod INT [" << opt_progress << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
 \n\
          --override       override the non-usage of this command\n\
 \n";
@@ -135,23 +158,21 @@ Options: --as-single-end           all reads treated as single-end, ignore pairi
 //-------------------------------------
 
 
-typedef list<BamAlignment>            alignmentList;
+typedef list<RawRecord>               alignmentList;
 typedef alignmentList::iterator       alignmentListI;
 typedef alignmentList::const_iterator alignmentListCI;
 
-enum dup_t { // types of potential duplicate reads in a dupMap
-    dupMap_singleend   = -1, 
-    dupMap_UNSET       = 0, 
-    dupMap_paired_one  = 1, 
-    dupMap_paired_both = 2
-};
-//typedef map<string, dup_t>            dupMap;
-typedef std::tr1::unordered_map<string, dup_t>  dupMap;
-typedef dupMap::iterator              dupMapI;
-typedef dupMap::const_iterator        dupMapCI;
-// must create class out of dupMap
+// spent list nodes are kept in a pool and spliced back in when needed, so
+// that neither the nodes nor the record buffers within them are reallocated;
+// each DuplicateScan has its own pool
+static void pushAlignment(alignmentList& al_pool, alignmentList& al_set, const RawRecord& rec);
+static alignmentListI eraseAlignment(alignmentList& al_pool, alignmentList& al_set, alignmentListI al_i);
+static void clearAlignments(alignmentList& al_pool, alignmentList& al_set);
+
+// dupMap is declared in yoruba_seda.h; must create class out of dupMap
 static void dump_dupMap(const dupMap& this_dm);
-static void update_dupMap(alignmentList& al_set, dupMap& this_dm);
+static void update_dupMap(alignmentList& al_pool, alignmentList& al_set, dupMap& this_dm,
+                          const BamShard* shard);
 static void query_dupMap(const dupMap& this_dm);
 static void clear_dupMap(dupMap& this_dm);
 static void clear_dupMap(dupMap& this_dm, dup_t val);
@@ -160,9 +181,222 @@ static void clear_dupMap(dupMap& this_dm, dup_t val);
 
 // local functions
 static void listAlignments(const alignmentList& al_set);
-static bool isDuplicate(const BamAlignment& al_i, const BamAlignment& al_j);
-static void diagnoseDuplicate(const BamAlignment& al_i, const BamAlignment& al_j);
-static void determineDuplicates(alignmentList& al_set, alignmentList& al_dups);
+static bool isDuplicate(const RawRecord& al_i, const RawRecord& al_j);
+static void diagnoseDuplicate(const RawRecord& al_i, const RawRecord& al_j);
+static void determineDuplicates(alignmentList& al_pool, alignmentList& al_set, alignmentList& al_dups);
+
+static int  parseOptions(int argc, char* argv[], bool in_run);
+static int  markByName(void);
+
+// pass 1 of seda: Add() each read in coordinate order, and reads at the same
+// position are examined for duplicates when the position changes; Finish()
+// examines the last position and drops unpaired halves from dup_map.
+//
+// Given a shard, only the reads of that shard are Add()ed, on a thread of its
+// own, and unpaired halves are left in dup_map as the shard's unresolved
+// mates, for reconcileShards() to match against those of other shards.
+
+class DuplicateScan {
+
+    public:
+        DuplicateScan(dupMap& dm, const BamShard* sh = NULL) 
+            : dup_map(dm), shard(sh), last_RefID(-2), last_Position(-1), n_reads(0) { }
+
+        bool Add(const RawRecord& al);  // false if the input is not sorted
+        void Finish(void);
+        int64_t ReadsAdded(void) const { return n_reads; }
+
+    private:
+        void            examine(void);
+
+        dupMap&         dup_map;
+        const BamShard* shard;
+        alignmentList   al_set;   // std::list<> with recycled nodes, see pushAlignment()
+        alignmentList   al_pool;  // the recycled nodes
+        int32_t         last_RefID, last_Position;
+        int64_t         n_reads;
+
+};
+
+// With --threads, both passes are run over shards of the input.  Position
+// groups never cross shards, so duplicates are found within each as they
+// would be in one pass over the whole input.  Only the pending mates in
+// dup_map cross positions: a pair is a duplicate if both of its mates are,
+// and in a shard that sees only one of them, that mate is left unresolved
+// for reconcileShards().  Each shard keeps the names of its own duplicates,
+// and in pass 2 uses them up and writes its own output, as one pass would.
+
+struct ShardScan {
+    BamShard        shard;
+    bool            first;             // the first shard also takes reads before (0, 0)
+    int32_t         end_ref, end_pos;  // the next shard's start; end_ref -1 for the last
+    dupMap          dup_map;           // the duplicates among its reads, and unresolved mates
+    string          path, path_dups;   // pass 2: temporary output files
+    RawBamWriter*   writer;
+    RawBamWriter*   writer_dups;
+    int64_t         n_reads, n_written, n_written_dups, n_removed;
+    int64_t         n_erased_SE, n_erased_PE, n_decremented;  // of dup_map in pass 2
+    bool            ok;
+};
+
+struct ShardQueue {
+    vector<ShardScan>*  scans;
+    size_t              next;  // taken with __atomic_fetch_add()
+    int                 pass;
+    const RefVector*    refs;
+    Progress*           progress;
+};
+
+static void planShards(const BamIndex& index, const RefVector& refs, vector<ShardScan>& scans);
+static bool findDuplicatesInShards(vector<ShardScan>& scans, const RefVector& refs,
+                                   int64_t& n_reads, size_t& n_names);
+static bool markDuplicatesInShards(vector<ShardScan>& scans, const RefVector& refs,
+                                   RawBamWriter& writer, RawBamWriter& writer_dups);
+static bool makeTemporaryFile(const string& dir, string& path);
+static int  shardPlace(const ShardScan& s, const RawRecord& al);
+
+// pass 2 of seda, marking the reads named in dup_map as each is seen.  Entries
+// are used up as reads go by, so this runs on a single pipeline worker, which
+// also writes the --duplicate-file output, or on the thread of one shard with
+// the shard's own dup_map.
+
+class MarkDuplicatesTransform : public RecordTransform {
+
+    public:
+        MarkDuplicatesTransform(dupMap& dm, RawBamWriter* dups) 
+            : dup_map(dm), writer_dups(dups), failed(false),
+              n_reads_written_to_output(0), n_reads_written_to_dups(0), n_reads_removed(0),
+              n_dupMap_entries_decremented(0), n_dupMap_entries_erased_SE(0),
+              n_dupMap_entries_erased_PE(0) { }
+
+        virtual bool Apply(RawRecord& al, int worker);
+        virtual bool Failed(void) const { return failed; }
+
+    private:
+        dupMap&         dup_map;
+        RawBamWriter*   writer_dups;
+        string          al_name;  // reused for lookups, so its buffer is only allocated once
+        bool            failed;
+
+    public:
+        int64_t         n_reads_written_to_output;
+        int64_t         n_reads_written_to_dups;
+        int64_t         n_reads_removed;
+        int64_t         n_dupMap_entries_decremented;
+        int64_t         n_dupMap_entries_erased_SE;
+        int64_t         n_dupMap_entries_erased_PE;
+
+};
+
+
+// seda --by-name, for input grouped by read name as an aligner writes it.
+// Each template is judged once its last record is read: its fragment is
+// reduced to a 64-bit signature of the read group and the unclipped 5' ends
+// of its mapped reads, and only the signatures are kept, so memory grows with
+// distinct fragments rather than with read names.  A fragment whose signature
+// has been seen is a duplicate.  The fragment seen first has already been
+// written by then, so it is the one kept, rather than the one with the best
+// mapping quality as with coordinate-sorted input.
+
+class SignatureSet {
+
+    public:
+        SignatureSet(void) : n(0) {
+            MEMTRACK_TAG("SignatureSet");
+            table.assign(size_t(1) << 16, 0);
+        }
+
+        bool            Insert(uint64_t sig);  // false if sig was already present
+        size_t          Size(void) const { return n; }
+
+    private:
+        void            grow(void);
+
+        vector<uint64_t> table;  // open addressing, 0 marks an empty slot
+        size_t          n;
+
+};
+
+class ByNameMarker {
+
+    public:
+        ByNameMarker(RawBamWriter& w, RawBamWriter* dups)
+            : writer(w), writer_dups(dups), n_templates(0), n_duplicate_templates(0),
+              n_reads_unmated(0), n_reads_written_to_output(0), n_reads_written_to_dups(0),
+              n_reads_removed(0) { }
+
+        // the n records of one template, which are then written
+        bool            Template(vector<RawRecord>& recs, size_t n);
+        size_t          Signatures(void) const { return seen.Size(); }
+
+    private:
+        RawBamWriter&   writer;
+        RawBamWriter*   writer_dups;
+        SignatureSet    seen;
+
+    public:
+        int64_t         n_templates;
+        int64_t         n_duplicate_templates;
+        int64_t         n_reads_unmated;
+        int64_t         n_reads_written_to_output;
+        int64_t         n_reads_written_to_dups;
+        int64_t         n_reads_removed;
+
+};
+
+
+//-------------------------------------
+
+
+bool
+MarkDuplicatesTransform::Apply(RawRecord& al, int worker)
+{
+    al_name.assign(al.Name(), al.NameLength());
+    dupMapI dupI = dup_map.find(al_name);
+
+    if (dupI == dup_map.end()) {  // we did not find this read name in dup_map
+        
+        al.SetIsDuplicate(false);
+        ++n_reads_written_to_output;
+        return true;
+
+    }
+
+    // read name found in dup_map
+
+    al.SetIsDuplicate(true);
+
+    if (writer_dups != NULL) {
+        if (! writer_dups->SaveRecord(al)) {
+            cerr << NAME << " error writing to " << duplicate_file << endl;
+            failed = true;
+        }
+        ++n_reads_written_to_dups;
+    }
+
+    if (dupI->second == dupMap_singleend) {
+        dup_map.erase(dupI);
+        ++n_dupMap_entries_erased_SE;
+    } else if (dupI->second == dupMap_paired_one) {  // second of pair
+        dup_map.erase(dupI);
+        ++n_dupMap_entries_erased_PE;
+    } else if (dupI->second == dupMap_paired_both) {
+        dupI->second = dupMap_paired_one;
+        ++n_dupMap_entries_decremented;
+    } else {
+        cerr << NAME << " unknown dupMap value for '" << dupI->first << "': " 
+            << dupI->second << endl;
+        failed = true;
+    }
+
+    if (opt_remove) {
+        ++n_reads_removed;
+        return false;
+    }
+    ++n_reads_written_to_output;
+    return true;
+}
+
 
 //-------------------------------------
 
@@ -186,23 +420,262 @@ yoruba::main_seda(int argc, char* argv[])
 		return usage();
 	}
     
-    enum { OPT_output, OPT_as_single, OPT_single_only, OPT_paired_only,
-        OPT_remove, OPT_duplicatefile,
+    if (parseOptions(argc, argv, false) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    if (opt_byname)
+        return markByName();
+
+
+    // in this map, key is a read name, value is dup_t depending on state of
+    // duplicate determination
+    //
+    // on pass 1, if a read name is in this map, then it is either a known
+    // duplicate (single-end with val = false) or it is an unmated read of a
+    // pair that might be a duplicate (val = true) or is a mated read that is
+    // an established duplicate.  if it was an unmated read of a pair its name
+    // is removed if the mates are not themselves duplicates.
+    //
+    // on pass 2, if a read name is in this map, then it is a known duplicate,
+    // and is either single-end (val = false) or paired-end (val = true)
+    //
+    // this map might get very, very large... maybe i'm better off reading in
+    // all reads for say 10kbp, and then slurp in steps of 5kbp keep the
+    // this-contig reads out of the map entirely
+    //
+    // also check whether string.c_str() is a faster key than string itself
+
+    //----------------- Open files, start reading data
+
+    ScopedPhase phase_open("open");
+
+    // with more than one thread, both passes are over shards found with the index
+    BamIndex index;
+    if (opt_threads > 1 && ! index.Load(input_file)) {
+        cerr << NAME << " --threads needs an indexed BAM file as input, and none was found for "
+            << input_file << endl;
+        return EXIT_FAILURE;
+    }
+
+	RawBamReader reader;
+
+    // input from a pipe is kept for pass 2, on disk unless --spill-memory
+    reader.SetSpill(spill_dir, size_t(opt_spill_memory) << 20);
+
+	if (! reader.Open(input_file)) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    const string& header = reader.GetHeaderText();  // passed through unparsed
+
+    RawBamWriter writer;
+    RawBamWriter writer_dups;
+
+    if (! output_opts.Open(writer, output_file, header, reader.GetReferenceData())) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (opt_duplicatefile 
+        && ! output_opts.Open(writer_dups, duplicate_file, header, reader.GetReferenceData(), false)) {
+        cerr << NAME << " could not open duplicate output file  " << duplicate_file << endl;
+        return EXIT_FAILURE;
+    }
+
+
+    phase_open.End();
+
+
+    //----------------- Pass 1: Determine which reads are duplicates
+
+
+    ScopedPhase phase_pass1("pass1");
+
+    dupMap dup_map;  // with --threads, each shard has its own instead
+    size_t n_duplicate_names = 0;
+
+    int64_t n_reads = 0;
+    int64_t n_reads_pass1 = 0;
+    int64_t n_reads_written_to_output = 0;
+    int64_t n_reads_written_to_dups = 0;
+    int64_t n_reads_removed = 0;
+
+	RawRecord al;  // holds the current read from the BAM file
+
+    vector<ShardScan> scans;
+
+    if (opt_threads > 1) {
+        planShards(index, reader.GetReferenceData(), scans);
+        if (! findDuplicatesInShards(scans, reader.GetReferenceData(), n_reads, n_duplicate_names))
+            return EXIT_FAILURE;
+    } else {
+        DuplicateScan scan(dup_map);
+        Progress progress;
+
+        progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+        while (reader.GetNextRecord(al) && (opt_reads < 0 || n_reads < opt_reads)) {
+            ++n_reads;
+            if (! scan.Add(al))
+                return EXIT_FAILURE;
+            progress.Add(al, reader.Tell());
+        }
+        progress.Stop();
+        if (reader.Failed()) {
+            cerr << NAME << "[pass1] error reading input" << endl;
+            return EXIT_FAILURE;
+        }
+        scan.Finish();
+        n_duplicate_names = dup_map.size();
+    }
+
+    n_reads_pass1 = n_reads;
+    Stats::Count("seda_duplicate_names", int64_t(n_duplicate_names));
+    phase_pass1.End();
+
+
+    //----------------- Pass 2: dup_map holds names of duplicate reads
+
+
+    ScopedPhase phase_pass2("pass2");
+
+    IF_DEBUG(1) {
+        cerr << NAME << "[pass2] ";
+        if (opt_threads > 1)
+            for (size_t i = 0; i < scans.size(); ++i)
+                query_dupMap(scans[i].dup_map);
+        else
+            query_dupMap(dup_map);
+    }
+
+    n_reads = 0;
+    int64_t n_dupMap_entries_decremented = 0;
+    int64_t n_dupMap_entries_erased_SE = 0;
+    int64_t n_dupMap_entries_erased_PE = 0;
+
+    if (opt_threads > 1) {
+        if (! markDuplicatesInShards(scans, reader.GetReferenceData(), writer, writer_dups)) {
+            cerr << NAME << "[pass2] error while marking duplicates" << endl;
+            return EXIT_FAILURE;
+        }
+        for (size_t i = 0; i < scans.size(); ++i) {
+            n_reads += scans[i].n_reads;
+            n_reads_written_to_output += scans[i].n_written;
+            n_reads_written_to_dups += scans[i].n_written_dups;
+            n_reads_removed += scans[i].n_removed;
+            n_dupMap_entries_erased_SE += scans[i].n_erased_SE;
+            n_dupMap_entries_erased_PE += scans[i].n_erased_PE;
+            n_dupMap_entries_decremented += scans[i].n_decremented;
+        }
+    } else {
+        if (reader.IsSpilling() && (opt_progress || DEBUG(1)))
+            cerr << NAME << "[pass2] replaying input, " << (reader.SpilledToDisk() >> 20) 
+                << " MB of it from the spill file" << endl;
+        if (! reader.Rewind()) {
+            cerr << NAME << "[pass2] could not rewind input" << endl;
+            return EXIT_FAILURE;
+        }
+
+        MarkDuplicatesTransform transform(dup_map, opt_duplicatefile ? &writer_dups : NULL);
+        Pipeline pipeline(reader, writer, transform);
+
+        Progress progress;
+        progress.Start(NAME "[pass2]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+
+        pipeline.SetMaxRecords(opt_reads);
+        pipeline.SetProgress(&progress);
+
+        if (! pipeline.Run()) {
+            cerr << NAME << "[pass2] error while marking duplicates" << endl;
+            return EXIT_FAILURE;
+        }
+        progress.Stop();
+        n_reads = pipeline.RecordsRead();
+        n_reads_written_to_output = transform.n_reads_written_to_output;
+        n_reads_written_to_dups = transform.n_reads_written_to_dups;
+        n_reads_removed = transform.n_reads_removed;
+        n_dupMap_entries_decremented = transform.n_dupMap_entries_decremented;
+        n_dupMap_entries_erased_SE = transform.n_dupMap_entries_erased_SE;
+        n_dupMap_entries_erased_PE = transform.n_dupMap_entries_erased_PE;
+    }
+
+    if (opt_progress && DEBUG(1))
+        cerr << NAME << "[pass2] dupMap operations: "
+            << " erased " << n_dupMap_entries_erased_SE << " SE, "
+            << " erased " << n_dupMap_entries_erased_PE << " PE, "
+            << " decremented " << n_dupMap_entries_decremented << " PE halves" << endl;
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] "
+            << n_reads << " reads seen, "
+            << n_reads_written_to_output << " written to " << output_file << ", "
+            << n_reads_written_to_dups << " written to " << duplicate_file << ", "
+            << n_reads_removed << " removed" << endl;
+
+    IF_DEBUG(2) {
+        cerr << n_reads_pass1 << " reads in pass 1" << endl;
+        cerr << n_reads << " reads in pass 2" << endl;
+    }
+
+    Stats::Count("seda_reads_written_to_dups", n_reads_written_to_dups);
+    Stats::Count("seda_reads_removed", n_reads_removed);
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+    bool ok = writer.Close();
+    if (opt_duplicatefile)
+        ok = writer_dups.Close() && ok;
+    if (! ok)
+        return EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+//-------------------------------------
+
+
+// parse options into the file-static option variables; in_run is true for
+// a step of 'yoruba run', which does its own input and output
+static int
+parseOptions(int argc, char* argv[], bool in_run)
+{
+    enum { OPT_output, OPT_byname, OPT_as_single, OPT_single_only, OPT_paired_only,
+        OPT_remove, OPT_threads, OPT_duplicatefile, OPT_level, OPT_uncompressed, OPT_writeindex,
+        OPT_checksum, OPT_checksumexclude, OPT_region, OPT_regions,
+        OPT_spilldir, OPT_spillmemory,
 #ifdef _WITH_DEBUG
         OPT_debug, OPT_reads, OPT_progress, OPT_override,
 #endif
         OPT_help };
 
     CSimpleOpt::SOption seda_options[] = {
+        { OPT_byname,          "--by-name",         SO_NONE },
         { OPT_as_single,       "--as-single-end",   SO_NONE },
         { OPT_single_only,     "--single-end-only", SO_NONE },
         { OPT_paired_only,     "--paired-end-only", SO_NONE },
         { OPT_remove,          "--remove",          SO_NONE },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
         { OPT_duplicatefile,   "--duplicate-file",  SO_REQ_SEP },
         { OPT_help,            "--help",            SO_NONE },
         { OPT_help,            "-?",                SO_NONE }, 
         { OPT_output,          "--output",          SO_REQ_SEP },
         { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_spilldir,        "--spill-dir",       SO_REQ_SEP },
+        { OPT_spillmemory,     "--spill-memory",    SO_REQ_SEP },
 #ifdef _WITH_DEBUG
         { OPT_debug,           "--debug",           SO_REQ_SEP },
         { OPT_reads,           "--reads",           SO_REQ_SEP },
@@ -212,320 +685,853 @@ yoruba::main_seda(int argc, char* argv[])
         SO_END_OF_OPTIONS
     };
 
-    CSimpleOpt args(argc, argv, seda_options);
+    CSimpleOpt args(argc, argv, seda_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage();
+        } else if (args.OptionId() == OPT_byname) {
+            opt_byname = true;
+        } else if (args.OptionId() == OPT_as_single) {
+            opt_detect = DETECT_as_single;
+        } else if (args.OptionId() == OPT_single_only) {
+            opt_detect = DETECT_single_only;
+        } else if (args.OptionId() == OPT_paired_only) {
+            opt_detect = DETECT_paired_only;
+        } else if (args.OptionId() == OPT_remove) {
+            opt_remove = true;
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
+        } else if (args.OptionId() == OPT_duplicatefile) {
+            opt_duplicatefile = true; duplicate_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_output) {
+            output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_spilldir) {
+            spill_dir = args.OptionArg();
+        } else if (args.OptionId() == OPT_spillmemory) {
+            opt_spill_memory = strtoll(args.OptionArg(), NULL, 10);
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+        } else if (args.OptionId() == OPT_override) {
+            opt_override = true;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (DEBUG(1) && ! opt_progress)
+        opt_progress = debug_progress;
+
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    if (! opt_override) {
+        cerr << NAME << " *** this command is not yet ready for general use ***" << endl;
+        return usage();
+    }
+
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+    if (opt_threads > 1 && (opt_byname || opt_reads >= 0)) {
+        cerr << NAME << " --threads cannot be used with " << (opt_byname ? "--by-name" : "--reads") << endl;
+        return usage();
+    }
+    if (! regions.Empty() && (opt_byname || opt_threads > 1)) {
+        cerr << NAME << " regions cannot be used with " << (opt_byname ? "--by-name" : "--threads") << endl;
+        return usage();
+    }
+
+    if (in_run) {
+        if (opt_threads > 1) {
+            cerr << NAME << " --threads is not available in 'yoruba run', give it to 'yoruba run' itself" << endl;
+            return usage();
+        }
+        if (args.FileCount() > 0 || ! output_file.empty() || ! checksum_file.empty() || ! regions.Empty()) {
+            cerr << NAME << " input, output, regions and --checksum are for 'yoruba run', not its steps" << endl;
+            return usage();
+        }
+        if (opt_byname) {
+            cerr << NAME << " --by-name is not available in 'yoruba run', whose steps see coordinate-sorted input" << endl;
+            return usage();
+        }
+        return EXIT_SUCCESS;
+    }
+
+    if (args.FileCount() > 1) {
+        cerr << NAME << " requires at most one BAM file specified as input" << endl;
+        return usage();
+    } else if (args.FileCount() == 1) {
+        input_file = args.File(0);
+    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
+        input_file = "/dev/stdin";
+    }
+    if (opt_spill_memory < 0) {
+        cerr << NAME << " --spill-memory must be at least 0" << endl;
+        return usage();
+    }
+
+    if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+//-------------------------------------  DuplicateScan
+//-------------------------------------
+
+
+bool
+DuplicateScan::Add(const RawRecord& al)
+{
+    if (! al_set.empty() && al.RefID() == last_RefID && al.Position() == last_Position) {
+        pushAlignment(al_pool, al_set, al);
+        IF_DEBUG(3) 
+            cerr << al_set.size() << " alignments, al.RefID = " << al.RefID() 
+                << " al.Position = " << al.Position() << endl;
+        ++n_reads;
+        return true;
+    }
+    if (n_reads > 0 && ! isCoordinateSorted(al.RefID(), al.Position(), last_RefID, last_Position)) {
+        cerr << NAME << " input is not coordinate-sorted, " << al.NameString() 
+            << " out of position" << endl;
+        return false;
+    }
+    if (! al_set.empty())
+        examine();
+
+    // unplaced reads sort last and are never duplicates, so are not collected
+    if (al.RefID() >= 0)
+        pushAlignment(al_pool, al_set, al);
+    last_RefID = al.RefID();
+    last_Position = al.Position();
+    ++n_reads;
+
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// all alignments in al_set share RefID and Position
+void
+DuplicateScan::examine(void)
+{
+    IF_DEBUG(2) 
+        cerr << "read " << al_set.size() << " alignments at Ref = " << last_RefID 
+            << " Pos = " << last_Position << endl;
+
+    if (al_set.size() > 1) {
+        alignmentList al_dups;  // holds duplicates detected
+
+        IF_DEBUG(2) listAlignments(al_set);
+        determineDuplicates(al_pool, al_set, al_dups);  // which reads here are potential duplicates?
+        assert(al_set.empty());  // still true?
+        update_dupMap(al_pool, al_dups, dup_map, shard);  // add duplicates to set for pass 2
+        assert(al_dups.empty());
+
+    } else {
+
+        clearAlignments(al_pool, al_set);  // just one read here, no duplicates
+
+    }
+}
+
+
+//-------------------------------------
+
+
+void
+DuplicateScan::Finish(void)
+{
+    if (! al_set.empty())
+        examine();
+
+    if (shard != NULL)  // unpaired halves are resolved across shards
+        return;
+
+    if (opt_progress || DEBUG(1)) {
+        cerr << NAME << "[pass1] " << n_reads << " reads examined"
+            << ", last at Ref = " << last_RefID << " Pos = " << last_Position
+            << ", size of dupMap = " << dup_map.size()
+            << endl;
+    }
+
+    { // clean the map: remove PE reads with unseen mates
+        size_t initial_size = dup_map.size();
+        clear_dupMap(dup_map, dupMap_paired_one);
+        size_t n_removed = initial_size - dup_map.size();
+        if (n_removed || DEBUG(1))
+            cerr << NAME << "[pass1] map size was " << initial_size 
+                << ", removed " << n_removed << " PE reads with unseen mates, size now is " 
+                << dup_map.size() << endl;
+    }
+}
+
+
+//-------------------------------------
+//-------------------------------------  shards
+//-------------------------------------
+
+
+static bool
+scanShard(ShardScan& s)
+{
+    RawBamReader reader;
+    if (! reader.Open(input_file) || (s.shard.offset != 0 && ! reader.Seek(s.shard.offset))) {
+        cerr << NAME << "[pass1] could not read shard at Ref = " << s.shard.ref 
+            << " Pos = " << s.shard.pos << endl;
+        return false;
+    }
+
+    DuplicateScan scan(s.dup_map, &s.shard);
+    RawRecord al;
+    bool ok = true;
+
+    while (reader.GetNextRecord(al)) {
+        if (al.RefID() < 0)  // unplaced reads sort last and are never duplicates
+            break;
+        int place = shardPlace(s, al);
+        if (place < 0)
+            continue;
+        if (place > 0)
+            break;
+        if (! scan.Add(al)) {
+            ok = false;
+            break;
+        }
+    }
+    if (reader.Failed()) {
+        cerr << NAME << "[pass1] error reading shard at Ref = " << s.shard.ref 
+            << " Pos = " << s.shard.pos << endl;
+        ok = false;
+    }
+    scan.Finish();
+    s.n_reads = scan.ReadsAdded();
+    reader.Close();
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+// pass 2 of a shard, into files of its own that are added to the output in
+// order once all shards are done
+static bool
+markShard(ShardScan& s, const RefVector& refs)
+{
+    RawBamReader reader;
+    if (! reader.Open(input_file) || (s.shard.offset != 0 && ! reader.Seek(s.shard.offset))) {
+        cerr << NAME << "[pass2] could not read shard at Ref = " << s.shard.ref 
+            << " Pos = " << s.shard.pos << endl;
+        return false;
+    }
+    s.writer = new RawBamWriter;
+    if (! output_opts.OpenShard(*s.writer, s.path, refs))
+        return false;
+    if (opt_duplicatefile) {
+        s.writer_dups = new RawBamWriter;
+        if (! output_opts.OpenShard(*s.writer_dups, s.path_dups, refs, false))
+            return false;
+    }
+
+    MarkDuplicatesTransform transform(s.dup_map, s.writer_dups);
+    RawRecord al;
+    bool ok = true;
+
+    s.n_reads = 0;
+    while (ok && reader.GetNextRecord(al)) {
+        int place = shardPlace(s, al);
+        if (place < 0)
+            continue;
+        if (place > 0)
+            break;
+        ++s.n_reads;
+        if (transform.Apply(al, 0) && ! s.writer->SaveRecord(al)) {
+            cerr << NAME << "[pass2] error writing " << s.path << endl;
+            ok = false;
+        }
+        ok = ok && ! transform.Failed();
+    }
+    if (ok && reader.Failed()) {
+        cerr << NAME << "[pass2] error reading shard at Ref = " << s.shard.ref 
+            << " Pos = " << s.shard.pos << endl;
+        ok = false;
+    }
+    s.n_written = transform.n_reads_written_to_output;
+    s.n_written_dups = transform.n_reads_written_to_dups;
+    s.n_removed = transform.n_reads_removed;
+    s.n_erased_SE = transform.n_dupMap_entries_erased_SE;
+    s.n_erased_PE = transform.n_dupMap_entries_erased_PE;
+    s.n_decremented = transform.n_dupMap_entries_decremented;
+    reader.Close();
+    ok = s.writer->Close() && ok;
+    if (s.writer_dups != NULL)
+        ok = s.writer_dups->Close() && ok;
+    return ok;
+}
+
+
+//-------------------------------------
+
+
+static void*
+shardThread(void* arg)
+{
+    ShardQueue* q = static_cast<ShardQueue*>(arg);
+    size_t i;
+    while ((i = __atomic_fetch_add(&q->next, 1, __ATOMIC_RELAXED)) < q->scans->size()) {
+        ShardScan& s = (*q->scans)[i];
+        s.ok = (q->pass == 1) ? scanShard(s) : markShard(s, *q->refs);
+        q->progress->Add(s.n_reads);
+        if ((opt_progress || DEBUG(1)) && s.ok)
+            cerr << NAME << "[pass" << q->pass << "] shard " << i + 1 << " of " << q->scans->size() 
+                << " from Ref = " << s.shard.ref << " Pos = " << s.shard.pos << ", " 
+                << s.n_reads << " reads " << (q->pass == 1 ? "examined" : "seen") << endl;
+    }
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+// run pass 1 or 2 of every shard on opt_threads threads, false if any failed
+static bool
+runShards(vector<ShardScan>& scans, int pass, const RefVector& refs)
+{
+    ShardQueue queue;
+    queue.scans = &scans;
+    queue.next = 0;
+    queue.pass = pass;
+    queue.refs = &refs;
+
+    // counted as each shard finishes, as shards are read from many places at once
+    Progress progress;
+    progress.Start(pass == 1 ? NAME "[pass1]" : NAME "[pass2]", opt_progress);
+    queue.progress = &progress;
+
+    vector<pthread_t> threads(min(size_t(opt_threads), scans.size()));
+    size_t n_started = 0;
+    for ( ; n_started < threads.size(); ++n_started)
+        if (pthread_create(&threads[n_started], NULL, shardThread, &queue) != 0)
+            break;
+    if (n_started == 0)  // no threads to be had, so run them all here
+        shardThread(&queue);
+    for (size_t i = 0; i < n_started; ++i)
+        pthread_join(threads[i], NULL);
+
+    for (size_t i = 0; i < scans.size(); ++i)
+        if (! scans[i].ok)
+            return false;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// shards of similar compressed size found from the index, more than there
+// are threads so that threads finishing early take another
+static void
+planShards(const BamIndex& index, const RefVector& refs, vector<ShardScan>& scans)
+{
+    vector<BamShard> shards;
+    index.Shards(refs, size_t(opt_threads) * 4, shards);
+
+    scans.resize(shards.size());
+    for (size_t i = 0; i < shards.size(); ++i) {
+        ShardScan& s = scans[i];
+        s.shard = shards[i];
+        s.first = (i == 0);
+        s.end_ref = (i + 1 < shards.size()) ? shards[i + 1].ref : -1;
+        s.end_pos = (i + 1 < shards.size()) ? shards[i + 1].pos : -1;
+        s.n_reads = s.n_written = s.n_written_dups = s.n_removed = 0;
+        s.n_erased_SE = s.n_erased_PE = s.n_decremented = 0;
+        s.writer = s.writer_dups = NULL;
+        s.ok = false;
+    }
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << " " << scans.size() << " shards of " << index.Filename() 
+            << " on " << opt_threads << " threads" << endl;
+}
+
+
+//-------------------------------------
+
+
+// settle the mates left unresolved by the shards: one whose mate was left in
+// another shard is half of a duplicate pair, and stays in its shard's map for
+// pass 2 to use up, and those left unmatched are dropped as Finish() does;
+// returns the number of duplicate names
+static size_t
+reconcileShards(vector<ShardScan>& scans)
+{
+    MEMTRACK_TAG("dupMap");
+    dupMap pending;  // paired_one if seen in one shard, paired_both if in two
+    size_t n_names = 0;
+
+    for (size_t i = 0; i < scans.size(); ++i) {
+        const dupMap& dm = scans[i].dup_map;
+        for (dupMapCI dupI = dm.begin(); dupI != dm.end(); ++dupI) {
+            if (dupI->second != dupMap_paired_one) {
+                ++n_names;
+                continue;
+            }
+            pair<dupMapI, bool> p = pending.insert(*dupI);
+            if (! p.second)
+                p.first->second = dupMap_paired_both;
+        }
+    }
+
+    int64_t n_resolved = 0, n_removed = 0;
+    for (size_t i = 0; i < scans.size(); ++i) {
+        dupMap& dm = scans[i].dup_map;
+        for (dupMapI dupI = dm.begin(); dupI != dm.end(); ) {
+            if (dupI->second == dupMap_paired_one && pending[dupI->first] == dupMap_paired_one) {
+                dm.erase(dupI++);
+                ++n_removed;
+            } else {
+                ++dupI;
+            }
+        }
+    }
+    for (dupMapCI dupI = pending.begin(); dupI != pending.end(); ++dupI)
+        if (dupI->second == dupMap_paired_both)
+            ++n_resolved;
+    n_names += size_t(n_resolved);
+
+    if (n_removed || n_resolved || DEBUG(1))
+        cerr << NAME << "[pass1] " << n_resolved << " PE duplicates found across shards, removed "
+            << n_removed << " PE reads with unseen mates, " << n_names << " duplicate names" << endl;
+    return n_names;
+}
+
+
+//-------------------------------------
+
+
+static bool
+findDuplicatesInShards(vector<ShardScan>& scans, const RefVector& refs,
+                       int64_t& n_reads, size_t& n_names)
+{
+    if (! runShards(scans, 1, refs))
+        return false;
+    n_reads = 0;
+    for (size_t i = 0; i < scans.size(); ++i)
+        n_reads += scans[i].n_reads;
+    n_names = reconcileShards(scans);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+// each shard's output goes to a temporary file, whose compressed blocks are
+// then appended to writer in order
+static bool
+markDuplicatesInShards(vector<ShardScan>& scans, const RefVector& refs,
+                       RawBamWriter& writer, RawBamWriter& writer_dups)
+{
+    string dir = spill_dir;
+    if (dir.empty())
+        dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+    bool ok = true;
+    for (size_t i = 0; ok && i < scans.size(); ++i) {
+        ok = makeTemporaryFile(dir, scans[i].path);
+        if (ok && opt_duplicatefile)
+            ok = makeTemporaryFile(dir, scans[i].path_dups);
+    }
+    ok = ok && runShards(scans, 2, refs);
 
-    while (args.Next()) {
-        if (args.LastError() != SO_SUCCESS) {
-            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
-            return usage();
+    for (size_t i = 0; i < scans.size(); ++i) {
+        ShardScan& s = scans[i];
+        if (ok && ! writer.AppendShard(*s.writer)) {
+            cerr << NAME << "[pass2] could not add shard " << s.path << " to " << output_file << endl;
+            ok = false;
         }
-        if (args.OptionId() == OPT_help) {
-            return usage();
-        } else if (args.OptionId() == OPT_as_single) {
-            opt_detect = DETECT_as_single;
-        } else if (args.OptionId() == OPT_single_only) {
-            opt_detect = DETECT_single_only;
-        } else if (args.OptionId() == OPT_paired_only) {
-            opt_detect = DETECT_paired_only;
-        } else if (args.OptionId() == OPT_remove) {
-            opt_remove = true;
-        } else if (args.OptionId() == OPT_duplicatefile) {
-            opt_duplicatefile = true; duplicate_file = args.OptionArg();
-        } else if (args.OptionId() == OPT_output) {
-            output_file = args.OptionArg();
-#ifdef _WITH_DEBUG
-        } else if (args.OptionId() == OPT_debug) {
-            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
-        } else if (args.OptionId() == OPT_reads) {
-            opt_reads = strtoll(args.OptionArg(), NULL, 10);
-        } else if (args.OptionId() == OPT_progress) {
-            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
-        } else if (args.OptionId() == OPT_override) {
-            opt_override = true;
-#endif
-        } else {
-            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
-            return EXIT_FAILURE;
+        if (ok && opt_duplicatefile && ! writer_dups.AppendShard(*s.writer_dups)) {
+            cerr << NAME << "[pass2] could not add shard " << s.path_dups << " to " << duplicate_file << endl;
+            ok = false;
         }
+        if (! s.path.empty())
+            unlink(s.path.c_str());
+        if (! s.path_dups.empty())
+            unlink(s.path_dups.c_str());
+        delete s.writer;
+        delete s.writer_dups;
+        s.writer = s.writer_dups = NULL;
     }
+    return ok;
+}
 
-    if (DEBUG(1) && ! opt_progress)
-        opt_progress = debug_progress;
 
-    if (args.FileCount() > 1) {
-        cerr << NAME << " requires at most one BAM file specified as input" << endl;
-        return usage();
-    } else if (args.FileCount() == 1) {
-        input_file = args.File(0);
-    } else if (input_file.empty()) {
-        cerr << NAME << " can't currently read from stdin, ask Doug about it" << endl;
-        return EXIT_FAILURE;
-        input_file = "/dev/stdin";
-    }
+//-------------------------------------
 
-    if (output_file.empty())
-        output_file = "/dev/stdout";
 
-    if (! opt_override) {
-        cerr << NAME << " *** this command is not yet ready for general use ***" << endl;
-        return usage();
+static bool
+makeTemporaryFile(const string& dir, string& path)
+{
+    string templ_s = dir + "/yoruba_duplicate.XXXXXX";
+    vector<char> templ(templ_s.begin(), templ_s.end());
+    templ.push_back('\0');
+    int fd = mkstemp(&templ[0]);
+    if (fd < 0) {
+        cerr << NAME << " could not create temporary file in " << dir
+            << ": " << strerror(errno) << endl;
+        return false;
     }
+    close(fd);
+    path = &templ[0];
+    return true;
+}
 
 
-    // in this map, key is a read name, value is dup_t depending on state of
-    // duplicate determination
-    //
-    // on pass 1, if a read name is in this map, then it is either a known
-    // duplicate (single-end with val = false) or it is an unmated read of a
-    // pair that might be a duplicate (val = true) or is a mated read that is
-    // an established duplicate.  if it was an unmated read of a pair its name
-    // is removed if the mates are not themselves duplicates.
-    //
-    // on pass 2, if a read name is in this map, then it is a known duplicate,
-    // and is either single-end (val = false) or paired-end (val = true)
-    //
-    // this map might get very, very large... maybe i'm better off reading in
-    // all reads for say 10kbp, and then slurp in steps of 5kbp keep the
-    // this-contig reads out of the map entirely
-    //
-    // also check whether string.c_str() is a faster key than string itself
+//-------------------------------------
 
-    //----------------- Open files, start reading data
 
-	BamReader reader;
+// where al lies for shard s: -1 before it, 0 in it, 1 after it.  The first
+// shard has no start and the last no end, so it takes the unplaced reads.
+static int
+shardPlace(const ShardScan& s, const RawRecord& al)
+{
+    if (! s.first && ! isCoordinateSorted(al.RefID(), al.Position(), s.shard.ref, s.shard.pos))
+        return -1;
+    if (s.end_ref >= 0 && isCoordinateSorted(al.RefID(), al.Position(), s.end_ref, s.end_pos))
+        return 1;
+    return 0;
+}
+
+
+//-------------------------------------
+//-------------------------------------  --by-name
+//-------------------------------------
+
+
+static int
+markByName(void)
+{
+    ScopedPhase phase_open("open");
+
+	RawBamReader reader;
 
 	if (! reader.Open(input_file)) {
         cerr << NAME << " could not open BAM input" << endl;
         return EXIT_FAILURE;
     }
 
-#ifdef _IF_BAMTOOLS_IS_BROKEN
-    SamHeader header = reader.GetHeader();
-#else
-    const SamHeader& header = reader.GetConstSamHeader();
-#endif
+    const string& header = reader.GetHeaderText();  // passed through unparsed
 
-    BamWriter writer;
-    BamWriter writer_dups;
+    RawBamWriter writer;
+    RawBamWriter writer_dups;
 
-    if (! writer.Open(output_file, header, reader.GetReferenceData())) {
+    if (! output_opts.Open(writer, output_file, header, reader.GetReferenceData())) {
         cerr << NAME << " could not open output " << output_file << endl;
         return EXIT_FAILURE;
     }
 
-    if (opt_duplicatefile && ! writer_dups.Open(duplicate_file, header, reader.GetReferenceData())) {
+    if (opt_duplicatefile 
+        && ! output_opts.Open(writer_dups, duplicate_file, header, reader.GetReferenceData(), false)) {
         cerr << NAME << " could not open duplicate output file  " << duplicate_file << endl;
         return EXIT_FAILURE;
     }
 
+    phase_open.End();
 
-    //----------------- Pass 1: Determine which reads are duplicates
+    ScopedPhase phase_pass1("pass1");
 
+    ByNameMarker marker(writer, opt_duplicatefile ? &writer_dups : NULL);
 
-    dupMap dup_map;
+    // records of the current template; entries are reused, and their buffers with them
+    vector<RawRecord> group;
+    size_t n_group = 0;
 
     int64_t n_reads = 0;
-    int64_t n_reads_pass1 = 0;
-    int64_t n_reads_written_to_output = 0;
-    int64_t n_reads_written_to_dups = 0;
-    int64_t n_reads_removed = 0;
-
-	BamAlignment al;  // holds the current read from the BAM file
+    RawRecord al;
+    Progress progress;
 
-    // it might be more efficient to manage my own list, std::list<> is fine for now
-    alignmentList al_set;
+    progress.Start(NAME, opt_progress, reader.InputSize(), &reader.GetReferenceData());
 
-    int32_t last_RefID = -2;
-    int32_t last_Position = -1;
-
-    if (reader.GetNextAlignment(al)) {
-        al_set.push_back(al);
-        last_RefID = al.RefID;
-        last_Position = al.Position;
+    while (reader.GetNextRecord(al) && (opt_reads < 0 || n_reads < opt_reads)) {
         ++n_reads;
-        IF_DEBUG(3) 
-            cerr << "beginning with " << al_set.size() << " alignments, al.RefID = " 
-                << al.RefID << " al.Position = " << al.Position << endl;
+        if (n_group > 0 && ! al.NameEquals(group[0])) {
+            if (! marker.Template(group, n_group))
+                return EXIT_FAILURE;
+            n_group = 0;
+        }
+        if (n_group == group.size())
+            group.push_back(al);
+        else
+            group[n_group] = al;
+        ++n_group;
+        progress.Add(al, reader.Tell());
     }
+    progress.Stop();
+    if (reader.Failed()) {
+        cerr << NAME << " error reading input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (n_group > 0 && ! marker.Template(group, n_group))
+        return EXIT_FAILURE;
 
-	while (! al_set.empty() && (opt_reads < 0 || n_reads < opt_reads)) {
+    if (marker.n_reads_unmated > 0)
+        cerr << NAME << " " << marker.n_reads_unmated << " paired reads were not next to"
+            << " their mates and were not examined; is the input grouped by read name?" << endl;
 
-        IF_DEBUG(3) 
-            cerr << al_set.size() << " alignments at start of alignment-reading loop" << endl;
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << " "
+            << n_reads << " reads seen, "
+            << marker.n_templates << " templates, "
+            << marker.n_duplicate_templates << " duplicates, "
+            << marker.Signatures() << " signatures kept, "
+            << marker.n_reads_written_to_output << " reads written to " << output_file << ", "
+            << marker.n_reads_written_to_dups << " written to " << duplicate_file << ", "
+            << marker.n_reads_removed << " removed" << endl;
+
+    Stats::Count("seda_duplicate_templates", marker.n_duplicate_templates);
+    Stats::Count("seda_reads_written_to_dups", marker.n_reads_written_to_dups);
+    Stats::Count("seda_reads_removed", marker.n_reads_removed);
+    phase_pass1.End();
+
+    ScopedPhase phase_close("close");
+    reader.Close();
+    bool ok = writer.Close();
+    if (opt_duplicatefile)
+        ok = writer_dups.Close() && ok;
+    if (! ok)
+        return EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
 
-        bool al_remaining;
+    return EXIT_SUCCESS;
+}
 
-        while ((al_remaining = reader.GetNextAlignment(al)) 
-                && al.RefID == last_RefID 
-                && al.Position == last_Position ) {
-            al_set.push_back(al);
-            IF_DEBUG(3) 
-                cerr << al_set.size() << " alignments, al.RefID = " << al.RefID 
-                    << " al.Position = " << al.Position << endl;
-            ++n_reads;
-        }
 
-        if (al_remaining && ! isCoordinateSorted(al.RefID, al.Position, last_RefID, last_Position)) {
-            cerr << NAME << " input is not coordinate-sorted, " << al.Name 
-                << " out of position" << endl;
-            return EXIT_FAILURE;
-        }
+//-------------------------------------
 
-        // all alignments in al_set share RefID and Position
 
-        IF_DEBUG(2) 
-            cerr << "read " << al_set.size() << " alignments at Ref = " << last_RefID 
-                << " Pos = " << last_Position << endl;
+// 0 for a single-end read, else 1 or 2 for the first or second of a pair
+static inline int
+segment(const RawRecord& al)
+{
+    if (! al.IsPaired())
+        return 0;
+    return al.IsSecondMate() ? 2 : (al.IsFirstMate() ? 1 : 0);
+}
 
-        if (al_set.size() > 1) {
-            alignmentList al_dups;  // holds duplicates detected
 
-            IF_DEBUG(2) listAlignments(al_set);
-            determineDuplicates(al_set, al_dups);  // which reads here are potential duplicates?
-            assert(al_set.empty());  // still true?
-            update_dupMap(al_dups, dup_map);  // add duplicates to set for pass 2
-            assert(al_dups.empty());
+//-------------------------------------
 
-        } else {
 
-            al_set.clear();  // just one read here, no duplicates
+static inline uint64_t
+mixSignature(uint64_t h, uint64_t v)
+{
+    h ^= v;  // then the splitmix64 finalizer
+    h = (h ^ (h >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    h = (h ^ (h >> 27)) * 0x94d049bb133111ebULL;
+    return h ^ (h >> 31);
+}
 
-        }
 
-        if (al_remaining) {
-            al_set.push_back(al);
-            last_RefID = al.RefID;
-            last_Position = al.Position;
-            ++n_reads;
-        }
-        
-        // because we eat reads in chunks, we rarely hit n_reads % opt_progress == 0
-        if ((opt_progress || DEBUG(1)) && (n_reads % opt_progress <= last_n_reads_mod))
-            cerr << NAME << "[pass1] " << n_reads << " reads examined"
-                << ", last at Ref = " << last_RefID << " Pos = " << last_Position
-                << ", size of dupMap = " << dup_map.size()
-                << endl;
-        last_n_reads_mod = n_reads % opt_progress;
-	}
+//-------------------------------------
 
-    if (opt_progress || DEBUG(1)) {
-        cerr << NAME << "[pass1] " << n_reads << " reads examined"
-            << ", last at Ref = " << last_RefID << " Pos = " << last_Position
-            << ", size of dupMap = " << dup_map.size()
-            << endl;
-    }
 
-    { // clean the map: remove PE reads with unseen mates
-        size_t initial_size = dup_map.size();
-        clear_dupMap(dup_map, dupMap_paired_one);
-        size_t n_removed = initial_size - dup_map.size();
-        if (n_removed || DEBUG(1))
-            cerr << NAME << "[pass1] map size was " << initial_size 
-                << ", removed " << n_removed << " PE reads with unseen mates, size now is " 
-                << dup_map.size() << endl;
+// the read group and pairing of a fragment start its signature
+static uint64_t
+startSignature(const RawRecord& al, uint64_t kind)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;  // FNV-1a of the RG value
+    const char* tag;
+    size_t len;
+    if (al.GetTagString("RG", tag, len)) {
+        for (size_t i = 0; i < len; ++i)
+            h = (h ^ uint8_t(tag[i])) * 0x100000001b3ULL;
+        kind |= 0x10;
     }
-
-    n_reads_pass1 = n_reads;
+    return mixSignature(h, kind);
+}
 
 
-    //----------------- Pass 2: dup_map holds names of duplicate reads
+//-------------------------------------
 
 
-    IF_DEBUG(1) {
-        cerr << NAME << "[pass2] ";
-        query_dupMap(dup_map);
+// the unclipped 5' end of a mapped read with its reference, and its strand in
+// the low bit, as for Picard MarkDuplicates
+static uint64_t
+fivePrimeEnd(const RawRecord& al)
+{
+    const uint16_t n = al.CigarCount();
+    int32_t end;
+    if (! al.IsReverseStrand()) {
+        end = al.Position();
+        for (uint16_t i = 0; i < n && (al.CigarOp(i) & 0xf) >= 4 && (al.CigarOp(i) & 0xf) <= 5; ++i)
+            end -= al.CigarOp(i) >> 4;  // S or H
+    } else {
+        end = al.EndPosition() - 1;
+        for (int i = n - 1; i >= 0 && (al.CigarOp(i) & 0xf) >= 4 && (al.CigarOp(i) & 0xf) <= 5; --i)
+            end += al.CigarOp(i) >> 4;
     }
+    return (uint64_t(uint32_t(al.RefID())) << 33) 
+        | (uint64_t(uint32_t(end)) << 1) 
+        | (al.IsReverseStrand() ? 1 : 0);
+}
 
-    n_reads = 0;
-    int64_t n_dupMap_entries_decremented = 0;
-    int64_t n_dupMap_entries_erased_SE = 0;
-    int64_t n_dupMap_entries_erased_PE = 0;
-
-    reader.Rewind();
-
-    // we nead the read name, so GetNextAlignmentCore() is insufficient
-	while (reader.GetNextAlignment(al) && (opt_reads < 0 || n_reads < opt_reads)) {
-
-        ++n_reads;
 
-        dupMapI dupI = dup_map.find(al.Name);
+//-------------------------------------
 
-        if (dupI == dup_map.end()) {  // we did not find this read name in dup_map
-            
-            al.SetIsDuplicate(false);
 
-            writer.SaveAlignment(al);
-            ++n_reads_written_to_output;
+bool
+ByNameMarker::Template(vector<RawRecord>& recs, size_t n)
+{
+    ++n_templates;
+
+    // primary alignments by segment; secondary and supplementary records
+    // follow the judgement of their primary
+    const RawRecord* primary[3] = { NULL, NULL, NULL };
+    for (size_t i = 0; i < n; ++i)
+        if (recs[i].IsPrimaryAlignment() && ! (recs[i].Flag() & 0x0800))
+            primary[segment(recs[i])] = &recs[i];
+
+    bool dup[3] = { false, false, false };
+
+    if (opt_detect == DETECT_as_single) {
+        for (int s = 0; s < 3; ++s)
+            if (primary[s] != NULL && primary[s]->IsMapped())
+                dup[s] = ! seen.Insert(mixSignature(startSignature(*primary[s], 1), 
+                                                    fivePrimeEnd(*primary[s])));
+    } else if (primary[0] != NULL && ! primary[0]->IsPaired()) {
+        if (opt_detect != DETECT_paired_only && primary[0]->IsMapped())
+            dup[0] = ! seen.Insert(mixSignature(startSignature(*primary[0], 1), 
+                                                fivePrimeEnd(*primary[0])));
+    } else if (primary[1] != NULL && primary[2] != NULL) {
+        if (opt_detect != DETECT_single_only && primary[1]->IsMapped() && primary[2]->IsMapped()) {
+            // the ends in a fixed order, so the mates may be either way round
+            uint64_t end1 = fivePrimeEnd(*primary[1]);
+            uint64_t end2 = fivePrimeEnd(*primary[2]);
+            if (end2 < end1)
+                swap(end1, end2);
+            uint64_t sig = mixSignature(mixSignature(startSignature(*primary[1], 2), end1), end2);
+            dup[0] = dup[1] = dup[2] = ! seen.Insert(sig);
+        }
+    } else {
+        for (int s = 0; s < 3; ++s)
+            if (primary[s] != NULL)
+                ++n_reads_unmated;
+    }
 
-        } else {  // read name found in dup_map
+    if (dup[0] || dup[1] || dup[2])
+        ++n_duplicate_templates;
+
+    for (size_t i = 0; i < n; ++i) {
+        RawRecord& al = recs[i];
+        bool is_dup = dup[segment(al)];
+        al.SetIsDuplicate(is_dup);
+        if (is_dup && writer_dups != NULL) {
+            if (! writer_dups->SaveRecord(al)) {
+                cerr << NAME << " error writing to " << duplicate_file << endl;
+                return false;
+            }
+            ++n_reads_written_to_dups;
+        }
+        if (is_dup && opt_remove) {
+            ++n_reads_removed;
+            continue;
+        }
+        if (! writer.SaveRecord(al)) {
+            cerr << NAME << " error writing to " << output_file << endl;
+            return false;
+        }
+        ++n_reads_written_to_output;
+    }
+    return true;
+}
 
-            al.SetIsDuplicate(true);
 
-            if (opt_duplicatefile) {
-                writer_dups.SaveAlignment(al);
-                ++n_reads_written_to_dups;
-            }
+//-------------------------------------
 
-            if (opt_remove) {
-                ++n_reads_removed;
-            } else {
-                writer.SaveAlignment(al);
-                ++n_reads_written_to_output;
-            }
 
-            if (dupI->second == dupMap_singleend) {
-                dup_map.erase(dupI);
-                ++n_dupMap_entries_erased_SE;
-            } else if (dupI->second == dupMap_paired_one) {  // second of pair
-                dup_map.erase(dupI);
-                ++n_dupMap_entries_erased_PE;
-            } else if (dupI->second == dupMap_paired_both) {
-                dupI->second = dupMap_paired_one;
-                ++n_dupMap_entries_decremented;
-            } else {
-                cerr << NAME << " unknown dupMap value for '" << dupI->first << "': " 
-                    << dupI->second << endl;
-                return EXIT_FAILURE;
-            }
+bool
+SignatureSet::Insert(uint64_t sig)
+{
+    if (sig == 0)
+        sig = 1;
+    if ((n + 1) * 4 > table.size() * 3)
+        grow();
+    size_t mask = table.size() - 1;
+    for (size_t i = size_t(sig) & mask; ; i = (i + 1) & mask) {
+        if (table[i] == sig)
+            return false;
+        if (table[i] == 0) {
+            table[i] = sig;
+            ++n;
+            return true;
         }
+    }
+}
 
-        if ((opt_progress && DEBUG(1)) && n_reads % opt_progress == 0) 
-            cerr << NAME << "[pass2] dupMap operations:"
-                << " erased " << n_dupMap_entries_erased_SE << " SE, "
-                << " erased " << n_dupMap_entries_erased_PE << " PE, "
-                << " decremented " << n_dupMap_entries_decremented << " PE halves" << endl;
-        if ((opt_progress || DEBUG(1)) && n_reads % opt_progress == 0) 
-            cerr << NAME << "[pass2] "
-                << n_reads << " reads seen, last at RefID = " << al.RefID 
-                << " Pos = " << al.Position << ", "
-                << n_reads_written_to_output << " written to " << output_file << ", "
-                << n_reads_written_to_dups << " written to " << duplicate_file << ", "
-                << n_reads_removed << " removed" << endl;
-	}
-
-    if (opt_progress && DEBUG(1))
-        cerr << NAME << "[pass2] dupMap operations: "
-            << " erased " << n_dupMap_entries_erased_SE << " SE, "
-            << " erased " << n_dupMap_entries_erased_PE << " PE, "
-            << " decremented " << n_dupMap_entries_decremented << " PE halves" << endl;
-    if ((opt_progress || DEBUG(1)) && n_reads % opt_progress == 0) 
-        cerr << NAME << "[pass2] "
-            << n_reads << " reads seen, "
-            << n_reads_written_to_output << " written to " << output_file << ", "
-            << n_reads_written_to_dups << " written to " << duplicate_file << ", "
-            << n_reads_removed << " removed" << endl;
 
-    IF_DEBUG(2) {
-        cerr << n_reads_pass1 << " reads in pass 1" << endl;
-        cerr << n_reads << " reads in pass 2" << endl;
-    }
+//-------------------------------------
 
-	reader.Close();
-	writer.Close();
-    if (opt_duplicatefile)
-        writer_dups.Close();
 
-	return EXIT_SUCCESS;
+void
+SignatureSet::grow(void)
+{
+    MEMTRACK_TAG("SignatureSet");
+    vector<uint64_t> old(table.size() * 2, 0);
+    old.swap(table);
+    size_t mask = table.size() - 1;
+    for (size_t j = 0; j < old.size(); ++j) {
+        if (old[j] == 0)
+            continue;
+        size_t i = size_t(old[j]) & mask;
+        while (table[i] != 0)
+            i = (i + 1) & mask;
+        table[i] = old[j];
+    }
 }
 
 
@@ -547,7 +1553,7 @@ listAlignments(const alignmentList& al_set)
 
 
 static void
-determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
+determineDuplicates(alignmentList& al_pool, alignmentList& al_set, alignmentList& al_dups)
 {
     const string HERE = "determineDuplicates():";
     size_t initial_size = al_set.size();
@@ -565,21 +1571,21 @@ determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
     al_i = al_set.begin();
     while (al_i != al_set.end()) {
         if (opt_detect == DETECT_single_only && al_i->IsPaired()) {
-            IF_DEBUG(3) cerr << HERE << " " << al_i->Name << " is paired and --single-only, excluded" << endl;
-            al_i = al_set.erase(al_i); 
+            IF_DEBUG(3) cerr << HERE << " " << al_i->NameString() << " is paired and --single-only, excluded" << endl;
+            al_i = eraseAlignment(al_pool, al_set, al_i); 
             ++n0_paired_single_only;
         } else if (opt_detect == DETECT_paired_only && ! al_i->IsPaired()) {
-            IF_DEBUG(3) cerr << HERE << " " << al_i->Name << " is single and --paired-only, excluded" << endl;
-            al_i = al_set.erase(al_i); 
+            IF_DEBUG(3) cerr << HERE << " " << al_i->NameString() << " is single and --paired-only, excluded" << endl;
+            al_i = eraseAlignment(al_pool, al_set, al_i); 
             ++n0_single_paired_only;
         } else if (! al_i->IsMapped()) { // no dup if not mapped
-            IF_DEBUG(3) cerr << HERE << " " << al_i->Name << " is not mapped, excluded" << endl;
-            al_i = al_set.erase(al_i); 
+            IF_DEBUG(3) cerr << HERE << " " << al_i->NameString() << " is not mapped, excluded" << endl;
+            al_i = eraseAlignment(al_pool, al_set, al_i); 
             ++n0_unmapped;
         } else if (opt_detect != DETECT_as_single // ignore mate if --as-single-end
                    && al_i->IsPaired() && ! al_i->IsMateMapped()) { // no dup if mate not mapped
-            IF_DEBUG(3) cerr << HERE << " " << al_i->Name << " has a mate that is not mapped, excluded" << endl;
-            al_i = al_set.erase(al_i); 
+            IF_DEBUG(3) cerr << HERE << " " << al_i->NameString() << " has a mate that is not mapped, excluded" << endl;
+            al_i = eraseAlignment(al_pool, al_set, al_i); 
             ++n0_mate_unmapped;
         } else {
             ++al_i;
@@ -630,7 +1636,7 @@ determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
 
         bool found_a_match = false;
 
-        IF_DEBUG(2) cerr << HERE << " starting cycle, looking for duplicates of " << al_i->Name << endl;
+        IF_DEBUG(2) cerr << HERE << " starting cycle, looking for duplicates of " << al_i->NameString() << endl;
 
         while (al_j != al_set.end()) {
             // al_i is the "best" read that we're comparing al_j against
@@ -638,13 +1644,12 @@ determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
             if (isDuplicate((*al_i), (*al_j))) {
 
                 found_a_match = true;
-                if (al_j->MapQuality <= al_i->MapQuality) {
-                    al_dups.push_back((*al_j));  // add second read to dups list
-                    al_j = al_set.erase(al_j);   // erase second read from al_set, continue with next read
+                if (al_j->MapQuality() <= al_i->MapQuality()) {
+                    alignmentListI dup = al_j++;                    // continue with next read
+                    al_dups.splice(al_dups.end(), al_set, dup);     // move second read to dups list
                 } else {
                     IF_DEBUG(2) cerr << HERE << " second read has better map quality" << endl;
-                    al_dups.push_back((*al_i));  // add first read to dups list
-                    al_set.erase(al_i);          // erase first read from al_set
+                    al_dups.splice(al_dups.end(), al_set, al_i);    // move first read to dups list
                     al_i = al_j;                 // reset best read for these dups
                     ++al_j;                      // continue with next read
                 }
@@ -663,9 +1668,9 @@ determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
         // that has not yet been determined to be a dup.
 
         if (! found_a_match)
-            IF_DEBUG(2) cerr << HERE << " " << al_i->Name << " had no duplicates" << endl;
+            IF_DEBUG(2) cerr << HERE << " " << al_i->NameString() << " had no duplicates" << endl;
 
-        al_set.erase(al_i);
+        eraseAlignment(al_pool, al_set, al_i);
         al_i = al_j = al_set.begin();
 
         IF_DEBUG(2) cerr << HERE << " end of cycle " << cycle << ", " << al_set.size() 
@@ -685,32 +1690,47 @@ determineDuplicates(alignmentList& al_set, alignmentList& al_dups)
 //-------------------------------------
 
 
+// do the RG tags of the two reads match, including both being absent?
+static bool
+sameReadGroup(const RawRecord& al_i, const RawRecord& al_j)
+{
+    const char *i_tag, *j_tag;
+    size_t i_len, j_len;
+    bool i_has = al_i.GetTagString("RG", i_tag, i_len);
+    bool j_has = al_j.GetTagString("RG", j_tag, j_len);
+    if (i_has != j_has)
+        return false;
+    return ! i_has || (i_len == j_len && memcmp(i_tag, j_tag, i_len) == 0);
+}
+
+
+//-------------------------------------
+
+
 static bool
-isDuplicate(const BamAlignment& al_i, const BamAlignment& al_j)
+isDuplicate(const RawRecord& al_i, const RawRecord& al_j)
 {
     const string HERE = "isDuplicate():";
-    string i_tag, j_tag;
 
     // we already know that these alignments are mapped, and 
     // to the same reference at the same position
 
-    if (   al_j.RefID               == al_i.RefID        // same reference
-        && al_j.Position            == al_i.Position     // same position
+    if (   al_j.RefID()             == al_i.RefID()        // same reference
+        && al_j.Position()          == al_i.Position()     // same position
         && al_j.IsReverseStrand()   == al_i.IsReverseStrand()   // same orientation
-        && al_j.GetTag("RG", j_tag) == al_i.GetTag("RG", i_tag)  // has a RG tag?
-        && j_tag                    == i_tag             // RG tag is the same?
+        && sameReadGroup(al_i, al_j)                       // RG tag is the same?
         && (opt_detect == DETECT_as_single  // ignore pair stuff with --as-single-end
            || (   al_j.IsPaired()            == al_i.IsPaired()     // same pairing
-               && al_j.MateRefID             == al_i.MateRefID      // mates mapped to same sequence
-               && al_j.MatePosition          == al_i.MatePosition // mates mapped to same position
+               && al_j.MateRefID()           == al_i.MateRefID()      // mates mapped to same sequence
+               && al_j.MatePosition()        == al_i.MatePosition() // mates mapped to same position
                && al_j.IsMateReverseStrand() == al_i.IsMateReverseStrand())) // mates same orientation
-        && al_j.QueryBases.length()   == al_i.QueryBases.length() // same read length
-        && al_j.AlignedBases.length() == al_i.AlignedBases.length() // same alignment length
+        && al_j.QueryLength()   == al_i.QueryLength() // same read length
+        && al_j.AlignedLength() == al_i.AlignedLength() // same alignment length
         // need to include some notion of optical distance?
         ) {
 
         IF_DEBUG(2) 
-            cerr << HERE << " " << al_j.Name << " is a duplicate of " << al_i.Name << endl;
+            cerr << HERE << " " << al_j.NameString() << " is a duplicate of " << al_i.NameString() << endl;
 
         return true;
 
@@ -720,48 +1740,54 @@ isDuplicate(const BamAlignment& al_i, const BamAlignment& al_j)
 }
 
 
+bool
+yoruba::sedaIsDuplicate(const RawRecord& al_i, const RawRecord& al_j)
+{
+    return isDuplicate(al_i, al_j);
+}
+
+
 //-------------------------------------
 
 
 static void
-diagnoseDuplicate(const BamAlignment& al_i, const BamAlignment& al_j)
+diagnoseDuplicate(const RawRecord& al_i, const RawRecord& al_j)
 {
     const string HERE = "diagnoseDuplicate():";
-    cerr << HERE << " " << al_i.Name << " vs " << al_j.Name << endl;
+    cerr << HERE << " " << al_i.NameString() << " vs " << al_j.NameString() << endl;
     printAlignmentInfo(cerr, al_i, 99);
     printAlignmentInfo(cerr, al_j, 99);
-    string i_tag, j_tag;
 
     // we already know that these alignments are mapped, and 
     // to the same reference at the same position
 
-    if (al_j.RefID != al_i.RefID)
+    if (al_j.RefID() != al_i.RefID())
         { cerr << HERE << " mismatch RefID" << endl; return; }
-    if (al_j.Position != al_i.Position)
+    if (al_j.Position() != al_i.Position())
         { cerr << HERE << " mismatch Position" << endl; return; }
     if (al_j.IsReverseStrand() != al_i.IsReverseStrand())
         { cerr << HERE << " mismatch IsReverseStrand()" << endl; return; }
-    if (al_j.GetTag("RG", j_tag) != al_i.GetTag("RG", i_tag))
+    if (al_j.HasTag("RG") != al_i.HasTag("RG"))
         { cerr << HERE << " mismatch GetTag(\"RG\")" << endl; return; }
-    if (j_tag != i_tag)
+    if (! sameReadGroup(al_i, al_j))
         { cerr << HERE << " mismatch RG: tag value" << endl; return; }
     if (opt_detect == DETECT_as_single)
         { cerr << HERE << " skipped pair stuff, DETECT_as_single" << endl; return; }
     else {
         if (al_j.IsPaired() != al_i.IsPaired())
             { cerr << HERE << " mismatch IsPaired()" << endl; return; }
-        if (al_j.MateRefID != al_i.MateRefID)
+        if (al_j.MateRefID() != al_i.MateRefID())
             { cerr << HERE << " mismatch MateRefID" << endl; return; }
-        if (al_j.MatePosition != al_i.MatePosition)
+        if (al_j.MatePosition() != al_i.MatePosition())
             { cerr << HERE << " mismatch MatePosition" << endl; return; }
         if (al_j.IsMateReverseStrand() != al_i.IsMateReverseStrand())
             { cerr << HERE << " mismatch IsMateReverseStrand()" << endl; return; }
     }
-    if (al_j.QueryBases.length() != al_i.QueryBases.length())
+    if (al_j.QueryLength() != al_i.QueryLength())
         { cerr << HERE << " mismatch QueryBases.length()" << endl; return; }
-    if (al_j.AlignedBases.length() != al_i.AlignedBases.length())
+    if (al_j.AlignedLength() != al_i.AlignedLength())
         { cerr << HERE << " mismatch AlignedBases.length()" << endl; return; }
-    cerr << HERE << " " << al_i.Name << " and " << al_j.Name << " are duplicates" << endl;
+    cerr << HERE << " " << al_i.NameString() << " and " << al_j.NameString() << " are duplicates" << endl;
 }
 
 
@@ -807,8 +1833,9 @@ query_dupMap(const dupMap& this_dm)
 
 
 static void
-update_dupMap(alignmentList& al_set, dupMap& this_dm)
+update_dupMap(alignmentList& al_pool, alignmentList& al_set, dupMap& this_dm, const BamShard* shard)
 {
+    MEMTRACK_TAG("dupMap");
     const string HERE = "update_dupMap():";
     IF_DEBUG(2) cerr << HERE << " received " << al_set.size() 
         << " duplicate alignments" << endl;
@@ -827,14 +1854,16 @@ update_dupMap(alignmentList& al_set, dupMap& this_dm)
     int n_PE_mate_upstream = 0;
 
     alignmentListI aLI_i;
+    string name;
 
     for (aLI_i = al_set.begin(); aLI_i != al_set.end(); ++aLI_i) {
 
-        dupMapI dupI = this_dm.find(aLI_i->Name);
+        name.assign(aLI_i->Name(), aLI_i->NameLength());
+        dupMapI dupI = this_dm.find(name);
 
         if (dupI != this_dm.end()) {
             ++n_reads_found_in_map;
-            IF_DEBUG(2) cerr << HERE << " " << aLI_i->Name 
+            IF_DEBUG(2) cerr << HERE << " " << name 
                 << " in dupMap, val = " << dupI->second << endl;
         }
 
@@ -843,30 +1872,34 @@ update_dupMap(alignmentList& al_set, dupMap& this_dm)
             if (dupI != this_dm.end()) {
                 ++n_SE_found_in_map;
                 cerr << HERE << " ERROR, SE read name already seen for '"
-                        << aLI_i->Name << "', is this a duplicate read name??" << endl;
+                        << name << "', is this a duplicate read name??" << endl;
             }
 
-            this_dm[aLI_i->Name] = dupMap_singleend;  // add to map as SE
+            this_dm[name] = dupMap_singleend;  // add to map as SE
             ++n_SE_added;
-            IF_DEBUG(3) cerr << HERE << " " << aLI_i->Name
+            IF_DEBUG(3) cerr << HERE << " " << name
                 << " SE, set dupMap = -1" << endl;
 
         } else {  // paired-end
 
             if (dupI == this_dm.end()) {  // not in map
 
-                if (aLI_i->MateRefID >= 0 && isMateUpstream((*aLI_i))) { 
+                if (aLI_i->MateRefID() >= 0 && isMateUpstream((*aLI_i))
+                    && (shard == NULL 
+                        || isCoordinateSorted(aLI_i->MateRefID(), aLI_i->MatePosition(), 
+                                              shard->ref, shard->pos))) { 
 
-                    // if mate is upstream and not in the dupMap, it wasn't a dup
+                    // if mate is upstream and not in the dupMap, it wasn't a
+                    // dup, unless it was in an earlier shard
                     ++n_PE_mate_upstream;
-                    IF_DEBUG(2) cerr << HERE << " " << aLI_i->Name 
+                    IF_DEBUG(2) cerr << HERE << " " << name 
                         << " PE, dupMap no mate found" << ", mate UPSTREAM, NOT DUP" << endl;
 
                 } else {
 
-                    this_dm[aLI_i->Name] = dupMap_paired_one;  // add to map as first read of PE
+                    this_dm[name] = dupMap_paired_one;  // add to map as first read of PE
                     ++n_PE_first_added;
-                    IF_DEBUG(2) cerr << HERE << " " << aLI_i->Name 
+                    IF_DEBUG(2) cerr << HERE << " " << name 
                         << " PE, dupMap no mate found" << ", set dupMap = 1" << endl;
 
                 }
@@ -883,7 +1916,7 @@ update_dupMap(alignmentList& al_set, dupMap& this_dm)
                 }
                 dupI->second = dupMap_paired_both;
                 ++n_PE_second_added;
-                IF_DEBUG(2) cerr << HERE << " " << aLI_i->Name 
+                IF_DEBUG(2) cerr << HERE << " " << name 
                     << " PE, update dupMap = " << (*dupI).second << endl;
 
             }
@@ -891,7 +1924,7 @@ update_dupMap(alignmentList& al_set, dupMap& this_dm)
     }
 
     assert(aLI_i == al_set.end());  // should be none left
-    al_set.clear();
+    clearAlignments(al_pool, al_set);
 
     IF_DEBUG(2) {
         cerr << HERE << " received " << n_reads_received;
@@ -947,3 +1980,107 @@ clear_dupMap(dupMap& this_dm, dup_t val)
 
 //-------------------------------------
 
+
+static void
+pushAlignment(alignmentList& al_pool, alignmentList& al_set, const RawRecord& rec)
+{
+    MEMTRACK_TAG("alignmentList");
+    if (al_pool.empty()) {
+        al_set.push_back(rec);
+    } else {
+        al_set.splice(al_set.end(), al_pool, al_pool.begin());
+        al_set.back() = rec;
+    }
+}
+
+
+//-------------------------------------
+
+
+static alignmentListI
+eraseAlignment(alignmentList& al_pool, alignmentList& al_set, alignmentListI al_i)
+{
+    alignmentListI next = al_i;
+    ++next;
+    al_pool.splice(al_pool.end(), al_set, al_i);
+    return next;
+}
+
+
+//-------------------------------------
+
+
+static void
+clearAlignments(alignmentList& al_pool, alignmentList& al_set)
+{
+    al_pool.splice(al_pool.end(), al_set);
+}
+
+
+//-------------------------------------
+
+
+
+//-------------------------------------
+
+
+// seda as a step of 'yoruba run'; the --duplicate-file output gets the header
+// as it stands at this step in the chain
+
+class SedaStep : public RunStep {
+
+    public:
+        SedaStep(void) : scan(NULL), transform(NULL) { }
+        virtual ~SedaStep(void) { delete scan; delete transform; }
+
+        virtual int ParseOptions(int argc, char* argv[]) {
+            return parseOptions(argc, argv, true);
+        }
+        virtual bool NeedsPass1(void) const { return true; }
+        virtual bool BeginPass1(const RefVector& refs) {
+            scan = new DuplicateScan(dup_map);
+            return true;
+        }
+        virtual bool Pass1(const RawRecord& rec) { return scan->Add(rec); }
+        virtual bool EndPass1(void) { scan->Finish(); return true; }
+        virtual bool RewriteHeader(SamHeader& header, RefVector& refs) {
+            if (opt_duplicatefile && ! output_opts.Open(writer_dups, duplicate_file, header, refs, false)) {
+                cerr << NAME << " could not open duplicate output file  " << duplicate_file << endl;
+                return false;
+            }
+            return true;
+        }
+        virtual RecordTransform& Transform(int n_workers) {
+            delete transform;
+            transform = new MarkDuplicatesTransform(dup_map, opt_duplicatefile ? &writer_dups : NULL);
+            return *transform;
+        }
+        virtual bool Finish(void) {
+            bool ok = true;
+            if (opt_duplicatefile)
+                ok = writer_dups.Close();
+            if (opt_progress || DEBUG(1))
+                cerr << NAME << "[pass2] "
+                    << transform->n_reads_written_to_dups << " written to " << duplicate_file << ", "
+                    << transform->n_reads_removed << " removed" << endl;
+            return ok;
+        }
+
+    private:
+        dupMap                      dup_map;
+        DuplicateScan*              scan;
+        MarkDuplicatesTransform*    transform;
+        RawBamWriter                writer_dups;
+
+};
+
+
+//-------------------------------------
+
+
+RunStep*
+yoruba::newSedaStep(void)
+{
+    return new SedaStep;
+}
+
@@ -20,6 +20,7 @@
 #include <tr1/unordered_set>
 // #endif
 #include <new>
+#include <pthread.h>
 
 // BamTools includes: https://github.com/pezmaster31/bamtools
 #include "api/BamReader.h"
@@ -38,6 +39,9 @@
 #include "yoruba.h"
 // #include "yoruba_lightAlignment.h"  // do I need this for 'yoruba seda'?
 #include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_pipeline.h"
+#include "yoruba_stats.h"
 
 #ifndef _YORUBA_MAIN
 #define NAME "[yoruba_duplicate]"
@@ -49,6 +53,22 @@ namespace yoruba {
 
 int  main_seda(int argc, char* argv[]);
 
+// pass 1 keeps the names of reads found to be duplicates in a dupMap, with
+// whether one or both reads of a pair have been seen
+enum dup_t {
+    dupMap_singleend   = -1, 
+    dupMap_UNSET       = 0, 
+    dupMap_paired_one  = 1, 
+    dupMap_paired_both = 2
+};
+typedef std::tr1::unordered_map<std::string, dup_t>  dupMap;
+typedef dupMap::iterator              dupMapI;
+typedef dupMap::const_iterator        dupMapCI;
+
+// the test pass 1 applies to two reads at the same position, for timing it
+// in bench/yoruba_microbench.cpp
+bool sedaIsDuplicate(const RawRecord& al_i, const RawRecord& al_j);
+
 }  // namespace yoruba
 
 #endif // _YORUBA_SEDA_H_
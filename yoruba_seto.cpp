@@ -0,0 +1,679 @@
+// yoruba_seto.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Seto (English command is sort) sorts the reads in a BAM file by coordinate,
+// in the same order as 'samtools sort'.
+//
+// Reads are collected into runs in memory, and each run is radix-sorted on
+// its own thread on 64-bit keys packing reference, position and strand while
+// the next run is read.  The sorted runs are merged into the output with a
+// loser tree.  A run is written to a temporary file, as uncompressed BGZF,
+// only when its memory is needed for reads still to come, so input that fits
+// within --memory never touches the disk.  Both the radix sort and the merge
+// are stable, so reads at the same key keep their input order.
+//
+// Seto is the Yoruba (Nigeria) verb for 'to arrange'.
+//
+// Uses pthreads, and BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- sort by read name, as 'samtools sort -n'
+// --- spill runs on their sorting threads rather than the reading thread
+
+#include <algorithm>
+#include <cerrno>
+#include <cstring>
+#include <unistd.h>
+
+#include "yoruba_seto.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static string       input_file;
+static string       output_file;
+static OutputOptions output_opts;
+static string       checksum_file;     // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
+static int          opt_threads = 1;
+static int64_t      opt_memory = 768;  // MB for runs in memory, across all threads
+static string       spill_dir;         // for runs written to disk, defaults to $TMPDIR or /tmp
+#ifdef _WITH_DEBUG
+static int32_t      opt_debug = 0;
+static int32_t      debug_progress = 10;  // seconds
+static int64_t      opt_reads = -1;
+static int64_t      opt_progress = 0;  // seconds between progress lines
+#endif
+
+static SamProgram   new_program;  // set in parseOptions()
+static vector<string> spill_paths;  // runs written to disk, removed once opened again
+
+static int  parseOptions(int argc, char* argv[]);
+static void removeSpills(void);
+
+
+//-------------------------------------
+
+
+#ifdef _STANDALONE
+int
+main(int argc, char* argv[]) {
+    return main_seto(argc, argv);
+}
+#endif
+
+
+//-------------------------------------
+
+
+static int
+usage(bool longer = false)
+{
+    cerr << endl;
+    cerr << "Usage:   " << YORUBA_NAME << " sort [options] <in.bam>" << endl;
+    cerr << "         " << YORUBA_NAME << " seto [options] <in.bam>" << endl;
+    cerr << "\n\
+Sort the reads in <in.bam> by coordinate, in the same order as 'samtools sort':\n\
+by reference, then position, then forward before reverse strand, with reads\n\
+lacking a reference at the end.  Either command invokes this function.\n\
+\n";
+    if (longer) cerr << "\
+Reads are sorted in runs held in memory, each sorted on its own thread while\n\
+the next is read.  --memory is shared among --threads plus one runs.  When the\n\
+input does not fit, runs are written as they are sorted to temporary files in\n\
+the --spill-dir directory, which are merged into the output and removed.\n\
+Sorting is stable, so reads at the same position and strand keep their input\n\
+order.\n\
+\n";
+    cerr << "\
+Options: -m INT | --memory INT     MB of memory for sorting reads [" << opt_memory << "]\n\
+         -t INT | --threads INT    threads sorting runs of reads [" << opt_threads << "]\n\
+         --spill-dir DIR           directory for runs that do not fit in memory [$TMPDIR or /tmp]\n\
+         -r STR | --region STR     only reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            only reads overlapping the regions of BED FILE\n\
+         -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of the output\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         -? | --help               longer help\n\
+\n";
+#ifdef _WITH_DEBUG
+    cerr << "\
+         --debug INT      debug info level INT [" << opt_debug << "]\n\
+         --reads INT      only process INT reads [" << opt_reads << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
+\n";
+#endif
+    cerr << "Seto is the Yoruba (Nigeria) verb for 'to arrange'." << endl;
+    cerr << endl;
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+// SortRun is one run of reads in memory, stored as in a BAM file with each
+// record preceded by its block_size, along with the sort key and offset of
+// each record.  It is sorted on a thread of its own between Start() and Wait().
+
+class SortRun {
+
+    public:
+        SortRun(void) : run_index(-1), length(0), running(false) { }
+
+        void        Clear(void) { length = 0; entries.clear(); run_index = -1; }
+        bool        IsEmpty(void) const { return entries.empty(); }
+        size_t      Length(void) const { return length; }
+        void        Append(const RawRecord& rec);
+
+        void        Start(void);
+        void        Wait(void);
+
+        size_t      RecordCount(void) const { return entries.size(); }
+        void        GetRecord(size_t i, RawRecord& rec) {
+            int32_t block_size;
+            memcpy(&block_size, &data[entries[i].offset], 4);
+            rec.SetView(&data[entries[i].offset + 4], block_size);
+        }
+
+        // write the sorted run to a new temporary file, named in path
+        bool        Spill(string& path);
+
+        int64_t     run_index;  // of the run held, -1 if none
+
+    private:
+        struct Entry {
+            uint64_t    key;
+            size_t      offset;
+        };
+
+        void        radixSort(void);
+        static void* sortThread(void* arg);
+
+        vector<char>    data;
+        size_t          length;
+        vector<Entry>   entries, scratch;
+        pthread_t       thread;
+        bool            running;
+
+};
+
+
+// Run is a run of sorted reads, either in memory or in a temporary file, as
+// a source for the merge
+
+class Run {
+
+    public:
+        Run(SortRun* m) : memory(m), next(0) { }
+
+        bool        Open(void);  // reopen from disk if spilled
+        bool        Next(RawRecord& rec);
+        bool        Failed(void) const { return memory == NULL && reader.Failed(); }
+
+        SortRun*        memory;  // NULL once spilled
+        string          path;
+
+    private:
+        size_t          next;
+        RawBamReader    reader;
+
+        Run(const Run&);  // not copyable
+        Run& operator=(const Run&);
+
+};
+
+
+//-------------------------------------
+
+
+int
+yoruba::main_seto(int argc, char* argv[])
+{
+    if (parseOptions(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+    ScopedPhase phase_open("open");
+
+    RawBamReader reader;
+
+    if (! reader.Open(input_file)) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! regions.Empty() && ! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    RawHeader raw_header = reader.GetRawHeader();  // the @SQ lines are copied as they are
+    SamHeader& header = raw_header.Meta();
+    RefVector refs = reader.GetReferenceData();
+    if (header.Version.empty())  // there is no @HD without VN
+        header.Version = "1.4";
+    header.SortOrder = "coordinate";
+    if (header.Programs.Contains(new_program.ID)) {
+        SamProgram& prog = header.Programs[new_program.ID];
+        prog.Name = new_program.Name;
+        prog.Version = new_program.Version;
+        prog.CommandLine = new_program.CommandLine;
+    } else {
+        header.Programs.Add(new_program);
+    }
+
+    phase_open.End();
+
+    //-------------------------------------  sort runs of reads
+
+    ScopedPhase phase_pass1("pass1");
+
+    // one more run than threads, so one is read while the others are sorted
+    size_t n_buffers = size_t(opt_threads) + 1;
+    size_t run_bytes = size_t(opt_memory) * 1024 * 1024 / n_buffers;
+    vector<SortRun> buffers(n_buffers);
+    vector<Run*> runs;  // in input order
+    RawRecord rec;
+    int64_t n_reads = 0;
+    int64_t n_spilled = 0;
+    bool ok = true;
+    Progress progress;
+
+    progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &refs);
+
+    for (size_t next = 0; ok; next = (next + 1) % n_buffers) {
+        SortRun& b = buffers[next];
+        if (b.run_index >= 0) {  // holds the oldest run in memory, which goes to disk
+            Run& r = *runs[b.run_index];
+            b.Wait();
+            if (! b.Spill(r.path)) {
+                ok = false;
+                break;
+            }
+            IF_DEBUG(1) cerr << NAME << " run " << b.run_index << " written to " << r.path << endl;
+            r.memory = NULL;
+            b.Clear();
+            ++n_spilled;
+        }
+        bool more = true;
+        while (b.Length() < run_bytes) {
+            if ((opt_reads >= 0 && n_reads >= opt_reads) || ! reader.GetNextRecord(rec)) {
+                more = false;
+                break;
+            }
+            b.Append(rec);
+            ++n_reads;
+            progress.Add(rec, reader.Tell());
+        }
+        if (! more && reader.Failed()) {
+            cerr << NAME << "[pass1] error reading input" << endl;
+            ok = false;
+            break;
+        }
+        if (! b.IsEmpty()) {
+            b.run_index = int64_t(runs.size());
+            runs.push_back(new Run(&b));
+            b.Start();
+        }
+        if (! more)
+            break;
+    }
+    for (size_t i = 0; i < n_buffers; ++i)
+        if (buffers[i].run_index >= 0)
+            buffers[i].Wait();
+    progress.Stop();
+    reader.Close();
+
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass1] " << n_reads << " reads sorted in " << runs.size() << " runs, "
+            << n_spilled << " written to disk" << endl;
+    Stats::Count("sort_runs", int64_t(runs.size()));
+    Stats::Count("sort_runs_spilled", n_spilled);
+    phase_pass1.End();
+
+    //-------------------------------------  merge the runs into the output
+
+    ScopedPhase phase_pass2("pass2");
+
+    RawBamWriter writer;
+    LoserTree tree;
+    vector<RawRecord> heads(runs.size());
+    int64_t n_written = 0;
+
+    if (ok && ! output_opts.Open(writer, output_file, raw_header.ToString(), refs)) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        ok = false;
+    }
+    // the runs are read from several places at once, so only reads are counted
+    progress.Start(NAME "[pass2]", opt_progress, 0, &refs);
+    if (ok) {
+        tree.Reset(runs.size());
+        for (size_t i = 0; ok && i < runs.size(); ++i) {
+            if (! runs[i]->Open())
+                ok = false;
+            else if (runs[i]->Next(heads[i]))
+                tree.Set(i, coordinateSortKey(heads[i]));
+        }
+        tree.Build();
+    }
+    while (ok && ! tree.Empty()) {
+        size_t i = tree.Winner();
+        if (! writer.SaveRecord(heads[i])) {
+            cerr << NAME << " error writing to " << output_file << endl;
+            ok = false;
+            break;
+        }
+        ++n_written;
+        progress.Add(heads[i], 0);
+        if (runs[i]->Next(heads[i]))
+            tree.Update(i, coordinateSortKey(heads[i]));
+        else
+            tree.Finish(i);
+    }
+    for (size_t i = 0; ok && i < runs.size(); ++i) {
+        if (runs[i]->Failed()) {
+            cerr << NAME << "[pass2] error reading temporary file " << runs[i]->path << endl;
+            ok = false;
+        }
+    }
+    progress.Stop();
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    for (size_t i = 0; i < runs.size(); ++i)
+        delete runs[i];
+    removeSpills();
+    if (writer.IsOpen() && ! writer.Close())
+        ok = false;
+
+    if (! ok) {
+        cerr << NAME << " error while sorting reads" << endl;
+        return EXIT_FAILURE;
+    }
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] " << n_written << " reads written to " << output_file << endl;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+static int
+parseOptions(int argc, char* argv[])
+{
+    new_program.ID = YORUBA_NAME;
+    new_program.ID = new_program.ID + " " + argv[0];
+    new_program.Name = YORUBA_NAME;
+    new_program.Version = YORUBA_VERSION;
+    new_program.CommandLine = YORUBA_NAME;
+    for (int i = 0; i < argc; ++i)
+        new_program.CommandLine = new_program.CommandLine + " " + argv[i];
+
+    enum { OPT_output, OPT_memory, OPT_threads, OPT_spilldir,
+        OPT_level, OPT_uncompressed, OPT_writeindex, OPT_checksum, OPT_checksumexclude,
+        OPT_region, OPT_regions,
+#ifdef _WITH_DEBUG
+        OPT_debug, OPT_reads, OPT_progress,
+#endif
+        OPT_help };
+
+    CSimpleOpt::SOption seto_options[] = {
+        { OPT_memory,          "--memory",          SO_REQ_SEP },
+        { OPT_memory,          "-m",                SO_REQ_SEP },
+        { OPT_threads,         "--threads",         SO_REQ_SEP },
+        { OPT_threads,         "-t",                SO_REQ_SEP },
+        { OPT_spilldir,        "--spill-dir",       SO_REQ_SEP },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        { OPT_output,          "--output",          SO_REQ_SEP },
+        { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+#ifdef _WITH_DEBUG
+        { OPT_debug,           "--debug",           SO_REQ_SEP },
+        { OPT_reads,           "--reads",           SO_REQ_SEP },
+        { OPT_progress,        "--progress",        SO_REQ_SEP },
+#endif
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, seto_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage(true);
+        } else if (args.OptionId() == OPT_memory) {
+            opt_memory = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_threads) {
+            opt_threads = atoi(args.OptionArg());
+        } else if (args.OptionId() == OPT_spilldir) {
+            spill_dir = args.OptionArg();
+        } else if (args.OptionId() == OPT_output) {
+            output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (DEBUG(1) && ! opt_progress)
+        opt_progress = debug_progress;
+
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    if (opt_threads < 1) {
+        cerr << NAME << " --threads must be at least 1" << endl;
+        return usage();
+    }
+    if (opt_memory < 1) {
+        cerr << NAME << " --memory must be at least 1" << endl;
+        return usage();
+    }
+    if (spill_dir.empty())
+        spill_dir = getenv("TMPDIR") ? getenv("TMPDIR") : "/tmp";
+
+    if (args.FileCount() > 1) {
+        cerr << NAME << " requires at most one BAM file specified as input" << endl;
+        return usage();
+    } else if (args.FileCount() == 1) {
+        input_file = args.File(0);
+    } else if (input_file.empty()) {  // if unset, read from stdin or its equivalent
+        input_file = "/dev/stdin";
+    }
+
+    // set up output; if file not specified, use stdout or its equivalent
+    if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+static void
+removeSpills(void)
+{
+    for (size_t i = 0; i < spill_paths.size(); ++i)
+        unlink(spill_paths[i].c_str());
+    spill_paths.clear();
+}
+
+
+//-------------------------------------
+//-------------------------------------  SortRun
+//-------------------------------------
+
+
+void
+SortRun::Append(const RawRecord& rec)
+{
+    MEMTRACK_TAG("SortRun");
+    size_t need = length + 4 + rec.Size();
+    if (need > data.size())
+        data.resize(max(need, data.size() + data.size() / 2 + BGZF_MAX_BLOCK_SIZE));
+    int32_t block_size = int32_t(rec.Size());
+    memcpy(&data[length], &block_size, 4);
+    memcpy(&data[length + 4], rec.Data(), rec.Size());
+    Entry e;
+    e.key = coordinateSortKey(rec);
+    e.offset = length;
+    entries.push_back(e);
+    length = need;
+}
+
+
+//-------------------------------------
+
+
+void
+SortRun::Start(void)
+{
+    running = pthread_create(&thread, NULL, sortThread, this) == 0;
+    if (! running)  // no thread to be had, so sort it here
+        radixSort();
+}
+
+
+//-------------------------------------
+
+
+void
+SortRun::Wait(void)
+{
+    if (running)
+        pthread_join(thread, NULL);
+    running = false;
+}
+
+
+//-------------------------------------
+
+
+void*
+SortRun::sortThread(void* arg)
+{
+    static_cast<SortRun*>(arg)->radixSort();
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+// LSD radix sort of entries on 16-bit digits, which is stable.  Digits that
+// every key shares are skipped, which for most BAMs are the high bits of the
+// reference ID and of the position.
+void
+SortRun::radixSort(void)
+{
+    size_t n = entries.size();
+    scratch.resize(n);
+    vector<size_t> count(1 << 16);
+
+    for (int shift = 0; shift < 64; shift += 16) {
+        fill(count.begin(), count.end(), 0);
+        for (size_t i = 0; i < n; ++i)
+            ++count[(entries[i].key >> shift) & 0xffff];
+        if (count[(entries[0].key >> shift) & 0xffff] == n)
+            continue;
+        size_t sum = 0;
+        for (size_t d = 0; d < count.size(); ++d) {
+            size_t c = count[d];
+            count[d] = sum;
+            sum += c;
+        }
+        for (size_t i = 0; i < n; ++i)
+            scratch[count[(entries[i].key >> shift) & 0xffff]++] = entries[i];
+        entries.swap(scratch);
+    }
+}
+
+
+//-------------------------------------
+
+
+bool
+SortRun::Spill(string& path)
+{
+    string templ_s = spill_dir + "/yoruba_sort.XXXXXX";
+    vector<char> templ(templ_s.begin(), templ_s.end());
+    templ.push_back('\0');
+    int fd = mkstemp(&templ[0]);
+    if (fd < 0) {
+        cerr << NAME << " could not create temporary file in " << spill_dir
+            << ": " << strerror(errno) << endl;
+        return false;
+    }
+    close(fd);
+    path = &templ[0];
+    spill_paths.push_back(path);
+
+    // no header text or references, the runs are only read back by us
+    RawBamWriter writer;
+    writer.SetCompressionLevel(0);
+    if (! writer.Open(path, string(), RefVector()))
+        return false;
+    RawRecord rec;
+    for (size_t i = 0; i < entries.size(); ++i) {
+        GetRecord(i, rec);
+        if (! writer.SaveRecord(rec)) {
+            cerr << NAME << " error writing temporary file " << path << endl;
+            return false;
+        }
+    }
+    return writer.Close();
+}
+
+
+//-------------------------------------
+//-------------------------------------  Run
+//-------------------------------------
+
+
+bool
+Run::Open(void)
+{
+    if (memory != NULL)
+        return true;
+    if (! reader.Open(path)) {
+        cerr << NAME << " could not open temporary file " << path << endl;
+        return false;
+    }
+    unlink(path.c_str());  // gone once we are done with it, however that happens
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+Run::Next(RawRecord& rec)
+{
+    if (memory == NULL)
+        return reader.GetNextRecord(rec);
+    if (next >= memory->RecordCount())
+        return false;
+    memory->GetRecord(next++, rec);
+    return true;
+}
+
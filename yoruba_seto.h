@@ -0,0 +1,47 @@
+// yoruba_seto.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_seto.cpp
+//
+// Seto is the Yoruba (Nigeria) verb for 'to arrange'.
+//
+// Uses pthreads, and BamTools only for header types
+
+#ifndef _YORUBA_SETO_H_
+#define _YORUBA_SETO_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <pthread.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+#include "api/SamHeader.h"
+#include "api/SamProgram.h"
+#include "api/SamProgramChain.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_stats.h"
+
+#ifndef _YORUBA_MAIN
+#define NAME "[yoruba_sort]"
+#endif
+
+// Functions defined in yoruba_seto.cpp
+//
+namespace yoruba {
+
+int  main_seto(int argc, char* argv[]);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_SETO_H_
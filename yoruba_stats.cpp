@@ -0,0 +1,385 @@
+// yoruba_stats.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Run statistics, see yoruba_stats.h.
+//
+// The report is a single JSON object:
+//
+//    { "program": "yoruba", "version": "0.0.4-dev", "command": "sort",
+//      "argv": [ ... ], "exit_status": 0,
+//      "wall_seconds": 12.3, "cpu_seconds": 40.1, "peak_rss_bytes": 812345344,
+//      "phases": [ { "name": "pass1", "seconds": 5.2, "times": 1 }, ... ],
+//      "counters": { "bam_records_read": 1000000, ... } }
+//
+// Phases are listed in the order in which they first ended.
+
+// CHANGELOG
+//
+//
+//
+// TODO
+
+#include <cerrno>
+#include <cstdio>
+#include <iostream>
+#include <map>
+#include <sstream>
+#include <vector>
+#include <pthread.h>
+#include <sys/time.h>
+#include <sys/resource.h>
+
+#include "yoruba.h"
+#include "yoruba_stats.h"
+
+using namespace std;
+using namespace yoruba;
+
+struct Phase {
+    string      name;
+    double      seconds;
+    int64_t     times;
+};
+
+static pthread_mutex_t          stats_lock = PTHREAD_MUTEX_INITIALIZER;
+static double                   start_time;
+static string                   output_file;
+static string                   command;
+static vector<string>           command_line;
+static vector<Phase>            phases;
+static map<string, int64_t>     counters;
+
+
+//-------------------------------------
+
+
+static string
+jsonString(const string& s)
+{
+    string out = "\"";
+    for (size_t i = 0; i < s.length(); ++i) {
+        unsigned char c = s[i];
+        if (c == '"' || c == '\\') {
+            out += '\\';
+            out += c;
+        } else if (c < 0x20) {
+            char buf[8];
+            snprintf(buf, sizeof(buf), "\\u%04x", c);
+            out += buf;
+        } else {
+            out += c;
+        }
+    }
+    return out + "\"";
+}
+
+
+//-------------------------------------
+
+
+double
+Stats::Now(void)
+{
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return double(tv.tv_sec) + double(tv.tv_usec) * 1e-6;
+}
+
+
+//-------------------------------------
+
+
+void
+Stats::Start(int argc, char* argv[])
+{
+    start_time = Now();
+    command_line.assign(argv, argv + argc);
+    for (int i = 1; i < argc && command.empty(); ++i) {
+        string a = argv[i];
+        if (a == "--stats-json")
+            ++i;
+        else if (a.compare(0, 13, "--stats-json=") != 0)
+            command = a;
+    }
+}
+
+
+//-------------------------------------
+
+
+void
+Stats::SetOutput(const string& filename)
+{
+    output_file = filename;
+}
+
+
+//-------------------------------------
+
+
+bool
+Stats::HasOutput(void)
+{
+    return ! output_file.empty();
+}
+
+
+//-------------------------------------
+
+
+void
+Stats::AddPhase(const char* name, double seconds)
+{
+    pthread_mutex_lock(&stats_lock);
+    size_t i = 0;
+    while (i < phases.size() && phases[i].name != name)
+        ++i;
+    if (i == phases.size()) {
+        Phase p;
+        p.name = name;
+        p.seconds = 0;
+        p.times = 0;
+        phases.push_back(p);
+    }
+    phases[i].seconds += seconds;
+    ++phases[i].times;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+
+//-------------------------------------
+
+
+void
+Stats::Count(const char* name, int64_t n)
+{
+    if (n == 0)
+        return;
+    pthread_mutex_lock(&stats_lock);
+    counters[name] += n;
+    pthread_mutex_unlock(&stats_lock);
+}
+
+
+//-------------------------------------
+
+
+double
+Stats::WallSeconds(void)
+{
+    return Now() - start_time;
+}
+
+
+//-------------------------------------
+
+
+double
+Stats::CPUSeconds(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return double(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec)
+        + double(ru.ru_utime.tv_usec + ru.ru_stime.tv_usec) * 1e-6;
+}
+
+
+//-------------------------------------
+
+
+int64_t
+Stats::PeakRSS(void)
+{
+    struct rusage ru;
+    if (getrusage(RUSAGE_SELF, &ru) != 0)
+        return 0;
+    return int64_t(ru.ru_maxrss) * 1024;  // kilobytes on Linux
+}
+
+
+//-------------------------------------
+
+
+bool
+Stats::Finish(int exit_status)
+{
+    if (output_file.empty())
+        return true;
+
+    FILE* f = fopen(output_file.c_str(), "w");
+    if (f == NULL) {
+        cerr << "yoruba::Stats: could not write --stats-json file " << output_file << endl;
+        return false;
+    }
+
+    pthread_mutex_lock(&stats_lock);
+    fprintf(f, "{\n  \"program\": %s,\n  \"version\": %s,\n  \"command\": %s,\n  \"argv\": [",
+            jsonString(YORUBA_NAME).c_str(), jsonString(YORUBA_VERSION).c_str(),
+            jsonString(command).c_str());
+    for (size_t i = 0; i < command_line.size(); ++i)
+        fprintf(f, "%s%s", i ? ", " : "", jsonString(command_line[i]).c_str());
+    fprintf(f, "],\n  \"exit_status\": %d,\n", exit_status);
+    fprintf(f, "  \"wall_seconds\": %.6f,\n  \"cpu_seconds\": %.6f,\n  \"peak_rss_bytes\": %lld,\n",
+            WallSeconds(), CPUSeconds(), (long long)PeakRSS());
+    fprintf(f, "  \"phases\": [");
+    for (size_t i = 0; i < phases.size(); ++i)
+        fprintf(f, "%s\n    { \"name\": %s, \"seconds\": %.6f, \"times\": %lld }", i ? "," : "",
+                jsonString(phases[i].name).c_str(), phases[i].seconds, (long long)phases[i].times);
+    fprintf(f, "%s],\n  \"counters\": {", phases.empty() ? "" : "\n  ");
+    for (map<string, int64_t>::const_iterator it = counters.begin(); it != counters.end(); ++it)
+        fprintf(f, "%s\n    %s: %lld", it == counters.begin() ? "" : ",",
+                jsonString(it->first).c_str(), (long long)it->second);
+    fprintf(f, "%s}\n}\n", counters.empty() ? "" : "\n  ");
+    pthread_mutex_unlock(&stats_lock);
+
+    if (fclose(f) != 0) {
+        cerr << "yoruba::Stats: error writing --stats-json file " << output_file << endl;
+        return false;
+    }
+    return true;
+}
+
+
+//-------------------------------------
+//-------------------------------------  Progress
+//-------------------------------------
+
+
+Progress::Progress(void)
+    : interval(0), input_bytes(0), refs(NULL), n_records(0), offset(0), position(NO_POSITION),
+      running(false), stopping(false), start_time(0), last_time(0), last_records(0), last_offset(0)
+{
+    pthread_mutex_init(&lock, NULL);
+    pthread_cond_init(&wake, NULL);
+}
+
+
+//-------------------------------------
+
+
+bool
+Progress::Start(const string& pfx, int64_t interval_seconds, int64_t in_bytes,
+                const BamTools::RefVector* ref_names)
+{
+    Stop();
+    if (interval_seconds <= 0)
+        return true;
+    prefix = pfx;
+    interval = double(interval_seconds);
+    input_bytes = in_bytes;
+    refs = ref_names;
+    n_records = offset = 0;
+    position = NO_POSITION;
+    start_time = last_time = Stats::Now();
+    last_records = last_offset = 0;
+    stopping = false;
+    if (pthread_create(&thread, NULL, reportThread, this) != 0) {
+        cerr << "yoruba::Progress: could not start thread, no progress will be reported" << endl;
+        return false;
+    }
+    running = true;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+Progress::Stop(void)
+{
+    if (! running)
+        return;
+    pthread_mutex_lock(&lock);
+    stopping = true;
+    pthread_cond_signal(&wake);
+    pthread_mutex_unlock(&lock);
+    pthread_join(thread, NULL);
+    running = false;
+}
+
+
+//-------------------------------------
+
+
+void*
+Progress::reportThread(void* arg)
+{
+    Progress* p = static_cast<Progress*>(arg);
+    pthread_mutex_lock(&p->lock);
+    double next = p->start_time + p->interval;
+    while (! p->stopping) {
+        struct timespec ts;
+        ts.tv_sec = time_t(next);
+        ts.tv_nsec = long((next - double(ts.tv_sec)) * 1e9);
+        int ret = 0;
+        while (! p->stopping && ret != ETIMEDOUT)
+            ret = pthread_cond_timedwait(&p->wake, &p->lock, &ts);
+        if (p->stopping)
+            break;
+        double now = Stats::Now();
+        p->report(now);
+        next += p->interval;
+        if (next < now)  // we were held up, so skip the lines missed
+            next = now + p->interval;
+    }
+    pthread_mutex_unlock(&p->lock);
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+static string
+clockTime(double seconds)
+{
+    int64_t t = int64_t(seconds + 0.5);
+    char buf[32];
+    snprintf(buf, sizeof(buf), "%lld:%02d:%02d", (long long)(t / 3600), int((t / 60) % 60), int(t % 60));
+    return buf;
+}
+
+
+//-------------------------------------
+
+
+void
+Progress::report(double now)
+{
+    int64_t  n = __atomic_load_n(&n_records, __ATOMIC_RELAXED);
+    int64_t  off = __atomic_load_n(&offset, __ATOMIC_RELAXED);
+    uint64_t pos = __atomic_load_n(&position, __ATOMIC_RELAXED);
+    double   dt = now - last_time;
+
+    ostringstream line;
+    line << prefix << " " << n << " reads";
+    if (dt > 0) {
+        line << ", " << int64_t(double(n - last_records) / dt) << " reads/s";
+        if (off > 0)
+            line << ", " << fixed << setprecision(1) 
+                << double(off - last_offset) / dt / (1 << 20) << " MB/s";
+    }
+    if (pos != NO_POSITION) {
+        int32_t ref = int32_t(pos >> 32) - 1;
+        int32_t p = int32_t(uint32_t(pos));
+        line << ", at ";
+        if (ref < 0)
+            line << "unplaced reads";
+        else if (refs != NULL && size_t(ref) < refs->size())
+            line << (*refs)[ref].RefName << ":" << p + 1;
+        else
+            line << "RefID " << ref << " Pos " << p;
+    }
+    if (input_bytes > 0 && off > 0 && off <= input_bytes) {
+        double done = double(off) / double(input_bytes);
+        line << ", " << fixed << setprecision(1) << 100.0 * done << "%"
+            << ", ETA " << clockTime((now - start_time) * (1.0 - done) / done);
+    }
+    cerr << line.str() << endl;
+
+    last_time = now;
+    last_records = n;
+    last_offset = off;
+}
+
@@ -0,0 +1,160 @@
+// yoruba_stats.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_stats.cpp
+//
+// Run statistics for a yoruba command: wall-clock time by phase, counters
+// kept by the I/O layer and the commands, and peak resident memory, written
+// as JSON with --stats-json FILE so runs can be compared with one another.
+//
+// Phases are timed by a ScopedPhase on the stack, and phases of the same name
+// add up.  Phases and counters may be added from any thread; they are added
+// at the end of a phase or when a file is closed, not per record.
+//
+// Progress reports how far a pass has got, from a thread of its own every so
+// many seconds, so the loop reading records only bumps a counter.
+//
+// In the profiling build, 'make profile', phases are also those MemTrack
+// reports peak memory by.
+
+#ifndef _YORUBA_STATS_H_
+#define _YORUBA_STATS_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <string>
+#include <stdint.h>
+#include <pthread.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "MemTrack.h"
+
+namespace yoruba {
+
+class Stats {
+
+    public:
+        // at program start, with the whole command line
+        static void     Start(int argc, char* argv[]);
+        static void     SetOutput(const std::string& filename);
+        static bool     HasOutput(void);
+
+        static void     AddPhase(const char* name, double seconds);
+        static void     Count(const char* name, int64_t n);
+
+        static double   WallSeconds(void);   // since Start()
+        static double   CPUSeconds(void);    // user and system, all threads
+        static int64_t  PeakRSS(void);       // bytes
+
+        // write the report, if SetOutput() was given a file
+        static bool     Finish(int exit_status);
+
+        static double   Now(void);           // wall-clock seconds
+
+};  // class Stats
+
+
+class ScopedPhase {
+
+    public:
+        explicit ScopedPhase(const char* n) : name(n), start(Stats::Now()), ended(false) {
+            MEMTRACK_BEGIN_PHASE(n);
+        }
+        ~ScopedPhase(void) { End(); }
+
+        void        End(void) {  // before the end of the scope
+            if (! ended) {
+                Stats::AddPhase(name, Stats::Now() - start);
+                MEMTRACK_END_PHASE();
+            }
+            ended = true;
+        }
+
+    private:
+        const char* name;
+        double      start;
+        bool        ended;
+
+        ScopedPhase(const ScopedPhase&);             // not copyable
+        ScopedPhase& operator=(const ScopedPhase&);
+
+};  // class ScopedPhase
+
+
+// Between Start() and Stop(), a line every interval seconds with the records
+// so far, records/s and compressed MB/s since the last line, the position of
+// the last record and, if the size of the input is known, the estimated time
+// left, e.g.
+//
+//     [yoruba_sort][pass1] 41200000 reads, 312000 reads/s, 19.2 MB/s, at chr7:1203311, 38.1%, ETA 0:09:47
+//
+// The reading loop calls Add() for each record, which are relaxed atomic
+// stores and an increment.  Threads reading separate parts of the input
+// should add counts now and then with Add(n) instead; the position and
+// progress through the input are then not shown.
+
+class Progress {
+
+    public:
+        Progress(void);
+        ~Progress(void) { Stop(); }
+
+        // prefix begins each line; input_bytes is the compressed size of the
+        // input, 0 if unknown; refs names reference IDs if given.  Does
+        // nothing if interval is 0.
+        bool        Start(const std::string& prefix, int64_t interval, int64_t input_bytes = 0,
+                          const BamTools::RefVector* refs = NULL);
+        void        Stop(void);
+
+        // one more record, read from before voffset in the input
+        void        Add(const RawRecord& rec, int64_t voffset) {
+            __atomic_store_n(&position, (uint64_t(uint32_t(rec.RefID() + 1)) << 32)
+                             | uint32_t(rec.Position()), __ATOMIC_RELAXED);
+            __atomic_store_n(&offset, voffset >> 16, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&n_records, 1, __ATOMIC_RELAXED);
+        }
+        // n more records, all before voffset
+        void        Add(int64_t n, int64_t voffset) {
+            __atomic_store_n(&offset, voffset >> 16, __ATOMIC_RELAXED);
+            __atomic_fetch_add(&n_records, n, __ATOMIC_RELAXED);
+        }
+        // n more records, from wherever
+        void        Add(int64_t n) { __atomic_fetch_add(&n_records, n, __ATOMIC_RELAXED); }
+
+    private:
+        static void*    reportThread(void* arg);
+        void            report(double now);
+
+        static const uint64_t NO_POSITION = ~uint64_t(0);
+
+        std::string                 prefix;
+        double                      interval;
+        int64_t                     input_bytes;
+        const BamTools::RefVector*  refs;
+
+        // written by the reading loop
+        int64_t             n_records;
+        int64_t             offset;      // compressed
+        uint64_t            position;    // RefID + 1 << 32 | Position
+
+        // the reporting thread
+        bool                running, stopping;
+        pthread_t           thread;
+        pthread_mutex_t     lock;
+        pthread_cond_t      wake;
+        double              start_time, last_time;
+        int64_t             last_records, last_offset;
+
+        Progress(const Progress&);             // not copyable
+        Progress& operator=(const Progress&);
+
+};  // class Progress
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_STATS_H_
@@ -13,6 +13,11 @@ using namespace yoruba;
 bool
 yoruba::isCoordinateSorted(int32_t ref, int32_t pos, int32_t prev_ref, int32_t prev_pos)
 {
+    // reads without a reference (RefID -1) come after all others
+    if (prev_ref == -1)
+        return ref == -1;
+    if (ref == -1)
+        return true;
     if (ref < prev_ref || (ref == prev_ref && pos < prev_pos))
         return false;
     return true;
@@ -78,6 +83,374 @@ yoruba::isMateDownstream(const BamAlignment& alignment)
 //-------------------------------------
 
 
+bool
+yoruba::isMateUpstream(const RawRecord& rec)
+{
+    // assumes coordinate-sorted
+    if (! rec.IsPaired() || ! rec.IsMateMapped()) {
+        return false;
+    } else if (rec.RefID() < rec.MateRefID()) {
+        return false;
+    } else if (rec.RefID() == rec.MateRefID()) {
+        if (rec.InsertSize() > 0) {
+            return false;
+        } else if (rec.InsertSize() == 0) {
+            cerr << "yoruba::isMateUpstream(): InsertSize == 0, strangely..." << endl;
+            return false;
+        } else {
+            return true;
+        }
+    }
+    return true;  // rec.RefID() > rec.MateRefID()
+}
+
+
+//-------------------------------------
+
+
+bool
+yoruba::isMateDownstream(const RawRecord& rec)
+{
+    // assumes coordinate-sorted
+    if (! rec.IsPaired() || ! rec.IsMateMapped()) {
+        return false;
+    } else if (rec.RefID() < rec.MateRefID()) {
+        return true;
+    } else if (rec.RefID() == rec.MateRefID()) {
+        if (rec.InsertSize() > 0) {
+            return true;
+        } else if (rec.InsertSize() == 0) {
+            cerr << "yoruba::isMateDownstream(): InsertSize == 0, strangely..." << endl;
+            return false;
+        } else {
+            return false;
+        }
+    }
+    return false;  // rec.RefID() > rec.MateRefID()
+}
+
+
+//-------------------------------------
+//-------------------------------------  RawRecord
+//-------------------------------------
+
+
+RawRecord::RawRecord(const RawRecord& other)
+    : data(NULL), size(0), owned(false)
+{
+    Assign(other.data, other.size);
+}
+
+
+//-------------------------------------
+
+
+RawRecord&
+RawRecord::operator=(const RawRecord& other)
+{
+    if (this != &other)
+        Assign(other.data, other.size);
+    return *this;
+}
+
+
+//-------------------------------------
+
+
+char*
+RawRecord::Allocate(uint32_t sz)
+{
+    if (buf.size() < sz)
+        buf.resize(sz);
+    data = buf.empty() ? NULL : &buf[0];
+    size = sz;
+    owned = true;
+    return data;
+}
+
+
+//-------------------------------------
+
+
+void
+RawRecord::Assign(const char* d, uint32_t sz)
+{
+    if (sz == 0) {
+        data = NULL; size = 0; owned = false;
+        return;
+    }
+    memcpy(Allocate(sz), d, sz);
+}
+
+
+//-------------------------------------
+
+
+void
+RawRecord::Detach(void)
+{
+    if (! owned && data != NULL)
+        Assign(data, size);
+}
+
+
+//-------------------------------------
+
+
+int32_t
+RawRecord::AlignedLength(void) const
+{
+    // as BamAlignment::BuildCharData() builds AlignedBases: M, I, =, X take
+    // query bases, D, N and P are filled in, S and H are left out
+    int32_t len = 0;
+    for (uint16_t i = 0; i < CigarCount(); ++i) {
+        uint32_t op = CigarOp(i);
+        switch (op & 0xf) {
+            case 0: case 1: case 2: case 3: case 6: case 7: case 8:
+                len += op >> 4; break;
+            default:
+                break;
+        }
+    }
+    return len;
+}
+
+
+//-------------------------------------
+
+
+int32_t
+RawRecord::ReferenceLength(void) const
+{
+    int32_t len = 0;
+    for (uint16_t i = 0; i < CigarCount(); ++i) {
+        uint32_t op = CigarOp(i);
+        switch (op & 0xf) {
+            case 0: case 2: case 3: case 7: case 8:  // M, D, N, =, X
+                len += op >> 4; break;
+            default:
+                break;
+        }
+    }
+    return len;
+}
+
+
+//-------------------------------------
+
+
+// node n has children 2n and 2n+1, with source i the leaf at node k+i
+void
+LoserTree::Build(void)
+{
+    size_t k = key.size();
+    if (k <= 1) {
+        tree[0] = 0;
+        return;
+    }
+    vector<size_t> winner(2 * k);
+    for (size_t i = 0; i < k; ++i)
+        winner[k + i] = i;
+    for (size_t n = k - 1; n >= 1; --n) {
+        size_t a = winner[2 * n], b = winner[2 * n + 1];
+        winner[n] = less(a, b) ? a : b;
+        tree[n] = less(a, b) ? b : a;
+    }
+    tree[0] = winner[1];
+}
+
+
+//-------------------------------------
+
+
+// source i has a new key, so play its matches again up to the root
+void
+LoserTree::replay(size_t i)
+{
+    size_t k = key.size();
+    size_t w = i;
+    for (size_t n = (k + i) / 2; n >= 1; n /= 2) {
+        if (less(tree[n], w))
+            swap(tree[n], w);
+    }
+    tree[0] = w;
+}
+
+
+//-------------------------------------
+
+
+// the slot holding s, or the empty slot where it would go
+size_t
+StringTable::slot(const char* s, size_t len, uint64_t h) const
+{
+    size_t mask = slots.size() - 1;
+    for (size_t i = size_t(h) & mask; ; i = (i + 1) & mask) {
+        int32_t j = slots[i];
+        if (j < 0 || (hashes[j] == h && strings[j].length() == len
+                      && memcmp(strings[j].data(), s, len) == 0))
+            return i;
+    }
+}
+
+
+int
+StringTable::Find(const char* s, size_t len) const
+{
+    return slots[slot(s, len, hash(s, len))];
+}
+
+
+int
+StringTable::Add(const char* s, size_t len)
+{
+    uint64_t h = hash(s, len);
+    size_t i = slot(s, len, h);
+    if (slots[i] >= 0)
+        return slots[i];
+    if (2 * (strings.size() + 1) > slots.size()) {  // keep at most half full
+        grow();
+        i = slot(s, len, h);
+    }
+    slots[i] = int32_t(strings.size());
+    strings.push_back(string(s, len));
+    hashes.push_back(h);
+    return slots[i];
+}
+
+
+void
+StringTable::grow(void)
+{
+    slots.assign(2 * slots.size(), -1);
+    size_t mask = slots.size() - 1;
+    for (size_t j = 0; j < strings.size(); ++j) {
+        size_t i = size_t(hashes[j]) & mask;
+        while (slots[i] >= 0)
+            i = (i + 1) & mask;
+        slots[i] = int32_t(j);
+    }
+}
+
+
+//-------------------------------------
+
+
+size_t
+yoruba::auxValueSize(char type, const char* p, const char* end)
+{
+    switch (type) {
+        case 'A': case 'c': case 'C': return 1;
+        case 's': case 'S':           return 2;
+        case 'i': case 'I': case 'f': return 4;
+        case 'Z': case 'H': {
+            const char* z = static_cast<const char*>(memchr(p, '\0', end - p));
+            return z ? (z - p + 1) : 0;
+        }
+        case 'B': {
+            if (end - p < 5 || p[0] == 'Z' || p[0] == 'H' || p[0] == 'A' || p[0] == 'B') 
+                return 0;
+            int32_t n; memcpy(&n, p + 1, 4);
+            size_t sub = auxValueSize(p[0], NULL, NULL);
+            if (sub == 0 || n < 0) return 0;
+            return 5 + sub * size_t(n);
+        }
+        default:
+            return 0;
+    }
+}
+
+
+//-------------------------------------
+
+
+const char*
+RawRecord::FindTag(const char* tag) const
+{
+    const char* p = AuxData();
+    const char* end = data + size;
+    while (p + 3 <= end) {
+        size_t vs = auxValueSize(p[2], p + 3, end);
+        if (vs == 0 || p + 3 + vs > end)
+            return NULL;  // malformed, don't look further
+        if (p[0] == tag[0] && p[1] == tag[1])
+            return p;
+        p += 3 + vs;
+    }
+    return NULL;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawRecord::GetTagString(const char* tag, const char*& val, size_t& len) const
+{
+    const char* p = FindTag(tag);
+    if (p == NULL || (p[2] != 'Z' && p[2] != 'H'))
+        return false;
+    val = p + 3;
+    len = strlen(val);
+    return true;
+}
+
+
+//-------------------------------------
+
+
+bool
+RawRecord::RemoveTag(const char* tag)
+{
+    const char* p = FindTag(tag);
+    if (p == NULL)
+        return false;
+    Detach();
+    p = FindTag(tag);  // now in our own bytes
+    size_t tag_size = 3 + auxValueSize(p[2], p + 3, data + size);
+    size_t off = p - data;
+    memmove(data + off, data + off + tag_size, size - off - tag_size);
+    size -= tag_size;
+    return true;
+}
+
+
+//-------------------------------------
+
+
+void
+RawRecord::SetTagString(const char* tag, const char* val, size_t len)
+{
+    // replace in place if the tag exists, as BamAlignment::EditTag() does,
+    // otherwise append it
+    Detach();
+    const char* p = FindTag(tag);
+    size_t off, old_size;
+    if (p != NULL) {
+        off = p - data;
+        old_size = 3 + auxValueSize(p[2], p + 3, data + size);
+    } else {
+        off = size;
+        old_size = 0;
+    }
+    size_t new_size = 3 + len + 1;
+    uint32_t new_total = size - old_size + new_size;
+    if (buf.size() < new_total)
+        buf.resize(new_total);
+    data = &buf[0];
+    memmove(data + off + new_size, data + off + old_size, size - off - old_size);
+    data[off] = tag[0];
+    data[off + 1] = tag[1];
+    data[off + 2] = 'Z';
+    memcpy(data + off + 3, val, len);
+    data[off + 3 + len] = '\0';
+    size = new_total;
+}
+
+
+//-------------------------------------
+
+
 // overloaded
 void
 yoruba::PrintAlignment(const BamAlignment& alignment)
@@ -297,3 +670,70 @@ yoruba::printAlignmentInfo_fields(std::ostream& os,
 }
 
 
+
+
+//-------------------------------------
+
+
+// overloaded
+void
+yoruba::printAlignmentInfo(std::ostream& os,
+                           const RawRecord& rec,
+                           int32_t level)
+{
+    const RefVector dummy_refs;
+    yoruba::printAlignmentInfo(os, rec, dummy_refs, level);
+}
+
+
+//-------------------------------------
+
+
+// overloaded
+void
+yoruba::printAlignmentInfo(std::ostream& os,
+                           const RawRecord& rec,
+                           const RefVector& refs,
+                           int32_t level)
+{
+    os.write(rec.Name(), rec.NameLength());
+    if (rec.IsDuplicate()) os << "\tDuplicate";
+    if (level > 1)
+        if (rec.IsPrimaryAlignment()) os << "\tPrimary";
+    os << (rec.IsMapped() ? "\tMapped" : "\tUnmapped");
+    os << "\tRefID=" << rec.RefID();
+    if (rec.IsMapped() && rec.RefID() >= 0 && ! refs.empty()) {
+        os << "[" << refs[rec.RefID()].RefName << ",l=" << refs[rec.RefID()].RefLength << "]";
+    }
+    os << ":Pos=" << rec.Position();
+    os << "\tmapQ=" << int(rec.MapQuality());
+    os << (rec.IsReverseStrand() ?  "\tRev" : "\tForw");
+    if (level > 0)
+        os << "\tQ,A=" << rec.QueryLength() << "," << rec.AlignedLength();
+    os << "\tPair=" << rec.IsPaired();
+    if (rec.IsPaired() && level > 1) {
+        os << " |";
+        os << (rec.IsMateMapped() ? "\tmMapped" : "\tmUnmapped");
+        os << "\tmRefID=" << rec.MateRefID();
+        if (rec.IsMateMapped() && rec.MateRefID() >= 0 && ! refs.empty()) {
+            os << "[" << refs[rec.MateRefID()].RefName << ",l=" << refs[rec.MateRefID()].RefLength << "]";
+        }
+        os << ":mPos=" << rec.MatePosition();
+        os << (rec.IsMateReverseStrand() ?  "\tmRev" : "\tmForw");
+    }
+    if (rec.IsPaired() && level > 2) {
+        os << "\t";
+        if (rec.IsProperPair()) os << "PropPair,";
+        if (rec.IsFirstMate()) os << "1stMate";
+        if (rec.IsSecondMate()) os << "2ndMate";
+        os << "\tISize=" << rec.InsertSize();
+    }
+    // tags
+    const char* rg;
+    size_t rg_len;
+    if (rec.GetTagString("RG", rg, rg_len)) {
+        os << "\tRG:Z:";
+        os.write(rg, rg_len);
+    }
+    os << endl;
+}
@@ -7,6 +7,9 @@
 #include <iostream>
 #include <iomanip>
 #include <string>
+#include <vector>
+#include <cstring>
+#include <stdint.h>
 
 // #define NDEBUG  // uncomment to remove assert() code
 #include <assert.h>
@@ -35,6 +38,203 @@
 
 namespace yoruba {
 
+// RawRecord is a view of one BAM record as it is laid out in a decompressed
+// BGZF block, starting at refID; the block_size that precedes each record in
+// the BAM file is not included.  Fields are decoded from the bytes on demand,
+// so reading and examining a record costs no heap traffic.  The bytes are
+// either borrowed, usually from the current block of a RawBamReader and then
+// only valid until the next read, or owned by the record in a buffer that is
+// reused from record to record.  Copies always own their bytes.
+//
+// The accessor names follow BamTools::BamAlignment.  BAM is little-endian, as
+// is every machine we run on, so no byte swapping is done.
+
+class RawRecord {
+
+    public:
+        RawRecord(void) : data(NULL), size(0), owned(false) { }
+        RawRecord(const RawRecord& other);
+        RawRecord& operator=(const RawRecord& other);
+
+        // the bytes themselves
+        void        SetView(char* d, uint32_t sz) { data = d; size = sz; owned = false; }
+        char*       Allocate(uint32_t sz);  // own sz bytes, contents undefined
+        void        Assign(const char* d, uint32_t sz);
+        void        Detach(void);           // copy borrowed bytes into our own buffer
+        bool        IsView(void) const { return ! owned; }
+        bool        IsEmpty(void) const { return size == 0; }
+        const char* Data(void) const { return data; }
+        char*       Data(void) { return data; }
+        uint32_t    Size(void) const { return size; }
+
+        // core fields
+        int32_t     RefID(void) const { return get32(0); }
+        int32_t     Position(void) const { return get32(4); }
+        uint8_t     MapQuality(void) const { return uint8_t(data[9]); }
+        uint16_t    Bin(void) const { return get16(10); }
+        uint16_t    CigarCount(void) const { return get16(12); }
+        uint16_t    Flag(void) const { return get16(14); }
+        int32_t     QueryLength(void) const { return get32(16); }
+        int32_t     MateRefID(void) const { return get32(20); }
+        int32_t     MatePosition(void) const { return get32(24); }
+        int32_t     InsertSize(void) const { return get32(28); }
+
+        // read name, not NUL-counted, as a pointer/length pair
+        const char* Name(void) const { return data + 32; }
+        size_t      NameLength(void) const { return uint8_t(data[8]) - 1; }
+        std::string NameString(void) const { return std::string(Name(), NameLength()); }
+        bool        NameEquals(const RawRecord& other) const {
+            return NameLength() == other.NameLength() 
+                && memcmp(Name(), other.Name(), NameLength()) == 0;
+        }
+
+        // CIGAR ops are raw, length << 4 | op, op indexing "MIDNSHP=X"
+        uint32_t    CigarOp(uint16_t i) const { return get32u(cigarOffset() + 4 * i); }
+        int32_t     AlignedLength(void) const;    // same as BamAlignment AlignedBases.length()
+        int32_t     ReferenceLength(void) const;  // reference bases covered
+        int32_t     EndPosition(void) const { return Position() + ReferenceLength(); }
+
+        // packed sequence and qualities
+        const char* SeqData(void) const { return data + seqOffset(); }
+        const char* QualData(void) const { return data + seqOffset() + (QueryLength() + 1) / 2; }
+
+        // aux tags are only scanned when asked for
+        const char* AuxData(void) const { return data + auxOffset(); }
+        uint32_t    AuxLength(void) const { return size - auxOffset(); }
+        const char* FindTag(const char* tag) const;  // pointer to the tag, or NULL
+        bool        HasTag(const char* tag) const { return FindTag(tag) != NULL; }
+        bool        GetTagString(const char* tag, const char*& val, size_t& len) const;
+        bool        RemoveTag(const char* tag);
+        void        SetTagString(const char* tag, const char* val, size_t len);
+        void        SetTagString(const char* tag, const std::string& val) {
+            SetTagString(tag, val.data(), val.length());
+        }
+
+        // flags
+        bool        IsPaired(void) const { return Flag() & 0x0001; }
+        bool        IsProperPair(void) const { return Flag() & 0x0002; }
+        bool        IsMapped(void) const { return ! (Flag() & 0x0004); }
+        bool        IsMateMapped(void) const { return ! (Flag() & 0x0008); }
+        bool        IsReverseStrand(void) const { return Flag() & 0x0010; }
+        bool        IsMateReverseStrand(void) const { return Flag() & 0x0020; }
+        bool        IsFirstMate(void) const { return Flag() & 0x0040; }
+        bool        IsSecondMate(void) const { return Flag() & 0x0080; }
+        bool        IsPrimaryAlignment(void) const { return ! (Flag() & 0x0100); }
+        bool        IsFailedQC(void) const { return Flag() & 0x0200; }
+        bool        IsDuplicate(void) const { return Flag() & 0x0400; }
+
+        // in-place edits, which write through to borrowed bytes
+        void        SetRefID(int32_t id) { set32(0, id); }
+        void        SetMateRefID(int32_t id) { set32(20, id); }
+        void        SetFlag(uint16_t f) { memcpy(data + 14, &f, 2); }
+        void        SetIsDuplicate(bool ok) { SetFlag(ok ? (Flag() | 0x0400) : (Flag() & ~0x0400)); }
+
+    private:
+        int32_t     get32(uint32_t o) const { int32_t v; memcpy(&v, data + o, 4); return v; }
+        uint32_t    get32u(uint32_t o) const { uint32_t v; memcpy(&v, data + o, 4); return v; }
+        uint16_t    get16(uint32_t o) const { uint16_t v; memcpy(&v, data + o, 2); return v; }
+        void        set32(uint32_t o, int32_t v) { memcpy(data + o, &v, 4); }
+        uint32_t    cigarOffset(void) const { return 32 + uint8_t(data[8]); }
+        uint32_t    seqOffset(void) const { return cigarOffset() + 4 * CigarCount(); }
+        uint32_t    auxOffset(void) const { 
+            return seqOffset() + (QueryLength() + 1) / 2 + QueryLength(); 
+        }
+
+        char*             data;
+        uint32_t          size;
+        bool              owned;
+        std::vector<char> buf;   // our own bytes, capacity kept between records
+
+};  // class RawRecord
+
+
+// LoserTree picks the least of k keyed sources, as for a k-way merge of
+// sorted runs, in log2(k) comparisons per record.  Ties go to the lower
+// source index, so merging runs given in input order is stable.  Sources are
+// Set() or SetDone() and then Build(); after taking the Winner(), Update() it
+// with its next key or Finish() it once it has run out.
+
+class LoserTree {
+
+    public:
+        void        Reset(size_t k) { 
+            key.assign(k, 0); done.assign(k, true); tree.assign(k > 0 ? k : 1, 0);
+        }
+        void        Set(size_t i, uint64_t k) { key[i] = k; done[i] = false; }
+        void        SetDone(size_t i) { done[i] = true; }
+        void        Build(void);
+        bool        Empty(void) const { return done.empty() || done[tree[0]]; }
+        size_t      Winner(void) const { return tree[0]; }
+        uint64_t    WinnerKey(void) const { return key[tree[0]]; }
+        void        Update(size_t i, uint64_t k) { Set(i, k); replay(i); }
+        void        Finish(size_t i) { SetDone(i); replay(i); }
+
+    private:
+        bool        less(size_t a, size_t b) const {  // sources run out are greatest
+            if (done[a] != done[b])
+                return done[b];
+            if (done[a])
+                return a < b;
+            return key[a] < key[b] || (key[a] == key[b] && a < b);
+        }
+        void        replay(size_t i);
+
+        std::vector<uint64_t>   key;
+        std::vector<bool>       done;
+        std::vector<size_t>     tree;  // [0] the winner, [1..k-1] the losers at each node
+
+};  // class LoserTree
+
+
+// the samtools coordinate sort key: reference, then position, then forward
+// before reverse strand; reads without a reference (RefID -1) sort last
+inline uint64_t
+coordinateSortKey(const RawRecord& rec)
+{
+    return (uint64_t(uint32_t(rec.RefID())) << 32)
+        | (uint64_t(uint32_t(rec.Position() + 1)) << 1)
+        | (rec.IsReverseStrand() ? 1 : 0);
+}
+
+// StringTable interns strings, giving each distinct one a small index in
+// the order added.  Find() takes a pointer and length, so a string within a
+// record, a tag value or part of a read name, can be looked up in place
+// without making a std::string of it.  Open addressing on an FNV-1a hash.
+
+class StringTable {
+
+    public:
+        StringTable(void) : slots(16, -1) { }
+
+        // index of s, adding it if new
+        int                 Add(const char* s, size_t len);
+        int                 Add(const std::string& s) { return Add(s.data(), s.length()); }
+        // index of s, or -1 if it has not been added
+        int                 Find(const char* s, size_t len) const;
+        int                 Find(const std::string& s) const { return Find(s.data(), s.length()); }
+        size_t              Size(void) const { return strings.size(); }
+        const std::string&  operator[](size_t i) const { return strings[i]; }
+
+    private:
+        static uint64_t     hash(const char* s, size_t len) {
+            uint64_t h = 14695981039346656037ULL;
+            for (size_t i = 0; i < len; ++i)
+                h = (h ^ uint8_t(s[i])) * 1099511628211ULL;
+            return h;
+        }
+        size_t              slot(const char* s, size_t len, uint64_t h) const;
+        void                grow(void);
+
+        std::vector<std::string>  strings;
+        std::vector<uint64_t>     hashes;  // of strings[i], for growing and for quick misses
+        std::vector<int32_t>      slots;   // index into strings, -1 if empty; size a power of 2
+
+};  // class StringTable
+
+// size of an aux tag value of the given type starting at p, 0 if malformed
+size_t
+auxValueSize(char type, const char* p, const char* end);
+
 bool 
 isCoordinateSorted(int32_t ref, int32_t pos, int32_t prev_ref, int32_t prev_pos);
 
@@ -44,6 +244,12 @@ isMateUpstream(const BamTools::BamAlignment&);
 bool 
 isMateDownstream(const BamTools::BamAlignment&);
 
+bool 
+isMateUpstream(const RawRecord&);
+
+bool 
+isMateDownstream(const RawRecord&);
+
 void 
 PrintAlignment(const BamTools::BamAlignment&);
 
@@ -62,6 +268,17 @@ printAlignmentInfo(std::ostream& os,
                const BamTools::RefVector& refs, 
                int32_t level = 0);
 
+void
+printAlignmentInfo(std::ostream& os, 
+               const RawRecord& rec, 
+               int32_t level = 0);
+
+void
+printAlignmentInfo(std::ostream& os, 
+               const RawRecord& rec, 
+               const BamTools::RefVector& refs, 
+               int32_t level = 0);
+
 void
 printAlignmentInfo_fields(std::ostream& os, 
                const BamTools::BamAlignment& alignment, 
@@ -0,0 +1,538 @@
+// yoruba_validate.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Record-level checks of a BAM, see yoruba_validate.h
+//
+// Uses pthreads, and BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+//
+// --- check SO:queryname order; samtools and Picard collate names differently
+// --- check mate fields against the mate itself, which needs the mate
+
+#include <algorithm>
+#include <cctype>
+#include <cstring>
+#include <sstream>
+
+#include "yoruba_validate.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+
+static const char* PROBLEM_NAMES[RecordValidator::N_PROBLEMS] = {
+    "malformed", "read-name", "ref-id", "position", "end-position", "bin",
+    "cigar-op", "cigar-length", "cigar-clip", "mate-flags", "mate-ref-id",
+    "mate-position", "quality", "aux-tag", "sort-order"
+};
+
+// the BAI bin of [begin, end), as reg2bin() in the SAM specification; only
+// meaningful for alignments ending within 2^29 bases
+static uint32_t
+baiBin(int64_t begin, int64_t end)
+{
+    --end;
+    if (begin >> 14 == end >> 14) return ((1 << 15) - 1) / 7 + uint32_t(begin >> 14);
+    if (begin >> 17 == end >> 17) return ((1 << 12) - 1) / 7 + uint32_t(begin >> 17);
+    if (begin >> 20 == end >> 20) return ((1 << 9) - 1) / 7 + uint32_t(begin >> 20);
+    if (begin >> 23 == end >> 23) return ((1 << 6) - 1) / 7 + uint32_t(begin >> 23);
+    if (begin >> 26 == end >> 26) return ((1 << 3) - 1) / 7 + uint32_t(begin >> 26);
+    return 0;
+}
+
+
+//-------------------------------------
+//-------------------------------------  RecordValidator
+//-------------------------------------
+
+
+const char*
+RecordValidator::ProblemName(int p)
+{
+    return (p >= 0 && p < N_PROBLEMS) ? PROBLEM_NAMES[p] : "unknown";
+}
+
+
+RecordValidator::RecordValidator(const RefVector& r)
+    : refs(&r), n_refs(int32_t(r.size())), check_order(false), prev_key(0), n_found(0)
+{
+    memset(counts, 0, sizeof(counts));
+}
+
+
+//-------------------------------------
+
+
+// one line: where the record is, as a virtual offset and as the block's
+// compressed address and offset within it, its name, and the problem
+void
+RecordValidator::problem(Problem p, const RawRecord* rec, int64_t voffset,
+                         const string& what, string& report)
+{
+    ++counts[p];
+    ++n_found;
+    ostringstream line;
+    line << "at " << voffset << " (" << (voffset >> 16) << ":" << (voffset & 0xffff) << ")";
+    if (rec != NULL)
+        line << " read '" << rec->NameString() << "'";
+    line << " " << PROBLEM_NAMES[p] << ": " << what << "\n";
+    report += line.str();
+}
+
+
+// true if the fixed fields, name, CIGAR, sequence and qualities lie within
+// the record, otherwise what is wrong
+bool
+RecordValidator::checkLayout(const RawRecord& rec, string& what) const
+{
+    ostringstream s;
+    if (rec.Size() < 32) {
+        s << "record of " << rec.Size() << " bytes is shorter than its fixed fields";
+    } else if (uint8_t(rec.Data()[8]) == 0) {
+        s << "read name length is 0, which leaves no room for its NUL";
+    } else if (rec.QueryLength() < 0) {
+        s << "sequence length " << rec.QueryLength() << " is negative";
+    } else {
+        int64_t need = 32 + int64_t(uint8_t(rec.Data()[8])) + 4 * int64_t(rec.CigarCount())
+            + (int64_t(rec.QueryLength()) + 1) / 2 + int64_t(rec.QueryLength());
+        if (need > int64_t(rec.Size()))
+            s << "name, CIGAR, sequence and qualities need " << need
+                << " bytes but the record has " << rec.Size();
+        else if (rec.Data()[32 + uint8_t(rec.Data()[8]) - 1] != '\0')
+            s << "read name is not NUL-terminated";
+        else
+            return true;
+    }
+    what = s.str();
+    return false;
+}
+
+
+//-------------------------------------
+
+
+size_t
+RecordValidator::Check(const RawRecord& rec, int64_t voffset, string& report)
+{
+    n_found = 0;
+    string what;
+    if (! checkLayout(rec, what)) {
+        problem(MALFORMED, NULL, voffset, what, report);
+        return n_found;
+    }
+
+    const size_t name_length = rec.NameLength();
+    const char* name = rec.Name();
+    if (name_length == 0 || name_length > 254) {
+        ostringstream s;
+        s << "name length " << name_length << " is not 1 to 254";
+        problem(READ_NAME, &rec, voffset, s.str(), report);
+    } else {
+        for (size_t i = 0; i < name_length; ++i)
+            if (name[i] < '!' || name[i] > '~' || name[i] == '@') {
+                problem(READ_NAME, &rec, voffset, "name has a character outside [!-?A-~]", report);
+                break;
+            }
+    }
+
+    // reference and position
+
+    const int32_t ref_id = rec.RefID();
+    const int32_t pos = rec.Position();
+    bool placed = false;  // on a known reference at a position within it
+    if (ref_id < -1 || ref_id >= n_refs) {
+        ostringstream s;
+        s << "reference ID " << ref_id << " is not -1 or one of the " << n_refs << " references";
+        problem(REF_ID, &rec, voffset, s.str(), report);
+    } else if (ref_id == -1 && rec.IsMapped()) {
+        problem(REF_ID, &rec, voffset, "mapped read has no reference", report);
+    } else if (pos < -1) {
+        ostringstream s;
+        s << "position " << pos << " is negative";
+        problem(POSITION, &rec, voffset, s.str(), report);
+    } else if (ref_id >= 0 && pos >= (*refs)[ref_id].RefLength) {
+        ostringstream s;
+        s << "position " << (pos + 1) << " is beyond the end of " << (*refs)[ref_id].RefName
+            << " at " << (*refs)[ref_id].RefLength;
+        problem(POSITION, &rec, voffset, s.str(), report);
+    } else if (pos == -1 && rec.IsMapped()) {
+        problem(POSITION, &rec, voffset, "mapped read has no position", report);
+    } else {
+        placed = ref_id >= 0 && pos >= 0;
+    }
+
+    checkCigar(rec, voffset, report);
+
+    if (placed && rec.IsMapped()) {
+        if (rec.CigarCount() == 0)
+            problem(CIGAR_LENGTH, &rec, voffset, "mapped read has no CIGAR", report);
+        int64_t end = int64_t(pos) + rec.ReferenceLength();
+        if (end > (*refs)[ref_id].RefLength) {
+            ostringstream s;
+            s << "alignment ends at " << end << ", beyond the end of " << (*refs)[ref_id].RefName
+                << " at " << (*refs)[ref_id].RefLength;
+            problem(END_POSITION, &rec, voffset, s.str(), report);
+        }
+        if (end <= (int64_t(1) << 29)) {
+            uint32_t bin = baiBin(pos, end > pos ? end : pos + 1);
+            if (rec.Bin() != bin) {
+                ostringstream s;
+                s << "bin " << rec.Bin() << " should be " << bin;
+                problem(BIN, &rec, voffset, s.str(), report);
+            }
+        }
+    }
+
+    // mate fields against the flags
+
+    const int32_t mate_ref_id = rec.MateRefID();
+    const int32_t mate_pos = rec.MatePosition();
+    if (! rec.IsPaired()) {
+        if (rec.Flag() & (0x0002 | 0x0008 | 0x0020 | 0x0040 | 0x0080)) {
+            ostringstream s;
+            s << "flag " << rec.Flag() << " has mate flags set but not paired (0x1)";
+            problem(MATE_FLAGS, &rec, voffset, s.str(), report);
+        }
+    }
+    if (mate_ref_id < -1 || mate_ref_id >= n_refs) {
+        ostringstream s;
+        s << "mate reference ID " << mate_ref_id << " is not -1 or one of the " << n_refs << " references";
+        problem(MATE_REF_ID, &rec, voffset, s.str(), report);
+    } else if (rec.IsPaired() && rec.IsMateMapped() && mate_ref_id == -1) {
+        problem(MATE_REF_ID, &rec, voffset, "mate is mapped but has no reference", report);
+    } else if (mate_pos < -1) {
+        ostringstream s;
+        s << "mate position " << mate_pos << " is negative";
+        problem(MATE_POSITION, &rec, voffset, s.str(), report);
+    } else if (mate_ref_id >= 0 && mate_pos >= (*refs)[mate_ref_id].RefLength) {
+        ostringstream s;
+        s << "mate position " << (mate_pos + 1) << " is beyond the end of "
+            << (*refs)[mate_ref_id].RefName << " at " << (*refs)[mate_ref_id].RefLength;
+        problem(MATE_POSITION, &rec, voffset, s.str(), report);
+    } else if (rec.IsPaired() && rec.IsMateMapped() && mate_pos == -1) {
+        problem(MATE_POSITION, &rec, voffset, "mate is mapped but has no position", report);
+    }
+
+    // qualities are all 0xff when missing, otherwise Phred scores that fit SAM
+
+    const int32_t l_seq = rec.QueryLength();
+    const uint8_t* qual = reinterpret_cast<const uint8_t*>(rec.QualData());
+    if (l_seq > 0 && qual[0] != 0xff) {
+        for (int32_t i = 0; i < l_seq; ++i)
+            if (qual[i] > 93) {
+                ostringstream s;
+                s << "base quality " << int(qual[i]) << " at base " << (i + 1) << " is above 93";
+                problem(QUALITY, &rec, voffset, s.str(), report);
+                break;
+            }
+    }
+
+    checkAux(rec, voffset, report);
+
+    if (check_order) {
+        uint64_t key = coordinateSortKey(rec) >> 1;  // the strand is only a tie-break
+        if (key < prev_key) {
+            ostringstream s;
+            s << "not in coordinate order, it follows a read at ";
+            uint32_t prev_ref = uint32_t(prev_key >> 31);
+            if (prev_ref < uint32_t(n_refs))
+                s << (*refs)[prev_ref].RefName << ":" << (prev_key & 0x7fffffff);
+            else
+                s << "no reference";
+            problem(SORT_ORDER, &rec, voffset, s.str(), report);
+        }
+        prev_key = key;
+    }
+
+    return n_found;
+}
+
+
+//-------------------------------------
+
+
+void
+RecordValidator::checkCigar(const RawRecord& rec, int64_t voffset, string& report)
+{
+    const uint16_t n = rec.CigarCount();
+    if (n == 0)
+        return;
+    int64_t query_length = 0;
+    for (uint16_t i = 0; i < n; ++i) {
+        uint32_t c = rec.CigarOp(i);
+        uint32_t op = c & 0xf;
+        if (op > 8) {
+            ostringstream s;
+            s << "CIGAR operation " << (i + 1) << " has unknown code " << op;
+            problem(CIGAR_OP, &rec, voffset, s.str(), report);
+            return;
+        }
+        if (op == 0 || op == 1 || op == 4 || op == 7 || op == 8)  // M I S = X
+            query_length += c >> 4;
+        // H only first or last, S only next to the ends or an H there
+        bool clip_ok = true;
+        if (op == 5)
+            clip_ok = (i == 0 || i == n - 1);
+        else if (op == 4)
+            clip_ok = (i == 0 || i == n - 1
+                       || (i == 1 && (rec.CigarOp(0) & 0xf) == 5)
+                       || (i == n - 2 && (rec.CigarOp(n - 1) & 0xf) == 5));
+        if (! clip_ok) {
+            ostringstream s;
+            s << "CIGAR operation " << (i + 1) << " of " << n << " is a "
+                << (op == 5 ? "hard" : "soft") << " clip inside the alignment";
+            problem(CIGAR_CLIP, &rec, voffset, s.str(), report);
+        }
+    }
+    // a missing sequence, length 0, is allowed with any CIGAR
+    if (rec.QueryLength() > 0 && query_length != rec.QueryLength()) {
+        ostringstream s;
+        s << "CIGAR covers " << query_length << " query bases but the sequence has "
+            << rec.QueryLength();
+        problem(CIGAR_LENGTH, &rec, voffset, s.str(), report);
+    }
+}
+
+
+//-------------------------------------
+
+
+// walk the tags, stopping at the first that cannot be stepped over
+void
+RecordValidator::checkAux(const RawRecord& rec, int64_t voffset, string& report)
+{
+    const char* p = rec.AuxData();
+    const char* end = rec.Data() + rec.Size();
+    vector<uint16_t> seen;
+    while (p < end) {
+        ostringstream s;
+        if (end - p < 3) {
+            s << (end - p) << " bytes after the last tag, too few for another";
+            problem(AUX_TAG, &rec, voffset, s.str(), report);
+            return;
+        }
+        const string tag(p, 2);
+        const char type = p[2];
+        if (! isalpha(uint8_t(p[0])) || ! isalnum(uint8_t(p[1]))) {
+            s << "tag name '" << tag << "' is not [A-Za-z][A-Za-z0-9]";
+            problem(AUX_TAG, &rec, voffset, s.str(), report);
+        }
+        uint16_t code = uint16_t(uint8_t(p[0]) << 8 | uint8_t(p[1]));
+        if (find(seen.begin(), seen.end(), code) != seen.end()) {
+            s << "tag " << tag << " appears more than once";
+            problem(AUX_TAG, &rec, voffset, s.str(), report);
+        } else {
+            seen.push_back(code);
+        }
+        p += 3;
+        size_t width = 0;
+        switch (type) {
+            case 'A':
+                if (p < end && (*p < '!' || *p > '~')) {
+                    s << "tag " << tag << ":A value is not a printable character";
+                    problem(AUX_TAG, &rec, voffset, s.str(), report);
+                }
+                width = 1;
+                break;
+            case 'c': case 'C': width = 1; break;
+            case 's': case 'S': width = 2; break;
+            case 'i': case 'I': case 'f': width = 4; break;
+            case 'Z': case 'H': {
+                const char* nul = static_cast<const char*>(memchr(p, '\0', end - p));
+                if (nul == NULL) {
+                    s << "tag " << tag << ":" << type << " value is not NUL-terminated";
+                    problem(AUX_TAG, &rec, voffset, s.str(), report);
+                    return;
+                }
+                bool ok = true;
+                for (const char* q = p; q < nul && ok; ++q)
+                    ok = (type == 'Z') ? (*q >= ' ' && *q <= '~') : isxdigit(uint8_t(*q));
+                if (type == 'H' && (nul - p) % 2 != 0)
+                    ok = false;
+                if (! ok) {
+                    s << "tag " << tag << ":" << type << " value has "
+                        << (type == 'Z' ? "a character outside [ -~]" : "an odd length or non-hex digit");
+                    problem(AUX_TAG, &rec, voffset, s.str(), report);
+                }
+                width = nul - p + 1;
+                break;
+            }
+            case 'B': {
+                if (end - p < 5) {
+                    s << "tag " << tag << ":B array is truncated";
+                    problem(AUX_TAG, &rec, voffset, s.str(), report);
+                    return;
+                }
+                size_t size = 0;
+                switch (p[0]) {
+                    case 'c': case 'C': size = 1; break;
+                    case 's': case 'S': size = 2; break;
+                    case 'i': case 'I': case 'f': size = 4; break;
+                }
+                if (size == 0) {
+                    s << "tag " << tag << ":B array has unknown element type '" << p[0] << "'";
+                    problem(AUX_TAG, &rec, voffset, s.str(), report);
+                    return;
+                }
+                uint32_t count;
+                memcpy(&count, p + 1, 4);
+                width = 5 + size * size_t(count);
+                break;
+            }
+            default:
+                s << "tag " << tag << " has unknown type '" << type << "'";
+                problem(AUX_TAG, &rec, voffset, s.str(), report);
+                return;
+        }
+        if (width > size_t(end - p)) {
+            ostringstream t;
+            t << "tag " << tag << ":" << type << " value runs past the end of the record";
+            problem(AUX_TAG, &rec, voffset, t.str(), report);
+            return;
+        }
+        p += width;
+    }
+}
+
+
+//-------------------------------------
+//-------------------------------------  BamValidator
+//-------------------------------------
+
+
+BamValidator::BamValidator(const RefVector& refs, bool coordinate_sorted,
+                           ostream& o, const string& pre,
+                           int64_t max_rep, int n_threads)
+    : validator(refs), out(o), prefix(pre), max_reports(max_rep), n_reported(0),
+      last_key(0), closed(false)
+{
+    validator.SetCheckOrder(coordinate_sorted);
+    if (n_threads <= 1)
+        return;
+    for (int i = 0; i < n_threads; ++i) {
+        CheckTask* t = new CheckTask(*this, refs);
+        t->validator.SetCheckOrder(coordinate_sorted);
+        if (! workers.Start(t)) {
+            cerr << "yoruba::BamValidator: could not start worker thread, continuing with "
+                << workers.Threads() << endl;
+            delete t;
+            break;
+        }
+        tasks.push_back(t);
+    }
+}
+
+
+BamValidator::~BamValidator(void)
+{
+    Close();
+    for (size_t i = 0; i < tasks.size(); ++i)
+        delete tasks[i];
+}
+
+
+//-------------------------------------
+
+
+void
+BamValidator::Check(const RawRecord& rec, int64_t voffset)
+{
+    if (workers.Threads() == 0) {
+        string report;
+        size_t n = validator.Check(rec, voffset, report);
+        if (n > 0)
+            write(report);
+        return;
+    }
+    Batch& current = workers.Current();
+    if (current.records.n_records == 0)
+        current.prev_key = last_key;
+    current.records.Append(rec);
+    current.voffsets.push_back(voffset);
+    if (rec.Size() >= 32)
+        last_key = coordinateSortKey(rec) >> 1;
+    if (current.records.IsFull())
+        workers.Submit();
+}
+
+
+//-------------------------------------
+
+
+int64_t
+BamValidator::Count(int p) const
+{
+    int64_t n = validator.Count(p);
+    for (size_t i = 0; i < tasks.size(); ++i)
+        n += tasks[i]->validator.Count(p);
+    return n;
+}
+
+
+int64_t
+BamValidator::Problems(void) const
+{
+    int64_t n = 0;
+    for (int p = 0; p < RecordValidator::N_PROBLEMS; ++p)
+        n += Count(p);
+    return n;
+}
+
+
+//-------------------------------------
+
+
+// the report's lines, up to max_reports altogether
+void
+BamValidator::write(const string& report)
+{
+    for (size_t start = 0; start < report.length()
+         && (max_reports < 0 || n_reported < max_reports); ++n_reported) {
+        size_t end = report.find('\n', start);
+        end = (end == string::npos) ? report.length() : end + 1;
+        out << prefix;
+        out.write(report.data() + start, end - start);
+        start = end;
+    }
+}
+
+
+//-------------------------------------
+
+
+void
+BamValidator::CheckTask::Work(Batch& b)
+{
+    RawRecord rec;
+    validator.SetPrevious(b.prev_key);
+    size_t i = 0;
+    for (size_t off = 0; off < b.records.length; ++i) {
+        int32_t block_size;
+        memcpy(&block_size, &b.records.data[off], 4);
+        rec.SetView(&b.records.data[off + 4], block_size);
+        off += 4 + block_size;
+        b.n_found += validator.Check(rec, b.voffsets[i], b.report);
+    }
+}
+
+
+//-------------------------------------
+
+
+void
+BamValidator::Close(void)
+{
+    if (closed)
+        return;
+    closed = true;
+    if (workers.Threads() == 0)
+        return;
+    if (workers.Current().records.n_records > 0)
+        workers.Submit();
+    workers.Close();  // the tasks' counts are kept for Count()
+}
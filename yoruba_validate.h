@@ -0,0 +1,154 @@
+// yoruba_validate.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_validate.cpp
+//
+// Record-level checks of a BAM, for inside --validate.  Each record is
+// checked where it sits as a RawRecord, against the reference list and the
+// record before it, and problems are reported with the virtual offset of the
+// record so that it can be found again with a seek.
+//
+// Uses pthreads, and BamTools only for header types
+
+#ifndef _YORUBA_VALIDATE_H_
+#define _YORUBA_VALIDATE_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+
+// Yoruba includes
+#include "yoruba_util.h"
+#include "yoruba_pipeline.h"
+
+namespace yoruba {
+
+// RecordValidator checks one record at a time.  Its checks look at nothing
+// but the record, the references and, if checking coordinate order, the sort
+// key of the record before, so one validator per thread can check batches
+// of a BAM independently.  Each problem found is added to a report as a line
+// and counted by kind.
+
+class RecordValidator {
+
+    public:
+        enum Problem {
+            MALFORMED,      // the record's fields do not fit in it
+            READ_NAME,
+            REF_ID,
+            POSITION,
+            END_POSITION,   // the alignment runs past the end of its reference
+            BIN,
+            CIGAR_OP,
+            CIGAR_LENGTH,   // query bases of the CIGAR are not the sequence length
+            CIGAR_CLIP,     // clips not at the ends
+            MATE_FLAGS,
+            MATE_REF_ID,
+            MATE_POSITION,
+            QUALITY,
+            AUX_TAG,
+            SORT_ORDER,
+            N_PROBLEMS
+        };
+        static const char*  ProblemName(int p);
+
+        explicit RecordValidator(const BamTools::RefVector& r);
+
+        // check records for coordinate order, the next following one with
+        // the given coordinateSortKey()
+        void        SetCheckOrder(bool ok) { check_order = ok; }
+        void        SetPrevious(uint64_t key) { prev_key = key; }
+
+        // check rec, read from voffset, adding a line to report for each
+        // problem; returns the number found
+        size_t      Check(const RawRecord& rec, int64_t voffset, std::string& report);
+        int64_t     Count(int p) const { return counts[p]; }
+
+    private:
+        void        problem(Problem p, const RawRecord* rec, int64_t voffset,
+                            const std::string& what, std::string& report);
+        bool        checkLayout(const RawRecord& rec, std::string& what) const;
+        void        checkCigar(const RawRecord& rec, int64_t voffset, std::string& report);
+        void        checkAux(const RawRecord& rec, int64_t voffset, std::string& report);
+
+        const BamTools::RefVector*  refs;
+        int32_t                     n_refs;
+        bool                        check_order;
+        uint64_t                    prev_key;
+        size_t                      n_found;   // by the current Check()
+        int64_t                     counts[N_PROBLEMS];
+
+};  // class RecordValidator
+
+
+// BamValidator runs a RecordValidator over every record given to it,
+// writing the problems found to out, each line after prefix, in the order of
+// the records.  With more than one thread, records are gathered into batches
+// that are checked on the threads in turn, as for SamWriter.  At most
+// max_reports problems are written, though all are counted; negative
+// writes every one.
+
+class BamValidator {
+
+    public:
+        BamValidator(const BamTools::RefVector& refs, bool coordinate_sorted,
+                     std::ostream& out, const std::string& prefix,
+                     int64_t max_reports, int n_threads = 1);
+        ~BamValidator(void);
+
+        // rec, read from voffset
+        void        Check(const RawRecord& rec, int64_t voffset);
+        void        Close(void);  // check what is left and write its problems
+        int64_t     Count(int p) const;
+        int64_t     Problems(void) const;  // of every kind
+
+    private:
+        struct Batch {
+            Batch(void) : prev_key(0), n_found(0) { }
+            RecordBatch             records;
+            std::vector<int64_t>    voffsets;
+            uint64_t                prev_key;   // of the record before the batch
+            std::string             report;
+            size_t                  n_found;
+            void Clear(void) { records.Clear(); voffsets.clear(); report.clear(); n_found = 0; }
+        };
+        // checks the batches of one thread, and writes what it found in turn
+        class CheckTask : public BatchWorkers<Batch>::Task {
+            public:
+                CheckTask(BamValidator& v, const BamTools::RefVector& refs) : owner(v), validator(refs) { }
+                virtual void Work(Batch& b);
+                virtual void Done(Batch& b) {
+                    if (b.n_found > 0)
+                        owner.write(b.report);
+                }
+                BamValidator&       owner;
+                RecordValidator     validator;
+        };
+
+        void            write(const std::string& report);
+
+        RecordValidator         validator;  // with one thread
+        std::ostream&           out;
+        std::string             prefix;
+        int64_t                 max_reports;
+        int64_t                 n_reported;
+        std::vector<CheckTask*> tasks;      // kept after Close() for Count()
+        BatchWorkers<Batch>     workers;
+        uint64_t                last_key;   // of the last record given
+        bool                    closed;
+
+        BamValidator(const BamValidator&);             // not copyable
+        BamValidator& operator=(const BamValidator&);
+
+};  // class BamValidator
+
+
+}  // namespace yoruba
+
+#endif // _YORUBA_VALIDATE_H_
@@ -0,0 +1,403 @@
+// yoruba_yo.cpp  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Yo (English command is extract) writes the reads of a coordinate-sorted,
+// indexed BAM file that overlap regions, and with --mates the mates of those
+// reads wherever they are.
+//
+// The reads in the regions are read twice, once to request their mates from
+// a MateFetcher and once to write them, with the mates fetched in between
+// merged into them in coordinate order, so the output is sorted too.  Mates
+// that are themselves in the regions are written from there.
+//
+// Yo is the Yoruba (Nigeria) verb for 'to pull out'.
+//
+// Uses BamTools only for header types
+
+// CHANGELOG
+//
+//
+//
+// TODO
+// --- fetch mates in batches of requests, for regions with very many reads
+
+#include <algorithm>
+
+#include "yoruba_yo.h"
+
+using namespace std;
+using namespace BamTools;
+using namespace yoruba;
+
+static string       input_file;
+static string       output_file;
+static OutputOptions output_opts;
+static string       checksum_file;     // --checksum FILE
+static string       checksum_exclude;
+static RegionList   regions;  // -r and --regions
+static bool         opt_mates = false;
+#ifdef _WITH_DEBUG
+static int32_t      opt_debug = 0;
+static int32_t      debug_progress = 10;  // seconds
+static int64_t      opt_reads = -1;
+static int64_t      opt_progress = 0;  // seconds between progress lines
+#endif
+
+static SamProgram   new_program;  // set in parseOptions()
+
+static int  parseOptions(int argc, char* argv[]);
+static bool inRegions(const vector<Region>& rs, const RawRecord& rec);
+
+
+//-------------------------------------
+
+
+#ifdef _STANDALONE
+int
+main(int argc, char* argv[]) {
+    return main_yo(argc, argv);
+}
+#endif
+
+
+//-------------------------------------
+
+
+static int
+usage(bool longer = false)
+{
+    cerr << endl;
+    cerr << "Usage:   " << YORUBA_NAME << " extract [options] -r STR <in.bam>" << endl;
+    cerr << "         " << YORUBA_NAME << " yo [options] -r STR <in.bam>" << endl;
+    cerr << "\n\
+Write the reads of <in.bam> overlapping regions, and with --mates their\n\
+mates too.  <in.bam> must be sorted by coordinate and indexed.  Either command\n\
+invokes this function.\n\
+\n";
+    if (longer) cerr << "\
+With --mates, the mates of the reads in the regions are fetched together after\n\
+the regions have been read, in one pass forward through <in.bam> that seeks\n\
+with the index only to skip ahead, rather than by jumping to each mate and\n\
+back.  Only the primary alignment of each mate is fetched.  The output is\n\
+sorted by coordinate, with the mates merged among the reads of the regions.\n\
+\n";
+    cerr << "\
+Options: -r STR | --region STR     reads overlapping region STR, as CHR, CHR:BEG\n\
+                                   or CHR:BEG-END; may be given more than once\n\
+         --regions FILE            reads overlapping the regions of BED FILE\n\
+         --mates                   also the mates of those reads\n\
+         -o FILE | --output FILE   output file name [default is stdout]\n\
+         -l INT | --level INT      output compression level 0-9 [6]\n\
+         -u                        uncompressed output, same as --level 0\n\
+         --write-index             also write a BAI (or CSI) index of the output\n\
+         --checksum FILE           write order-independent checksums of the output to FILE\n\
+         --checksum-exclude LIST   fields and tags to leave out of them, see checksum\n\
+         -? | --help               longer help\n\
+\n";
+#ifdef _WITH_DEBUG
+    cerr << "\
+         --debug INT      debug info level INT [" << opt_debug << "]\n\
+         --reads INT      only process INT reads [" << opt_reads << "]\n\
+         --progress INT   print progress every INT seconds [" << opt_progress << "]\n\
+\n";
+#endif
+    cerr << "Yo is the Yoruba (Nigeria) verb for 'to pull out'." << endl;
+    cerr << endl;
+
+    return EXIT_FAILURE;
+}
+
+
+//-------------------------------------
+
+
+// true if rec overlaps one of rs, merged and sorted, as the reader decides
+// for the reads it returns
+static bool
+inRegions(const vector<Region>& rs, const RawRecord& rec)
+{
+    const int32_t ref = rec.RefID();
+    const int32_t pos = rec.Position();
+    // the first region not wholly before pos; later ones begin later still
+    size_t lo = 0, hi = rs.size();
+    while (lo < hi) {
+        size_t mid = lo + (hi - lo) / 2;
+        if (rs[mid].ref < ref || (rs[mid].ref == ref && rs[mid].end <= pos))
+            lo = mid + 1;
+        else
+            hi = mid;
+    }
+    return lo < rs.size() && rs[lo].ref == ref && max(rec.EndPosition(), pos + 1) > rs[lo].begin;
+}
+
+
+// mates in coordinate order, ties in the order fetched
+static bool
+mateLess(const RawRecord* a, const RawRecord* b)
+{
+    return coordinateSortKey(*a) < coordinateSortKey(*b);
+}
+
+
+//-------------------------------------
+
+
+int
+yoruba::main_yo(int argc, char* argv[])
+{
+    //----------------- Command-line options
+
+    if (argc < 2)
+        return usage();
+
+    if (parseOptions(argc, argv) != EXIT_SUCCESS)
+        return EXIT_FAILURE;
+
+
+    //----------------- Open input BAM
+
+
+    ScopedPhase phase_open("open");
+
+    RawBamReader reader;
+
+    if (! reader.Open(input_file)) {
+        cerr << NAME << " could not open BAM input" << endl;
+        return EXIT_FAILURE;
+    }
+    if (! reader.SetRegions(regions))
+        return EXIT_FAILURE;
+
+    RawHeader raw_header = reader.GetRawHeader();  // the @SQ lines are copied as they are
+    SamHeader& header = raw_header.Meta();
+    if (header.Programs.Contains(new_program.ID)) {
+        SamProgram& prog = header.Programs[new_program.ID];
+        prog.Name = new_program.Name;
+        prog.Version = new_program.Version;
+        prog.CommandLine = new_program.CommandLine;
+    } else {
+        header.Programs.Add(new_program);
+    }
+
+    MateFetcher fetcher;
+    if (opt_mates && ! fetcher.Open(input_file))
+        return EXIT_FAILURE;
+
+    phase_open.End();
+
+
+    //----------------- Pass 1: Fetch the mates of reads in the regions
+
+
+    vector<const RawRecord*> mates;  // those outside the regions, sorted
+    int64_t n_reads = 0;
+    RawRecord rec;
+    Progress progress;
+
+    if (opt_mates) {
+        ScopedPhase phase_pass1("pass1");
+
+        progress.Start(NAME "[pass1]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+        while (reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
+            ++n_reads;
+            if (rec.IsPaired() && rec.IsPrimaryAlignment() && ! (rec.Flag() & 0x0800))
+                fetcher.Request(rec);
+            progress.Add(rec, reader.Tell());
+        }
+        progress.Stop();
+        if (reader.Failed()) {
+            cerr << NAME << "[pass1] error reading input" << endl;
+            return EXIT_FAILURE;
+        }
+        if (! fetcher.Fetch())
+            return EXIT_FAILURE;
+
+        for (size_t i = 0; i < fetcher.Requests(); ++i) {
+            const RawRecord* mate = fetcher.Mate(i);
+            if (mate != NULL && ! inRegions(reader.GetRegions(), *mate))
+                mates.push_back(mate);
+        }
+        stable_sort(mates.begin(), mates.end(), mateLess);
+
+        if (opt_progress || DEBUG(1))
+            cerr << NAME << "[pass1] " << fetcher.Found() << " mates found of " << fetcher.Requests()
+                << " requested with " << fetcher.Seeks() << " seeks, " << mates.size()
+                << " outside the regions" << endl;
+        Stats::Count("yo_mates_fetched", fetcher.Found());
+        phase_pass1.End();
+
+        if (! reader.Rewind()) {
+            cerr << NAME << "[pass2] could not rewind input" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+
+    //----------------- Pass 2: Write the reads in the regions, and mates
+
+
+    ScopedPhase phase_pass2("pass2");
+
+    RawBamWriter writer;
+
+    if (! output_opts.Open(writer, output_file, raw_header.ToString(), reader.GetReferenceData())) {
+        cerr << NAME << " could not open output " << output_file << endl;
+        return EXIT_FAILURE;
+    }
+
+    size_t next_mate = 0;
+    bool ok = true;
+    n_reads = 0;
+    progress.Start(NAME "[pass2]", opt_progress, reader.InputSize(), &reader.GetReferenceData());
+    while (ok && reader.GetNextRecord(rec) && (opt_reads < 0 || n_reads < opt_reads)) {
+        ++n_reads;
+        const uint64_t key = coordinateSortKey(rec);
+        while (ok && next_mate < mates.size() && coordinateSortKey(*mates[next_mate]) < key)
+            ok = writer.SaveRecord(*mates[next_mate++]);
+        ok = ok && writer.SaveRecord(rec);
+        progress.Add(rec, reader.Tell());
+    }
+    while (ok && next_mate < mates.size())
+        ok = writer.SaveRecord(*mates[next_mate++]);
+    progress.Stop();
+    if (! ok || reader.Failed()) {
+        cerr << NAME << "[pass2] error while extracting reads" << endl;
+        return EXIT_FAILURE;
+    }
+
+    if (opt_progress || DEBUG(1))
+        cerr << NAME << "[pass2] " << n_reads << " reads in the regions and "
+            << mates.size() << " mates written" << endl;
+    phase_pass2.End();
+
+    ScopedPhase phase_close("close");
+    fetcher.Close();
+    reader.Close();
+    if (! writer.Close())
+        return EXIT_FAILURE;
+    if (! output_opts.WriteChecksum())
+        return EXIT_FAILURE;
+
+    return EXIT_SUCCESS;
+}
+
+
+//-------------------------------------
+
+
+static int
+parseOptions(int argc, char* argv[])
+{
+    new_program.ID = YORUBA_NAME;
+    new_program.ID = new_program.ID + " " + argv[0];
+    new_program.Name = YORUBA_NAME;
+    new_program.Version = YORUBA_VERSION;
+    new_program.CommandLine = YORUBA_NAME;
+    for (int i = 0; i < argc; ++i)
+        new_program.CommandLine = new_program.CommandLine + " " + argv[i];
+
+    enum { OPT_output, OPT_region, OPT_regions, OPT_mates,
+        OPT_level, OPT_uncompressed, OPT_writeindex, OPT_checksum, OPT_checksumexclude,
+#ifdef _WITH_DEBUG
+        OPT_debug, OPT_reads, OPT_progress,
+#endif
+        OPT_help };
+
+    CSimpleOpt::SOption yo_options[] = {
+        { OPT_region,          "--region",          SO_REQ_SEP },
+        { OPT_region,          "-r",                SO_REQ_SEP },
+        { OPT_regions,         "--regions",         SO_REQ_SEP },
+        { OPT_mates,           "--mates",           SO_NONE },
+        { OPT_help,            "--help",            SO_NONE },
+        { OPT_help,            "-?",                SO_NONE },
+        { OPT_output,          "--output",          SO_REQ_SEP },
+        { OPT_output,          "-o",                SO_REQ_SEP },
+        { OPT_level,           "--level",           SO_REQ_SEP },
+        { OPT_level,           "-l",                SO_REQ_SEP },
+        { OPT_uncompressed,    "-u",                SO_NONE },
+        { OPT_writeindex,      "--write-index",     SO_NONE },
+        { OPT_checksum,        "--checksum",        SO_REQ_SEP },
+        { OPT_checksumexclude, "--checksum-exclude", SO_REQ_SEP },
+#ifdef _WITH_DEBUG
+        { OPT_debug,           "--debug",           SO_REQ_SEP },
+        { OPT_reads,           "--reads",           SO_REQ_SEP },
+        { OPT_progress,        "--progress",        SO_REQ_SEP },
+#endif
+        SO_END_OF_OPTIONS
+    };
+
+    CSimpleOpt args(argc, argv, yo_options);
+
+    while (args.Next()) {
+        if (args.LastError() != SO_SUCCESS) {
+            cerr << NAME << " invalid argument '" << args.OptionText() << "'" << endl;
+            return usage();
+        }
+        if (args.OptionId() == OPT_help) {
+            return usage(true);
+        } else if (args.OptionId() == OPT_region) {
+            regions.Add(args.OptionArg());
+        } else if (args.OptionId() == OPT_regions) {
+            if (! regions.AddBed(args.OptionArg()))
+                return usage();
+        } else if (args.OptionId() == OPT_mates) {
+            opt_mates = true;
+        } else if (args.OptionId() == OPT_output) {
+            output_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_level) {
+            if (! output_opts.SetLevel(args.OptionArg())) {
+                cerr << NAME << " --level must be 0-9" << endl;
+                return usage();
+            }
+        } else if (args.OptionId() == OPT_uncompressed) {
+            output_opts.SetUncompressed();
+        } else if (args.OptionId() == OPT_writeindex) {
+            output_opts.SetWriteIndex();
+        } else if (args.OptionId() == OPT_checksum) {
+            checksum_file = args.OptionArg();
+        } else if (args.OptionId() == OPT_checksumexclude) {
+            checksum_exclude = args.OptionArg();
+#ifdef _WITH_DEBUG
+        } else if (args.OptionId() == OPT_debug) {
+            opt_debug = args.OptionArg() ? atoi(args.OptionArg()) : opt_debug;
+        } else if (args.OptionId() == OPT_reads) {
+            opt_reads = strtoll(args.OptionArg(), NULL, 10);
+        } else if (args.OptionId() == OPT_progress) {
+            opt_progress = args.OptionArg() ? strtoll(args.OptionArg(), NULL, 10) : opt_progress;
+#endif
+        } else {
+            cerr << NAME << " unprocessed argument '" << args.OptionText() << "'" << endl;
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (DEBUG(1) && ! opt_progress)
+        opt_progress = debug_progress;
+
+    if (regions.Empty()) {
+        cerr << NAME << " requires regions, given with -r or --regions" << endl;
+        return usage();
+    }
+
+    if (checksum_file.empty() && ! checksum_exclude.empty()) {
+        cerr << NAME << " --checksum-exclude requires --checksum FILE" << endl;
+        return usage();
+    } else if (! checksum_file.empty() && ! output_opts.SetChecksum(checksum_file, checksum_exclude)) {
+        return usage();
+    }
+
+    if (args.FileCount() != 1) {
+        cerr << NAME << " requires one indexed BAM file specified as input" << endl;
+        return usage();
+    }
+    input_file = args.File(0);
+
+    // set up output; if file not specified, use stdout or its equivalent
+    if (output_file.empty() && output_opts.WriteIndex()) {
+        cerr << NAME << " --write-index requires an output file given with -o FILE" << endl;
+        return usage();
+    } else if (output_file.empty()) {
+        output_file = "/dev/stdout";
+    }
+
+    return EXIT_SUCCESS;
+}
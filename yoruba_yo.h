@@ -0,0 +1,49 @@
+// yoruba_yo.h  (c) Douglas G. Scofield, douglasgscofield@gmail.com
+//
+// Header file for yoruba_yo.cpp
+//
+// Yo is the Yoruba (Nigeria) verb for 'to pull out'.
+//
+// Uses BamTools only for header types
+
+#ifndef _YORUBA_YO_H_
+#define _YORUBA_YO_H_
+
+
+// Std C/C++ includes
+#include <cstdlib>
+#include <iostream>
+#include <string>
+#include <vector>
+#include <stdint.h>
+
+// BamTools includes: https://github.com/pezmaster31/bamtools
+#include "api/BamAux.h"
+#include "api/SamHeader.h"
+#include "api/SamProgram.h"
+#include "api/SamProgramChain.h"
+
+// SimpleOpt includes: http://code.jellycan.com/simpleopt, http://code.google.com/p/simpleopt/
+#include "SimpleOpt.h"
+
+// Yoruba includes
+#include "yoruba.h"
+#include "yoruba_util.h"
+#include "yoruba_bgzf.h"
+#include "yoruba_index.h"
+#include "yoruba_mates.h"
+#include "yoruba_stats.h"
+
+#ifndef _YORUBA_MAIN
+#define NAME "[yoruba_extract]"
+#endif
+
+// Functions defined in yoruba_yo.cpp
+//
+namespace yoruba {
+
+int  main_yo(int argc, char* argv[]);
+
+}  // namespace yoruba
+
+#endif // _YORUBA_YO_H_